@@ -0,0 +1,72 @@
+#ifndef __BENCHMARK_H
+#define __BENCHMARK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_heap.h"
+
+// Each benchmark runs for at least this long, in doubling batches
+#ifndef BENCHMARK_MIN_TIME_MS
+#define BENCHMARK_MIN_TIME_MS 200
+#endif
+
+// Keeps the compiler from optimizing away a result
+static inline void benchmarkKeep(const void *value)
+{
+    __asm__ __volatile__("" : : "g"(value) : "memory");
+}
+
+static inline uint64_t benchmarkNowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Set from the command line, only benchmarks containing it are run
+extern const char *benchmarkFilter;
+
+static inline bool benchmarkSelected(const char *name)
+{
+    return benchmarkFilter == NULL || strstr(name, benchmarkFilter) != NULL;
+}
+
+// Prints ns/op, heap allocations per op and the peak heap use above what
+// was allocated before the run
+template <typename Body>
+void runBenchmark(const char *name, Body body)
+{
+    if (!benchmarkSelected(name))
+        return;
+
+    body(); // warm up, and lazily allocated state isn't counted
+
+    uint64_t iterations = 1;
+    uint64_t elapsedNs;
+    HostHeapStats before;
+    size_t baseline;
+    for (;;)
+    {
+        before = hostHeapStats();
+        baseline = before.currentBytes;
+        hostHeapResetPeak();
+
+        uint64_t startNs = benchmarkNowNs();
+        for (uint64_t i = 0; i < iterations; i++)
+            body();
+        elapsedNs = benchmarkNowNs() - startNs;
+
+        if (elapsedNs >= (uint64_t)BENCHMARK_MIN_TIME_MS * 1000000)
+            break;
+        iterations *= 2;
+    }
+
+    HostHeapStats after = hostHeapStats();
+    printf("%-32s %12.1f ns/op %8.2f allocs/op %8zu B peak\n", name, (double)elapsedNs / iterations,
+           (double)(after.allocations - before.allocations) / iterations, after.peakBytes - baseline);
+}
+
+#endif // __BENCHMARK_H
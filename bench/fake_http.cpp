@@ -0,0 +1,112 @@
+#include "fake_http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+FakeHttpServer::FakeHttpServer(const std::string &file, uint32_t bytesPerSecond, uint32_t latencyMs)
+    : _file(file), _bytesPerSecond(bytesPerSecond), _latencyUs(latencyMs * 1000), _drops(0), _dropAfter(0), _ignoresRange(false),
+      _open(false), _respondedUs(0), _read(0), _connects(0), _rangeRequests(0)
+{
+}
+
+int FakeHttpServer::connect(const char *host, uint16_t port)
+{
+    delayMicroseconds(2 * _latencyUs);
+    _request.clear();
+    _response.clear();
+    _respondedUs = 0;
+    _read = 0;
+    _connects++;
+    _open = true;
+    return 1;
+}
+
+size_t FakeHttpServer::write(const uint8_t *buffer, size_t size)
+{
+    if (!_open)
+        return 0;
+    _request.append((const char *)buffer, size);
+    if (_respondedUs == 0 && _request.find("\r\n\r\n") != std::string::npos)
+        respond();
+    return size;
+}
+
+void FakeHttpServer::respond()
+{
+    size_t first = 0;
+    size_t range = _request.find("\r\nRange: bytes=");
+    bool isRanged = range != std::string::npos && !_ignoresRange;
+    if (isRanged)
+    {
+        first = strtoul(_request.c_str() + range + 15, NULL, 10);
+        _rangeRequests++;
+    }
+
+    char head[160];
+    if (first >= _file.size())
+    {
+        snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%u\r\n\r\n",
+                 (unsigned)_file.size());
+        _response = head;
+    }
+    else
+    {
+        size_t length = _file.size() - first;
+        if (isRanged)
+            snprintf(head, sizeof(head),
+                     "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %u-%u/%u\r\nContent-Length: %u\r\n\r\n",
+                     (unsigned)first, (unsigned)(_file.size() - 1), (unsigned)_file.size(), (unsigned)length);
+        else
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n", (unsigned)length);
+        if (_drops > 0 && length > _dropAfter)
+        {
+            _drops--;
+            length = _dropAfter;
+        }
+        _response = head + _file.substr(first, length);
+    }
+    _respondedUs = micros64() + 2 * _latencyUs;
+}
+
+size_t FakeHttpServer::arrived()
+{
+    uint64_t now = micros64();
+    if (_respondedUs == 0 || now < _respondedUs)
+        return 0;
+    uint64_t bytes = (now - _respondedUs) * _bytesPerSecond / 1000000 + 1;
+    return bytes < _response.size() ? bytes : _response.size();
+}
+
+int FakeHttpServer::available()
+{
+    return _open ? arrived() - _read : 0;
+}
+
+int FakeHttpServer::read()
+{
+    uint8_t value;
+    return read(&value, 1) == 1 ? value : -1;
+}
+
+int FakeHttpServer::read(uint8_t *buffer, size_t size)
+{
+    size_t available = this->available();
+    if (available == 0)
+        return -1;
+    if (size > available)
+        size = available;
+    memcpy(buffer, _response.data() + _read, size);
+    _read += size;
+    return size;
+}
+
+int FakeHttpServer::peek()
+{
+    return available() > 0 ? (uint8_t)_response[_read] : -1;
+}
+
+// The server closes once it has sent its response (Connection: close)
+uint8_t FakeHttpServer::connected()
+{
+    return _open && (_respondedUs == 0 || _read < _response.size());
+}
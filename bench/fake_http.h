@@ -0,0 +1,65 @@
+#ifndef __FAKE_HTTP_H
+#define __FAKE_HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include <ESP8266WiFi.h>
+
+// A connection to an HTTP server holding one file, on the host clock like
+// FakeLink: connecting takes a round trip, and the response starts a round
+// trip after the request and arrives at the link's rate. Every GET gets the
+// file, from the offset of a "Range: bytes=<first>-" header with a 206
+// unless the server is set to ignore Range. The first connections can be
+// dropped after some bytes of the body, like a flaky link would.
+class FakeHttpServer : public Client
+{
+  public:
+    FakeHttpServer(const std::string &file, uint32_t bytesPerSecond, uint32_t latencyMs);
+
+    // The next count connections are closed after bytes of body
+    void setDrops(uint32_t count, size_t bytes)
+    {
+        _drops = count;
+        _dropAfter = bytes;
+    }
+    void setIgnoresRange(bool ignores) { _ignoresRange = ignores; }
+
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t value) { return write(&value, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t size);
+    int peek();
+    void stop() { _open = false; }
+    uint8_t connected();
+    void flush() {}
+    using Print::write;
+
+    uint32_t getConnectCount() { return _connects; }
+    uint32_t getRangeRequestCount() { return _rangeRequests; }
+
+  private:
+    void respond();
+    // How much of the response has reached the device by now
+    size_t arrived();
+
+    std::string _file;
+    uint32_t _bytesPerSecond;
+    uint32_t _latencyUs;
+    uint32_t _drops;
+    size_t _dropAfter;
+    bool _ignoresRange;
+    bool _open;
+
+    std::string _request;
+    std::string _response; // head and as much body as this connection gets
+    uint64_t _respondedUs; // when the first byte arrives, 0 before the request
+    size_t _read;
+    uint32_t _connects;
+    uint32_t _rangeRequests;
+};
+
+#endif // __FAKE_HTTP_H
@@ -0,0 +1,160 @@
+#include "fake_link.h"
+
+FakeLink::FakeLink(uint32_t bytesPerSecond, uint32_t latencyMs, size_t sendBuffer)
+    : _bytesPerSecond(bytesPerSecond), _latencyUs(latencyMs * 1000), _sendBuffer(sendBuffer), _open(false), _upFreeUs(0),
+      _downFreeUs(0), _unacked(0)
+{
+}
+
+int FakeLink::connect(const char *host, uint16_t port)
+{
+    _up.clear();
+    _down.clear();
+    _in.clear();
+    _broker.clear();
+    _arrivals.clear();
+    _unacked = 0;
+    _upFreeUs = micros64();
+    _downFreeUs = _upFreeUs;
+    _open = true;
+    return 1;
+}
+
+size_t FakeLink::write(const uint8_t *buffer, size_t size)
+{
+    size_t written = 0;
+    while (written < size && _open)
+    {
+        advance();
+        if (_unacked >= _sendBuffer)
+        {
+            // Blocked until the oldest segment is acknowledged
+            delayMicroseconds(_up.front().ackedUs - micros64());
+            continue;
+        }
+
+        size_t chunk = _sendBuffer - _unacked;
+        if (chunk > size - written)
+            chunk = size - written;
+        transmit(_up, _upFreeUs, buffer + written, chunk, micros64());
+        _unacked += chunk;
+        written += chunk;
+    }
+    return written;
+}
+
+int FakeLink::availableForWrite()
+{
+    advance();
+    return _open ? _sendBuffer - _unacked : 0;
+}
+
+int FakeLink::available()
+{
+    advance();
+    return _in.size();
+}
+
+int FakeLink::read()
+{
+    uint8_t value;
+    return read(&value, 1) == 1 ? value : -1;
+}
+
+int FakeLink::read(uint8_t *buffer, size_t size)
+{
+    advance();
+    if (_in.empty())
+        return -1;
+    if (size > _in.size())
+        size = _in.size();
+    memcpy(buffer, _in.data(), size);
+    _in.erase(0, size);
+    return size;
+}
+
+int FakeLink::peek()
+{
+    advance();
+    return _in.empty() ? -1 : (uint8_t)_in[0];
+}
+
+void FakeLink::advance()
+{
+    uint64_t now = micros64();
+    for (size_t i = 0; i < _up.size() && _up[i].arrivesUs <= now; i++)
+    {
+        if (!_up[i].delivered)
+        {
+            _up[i].delivered = true;
+            receive(_up[i].bytes, _up[i].arrivesUs);
+        }
+    }
+    while (!_up.empty() && _up.front().ackedUs <= now)
+    {
+        _unacked -= _up.front().bytes.size();
+        _up.pop_front();
+    }
+    while (!_down.empty() && _down.front().arrivesUs <= now)
+    {
+        _in += _down.front().bytes;
+        _down.pop_front();
+    }
+}
+
+void FakeLink::transmit(std::deque<Segment> &direction, uint64_t &freeUs, const uint8_t *data, size_t length, uint64_t startUs)
+{
+    if (freeUs > startUs)
+        startUs = freeUs;
+    freeUs = startUs + (uint64_t)length * 1000000 / _bytesPerSecond;
+
+    Segment segment;
+    segment.bytes.assign((const char *)data, length);
+    segment.arrivesUs = freeUs + _latencyUs;
+    segment.ackedUs = segment.arrivesUs + _latencyUs;
+    segment.delivered = false;
+    direction.push_back(segment);
+}
+
+// The broker's side: whole packets are answered as they complete
+void FakeLink::receive(const std::string &bytes, uint64_t arrivedUs)
+{
+    _broker += bytes;
+    MqttPacket packet;
+    long size;
+    while ((size = mqttParsePacket((const uint8_t *)_broker.data(), _broker.size(), packet)) > 0)
+    {
+        std::string answer;
+        std::string topic;
+        const uint8_t *payload;
+        size_t length;
+        uint16_t packetId;
+        std::vector<MqttFilter> filters;
+        switch (packet.type)
+        {
+        case MQTT_PACKET_CONNECT:
+            mqttEncodeConnack(answer, false, MQTT_CONNACK_ACCEPTED);
+            break;
+        case MQTT_PACKET_PUBLISH:
+            _arrivals.push_back(arrivedUs);
+            if (mqttParsePublish(packet, topic, payload, length, packetId) && packetId != 0)
+                mqttEncodeAck(answer, MQTT_PACKET_PUBACK, packetId);
+            break;
+        case MQTT_PACKET_SUBSCRIBE: // granted as asked
+            if (mqttParseSubscribe(packet, packetId, filters))
+            {
+                std::vector<uint8_t> granted;
+                for (size_t i = 0; i < filters.size(); i++)
+                    granted.push_back(filters[i].qos);
+                mqttEncodeSuback(answer, packetId, granted.data(), granted.size());
+            }
+            break;
+        case MQTT_PACKET_PINGREQ:
+            mqttEncodeEmpty(answer, MQTT_PACKET_PINGRESP);
+            break;
+        }
+        if (!answer.empty())
+            transmit(_down, _downFreeUs, (const uint8_t *)answer.data(), answer.size(), arrivedUs);
+        _broker.erase(0, size);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef __FAKE_LINK_H
+#define __FAKE_LINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <ESP8266WiFi.h>
+#include <mqtt_packet.h>
+
+// A connection to a broker over a slow link, on the host clock (time only
+// moves on its own, or in delay()). Bytes leave at the link's rate, arrive
+// one latency later and free their room in the send buffer when the ACK is
+// back, like lwIP's send window. A write that doesn't fit blocks until it
+// does, in fake time, like the real client's.
+//
+// The broker at the far end answers CONNECT, SUBSCRIBE, PINGREQ and QoS 1
+// PUBLISH, and notes when each publish arrived.
+class FakeLink : public Client
+{
+  public:
+    FakeLink(uint32_t bytesPerSecond, uint32_t latencyMs, size_t sendBuffer);
+
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t value) { return write(&value, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    int availableForWrite();
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t size);
+    int peek();
+    void stop() { _open = false; }
+    uint8_t connected() { return _open; }
+    void flush() {}
+    using Print::write;
+
+    // micros64() when each publish had reached the broker
+    const std::vector<uint64_t> &getPublishArrivals() { return _arrivals; }
+
+  private:
+    typedef struct tagSegment
+    {
+        std::string bytes;
+        uint64_t arrivesUs;
+        uint64_t ackedUs;
+        bool delivered;
+    } Segment;
+
+    // Moves everything along to the current time
+    void advance();
+    void transmit(std::deque<Segment> &direction, uint64_t &freeUs, const uint8_t *data, size_t length, uint64_t startUs);
+    void receive(const std::string &bytes, uint64_t arrivedUs);
+
+    uint32_t _bytesPerSecond;
+    uint32_t _latencyUs;
+    size_t _sendBuffer;
+    bool _open;
+
+    std::deque<Segment> _up;   // written, not acknowledged yet
+    std::deque<Segment> _down; // on their way to the device
+    uint64_t _upFreeUs;        // when the link is done sending what it has
+    uint64_t _downFreeUs;
+    size_t _unacked;
+    std::string _in;     // arrived at the device, not read yet
+    std::string _broker; // arrived at the broker, not parsed yet
+    std::vector<uint64_t> _arrivals;
+};
+
+#endif // __FAKE_LINK_H
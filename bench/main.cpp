@@ -0,0 +1,605 @@
+// Host micro-benchmarks for the library's hot paths.
+//
+//   pio run -e native && .pio/build/native/program [filter]
+//
+// Each line reports the time per operation, heap allocations per operation
+// and the peak heap use during the run. Everything runs against the fakes
+// in host/, so network and flash costs aren't included.
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <ArduinoLog.h>
+#include <FS.h>
+#include <PubSubClient.h>
+#include <Updater.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "centralduino.h"
+#include "async_mqtt_transport.h"
+#include "azure_dps.h"
+#include "base64.h"
+#include "cbor_writer.h"
+#include "gzip_compressor.h"
+#include "metrics.h"
+#include "network_worker.h"
+#include "ota_update.h"
+#include "rule_engine.h"
+#include "sample_block.h"
+#include "sha256.h"
+#include "string_buffer.h"
+#include "telemetry_schema.h"
+
+#include "benchmark.h"
+#include "fake_http.h"
+#include "fake_link.h"
+
+// The unit tests in test/ build the fakes here, not the benchmarks
+#ifndef PIO_UNIT_TESTING
+
+const char *benchmarkFilter;
+
+static const char configJson[] =
+    "{\"network\":{\"ssid\":\"bench\",\"password\":\"bench\"},"
+    "\"hub\":{\"scope_id\":\"0ne0000BENCH\",\"device_id\":\"bench-device-0001\","
+    "\"sas_key\":\"wZ1b4Zp0j6Q7mYx2bV8kq3Q2n1v0c5T6r7E8w9Y0a1s=\"}}";
+
+// Typical strings the client handles
+static const char topic[] = "devices/bench-device-0001/messages/events/$.ct=application%2Fjson&$.ce=utf-8";
+static const char methodTopic[] = "$iothub/methods/POST/bench/?$rid=42";
+static const char twinTopic[] = "$iothub/twin/res/200/?$rid=7";
+static const uint8_t sasKey[32] = {0x31, 0x41, 0x59, 0x26, 0x53, 0x58, 0x97, 0x93, 0x23, 0x84, 0x62, 0x64, 0x33, 0x83, 0x27, 0x95,
+                                   0x02, 0x88, 0x41, 0x97, 0x16, 0x93, 0x99, 0x37, 0x51, 0x05, 0x82, 0x09, 0x74, 0x94, 0x45, 0x92};
+
+#define BENCH_TELEMETRY_FIELDS(FIELD) \
+    FIELD(FLOAT, temp, 1)             \
+    FIELD(FLOAT, humidity, 1)         \
+    FIELD(INT, lux, 0)                \
+    FIELD(INT, free_heap, 0)
+
+TELEMETRY_SCHEMA(BenchTelemetry, BENCH_TELEMETRY_FIELDS)
+
+#define BENCH_SAMPLES 256
+
+static float benchSample(int i)
+{
+    return roundf(20 * sinf(i * 0.05f) + 40) / 2;
+}
+
+static bool benchMethod()
+{
+    return true;
+}
+
+// A scratch SPIFFS directory with a config for the client
+static char directory[] = "/tmp/centralduino-bench-XXXXXX";
+
+static void setupClient()
+{
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+    setenv("SPIFFS_DIR", directory, 1);
+
+    File config = SPIFFS.open("/config.json", "w");
+    config.write((const uint8_t *)configJson, sizeof(configJson) - 1);
+    config.close();
+
+    Centralduino.setup("/config.json");
+    Centralduino.registerDeviceMethod("bench", benchMethod);
+    FakeMqtt::setConnected(true);
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Once the worker has seen the connection, publishes get through
+    while (FakeMqtt::publishCount() == 0)
+    {
+        Centralduino.sendMeasurement("temp", 21.5);
+        std::this_thread::sleep_for(std::chrono::milliseconds(NETWORK_WORKER_IDLE));
+    }
+#endif
+}
+
+static void removeDirectory()
+{
+    DIR *listing = opendir(directory);
+    if (listing == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            SPIFFS.remove(entry->d_name);
+    }
+    closedir(listing);
+    rmdir(directory);
+}
+
+static void benchStringBuffer()
+{
+    runBenchmark("StringBuffer urlEncode", []() {
+        StringBuffer buffer(topic, sizeof(topic) - 1);
+        buffer.urlEncode();
+        benchmarkKeep(*buffer);
+    });
+
+    StringBuffer encoded(topic, sizeof(topic) - 1);
+    encoded.urlEncode();
+    runBenchmark("StringBuffer urlDecode", [&encoded]() {
+        StringBuffer buffer(*encoded, encoded.getLength());
+        buffer.urlDecode();
+        benchmarkKeep(*buffer);
+    });
+
+    StringBuffer haystack(topic, sizeof(topic) - 1, false);
+    runBenchmark("StringBuffer indexOf", [&haystack]() {
+        int32_t index = haystack.indexOf("$.ce=", 5);
+        benchmarkKeep(&index);
+    });
+
+    runBenchmark("StringBuffer base64Encode", []() {
+        StringBuffer buffer((const char *)sasKey, sizeof(sasKey));
+        buffer.base64Encode();
+        benchmarkKeep(*buffer);
+    });
+
+    StringBuffer base64((const char *)sasKey, sizeof(sasKey));
+    base64.base64Encode();
+    runBenchmark("StringBuffer base64Decode", [&base64]() {
+        StringBuffer buffer(*base64, base64.getLength());
+        buffer.base64Decode();
+        benchmarkKeep(*buffer);
+    });
+}
+
+static void benchCrypto()
+{
+    runBenchmark("Sha256 HMAC (80 bytes)", []() {
+        Sha256 sha256;
+        sha256.initHmac(sasKey, sizeof(sasKey));
+        sha256.print(topic);
+        benchmarkKeep(sha256.resultHmac());
+    });
+
+    runBenchmark("base64_encode (32 bytes)", []() {
+        char output[48];
+        base64_encode(output, (char *)sasKey, sizeof(sasKey));
+        benchmarkKeep(output);
+    });
+
+    char encoded[48];
+    int encodedLength = base64_encode(encoded, (char *)sasKey, sizeof(sasKey));
+    runBenchmark("base64_decode (44 chars)", [&]() {
+        char output[36];
+        base64_decode(output, encoded, encodedLength);
+        benchmarkKeep(output);
+    });
+
+    runBenchmark("SAS token (DPS auth string)", []() {
+        char buffer[256];
+        size_t length;
+        AzureDps.getDPSAuthString("0ne0000BENCH", "bench-device-0001", "wZ1b4Zp0j6Q7mYx2bV8kq3Q2n1v0c5T6r7E8w9Y0a1s=",
+                                  buffer, sizeof(buffer), length);
+        benchmarkKeep(buffer);
+    });
+}
+
+static void benchEncoding()
+{
+    BenchTelemetry telemetry;
+    telemetry.temp = 21.5;
+    telemetry.humidity = 48.2;
+    telemetry.lux = 730;
+    telemetry.free_heap = 31544;
+
+    char json[BenchTelemetry::MAX_JSON_LENGTH + 1];
+    uint8_t cbor[BenchTelemetry::MAX_CBOR_LENGTH];
+    runBenchmark("telemetry toJson", [&]() { benchmarkKeep((void *)telemetry.toJson(json, sizeof(json))); });
+    runBenchmark("telemetry toCbor", [&]() { benchmarkKeep((void *)telemetry.toCbor(cbor, sizeof(cbor))); });
+    runBenchmark("telemetry ArduinoJson", [&]() {
+        StaticJsonDocument<256> document;
+        document["temp"] = telemetry.temp;
+        document["humidity"] = telemetry.humidity;
+        document["lux"] = telemetry.lux;
+        document["free_heap"] = telemetry.free_heap;
+        benchmarkKeep((void *)serializeJson(document, json, sizeof(json)));
+    });
+    if (benchmarkSelected("telemetry"))
+        printf("  telemetry size: JSON %u B, CBOR %u B\n", (unsigned)telemetry.toJson(json, sizeof(json)),
+               (unsigned)telemetry.toCbor(cbor, sizeof(cbor)));
+
+    // A slow 2 Hz sensor stream in 0.5 steps, sent either as a sample block
+    // or a JSON array
+    static uint8_t block[1024];
+    SampleBlockEncoder encoder(block, sizeof(block), SAMPLE_BLOCK_FLOAT);
+    runBenchmark("sample block (256 floats)", [&]() {
+        encoder.reset();
+        for (int i = 0; i < BENCH_SAMPLES; i++)
+            encoder.append(1600000000000ULL + i * 500, benchSample(i));
+        benchmarkKeep(block);
+    });
+
+    static char array[BENCH_SAMPLES * 8 + 2];
+    size_t arrayLength = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++)
+        arrayLength += snprintf(array + arrayLength, sizeof(array) - arrayLength, "%c%.1f", i == 0 ? '[' : ',', benchSample(i));
+    arrayLength += snprintf(array + arrayLength, sizeof(array) - arrayLength, "]");
+    if (benchmarkSelected("sample block"))
+        printf("  %u samples: sample block %u B, JSON array %u B\n", (unsigned)encoder.getCount(), (unsigned)encoder.getLength(),
+               (unsigned)arrayLength);
+
+    // Compression of a typical 1 KB telemetry batch
+    static char payload[1024];
+    size_t payloadLength = 0;
+    while (payloadLength + BenchTelemetry::MAX_JSON_LENGTH + 1 < sizeof(payload))
+    {
+        telemetry.lux++;
+        payloadLength += telemetry.toJson(payload + payloadLength, sizeof(payload) - payloadLength);
+    }
+    static GzipCompressor compressor;
+    static uint8_t compressed[1024];
+    size_t compressedLength = 0;
+    runBenchmark("gzip (1 KB of JSON)", [&]() {
+        compressedLength = compressor.compress((const uint8_t *)payload, payloadLength, compressed, sizeof(compressed));
+        benchmarkKeep(compressed);
+    });
+    if (benchmarkSelected("gzip"))
+        printf("  gzip: %u -> %u B\n", (unsigned)payloadLength, (unsigned)compressedLength);
+}
+
+// With the network worker, received messages are queued and handled in poll()
+static void deliver(const char *topic, const char *payload)
+{
+    FakeMqtt::deliver(topic, (const uint8_t *)payload, strlen(payload));
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    Centralduino.poll();
+#endif
+}
+
+static void benchClient()
+{
+    runBenchmark("topic parsing (direct method)", []() { deliver(methodTopic, "{}"); });
+
+    runBenchmark("topic parsing (twin response)", []() { deliver(twinTopic, "{\"desired\":{}}"); });
+
+    runBenchmark("sendMeasurement", []() {
+        Centralduino.sendMeasurement("temp", 21.5);
+    });
+
+    if (benchmarkSelected("sendMeasurement") && FakeMqtt::publishCount() == 0)
+        printf("warning: nothing was published, check the client setup\n");
+}
+
+// Per sample cost of the alert rules, to set against sending the sample:
+// eight rules over four streams (two of them on rates), a stream no rule
+// reads (summary only), and compiling a rule from its text
+static void benchRules()
+{
+    static RuleEngine engine;
+    engine.setRule("hot", "temp > 28 for 60s");
+    engine.setRule("cold", "temp < 12 hyst 1");
+    engine.setRule("heating", "rate temp > 0.5");
+    engine.setRule("humid", "humidity > 25 for 5m");
+    engine.setRule("dry", "humidity < 15");
+    engine.setRule("dark", "lux < 12 for 30s");
+    engine.setRule("low_batt", "battery < 14 hyst 2");
+    engine.setRule("draining", "rate battery < -0.5");
+
+    static uint32_t alerts = 0;
+    engine.onAlert([](const Rule &, const char *, bool, float) { alerts++; });
+
+    static const char *streams[] = {"temp", "humidity", "lux", "battery"};
+    uint32_t i = 0;
+    runBenchmark("rules record (2 rules)", [&]() {
+        engine.record(streams[i & 3], benchSample(i >> 2), i * 250);
+        i++;
+    });
+    runBenchmark("rules record (no rules)", [&]() {
+        engine.record("pressure", benchSample(i), i * 250);
+        i++;
+    });
+    runBenchmark("rules compile", [&]() {
+        benchmarkKeep((void *)engine.setRule("hot", (i++ & 1) != 0 ? "temp > 28 for 60s" : "temp > 29 for 60s"));
+    });
+    if (benchmarkSelected("rules record"))
+        printf("  rules: %u alerts over %u samples\n", (unsigned)alerts, (unsigned)i);
+}
+
+// Telemetry bursts over a slow link through each MQTT transport, in fake
+// time. The sketch ticks every LINK_TICK_MS; time spent in the transport
+// is time it isn't sampling or running its tasks.
+#define LINK_TICK_MS 10
+#define LINK_RUN_MS 20000
+#define LINK_BURST 8            // publishes, once a second
+#define LINK_MESSAGE_LENGTH 400 // bytes
+#define LINK_SEND_BUFFER 2920   // lwIP's TCP_SND_BUF, 2 x MSS
+
+static double percentileMs(std::vector<uint64_t> &latenciesUs, double fraction)
+{
+    if (latenciesUs.empty())
+        return 0;
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    return latenciesUs[(size_t)(fraction * (latenciesUs.size() - 1))] / 1000.0;
+}
+
+// QoS 1 acknowledgements, from AsyncMqttTransport's ack callback
+typedef struct tagLinkAcks
+{
+    uint64_t totalUs;
+    uint32_t count;
+} LinkAcks;
+
+static void runLink(const char *name, MqttTransport &transport, FakeLink &link, uint8_t qos, const LinkAcks *acks = NULL)
+{
+    static uint8_t payload[LINK_MESSAGE_LENGTH];
+    memset(payload, 'x', sizeof(payload));
+
+    link.connect("bench", 8883);
+    uint64_t startedUs = micros64();
+    transport.connect(link, "bench", 8883, "bench-device-0001", "bench", "password");
+    transport.subscribe("$iothub/methods/POST/#");
+    // Up to the CONNACK, which PubSubClient's connect() waits for
+    while (!transport.isAccepted() && transport.loop())
+        delay(1);
+    uint64_t connectUs = micros64() - startedUs;
+
+    std::vector<uint64_t> publishedUs;
+    uint32_t failed = 0;
+    uint64_t busyUs = 0, longestUs = 0;
+    uint64_t burstUs = micros64();
+    uint64_t endUs = burstUs + LINK_RUN_MS * 1000ULL;
+    while (micros64() < endUs)
+    {
+        uint64_t tickUs = micros64();
+        if (tickUs >= burstUs)
+        {
+            for (int i = 0; i < LINK_BURST; i++)
+            {
+                uint64_t nowUs = micros64();
+                if (transport.publish(topic, payload, sizeof(payload), qos))
+                    publishedUs.push_back(nowUs);
+                else
+                    failed++;
+            }
+            burstUs += 1000000;
+        }
+        transport.loop();
+
+        uint64_t spentUs = micros64() - tickUs;
+        busyUs += spentUs;
+        longestUs = std::max(longestUs, spentUs);
+        delay(LINK_TICK_MS);
+    }
+
+    // Whatever is still on its way gets there
+    for (int i = 0; i < 500; i++)
+    {
+        transport.loop();
+        delay(LINK_TICK_MS);
+    }
+    transport.disconnect();
+
+    const std::vector<uint64_t> &arrivals = link.getPublishArrivals();
+    std::vector<uint64_t> latenciesUs;
+    for (size_t i = 0; i < arrivals.size() && i < publishedUs.size(); i++)
+        latenciesUs.push_back(arrivals[i] - publishedUs[i]);
+
+    printf("  %-16s connect %6.1f ms  in transport %5.1f%% (longest %6.1f ms)  %3u/%3u delivered  latency p50 %6.1f ms p99 %6.1f ms",
+           name, connectUs / 1000.0, 100.0 * busyUs / (LINK_RUN_MS * 1000.0), longestUs / 1000.0, (unsigned)arrivals.size(),
+           (unsigned)(publishedUs.size() + failed), percentileMs(latenciesUs, 0.5), percentileMs(latenciesUs, 0.99));
+    if (acks != NULL && acks->count > 0)
+        printf("  acked in %.1f ms", acks->totalUs / 1000.0 / acks->count);
+    printf("\n");
+}
+
+static void compareTransports(uint32_t bytesPerSecond, uint32_t latencyMs)
+{
+    printf("MQTT transports, %d x %d B a second over %u KB/s with %u ms latency:\n", LINK_BURST, LINK_MESSAGE_LENGTH,
+           (unsigned)(bytesPerSecond / 1024), (unsigned)latencyMs);
+
+    FakeLink link(bytesPerSecond, latencyMs, LINK_SEND_BUFFER);
+    {
+        PubSubTransport transport;
+        runLink("PubSubClient", transport, link, 0);
+    }
+    {
+        AsyncMqttTransport transport;
+        runLink("async QoS 0", transport, link, 0);
+    }
+    {
+        AsyncMqttTransport transport;
+        LinkAcks acks = {0, 0};
+        transport.setAckCallback([&acks](uint16_t, bool isAcknowledged, uint32_t latencyUs) {
+            if (!isAcknowledged)
+                return;
+            acks.totalUs += latencyUs;
+            acks.count++;
+        });
+        runLink("async QoS 1", transport, link, 1, &acks);
+    }
+}
+
+// Sending telemetry when the network can't keep up, in real time: every
+// publish blocks for WORKER_SEND_US, longer than the sketch takes to
+// produce it. Built with CENTRALDUINO_NETWORK_WORKER (the native_worker env)
+// sendMeasurement() only queues the message for the client's worker, which
+// makes the write; built without it the sketch's thread makes it. Run both
+// envs to compare.
+#define WORKER_BURSTS 100
+#define WORKER_BURST_INTERVAL_MS 10
+#define WORKER_SEND_US 2000
+
+// A broker behind a slow blocking write
+class BlockingBroker : public FakeMqttBackend
+{
+  public:
+    bool connect(PubSubClient *, const char *, const char *, const char *, bool) { return true; }
+    bool publish(PubSubClient *, const char *, const uint8_t *, unsigned int)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(WORKER_SEND_US));
+        return true;
+    }
+    bool subscribe(PubSubClient *, const char *, uint8_t) { return true; }
+    void disconnect(PubSubClient *) {}
+};
+
+static void benchWorker()
+{
+    if (!benchmarkSelected("worker"))
+        return;
+
+    printf("Publishing %d measurements every %d ms, %d us per blocking write:\n", LINK_BURST, WORKER_BURST_INTERVAL_MS,
+           WORKER_SEND_US);
+
+    static BlockingBroker broker;
+    FakeMqtt::setBackend(&broker);
+    uint32_t publishes = FakeMqtt::publishCount();
+    uint32_t failures = Metrics.get(METRIC_PUBLISH_FAILURES);
+
+    std::vector<uint64_t> latenciesNs;
+    for (int burst = 0; burst < WORKER_BURSTS; burst++)
+    {
+        for (int i = 0; i < LINK_BURST; i++)
+        {
+            uint64_t startNs = benchmarkNowNs();
+            Centralduino.sendMeasurement("temp", benchSample(i));
+            latenciesNs.push_back(benchmarkNowNs() - startNs);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(WORKER_BURST_INTERVAL_MS));
+    }
+    uint32_t rejected = Metrics.get(METRIC_PUBLISH_FAILURES) - failures;
+
+    // Whatever the worker still has queued gets sent
+    while (FakeMqtt::publishCount() - publishes + rejected < latenciesNs.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(NETWORK_WORKER_IDLE));
+    FakeMqtt::setBackend(NULL);
+
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    const char *name = "worker queue";
+#else
+    const char *name = "inline";
+#endif
+    printf("  %-16s p50 %9.0f ns  p99 %9.0f ns  max %9.0f ns  %3u/%3u rejected\n", name,
+           (double)latenciesNs[latenciesNs.size() / 2], (double)latenciesNs[latenciesNs.size() * 99 / 100],
+           (double)latenciesNs.back(), (unsigned)rejected, (unsigned)(latenciesNs.size()));
+}
+
+// A firmware download from FakeHttpServer, on the host clock: how long it
+// takes, what it costs the sketch's thread per KB (hashing included) and
+// how dropped connections are picked up, with a Range request or by
+// skipping what the server sends again when it ignores Range
+#define OTA_IMAGE_SIZE (512 * 1024)
+#define OTA_BYTES_PER_SECOND (64 * 1024)
+#define OTA_LATENCY_MS 50
+#define OTA_DROPS 4
+#define OTA_DROP_AFTER (96 * 1024)
+
+static void runOta(const char *name, FakeHttpServer &server, const std::string &image, const char *sha256)
+{
+    FakeUpdate::reset();
+    OtaUpdate.setClient(&server);
+    uint64_t startedUs = micros64();
+    if (OtaUpdate.start("http://firmware.bench/image.bin", image.size(), sha256, "bench") != OTA_STARTED)
+    {
+        printf("  %-20s not started\n", name);
+        return;
+    }
+
+    uint64_t busyNs = 0, longestNs = 0;
+    while (OtaUpdate.isBusy())
+    {
+        uint64_t tickNs = benchmarkNowNs();
+        OtaUpdate.loop();
+        uint64_t spentNs = benchmarkNowNs() - tickNs;
+        busyNs += spentNs;
+        longestNs = std::max(longestNs, spentNs);
+        delay(OTA_STEP_INTERVAL);
+    }
+    OtaUpdate.setClient(NULL);
+
+    double seconds = (micros64() - startedUs) / 1000000.0;
+    bool isCommitted = FakeUpdate::commitCount() > 0;
+    printf("  %-20s %5.1f s  %5.1f KB/s  %u connections  %6.0f ns/KB (longest tick %5.0f us)  %s\n", name, seconds,
+           OtaUpdate.getReceived() / 1024.0 / seconds, (unsigned)server.getConnectCount(),
+           (double)busyNs / (OtaUpdate.getReceived() / 1024.0), longestNs / 1000.0,
+           isCommitted && FakeUpdate::committedImage() == image ? "committed, verified"
+                                                                : isCommitted ? "COMMITTED WRONG IMAGE" : "not committed");
+}
+
+static void benchOta()
+{
+    if (!benchmarkSelected("ota"))
+        return;
+
+    std::string image(OTA_IMAGE_SIZE, '\0');
+    for (size_t i = 0; i < image.size(); i++)
+        image[i] = (char)(rand() & 0xFF);
+    Sha256 sha256;
+    sha256.init();
+    sha256.write((const uint8_t *)image.data(), image.size());
+    char hash[2 * HASH_LENGTH + 1];
+    uint8_t *digest = sha256.result();
+    for (int i = 0; i < HASH_LENGTH; i++)
+        sprintf(hash + 2 * i, "%02x", digest[i]);
+
+    printf("Firmware download, %d KB over %u KB/s with %u ms latency:\n", OTA_IMAGE_SIZE / 1024,
+           (unsigned)(OTA_BYTES_PER_SECOND / 1024), (unsigned)OTA_LATENCY_MS);
+
+    FakeHttpServer server(image, OTA_BYTES_PER_SECOND, OTA_LATENCY_MS);
+    runOta("whole", server, image, hash);
+
+    FakeHttpServer dropping(image, OTA_BYTES_PER_SECOND, OTA_LATENCY_MS);
+    dropping.setDrops(OTA_DROPS, OTA_DROP_AFTER);
+    runOta("dropped, ranged", dropping, image, hash);
+
+    FakeHttpServer ignoring(image, OTA_BYTES_PER_SECOND, OTA_LATENCY_MS);
+    ignoring.setDrops(1, OTA_DROP_AFTER);
+    ignoring.setIgnoresRange(true);
+    runOta("dropped, no Range", ignoring, image, hash);
+
+    std::string corrupted = image;
+    corrupted[corrupted.size() / 2] ^= 0x01;
+    FakeHttpServer corrupting(corrupted, OTA_BYTES_PER_SECOND, OTA_LATENCY_MS);
+    runOta("corrupted", corrupting, corrupted, hash);
+}
+
+// Last: the transports' PubSubClient takes over FakeMqtt
+static void benchTransports()
+{
+    if (!benchmarkSelected("transport"))
+        return;
+
+    compareTransports(64 * 1024, 30);
+    compareTransports(8 * 1024, 150);
+}
+
+int main(int argc, char **argv)
+{
+    benchmarkFilter = argc > 1 ? argv[1] : NULL;
+    setupClient();
+
+    benchStringBuffer();
+    benchCrypto();
+    benchEncoding();
+    benchClient();
+    benchRules();
+    benchOta();
+    benchWorker();
+    benchTransports();
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    CentralduinoClass::stopNetworkWorker();
+#endif
+    removeDirectory();
+    return 0;
+}
+
+#endif // PIO_UNIT_TESTING
@@ -0,0 +1,202 @@
+#include "Arduino.h"
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "coredecls.h"
+#include "host_heap.h"
+#include "spi_flash.h"
+
+#define RTC_USER_MEMORY_BYTES 512
+
+static std::atomic<uint64_t> skippedUs; // time delay() pretended to wait, from any thread
+static void (*timeSetCallback)();
+
+static uint64_t clockUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t monotonicUs()
+{
+    static const uint64_t startUs = clockUs(); // initialized once, whichever thread gets here first
+    return clockUs() - startUs;
+}
+
+uint64_t micros64()
+{
+    return monotonicUs() + skippedUs;
+}
+
+unsigned long micros()
+{
+    return (uint32_t)micros64();
+}
+
+unsigned long millis()
+{
+    return (uint32_t)(micros64() / 1000);
+}
+
+void delay(unsigned long ms)
+{
+    skippedUs += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    skippedUs += us;
+}
+
+void yield()
+{
+}
+
+void settimeofday_cb(void (*callback)())
+{
+    timeSetCallback = callback;
+}
+
+void configTime(int, int, const char *, const char *, const char *)
+{
+    if (timeSetCallback != NULL)
+        timeSetCallback();
+}
+
+extern "C" __attribute__((weak)) size_t strlcpy(char *destination, const char *source, size_t size) __THROW
+{
+    size_t length = strlen(source);
+    if (size > 0)
+    {
+        size_t copied = length < size - 1 ? length : size - 1;
+        memcpy(destination, source, copied);
+        destination[copied] = '\0';
+    }
+    return length;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+    int value;
+    while (count < length && (value = read()) >= 0)
+        buffer[count++] = (char)value;
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////
+// ESP
+
+// The config image is kept in the sector the linker reserves for EEPROM
+extern "C" uint32_t _EEPROM_start;
+uint32_t _EEPROM_start;
+
+static uint32_t rtcMemory[RTC_USER_MEMORY_BYTES / 4];
+static std::map<uint32_t, std::vector<uint8_t>> flashSectors;
+static rst_info resetInfo;
+
+uint32_t EspClass::getFreeHeap()
+{
+    size_t used = hostHeapStats().currentBytes;
+    return used < HOST_HEAP_SIZE ? (uint32_t)(HOST_HEAP_SIZE - used) : 0;
+}
+
+void EspClass::restart()
+{
+    fflush(stdout);
+    exit(0);
+}
+
+void EspClass::deepSleep(uint64_t, int)
+{
+    fflush(stdout);
+    exit(0);
+}
+
+rst_info *EspClass::getResetInfoPtr()
+{
+    return &resetInfo;
+}
+
+String EspClass::getResetReason()
+{
+    return String("Power on");
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+{
+    if (offset * 4 + size > RTC_USER_MEMORY_BYTES)
+        return false;
+    memcpy(data, (uint8_t *)rtcMemory + offset * 4, size);
+    return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+{
+    if (offset * 4 + size > RTC_USER_MEMORY_BYTES)
+        return false;
+    memcpy((uint8_t *)rtcMemory + offset * 4, data, size);
+    return true;
+}
+
+static std::vector<uint8_t> &flashSector(uint32_t sector)
+{
+    std::vector<uint8_t> &contents = flashSectors[sector];
+    if (contents.empty())
+        contents.assign(SPI_FLASH_SEC_SIZE, 0xff);
+    return contents;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector)
+{
+    flashSector(sector).assign(SPI_FLASH_SEC_SIZE, 0xff);
+    return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, uint32_t *data, size_t size)
+{
+    if (address % 4 != 0 || size % 4 != 0)
+        return false;
+
+    // Like NOR flash, writes can only clear bits
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++, address++)
+        flashSector(address / SPI_FLASH_SEC_SIZE)[address % SPI_FLASH_SEC_SIZE] &= bytes[i];
+    return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size)
+{
+    if (address % 4 != 0 || size % 4 != 0)
+        return false;
+
+    uint8_t *bytes = (uint8_t *)data;
+    for (size_t i = 0; i < size; i++, address++)
+        bytes[i] = flashSector(address / SPI_FLASH_SEC_SIZE)[address % SPI_FLASH_SEC_SIZE];
+    return true;
+}
+
+uint32_t EspClass::getCycleCount()
+{
+    return (uint32_t)(micros64() * 160);
+}
+
+EspClass ESP;
+
+///////////////////////////////////////////////////////////////////
+// Serial
+
+size_t HardwareSerial::write(uint8_t value)
+{
+    return fputc(value, stdout) == EOF ? 0 : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+HardwareSerial Serial;
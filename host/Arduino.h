@@ -0,0 +1,133 @@
+#ifndef __HOST_ARDUINO_H
+#define __HOST_ARDUINO_H
+
+// Thin stand-in for the ESP8266 Arduino core, enough to build the library
+// on Linux. The clock is the real one plus the time "spent" in delay(),
+// which returns at once, so timeouts and retry loops finish immediately.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <string>
+
+#include "pgmspace.h"
+#include "Print.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// From the core's libc, only recent glibc has it
+extern "C" size_t strlcpy(char *destination, const char *source, size_t size) __THROW;
+
+unsigned long millis();
+unsigned long micros();
+uint64_t micros64();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void configTime(int timezone, int daylightOffset, const char *server1, const char *server2 = NULL, const char *server3 = NULL);
+
+class String
+{
+  public:
+    String(const char *text = "") : _text(text != NULL ? text : "") {}
+    const char *c_str() const { return _text.c_str(); }
+    unsigned int length() const { return (unsigned int)_text.size(); }
+    bool operator==(const char *text) const { return _text == text; }
+
+  private:
+    std::string _text;
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+};
+
+struct rst_info
+{
+    uint32_t reason;
+    uint32_t exccause;
+    uint32_t epc1;
+    uint32_t epc2;
+    uint32_t epc3;
+    uint32_t excvaddr;
+    uint32_t depc;
+};
+
+#define REASON_DEFAULT_RST 0
+#define REASON_WDT_RST 1
+#define REASON_EXCEPTION_RST 2
+#define REASON_SOFT_WDT_RST 3
+#define REASON_SOFT_RESTART 4
+#define REASON_DEEP_SLEEP_AWAKE 5
+#define REASON_EXT_SYS_RST 6
+
+#define WAKE_RF_DEFAULT 0
+#define WAKE_NO_RFCAL 2
+#define WAKE_RF_DISABLED 4
+
+// Heap the fake reports as free when nothing is allocated, about what an
+// ESP8266 sketch starts with
+#ifndef HOST_HEAP_SIZE
+#define HOST_HEAP_SIZE 50000
+#endif
+
+// RTC user memory and flash live in RAM; restart() and deepSleep() end the
+// process (exit code 0) since there is nothing to reboot into
+class EspClass
+{
+  public:
+    uint32_t getFreeHeap();
+    uint8_t getHeapFragmentation() { return 0; }
+    uint32_t getMaxFreeBlockSize() { return getFreeHeap(); }
+
+    void restart();
+    void deepSleep(uint64_t us, int mode = WAKE_RF_DEFAULT);
+    rst_info *getResetInfoPtr();
+    String getResetReason();
+
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+
+    bool flashEraseSector(uint32_t sector);
+    bool flashWrite(uint32_t address, uint32_t *data, size_t size);
+    bool flashRead(uint32_t address, uint32_t *data, size_t size);
+
+    uint32_t getCycleCount();
+    uint32_t getChipId() { return 0x00c0ffee; }
+    uint32_t getCpuFreqMHz() { return 160; }
+    uint32_t getSketchSize() { return 0; }
+    uint32_t getFreeSketchSpace() { return 0; }
+    String getSketchMD5() { return String("host"); }
+};
+
+extern EspClass ESP;
+
+// Writes to stdout
+class HardwareSerial : public Print
+{
+  public:
+    void begin(unsigned long) {}
+    int available() { return 0; }
+    size_t write(uint8_t value);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif // __HOST_ARDUINO_H
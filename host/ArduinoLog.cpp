@@ -0,0 +1,58 @@
+#include "ArduinoLog.h"
+
+#include <stdio.h>
+
+void Logging::begin(int level, Print *output, bool showLevel)
+{
+    _level = level;
+    _output = output;
+    _showLevel = showLevel;
+}
+
+void Logging::print(int level, const char *format, va_list args)
+{
+    if (_output == NULL || level > _level)
+        return;
+
+    char converted[256];
+    size_t length = 0;
+    for (const char *p = format; *p != '\0' && length < sizeof(converted) - 2; p++)
+    {
+        converted[length++] = *p;
+        if (p[0] == '%' && p[1] == 'l' && p[2] != 'd' && p[2] != 'u' && p[2] != 'x')
+        {
+            converted[length++] = *++p;
+            converted[length++] = 'd';
+        }
+    }
+    converted[length] = '\0';
+
+    if (_showLevel)
+    {
+        _output->print("?FEWNTV"[level]);
+        _output->print(": ");
+    }
+
+    char text[512];
+    int written = vsnprintf(text, sizeof(text), converted, args);
+    if (written > 0)
+        _output->write((const uint8_t *)text, (size_t)written < sizeof(text) ? written : sizeof(text) - 1);
+}
+
+#define LOG_AT(name, level)                        \
+    void Logging::name(const char *format, ...)    \
+    {                                              \
+        va_list args;                              \
+        va_start(args, format);                    \
+        print(level, format, args);                \
+        va_end(args);                              \
+    }
+
+LOG_AT(fatal, LOG_LEVEL_FATAL)
+LOG_AT(error, LOG_LEVEL_ERROR)
+LOG_AT(warning, LOG_LEVEL_WARNING)
+LOG_AT(notice, LOG_LEVEL_NOTICE)
+LOG_AT(trace, LOG_LEVEL_TRACE)
+LOG_AT(verbose, LOG_LEVEL_VERBOSE)
+
+Logging Log;
@@ -0,0 +1,43 @@
+#ifndef __HOST_ARDUINO_LOG_H
+#define __HOST_ARDUINO_LOG_H
+
+#include <stdarg.h>
+
+#include "Arduino.h"
+
+// ArduinoLog's interface over vsnprintf. "%l" is ArduinoLog's long, the
+// other conversions the library uses mean the same in printf.
+
+#define CR "\n"
+
+#define LOG_LEVEL_SILENT 0
+#define LOG_LEVEL_FATAL 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_NOTICE 4
+#define LOG_LEVEL_TRACE 5
+#define LOG_LEVEL_VERBOSE 6
+
+class Logging
+{
+  public:
+    void begin(int level, Print *output, bool showLevel = true);
+
+    void fatal(const char *format, ...);
+    void error(const char *format, ...);
+    void warning(const char *format, ...);
+    void notice(const char *format, ...);
+    void trace(const char *format, ...);
+    void verbose(const char *format, ...);
+
+  private:
+    void print(int level, const char *format, va_list args);
+
+    int _level;
+    Print *_output;
+    bool _showLevel;
+};
+
+extern Logging Log;
+
+#endif // __HOST_ARDUINO_LOG_H
@@ -0,0 +1,31 @@
+#include "ESP8266WiFi.h"
+
+wl_status_t ESP8266WiFiClass::begin(const char *ssid, const char *password, int32_t channel, const uint8_t *bssid, bool connect)
+{
+    _ssid = ssid != NULL ? ssid : "";
+    _status = WL_CONNECTED;
+    return _status;
+}
+
+bool ESP8266WiFiClass::disconnect(bool wifiOff)
+{
+    _status = WL_DISCONNECTED;
+    return true;
+}
+
+static bool reachable;
+
+namespace FakeNet
+{
+void setReachable(bool newReachable)
+{
+    reachable = newReachable;
+}
+
+bool isReachable()
+{
+    return reachable;
+}
+} // namespace FakeNet
+
+ESP8266WiFiClass WiFi;
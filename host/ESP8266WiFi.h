@@ -0,0 +1,121 @@
+#ifndef __HOST_ESP8266WIFI_H
+#define __HOST_ESP8266WIFI_H
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+// WiFi that joins any network at once and never finds one in a scan, and
+// clients that can't reach anything: the host build has no network, only
+// what the fakes pretend. FakeNet::setReachable(true) lets clients connect
+// (and then read nothing), for a FakeMqttBackend that does the talking.
+
+#define WL_IDLE_STATUS 0
+#define WL_NO_SSID_AVAIL 1
+#define WL_CONNECTED 3
+#define WL_CONNECT_FAILED 4
+#define WL_DISCONNECTED 6
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+
+typedef int wl_status_t;
+
+class Client : public Stream
+{
+  public:
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual void flush() = 0;
+    using Stream::read;
+};
+
+namespace FakeNet
+{
+void setReachable(bool reachable);
+bool isReachable();
+} // namespace FakeNet
+
+class WiFiClient : public Client
+{
+  public:
+    int connect(const char *host, uint16_t port) { return FakeNet::isReachable() ? 1 : 0; }
+    size_t write(uint8_t value) { return 0; }
+    size_t write(const uint8_t *buffer, size_t size) { return 0; }
+    int available() { return 0; }
+    int read() { return -1; }
+    int read(uint8_t *buffer, size_t size) { return -1; }
+    int peek() { return -1; }
+    void stop() {}
+    uint8_t connected() { return 0; }
+    void flush() {}
+    void setNoDelay(bool) {}
+    using Print::write;
+};
+
+namespace BearSSL
+{
+class X509List
+{
+  public:
+    X509List(const char *pem) {}
+};
+
+class Session
+{
+};
+
+class WiFiClientSecure : public WiFiClient
+{
+  public:
+    void setX509Time(time_t) {}
+    void setTrustAnchors(const X509List *) {}
+    void setSession(Session *) {}
+    void setBufferSizes(int, int) {}
+    void setInsecure() {}
+};
+} // namespace BearSSL
+
+using BearSSL::WiFiClientSecure;
+
+class ESP8266WiFiClass
+{
+  public:
+    void persistent(bool) {}
+    bool mode(int mode) { return true; }
+    bool setAutoConnect(bool) { return true; }
+    bool forceSleepWake() { return true; }
+    bool forceSleepBegin() { return true; }
+
+    wl_status_t begin(const char *ssid, const char *password = NULL, int32_t channel = 0, const uint8_t *bssid = NULL, bool connect = true);
+    bool config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress()) { return true; }
+    bool disconnect(bool wifiOff = false);
+    wl_status_t status() { return _status; }
+
+    int8_t scanNetworks(bool async = false, bool hidden = false) { return 0; }
+    int8_t scanComplete() { return 0; }
+    void scanDelete() {}
+    String SSID(uint8_t) { return String(); }
+    int32_t RSSI(uint8_t) { return 0; }
+    uint8_t *BSSID(uint8_t) { return _bssid; }
+    int32_t channel(uint8_t) { return 0; }
+
+    String SSID() { return String(_ssid.c_str()); }
+    int32_t RSSI() { return -50; }
+    uint8_t *BSSID() { return _bssid; }
+    int32_t channel() { return 1; }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    IPAddress gatewayIP() { return IPAddress(127, 0, 0, 1); }
+    IPAddress subnetMask() { return IPAddress(255, 0, 0, 0); }
+    IPAddress dnsIP(uint8_t = 0) { return IPAddress(127, 0, 0, 1); }
+
+  private:
+    wl_status_t _status = WL_DISCONNECTED;
+    std::string _ssid;
+    uint8_t _bssid[6] = {0x02, 0, 0, 0, 0, 1};
+};
+
+extern ESP8266WiFiClass WiFi;
+
+#endif // __HOST_ESP8266WIFI_H
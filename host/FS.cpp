@@ -0,0 +1,84 @@
+#include "FS.h"
+
+#include <string>
+#include <sys/stat.h>
+
+static std::string hostPath(const char *path)
+{
+    const char *root = getenv("SPIFFS_DIR");
+    return std::string(root != NULL ? root : "data") + (path[0] == '/' ? "" : "/") + path;
+}
+
+namespace fs
+{
+size_t File::write(uint8_t value)
+{
+    return write(&value, 1);
+}
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+    return _file ? fwrite(buffer, 1, size, _file.get()) : 0;
+}
+
+int File::available()
+{
+    if (!_file)
+        return 0;
+    long position = ftell(_file.get());
+    return (int)(size() - position);
+}
+
+int File::read()
+{
+    return _file ? fgetc(_file.get()) : -1;
+}
+
+size_t File::read(uint8_t *buffer, size_t size)
+{
+    return _file ? fread(buffer, 1, size, _file.get()) : 0;
+}
+
+int File::peek()
+{
+    if (!_file)
+        return -1;
+    int value = fgetc(_file.get());
+    if (value != EOF)
+        ungetc(value, _file.get());
+    return value;
+}
+
+bool File::seek(uint32_t position)
+{
+    return _file && fseek(_file.get(), position, SEEK_SET) == 0;
+}
+
+size_t File::size() const
+{
+    struct stat info;
+    if (!_file || fflush(_file.get()) != 0 || fstat(fileno(_file.get()), &info) != 0)
+        return 0;
+    return info.st_size;
+}
+
+bool FS::exists(const char *path)
+{
+    struct stat info;
+    return stat(hostPath(path).c_str(), &info) == 0;
+}
+
+File FS::open(const char *path, const char *mode)
+{
+    // "r", "w" and "a" only, always binary
+    std::string hostMode = std::string(mode) + "b";
+    return File(fopen(hostPath(path).c_str(), hostMode.c_str()));
+}
+
+bool FS::remove(const char *path)
+{
+    return ::remove(hostPath(path).c_str()) == 0;
+}
+} // namespace fs
+
+fs::FS SPIFFS;
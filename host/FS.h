@@ -0,0 +1,53 @@
+#ifndef __HOST_FS_H
+#define __HOST_FS_H
+
+#include <memory>
+
+#include "Arduino.h"
+
+// SPIFFS backed by a directory: $SPIFFS_DIR, or data/ (what gets uploaded
+// to the device) when it isn't set. Paths are flat, like SPIFFS.
+namespace fs
+{
+class File : public Stream
+{
+  public:
+    File() {}
+    explicit File(FILE *file)
+    {
+        if (file != NULL)
+            _file.reset(file, fclose);
+    }
+
+    size_t write(uint8_t value);
+    size_t write(const uint8_t *buffer, size_t size);
+    int available();
+    int read();
+    size_t read(uint8_t *buffer, size_t size);
+    int peek();
+    bool seek(uint32_t position);
+    size_t size() const;
+    void close() { _file.reset(); }
+    operator bool() const { return (bool)_file; }
+    using Print::write;
+
+  private:
+    std::shared_ptr<FILE> _file;
+};
+
+class FS
+{
+  public:
+    bool begin() { return true; }
+    void end() {}
+    bool exists(const char *path);
+    File open(const char *path, const char *mode);
+    bool remove(const char *path);
+};
+} // namespace fs
+
+using fs::File;
+
+extern fs::FS SPIFFS;
+
+#endif // __HOST_FS_H
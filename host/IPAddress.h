@@ -0,0 +1,20 @@
+#ifndef __HOST_IPADDRESS_H
+#define __HOST_IPADDRESS_H
+
+#include <stdint.h>
+
+class IPAddress
+{
+  public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint32_t address) : _address(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+
+    operator uint32_t() const { return _address; }
+    bool isSet() const { return _address != 0; }
+
+  private:
+    uint32_t _address;
+};
+
+#endif // __HOST_IPADDRESS_H
@@ -0,0 +1,63 @@
+#include "Print.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t written = 0;
+    while (size--)
+        written += write(*buffer++);
+    return written;
+}
+
+size_t Print::print(long value, int base)
+{
+    char text[24];
+    if (base == HEX)
+        snprintf(text, sizeof(text), "%lx", value);
+    else
+        snprintf(text, sizeof(text), "%ld", value);
+    return write(text);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+    char text[24];
+    snprintf(text, sizeof(text), base == HEX ? "%lx" : "%lu", value);
+    return write(text);
+}
+
+size_t Print::print(double value, int digits)
+{
+    char text[40];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return write(text);
+}
+
+static size_t printTo(Print &output, const char *format, va_list args)
+{
+    char text[256];
+    int length = vsnprintf(text, sizeof(text), format, args);
+    if (length < 0)
+        return 0;
+    return output.write((const uint8_t *)text, (size_t)length < sizeof(text) ? length : sizeof(text) - 1);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t written = printTo(*this, format, args);
+    va_end(args);
+    return written;
+}
+
+size_t Print::printf_P(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t written = printTo(*this, format, args);
+    va_end(args);
+    return written;
+}
@@ -0,0 +1,43 @@
+#ifndef __HOST_PRINT_H
+#define __HOST_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEC 10
+#define HEX 16
+
+class __FlashStringHelper;
+#define F(string) ((const __FlashStringHelper *)(string))
+
+// The subset of the core's Print used by the library
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *text) { return text == NULL ? 0 : write((const uint8_t *)text, strlen(text)); }
+    // Bytes a write can take without blocking, 0 when unknown
+    virtual int availableForWrite() { return 0; }
+
+    size_t print(const char *text) { return write(text); }
+    size_t print(const __FlashStringHelper *text) { return write((const char *)text); }
+    size_t print(char value) { return write((uint8_t)value); }
+    size_t print(int value, int base = DEC) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template <typename T>
+    size_t println(T value) { return print(value) + println(); }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t printf_P(const char *format, ...);
+};
+
+#endif // __HOST_PRINT_H
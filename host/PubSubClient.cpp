@@ -0,0 +1,247 @@
+#include "PubSubClient.h"
+
+#include <atomic>
+#include <mutex>
+
+static PubSubClient *currentClient;
+// A network worker publishes while the sketch's thread reads these
+static std::atomic<FakeMqttBackend *> currentBackend;
+static std::atomic<uint32_t> publishes;
+static std::mutex publishedLock;
+static std::string publishedTopic;
+
+PubSubClient::PubSubClient() : _state(MQTT_DISCONNECTED), _client(NULL), _wired(false), _nextPacketId(0)
+{
+    currentClient = this;
+}
+
+PubSubClient::~PubSubClient()
+{
+    if (currentClient == this)
+        currentClient = NULL;
+}
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
+{
+    this->callback = callback;
+    return *this;
+}
+
+bool PubSubClient::connect(const char *id, const char *user, const char *password)
+{
+    return connect(id, user, password, NULL, 0, false, NULL, true);
+}
+
+bool PubSubClient::connect(const char *id, const char *user, const char *password, const char *willTopic, uint8_t willQos,
+                           bool willRetain, const char *willMessage, bool cleanSession)
+{
+    FakeMqttBackend *backend = currentBackend;
+    _wired = backend == NULL && _client != NULL && _client->connected();
+    if (!_wired)
+    {
+        _state = MQTT_CONNECTED;
+        if (backend != NULL && !backend->connect(this, id, user, password, cleanSession))
+            _state = MQTT_DISCONNECTED;
+        return connected();
+    }
+
+    std::string packet;
+    mqttEncodeConnect(packet, id, user, password, MQTT_KEEPALIVE, cleanSession);
+
+    _state = MQTT_CONNECTED;
+    std::string data;
+    MqttPacket connack;
+    if (!writePacket(packet) || !readPacket(data, connack) || connack.type != MQTT_PACKET_CONNACK)
+    {
+        if (_state == MQTT_CONNECTED)
+            _state = MQTT_CONNECTION_TIMEOUT;
+        _client->stop();
+        return false;
+    }
+    uint16_t code = mqttParseAck(connack);
+    _state = code == 0 ? MQTT_CONNECTED : code;
+    return connected();
+}
+
+void PubSubClient::disconnect()
+{
+    FakeMqttBackend *backend = currentBackend;
+    if (backend != NULL && connected())
+        backend->disconnect(this);
+    if (_wired && connected())
+    {
+        std::string packet;
+        mqttEncodeEmpty(packet, MQTT_PACKET_DISCONNECT);
+        writePacket(packet);
+        _client->stop();
+    }
+    _state = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected()
+{
+    if (_wired && _state == MQTT_CONNECTED && !_client->connected())
+        _state = MQTT_CONNECTION_LOST;
+    return _state == MQTT_CONNECTED;
+}
+
+bool PubSubClient::loop()
+{
+    if (!connected())
+        return false;
+    if (!_wired || _client->available() == 0)
+        return true;
+
+    // One packet per call, blocking until all of it is in
+    std::string data;
+    MqttPacket packet;
+    if (!readPacket(data, packet))
+        return false;
+
+    std::string topic;
+    const uint8_t *payload;
+    size_t length;
+    uint16_t packetId;
+    if (packet.type == MQTT_PACKET_PUBLISH && mqttParsePublish(packet, topic, payload, length, packetId))
+    {
+        if (packetId != 0)
+        {
+            std::string puback;
+            mqttEncodeAck(puback, MQTT_PACKET_PUBACK, packetId);
+            writePacket(puback);
+        }
+        deliver(topic.c_str(), payload, length);
+    }
+    return connected();
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+{
+    // Same limit as the real client: header, topic and payload in one buffer
+    if (!connected() || 5 + 2 + strlen(topic) + length > MQTT_MAX_PACKET_SIZE)
+        return false;
+    FakeMqttBackend *backend = currentBackend;
+    if (backend != NULL && !backend->publish(this, topic, payload, length))
+        return false;
+    if (_wired)
+    {
+        std::string packet;
+        mqttEncodePublish(packet, topic, payload, length, 0, 0);
+        if (!writePacket(packet))
+            return false;
+    }
+
+    publishes++;
+    std::lock_guard<std::mutex> lock(publishedLock);
+    publishedTopic = topic;
+    return true;
+}
+
+bool PubSubClient::subscribe(const char *topic, uint8_t qos)
+{
+    if (!connected())
+        return false;
+    if (_wired)
+    {
+        if (++_nextPacketId == 0)
+            _nextPacketId = 1;
+        std::string packet;
+        mqttEncodeSubscribe(packet, _nextPacketId, topic, qos);
+        return writePacket(packet);
+    }
+    FakeMqttBackend *backend = currentBackend;
+    return backend == NULL || backend->subscribe(this, topic, qos);
+}
+
+// The whole packet in one write, which blocks until the client took it
+bool PubSubClient::writePacket(const std::string &packet)
+{
+    if (_client->write((const uint8_t *)packet.data(), packet.size()) != packet.size())
+    {
+        _client->stop();
+        _state = MQTT_CONNECTION_LOST;
+        return false;
+    }
+    return true;
+}
+
+// Reads into data until it holds a whole packet, which packet then points into
+bool PubSubClient::readPacket(std::string &data, MqttPacket &packet)
+{
+    long size;
+    while ((size = mqttParsePacket((const uint8_t *)data.data(), data.size(), packet)) == 0)
+    {
+        uint8_t value;
+        if (!readByte(value))
+            return false;
+        data += (char)value;
+    }
+    return size > 0;
+}
+
+// Spins until a byte arrives, up to MQTT_SOCKET_TIMEOUT
+bool PubSubClient::readByte(uint8_t &value)
+{
+    uint32_t startedMs = millis();
+    while (!_client->available())
+    {
+        if (millis() - startedMs >= MQTT_SOCKET_TIMEOUT * 1000UL)
+        {
+            _client->stop();
+            _state = MQTT_CONNECTION_TIMEOUT;
+            return false;
+        }
+        yield();
+    }
+    value = _client->read();
+    return true;
+}
+
+void PubSubClient::deliver(const char *topic, const uint8_t *payload, unsigned int length)
+{
+    if (!callback)
+        return;
+
+    // The real client hands out pointers into its packet buffer
+    char buffer[MQTT_MAX_PACKET_SIZE];
+    size_t topicLength = strlen(topic);
+    if (topicLength + 1 + length > sizeof(buffer))
+        return;
+
+    memcpy(buffer, topic, topicLength + 1);
+    memcpy(buffer + topicLength + 1, payload, length);
+    callback(buffer, (uint8_t *)buffer + topicLength + 1, length);
+}
+
+namespace FakeMqtt
+{
+void setBackend(FakeMqttBackend *newBackend)
+{
+    currentBackend = newBackend;
+}
+
+void setConnected(bool connected)
+{
+    if (currentClient != NULL)
+        currentClient->setConnected(connected);
+}
+
+bool deliver(const char *topic, const uint8_t *payload, unsigned int length)
+{
+    if (currentClient == NULL)
+        return false;
+    currentClient->deliver(topic, payload, length);
+    return true;
+}
+
+uint32_t publishCount()
+{
+    return publishes;
+}
+
+std::string lastTopic()
+{
+    std::lock_guard<std::mutex> lock(publishedLock);
+    return publishedTopic;
+}
+} // namespace FakeMqtt
@@ -0,0 +1,115 @@
+#ifndef __HOST_PUBSUBCLIENT_H
+#define __HOST_PUBSUBCLIENT_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "mqtt_packet.h"
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 128
+#endif
+
+#ifndef MQTT_SOCKET_TIMEOUT
+#define MQTT_SOCKET_TIMEOUT 15
+#endif
+
+#ifndef MQTT_KEEPALIVE
+#define MQTT_KEEPALIVE 15
+#endif
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECT_BAD_PROTOCOL 1
+#define MQTT_CONNECT_BAD_CLIENT_ID 2
+#define MQTT_CONNECT_UNAVAILABLE 3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED 5
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+class PubSubClient;
+
+// Carries the clients' traffic somewhere else, see FakeMqtt::setBackend().
+// connect() may return before the broker answers; the backend calls
+// setConnected(false) on the client if it doesn't accept.
+class FakeMqttBackend
+{
+  public:
+    virtual ~FakeMqttBackend() {}
+    virtual bool connect(PubSubClient *client, const char *id, const char *user, const char *password, bool cleanSession) = 0;
+    virtual bool publish(PubSubClient *client, const char *topic, const uint8_t *payload, unsigned int length) = 0;
+    virtual bool subscribe(PubSubClient *client, const char *topic, uint8_t qos) = 0;
+    virtual void disconnect(PubSubClient *client) = 0;
+};
+
+// PubSubClient's interface without the network. connect() always succeeds
+// (the WiFiClient fake fails before it's called), publishes are counted and
+// dropped, and FakeMqtt can hand messages to the callback as if the broker
+// sent them. With a backend, the backend decides instead.
+//
+// Given a Client that is already connected (a fake link with something at
+// the other end), it talks MQTT over it the way the real one does: each
+// packet in one blocking write(), connect() waiting for the CONNACK and
+// loop() reading one whole packet at a time. No keepalive pings.
+class PubSubClient
+{
+  public:
+    PubSubClient();
+    ~PubSubClient();
+
+    PubSubClient &setClient(Client &client)
+    {
+        _client = &client;
+        return *this;
+    }
+    PubSubClient &setServer(const char *host, uint16_t port) { return *this; }
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+
+    bool connect(const char *id, const char *user, const char *password);
+    bool connect(const char *id, const char *user, const char *password, const char *willTopic, uint8_t willQos,
+                 bool willRetain, const char *willMessage, bool cleanSession = true);
+    void disconnect();
+    bool connected();
+    int state() { return _state; }
+    bool loop();
+
+    bool publish(const char *topic, const char *payload) { return publish(topic, (const uint8_t *)payload, strlen(payload)); }
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false);
+    bool subscribe(const char *topic, uint8_t qos = 0);
+
+    // For FakeMqtt
+    void setConnected(bool connected) { _state = connected ? MQTT_CONNECTED : MQTT_DISCONNECTED; }
+    void deliver(const char *topic, const uint8_t *payload, unsigned int length);
+
+  private:
+    bool writePacket(const std::string &packet);
+    bool readPacket(std::string &data, MqttPacket &packet);
+    bool readByte(uint8_t &value);
+
+    MQTT_CALLBACK_SIGNATURE;
+    std::atomic<int> _state; // FakeMqtt sets it from the sketch's thread, a network worker reads it
+    Client *_client;
+    bool _wired; // talking to _client
+    uint16_t _nextPacketId;
+};
+
+// Control over the fake broker. Applies to the most recently created client,
+// unless the library runs several (gateway mode).
+namespace FakeMqtt
+{
+// Every client's traffic goes to the backend, NULL restores the default
+void setBackend(FakeMqttBackend *backend);
+void setConnected(bool connected);
+bool deliver(const char *topic, const uint8_t *payload, unsigned int length);
+uint32_t publishCount();
+std::string lastTopic();
+} // namespace FakeMqtt
+
+#endif // __HOST_PUBSUBCLIENT_H
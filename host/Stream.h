@@ -0,0 +1,7 @@
+#ifndef __HOST_STREAM_H
+#define __HOST_STREAM_H
+
+// Stream is declared with the rest of the core in Arduino.h
+#include "Arduino.h"
+
+#endif // __HOST_STREAM_H
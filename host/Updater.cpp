@@ -0,0 +1,81 @@
+#include "Updater.h"
+
+UpdaterClass Update;
+
+static size_t capacity = 1024 * 1024;
+static std::string committed;
+static uint32_t commits;
+
+bool UpdaterClass::begin(size_t size, int command, int ledPin, uint8_t ledOn)
+{
+    if (isRunning())
+        return false;
+
+    _image.clear();
+    if (size == 0)
+    {
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    if (size > capacity)
+    {
+        _error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    _error = UPDATE_ERROR_OK;
+    _size = size;
+    return true;
+}
+
+size_t UpdaterClass::write(uint8_t *data, size_t length)
+{
+    if (!isRunning() || hasError())
+        return 0;
+    if (length > remaining())
+    {
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    _image.append((const char *)data, length);
+    return length;
+}
+
+bool UpdaterClass::end(bool evenIfRemaining)
+{
+    if (!isRunning())
+        return false;
+
+    bool isComplete = !hasError() && (remaining() == 0 || evenIfRemaining);
+    if (isComplete)
+    {
+        committed = _image;
+        commits++;
+    }
+    _size = 0;
+    _image.clear();
+    return isComplete;
+}
+
+namespace FakeUpdate
+{
+void setCapacity(size_t bytes)
+{
+    capacity = bytes;
+}
+
+const std::string &committedImage()
+{
+    return committed;
+}
+
+uint32_t commitCount()
+{
+    return commits;
+}
+
+void reset()
+{
+    committed.clear();
+    commits = 0;
+}
+} // namespace FakeUpdate
@@ -0,0 +1,53 @@
+#ifndef __HOST_UPDATER_H
+#define __HOST_UPDATER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define U_FLASH 0
+
+#define UPDATE_ERROR_OK 0
+#define UPDATE_ERROR_WRITE 1
+#define UPDATE_ERROR_SPACE 4
+#define UPDATE_ERROR_SIZE 5
+
+// The core's Updater with the update partition in memory. Like the real
+// one, end() only commits once every byte begin() announced was written,
+// unless told to, and otherwise drops the update. FakeUpdate shows what was
+// committed.
+class UpdaterClass
+{
+  public:
+    UpdaterClass() : _size(0), _error(UPDATE_ERROR_OK) {}
+
+    bool begin(size_t size, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = 0);
+    size_t write(uint8_t *data, size_t length);
+    bool end(bool evenIfRemaining = false);
+
+    bool isRunning() { return _size > 0; }
+    size_t size() { return _size; }
+    size_t progress() { return _image.size(); }
+    size_t remaining() { return _size - _image.size(); }
+    uint8_t getError() { return _error; }
+    bool hasError() { return _error != UPDATE_ERROR_OK; }
+
+  private:
+    size_t _size;
+    std::string _image;
+    uint8_t _error;
+};
+
+extern UpdaterClass Update;
+
+namespace FakeUpdate
+{
+// Room in the update partition, 1 MB by default
+void setCapacity(size_t bytes);
+// The image of the last update end() committed, "" if none
+const std::string &committedImage();
+uint32_t commitCount();
+void reset();
+} // namespace FakeUpdate
+
+#endif // __HOST_UPDATER_H
@@ -0,0 +1,7 @@
+#ifndef __HOST_COREDECLS_H
+#define __HOST_COREDECLS_H
+
+// Called by configTime(); the host clock is already set
+void settimeofday_cb(void (*callback)());
+
+#endif // __HOST_COREDECLS_H
@@ -0,0 +1,105 @@
+#include "host_heap.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+// Lock-free, they're updated from inside malloc()
+static std::atomic<uint64_t> allocations;
+static std::atomic<uint64_t> frees;
+static std::atomic<size_t> currentBytes;
+static std::atomic<size_t> peakBytes;
+
+static void raisePeak(size_t current)
+{
+    size_t peak = peakBytes.load(std::memory_order_relaxed);
+    while (current > peak && !peakBytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+    {
+    }
+}
+
+static void *allocated(void *pointer)
+{
+    if (pointer != NULL)
+    {
+        size_t size = malloc_usable_size(pointer);
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        raisePeak(currentBytes.fetch_add(size, std::memory_order_relaxed) + size);
+    }
+    return pointer;
+}
+
+static void released(void *pointer)
+{
+    if (pointer == NULL)
+        return;
+
+    // Blocks from before the counting started would take it below 0
+    size_t size = malloc_usable_size(pointer);
+    frees.fetch_add(1, std::memory_order_relaxed);
+    size_t current = currentBytes.load(std::memory_order_relaxed);
+    while (!currentBytes.compare_exchange_weak(current, current > size ? current - size : 0, std::memory_order_relaxed))
+    {
+    }
+}
+
+extern "C" void *malloc(size_t size)
+{
+    return allocated(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    return allocated(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    released(pointer);
+    return allocated(__libc_realloc(pointer, size));
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size));
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size));
+}
+
+extern "C" int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+    *pointer = allocated(__libc_memalign(alignment, size));
+    return *pointer != NULL ? 0 : ENOMEM;
+}
+
+extern "C" void free(void *pointer)
+{
+    released(pointer);
+    __libc_free(pointer);
+}
+
+HostHeapStats hostHeapStats()
+{
+    HostHeapStats stats;
+    stats.allocations = allocations.load(std::memory_order_relaxed);
+    stats.frees = frees.load(std::memory_order_relaxed);
+    stats.currentBytes = currentBytes.load(std::memory_order_relaxed);
+    stats.peakBytes = peakBytes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void hostHeapResetPeak()
+{
+    peakBytes.store(currentBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
@@ -0,0 +1,23 @@
+#ifndef __HOST_HEAP_H
+#define __HOST_HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// malloc/free (and so new/delete) are counted on the host build, see
+// host_heap.cpp, from any thread; usable sizes are what's counted. With
+// several threads allocating, the stats are a snapshot.
+typedef struct tagHostHeapStats
+{
+    uint64_t allocations;
+    uint64_t frees;
+    size_t currentBytes;
+    size_t peakBytes;
+} HostHeapStats;
+
+HostHeapStats hostHeapStats();
+
+// Starts a new peak measurement from the current usage
+void hostHeapResetPeak();
+
+#endif // __HOST_HEAP_H
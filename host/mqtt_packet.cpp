@@ -0,0 +1,217 @@
+#include "mqtt_packet.h"
+
+#include <string.h>
+
+static void putLength(std::string &out, size_t length)
+{
+    do
+    {
+        uint8_t digit = length % 128;
+        length /= 128;
+        out.push_back((char)(length > 0 ? digit | 0x80 : digit));
+    } while (length > 0);
+}
+
+static void putShort(std::string &out, uint16_t value)
+{
+    out.push_back((char)(value >> 8));
+    out.push_back((char)value);
+}
+
+static void putString(std::string &out, const char *value)
+{
+    size_t length = strlen(value);
+    putShort(out, (uint16_t)length);
+    out.append(value, length);
+}
+
+void mqttEncodeConnect(std::string &out, const char *clientId, const char *user, const char *password, uint16_t keepAlive,
+                       bool cleanSession)
+{
+    size_t length = 10 + 2 + strlen(clientId);
+    uint8_t flags = cleanSession ? 0x02 : 0;
+    if (user != NULL)
+    {
+        flags |= 0x80;
+        length += 2 + strlen(user);
+    }
+    if (password != NULL)
+    {
+        flags |= 0x40;
+        length += 2 + strlen(password);
+    }
+
+    out.push_back((char)(MQTT_PACKET_CONNECT << 4));
+    putLength(out, length);
+    putString(out, "MQTT");
+    out.push_back(4); // 3.1.1
+    out.push_back((char)flags);
+    putShort(out, keepAlive);
+    putString(out, clientId);
+    if (user != NULL)
+        putString(out, user);
+    if (password != NULL)
+        putString(out, password);
+}
+
+void mqttEncodePublish(std::string &out, const char *topic, const uint8_t *payload, size_t length, uint8_t qos,
+                       uint16_t packetId)
+{
+    out.push_back((char)(MQTT_PACKET_PUBLISH << 4 | qos << 1));
+    putLength(out, 2 + strlen(topic) + (qos > 0 ? 2 : 0) + length);
+    putString(out, topic);
+    if (qos > 0)
+        putShort(out, packetId);
+    out.append((const char *)payload, length);
+}
+
+void mqttEncodeSubscribe(std::string &out, uint16_t packetId, const char *topic, uint8_t qos)
+{
+    out.push_back((char)(MQTT_PACKET_SUBSCRIBE << 4 | 0x02));
+    putLength(out, 2 + 2 + strlen(topic) + 1);
+    putShort(out, packetId);
+    putString(out, topic);
+    out.push_back((char)qos);
+}
+
+void mqttEncodeAck(std::string &out, uint8_t type, uint16_t packetId)
+{
+    out.push_back((char)(type << 4));
+    out.push_back(2);
+    putShort(out, packetId);
+}
+
+void mqttEncodeEmpty(std::string &out, uint8_t type)
+{
+    out.push_back((char)(type << 4));
+    out.push_back(0);
+}
+
+void mqttEncodeConnack(std::string &out, bool sessionPresent, uint8_t returnCode)
+{
+    out.push_back((char)(MQTT_PACKET_CONNACK << 4));
+    out.push_back(2);
+    out.push_back(sessionPresent ? 1 : 0);
+    out.push_back((char)returnCode);
+}
+
+void mqttEncodeSuback(std::string &out, uint16_t packetId, const uint8_t *returnCodes, size_t count)
+{
+    out.push_back((char)(MQTT_PACKET_SUBACK << 4));
+    putLength(out, 2 + count);
+    putShort(out, packetId);
+    out.append((const char *)returnCodes, count);
+}
+
+long mqttParsePacket(const uint8_t *data, size_t size, MqttPacket &packet)
+{
+    if (size < 2)
+        return 0;
+
+    size_t length = 0;
+    size_t position = 1;
+    for (int shift = 0;; shift += 7)
+    {
+        if (position >= size)
+            return 0;
+        if (shift > 21)
+            return -1;
+        uint8_t digit = data[position++];
+        length |= (size_t)(digit & 0x7f) << shift;
+        if ((digit & 0x80) == 0)
+            break;
+    }
+
+    if (length > MQTT_PACKET_MAX_LENGTH)
+        return -1;
+    if (size - position < length)
+        return 0;
+
+    packet.type = data[0] >> 4;
+    packet.flags = data[0] & 0x0f;
+    packet.body = data + position;
+    packet.length = length;
+    return (long)(position + length);
+}
+
+bool mqttParsePublish(const MqttPacket &packet, std::string &topic, const uint8_t *&payload, size_t &length,
+                      uint16_t &packetId)
+{
+    if (packet.length < 2)
+        return false;
+    size_t topicLength = (size_t)packet.body[0] << 8 | packet.body[1];
+    uint8_t qos = (packet.flags >> 1) & 0x03;
+    size_t headerLength = 2 + topicLength + (qos > 0 ? 2 : 0);
+    if (headerLength > packet.length)
+        return false;
+
+    topic.assign((const char *)packet.body + 2, topicLength);
+    packetId = qos > 0 ? (uint16_t)(packet.body[2 + topicLength] << 8 | packet.body[3 + topicLength]) : 0;
+    payload = packet.body + headerLength;
+    length = packet.length - headerLength;
+    return true;
+}
+
+uint16_t mqttParseAck(const MqttPacket &packet)
+{
+    if (packet.length < 2)
+        return 0xffff;
+    // CONNACK is flags, return code
+    if (packet.type == MQTT_PACKET_CONNACK)
+        return packet.body[1];
+    return (uint16_t)(packet.body[0] << 8 | packet.body[1]);
+}
+
+// Reads a length-prefixed string at position, moving it past the string
+static bool getString(const MqttPacket &packet, size_t &position, std::string &value)
+{
+    if (packet.length - position < 2)
+        return false;
+    size_t length = (size_t)packet.body[position] << 8 | packet.body[position + 1];
+    if (packet.length - position - 2 < length)
+        return false;
+    value.assign((const char *)packet.body + position + 2, length);
+    position += 2 + length;
+    return true;
+}
+
+bool mqttParseConnect(const MqttPacket &packet, MqttConnect &connect)
+{
+    size_t position = 0;
+    std::string protocol;
+    if (!getString(packet, position, protocol) || protocol != "MQTT" || packet.length - position < 4)
+        return false;
+
+    uint8_t level = packet.body[position];
+    uint8_t flags = packet.body[position + 1];
+    if (level != 4 || (flags & 0x05) != 0)
+        return false;
+    connect.keepAlive = (uint16_t)(packet.body[position + 2] << 8 | packet.body[position + 3]);
+    connect.cleanSession = (flags & 0x02) != 0;
+    position += 4;
+
+    connect.user.clear();
+    connect.password.clear();
+    return getString(packet, position, connect.clientId) &&
+           ((flags & 0x80) == 0 || getString(packet, position, connect.user)) &&
+           ((flags & 0x40) == 0 || getString(packet, position, connect.password)) && position == packet.length;
+}
+
+bool mqttParseSubscribe(const MqttPacket &packet, uint16_t &packetId, std::vector<MqttFilter> &filters)
+{
+    if (packet.flags != 0x02 || packet.length < 2)
+        return false;
+    packetId = (uint16_t)(packet.body[0] << 8 | packet.body[1]);
+
+    filters.clear();
+    size_t position = 2;
+    while (position < packet.length)
+    {
+        MqttFilter filter;
+        if (!getString(packet, position, filter.topic) || position >= packet.length)
+            return false;
+        filter.qos = packet.body[position++];
+        filters.push_back(filter);
+    }
+    return !filters.empty();
+}
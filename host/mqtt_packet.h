@@ -0,0 +1,88 @@
+#ifndef __MQTT_PACKET_H
+#define __MQTT_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// MQTT 3.1.1 packets, just what the host fakes, the simulator and the
+// stand-in hub send and read. Encoders append to a connection's output
+// buffer.
+
+#define MQTT_PACKET_CONNECT 1
+#define MQTT_PACKET_CONNACK 2
+#define MQTT_PACKET_PUBLISH 3
+#define MQTT_PACKET_PUBACK 4
+#define MQTT_PACKET_SUBSCRIBE 8
+#define MQTT_PACKET_SUBACK 9
+#define MQTT_PACKET_PINGREQ 12
+#define MQTT_PACKET_PINGRESP 13
+#define MQTT_PACKET_DISCONNECT 14
+
+// CONNACK return codes
+#define MQTT_CONNACK_ACCEPTED 0
+#define MQTT_CONNACK_UNAVAILABLE 3
+#define MQTT_CONNACK_BAD_CREDENTIALS 4
+#define MQTT_CONNACK_NOT_AUTHORIZED 5
+
+// SUBACK return code of a refused filter
+#define MQTT_SUBACK_FAILURE 0x80
+
+// Largest packet accepted from the broker
+#define MQTT_PACKET_MAX_LENGTH 65536
+
+typedef struct tagMqttPacket
+{
+    uint8_t type;
+    uint8_t flags; // low nibble of the first byte
+    const uint8_t *body;
+    size_t length; // of the body
+} MqttPacket;
+
+typedef struct tagMqttConnect
+{
+    std::string clientId;
+    std::string user;
+    std::string password;
+    uint16_t keepAlive;
+    bool cleanSession;
+} MqttConnect;
+
+typedef struct tagMqttFilter
+{
+    std::string topic;
+    uint8_t qos;
+} MqttFilter;
+
+void mqttEncodeConnect(std::string &out, const char *clientId, const char *user, const char *password, uint16_t keepAlive,
+                       bool cleanSession);
+void mqttEncodePublish(std::string &out, const char *topic, const uint8_t *payload, size_t length, uint8_t qos,
+                       uint16_t packetId);
+void mqttEncodeSubscribe(std::string &out, uint16_t packetId, const char *topic, uint8_t qos);
+
+// PUBACK, or the packet id of any other acknowledgement
+void mqttEncodeAck(std::string &out, uint8_t type, uint16_t packetId);
+
+// PINGREQ, PINGRESP and DISCONNECT
+void mqttEncodeEmpty(std::string &out, uint8_t type);
+
+void mqttEncodeConnack(std::string &out, bool sessionPresent, uint8_t returnCode);
+void mqttEncodeSuback(std::string &out, uint16_t packetId, const uint8_t *returnCodes, size_t count);
+
+// Finds the packet at the start of data. Returns its size, 0 if it isn't
+// all there yet, -1 if the data isn't MQTT.
+long mqttParsePacket(const uint8_t *data, size_t size, MqttPacket &packet);
+
+bool mqttParsePublish(const MqttPacket &packet, std::string &topic, const uint8_t *&payload, size_t &length,
+                      uint16_t &packetId);
+
+// Packet id of a PUBACK or SUBACK, or the return code of a CONNACK
+uint16_t mqttParseAck(const MqttPacket &packet);
+
+// Only protocol level 4; no will, which neither the library nor the
+// simulator sends
+bool mqttParseConnect(const MqttPacket &packet, MqttConnect &connect);
+bool mqttParseSubscribe(const MqttPacket &packet, uint16_t &packetId, std::vector<MqttFilter> &filters);
+
+#endif // __MQTT_PACKET_H
@@ -0,0 +1,27 @@
+#ifndef __HOST_PGMSPACE_H
+#define __HOST_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Flash and RAM are the same thing on the host
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(string) (string)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+#define pgm_read_ptr(address) (*(const void *const *)(address))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcmp_P strcmp
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+#define sprintf_P sprintf
+
+#endif // __HOST_PGMSPACE_H
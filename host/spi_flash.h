@@ -0,0 +1,6 @@
+#ifndef __HOST_SPI_FLASH_H
+#define __HOST_SPI_FLASH_H
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#endif // __HOST_SPI_FLASH_H
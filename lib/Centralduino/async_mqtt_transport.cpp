@@ -0,0 +1,635 @@
+#include "async_mqtt_transport.h"
+
+#include "defines.h"
+#include "binary_log.h"
+
+// Control packet types, the high nibble of the fixed header
+#define PACKET_CONNECT 0x10
+#define PACKET_CONNACK 0x20
+#define PACKET_PUBLISH 0x30
+#define PACKET_PUBACK 0x40
+#define PACKET_SUBSCRIBE 0x80
+#define PACKET_SUBACK 0x90
+#define PACKET_PINGREQ 0xC0
+#define PACKET_PINGRESP 0xD0
+#define PACKET_DISCONNECT 0xE0
+
+#define CONNECT_CLEAN_SESSION 0x02
+#define CONNECT_PASSWORD 0x40
+#define CONNECT_USERNAME 0x80
+
+#define SUBACK_FAILURE 0x80
+
+AsyncMqttTransport::AsyncMqttTransport()
+    : _client(NULL), _state(MQTT_DISCONNECTED), _accepted(false), _sessionPresent(false), _pingPending(false),
+      _inLoop(false), _lastPacketId(0), _connectedMs(0), _lastWriteMs(0), _lastReadMs(0), _outHead(0), _outLength(0),
+      _inflightCount(0), _pendingSubacks(0), _readState(READ_HEADER), _inHeader(0), _inRemaining(0), _inLength(0), _inShift(0),
+      _streamPrefix(NULL), _streamPrefixLength(0), _streamHandler(NULL), _streamPacketId(0), _streamOffset(0),
+      _streamLength(0)
+{
+}
+
+bool AsyncMqttTransport::connect(Client &client, const char *host, uint16_t port, const char *id, const char *user,
+                                 const char *password, bool cleanSession)
+{
+    _client = &client;
+    _accepted = false;
+    _sessionPresent = false;
+    _pingPending = false;
+    _outHead = 0;
+    _outLength = 0;
+    dropInflight();
+    _pendingSubacks = 0;
+    _readState = READ_HEADER;
+    if (!_client->connected())
+    {
+        _state = MQTT_CONNECT_FAILED;
+        return false;
+    }
+
+    uint8_t flags = cleanSession ? CONNECT_CLEAN_SESSION : 0;
+    size_t length = 10 + 2 + strlen(id);
+    if (user != NULL)
+    {
+        flags |= CONNECT_USERNAME;
+        length += 2 + strlen(user);
+    }
+    if (password != NULL)
+    {
+        flags |= CONNECT_PASSWORD;
+        length += 2 + strlen(password);
+    }
+    if (!beginPacket(PACKET_CONNECT, length))
+    {
+        _client->stop();
+        _state = MQTT_CONNECT_FAILED;
+        return false;
+    }
+
+    static const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 4}; // 3.1.1
+    put(protocol, sizeof(protocol));
+    putByte(flags);
+    putUint16(MQTT_KEEPALIVE);
+    putString(id);
+    if (user != NULL)
+        putString(user);
+    if (password != NULL)
+        putString(password);
+
+    _state = MQTT_CONNECTED;
+    _connectedMs = millis();
+    _lastWriteMs = _connectedMs;
+    _lastReadMs = _connectedMs;
+    writeOutbox();
+    return connected();
+}
+
+void AsyncMqttTransport::disconnect()
+{
+    if (_state == MQTT_CONNECTED && beginPacket(PACKET_DISCONNECT, 0))
+        writeOutbox();
+    abortStream();
+    if (_client != NULL)
+        _client->stop();
+    _state = MQTT_DISCONNECTED;
+    _accepted = false;
+    _outLength = 0;
+    _pendingSubacks = 0;
+    dropInflight();
+}
+
+bool AsyncMqttTransport::connected()
+{
+    if (_state != MQTT_CONNECTED)
+        return false;
+    if (!_client->connected())
+        close(MQTT_CONNECTION_LOST);
+    return _state == MQTT_CONNECTED;
+}
+
+bool AsyncMqttTransport::loop()
+{
+    if (!connected())
+        return false;
+
+    // A message callback that publishes ends up back here; its packets
+    // are written, the rest waits for the outer call
+    if (_inLoop)
+    {
+        writeOutbox();
+        return true;
+    }
+    _inLoop = true;
+
+    readInbox();
+
+    uint32_t now = millis();
+    if (_state == MQTT_CONNECTED && !_accepted && now - _connectedMs >= MQTT_SOCKET_TIMEOUT * 1000UL)
+    {
+        close(MQTT_CONNECTION_TIMEOUT);
+    }
+    else if (_state == MQTT_CONNECTED && _accepted &&
+             (now - _lastWriteMs >= MQTT_KEEPALIVE * 1000UL || now - _lastReadMs >= MQTT_KEEPALIVE * 1000UL))
+    {
+        // Like PubSubClient: a ping when either side has been quiet, and
+        // the connection is given up if the ping goes unanswered
+        if (_pingPending)
+        {
+            close(MQTT_CONNECTION_TIMEOUT);
+        }
+        else if (beginPacket(PACKET_PINGREQ, 0))
+        {
+            _pingPending = true;
+            _lastWriteMs = now;
+            _lastReadMs = now;
+        }
+    }
+
+    if (_state == MQTT_CONNECTED)
+        writeOutbox();
+
+    _inLoop = false;
+    return _state == MQTT_CONNECTED;
+}
+
+bool AsyncMqttTransport::publish(const char *topic, const uint8_t *payload, size_t length, uint8_t qos)
+{
+    if (!connected())
+        return false;
+    if (qos > 0 && _inflightCount >= MQTT_MAX_INFLIGHT)
+        return false;
+
+    uint8_t header = PACKET_PUBLISH | (qos > 0 ? 0x02 : 0);
+    if (!beginPacket(header, 2 + strlen(topic) + (qos > 0 ? 2 : 0) + length))
+        return false;
+
+    putString(topic);
+    if (qos > 0)
+    {
+        uint16_t packetId = nextPacketId();
+        putUint16(packetId);
+        _inflight[_inflightCount].packetId = packetId;
+        _inflight[_inflightCount].queuedUs = micros();
+        _inflightCount++;
+    }
+    put(payload, length);
+
+    // Whatever the link takes now goes at once, the rest from loop()
+    writeOutbox();
+    return true;
+}
+
+bool AsyncMqttTransport::subscribe(const char *topic, uint8_t qos)
+{
+    return subscribe(&topic, &qos, 1);
+}
+
+bool AsyncMqttTransport::subscribe(const char *const *topics, const uint8_t *qos, size_t count)
+{
+    size_t length = 2;
+    for (size_t i = 0; i < count; i++)
+        length += 2 + strlen(topics[i]) + 1;
+    if (!connected() || count == 0 || !beginPacket(PACKET_SUBSCRIBE | 0x02, length))
+        return false;
+
+    putUint16(nextPacketId());
+    for (size_t i = 0; i < count; i++)
+    {
+        putString(topics[i]);
+        putByte(qos[i]);
+    }
+    _pendingSubacks++;
+    writeOutbox();
+    return true;
+}
+
+bool AsyncMqttTransport::setStreamHandler(const char *topicPrefix, size_t prefixLength, MqttStreamHandler *handler)
+{
+    _streamPrefix = topicPrefix;
+    _streamPrefixLength = prefixLength;
+    _streamHandler = handler;
+    return true;
+}
+
+bool AsyncMqttTransport::flush(uint32_t timeoutMs)
+{
+    uint32_t startedMs = millis();
+    while (loop())
+    {
+        if (_accepted && _outLength == 0 && _inflightCount == 0)
+        {
+            _client->flush();
+            return true;
+        }
+        if (millis() - startedMs >= timeoutMs)
+            return false;
+        delay(1);
+    }
+    return false;
+}
+
+bool AsyncMqttTransport::beginPacket(uint8_t header, size_t remainingLength)
+{
+    uint8_t length[4];
+    size_t lengthBytes = 0;
+    size_t value = remainingLength;
+    do
+    {
+        length[lengthBytes] = value & 0x7F;
+        value >>= 7;
+        if (value > 0)
+            length[lengthBytes] |= 0x80;
+        lengthBytes++;
+    } while (value > 0 && lengthBytes < sizeof(length));
+
+    if (value > 0 || 1 + lengthBytes + remainingLength > (size_t)(MQTT_OUTBOX_SIZE - _outLength))
+        return false;
+
+    putByte(header);
+    put(length, lengthBytes);
+    return true;
+}
+
+void AsyncMqttTransport::put(const uint8_t *data, size_t length)
+{
+    size_t tail = (_outHead + _outLength) % MQTT_OUTBOX_SIZE;
+    size_t first = length < MQTT_OUTBOX_SIZE - tail ? length : MQTT_OUTBOX_SIZE - tail;
+    memcpy(_out + tail, data, first);
+    memcpy(_out, data + first, length - first);
+    _outLength += length;
+}
+
+void AsyncMqttTransport::putUint16(uint16_t value)
+{
+    uint8_t bytes[2] = {(uint8_t)(value >> 8), (uint8_t)value};
+    put(bytes, sizeof(bytes));
+}
+
+void AsyncMqttTransport::putString(const char *text)
+{
+    size_t length = strlen(text);
+    putUint16(length);
+    put((const uint8_t *)text, length);
+}
+
+uint16_t AsyncMqttTransport::nextPacketId()
+{
+    if (++_lastPacketId == 0)
+        _lastPacketId = 1;
+    return _lastPacketId;
+}
+
+// Only what fits in the TLS buffer is written, so this never waits for the
+// peer. BearSSL takes a whole record at a time.
+void AsyncMqttTransport::writeOutbox()
+{
+    while (_outLength > 0)
+    {
+        int room = _client->availableForWrite();
+        if (room <= 0)
+            break;
+
+        size_t chunk = _outLength;
+        if (chunk > (size_t)(MQTT_OUTBOX_SIZE - _outHead))
+            chunk = MQTT_OUTBOX_SIZE - _outHead;
+        if (chunk > (size_t)room)
+            chunk = room;
+
+        size_t written = _client->write(_out + _outHead, chunk);
+        if (written == 0)
+            break;
+        _outHead = (_outHead + written) % MQTT_OUTBOX_SIZE;
+        _outLength -= written;
+        _lastWriteMs = millis();
+        if (written < chunk)
+            break;
+    }
+
+    // Keeps the next packets contiguous
+    if (_outLength == 0)
+        _outHead = 0;
+}
+
+void AsyncMqttTransport::readInbox()
+{
+    // What the stream handler didn't take last time comes first
+    if (_readState == READ_STREAM && !streamPublish())
+        return;
+
+    int available;
+    while (_state == MQTT_CONNECTED && (available = _client->available()) > 0)
+    {
+        _lastReadMs = millis();
+        switch (_readState)
+        {
+        case READ_HEADER:
+            _inHeader = _client->read();
+            _inRemaining = 0;
+            _inLength = 0;
+            _inShift = 0;
+            _streamPacketId = 0;
+            _readState = READ_LENGTH;
+            break;
+
+        case READ_LENGTH:
+        {
+            uint8_t value = _client->read();
+            _inRemaining |= (uint32_t)(value & 0x7F) << _inShift;
+            _inShift += 7;
+            if (value & 0x80)
+            {
+                if (_inShift >= 28) // at most 4 length bytes
+                    close(MQTT_CONNECTION_LOST);
+                break;
+            }
+
+            if ((_inHeader & 0xF0) == PACKET_PUBLISH && _streamHandler != NULL && _inRemaining >= 2)
+            {
+                _readState = READ_TOPIC;
+            }
+            else if (_inRemaining > sizeof(_in))
+            {
+                CLOG(MQTT_PACKET_DROPPED, (unsigned long)_inRemaining);
+                _readState = READ_SKIP;
+            }
+            else if (_inRemaining == 0)
+            {
+                _readState = READ_HEADER;
+                handlePacket();
+            }
+            else
+            {
+                _readState = READ_BODY;
+            }
+            break;
+        }
+
+        case READ_TOPIC:
+        {
+            size_t header = getPublishHeaderLength();
+            size_t wanted = (size_t)available < header - _inLength ? available : header - _inLength;
+            int count = _client->read(_in + _inLength, wanted);
+            if (count <= 0)
+                return;
+            _inLength += count;
+            _inRemaining -= count;
+
+            // Once the topic length is in, the header's length is known
+            header = getPublishHeaderLength();
+            if (header > _inLength + _inRemaining)
+            {
+                close(MQTT_CONNECTION_LOST);
+            }
+            else if (header >= sizeof(_in))
+            {
+                CLOG(MQTT_PACKET_DROPPED, (unsigned long)(_inLength + _inRemaining));
+                _readState = READ_SKIP;
+            }
+            else if (_inLength == header)
+            {
+                routePublish();
+            }
+            break;
+        }
+
+        case READ_STREAM:
+            if (!streamPublish())
+                return;
+            break;
+
+        case READ_BODY:
+        {
+            size_t wanted = (size_t)available < _inRemaining ? available : _inRemaining;
+            int count = _client->read(_in + _inLength, wanted);
+            if (count <= 0)
+                return;
+            _inLength += count;
+            _inRemaining -= count;
+            if (_inRemaining == 0)
+            {
+                _readState = READ_HEADER;
+                handlePacket();
+            }
+            break;
+        }
+
+        case READ_SKIP:
+        {
+            uint8_t scratch[64];
+            size_t wanted = (size_t)available < _inRemaining ? available : _inRemaining;
+            int count = _client->read(scratch, wanted < sizeof(scratch) ? wanted : sizeof(scratch));
+            if (count <= 0)
+                return;
+            _inRemaining -= count;
+            if (_inRemaining == 0)
+            {
+                _readState = READ_HEADER;
+                // Skipped by the stream handler, the hub mustn't send it again
+                if (_streamPacketId != 0 && beginPacket(PACKET_PUBACK, 2))
+                    putUint16(_streamPacketId);
+            }
+            break;
+        }
+        }
+    }
+}
+
+// The topic length, the topic and the packet id, of the publish being read
+size_t AsyncMqttTransport::getPublishHeaderLength()
+{
+    if (_inLength < 2)
+        return 2;
+    return 2 + ((_in[0] << 8) | _in[1]) + ((_inHeader & 0x06) ? 2 : 0);
+}
+
+// The header of a publish is in: streamed if it's for the stream handler,
+// otherwise read whole like any other packet
+void AsyncMqttTransport::routePublish()
+{
+    uint8_t qos = (_inHeader >> 1) & 0x03;
+    size_t topicLength = (_in[0] << 8) | _in[1];
+    if (qos <= 1 && topicLength >= _streamPrefixLength && memcmp(_in + 2, _streamPrefix, _streamPrefixLength) == 0)
+    {
+        _streamPacketId = qos == 1 ? (_in[2 + topicLength] << 8) | _in[3 + topicLength] : 0;
+        memmove(_in, _in + 2, topicLength);
+        _in[topicLength] = '\0';
+        _streamOffset = 0;
+        _streamLength = 0;
+        if (!_streamHandler->beginMessage((char *)_in, _inRemaining))
+            _readState = _inRemaining > 0 ? READ_SKIP : READ_HEADER;
+        else
+            _readState = READ_STREAM;
+
+        if (_readState == READ_HEADER && _streamPacketId != 0 && beginPacket(PACKET_PUBACK, 2))
+            putUint16(_streamPacketId);
+    }
+    else if (_inLength + _inRemaining > sizeof(_in))
+    {
+        CLOG(MQTT_PACKET_DROPPED, (unsigned long)(_inLength + _inRemaining));
+        _readState = READ_SKIP;
+    }
+    else if (_inRemaining == 0)
+    {
+        _readState = READ_HEADER;
+        handlePacket();
+    }
+    else
+    {
+        _readState = READ_BODY;
+    }
+}
+
+// Hands the handler the payload as it arrives. False when the handler
+// didn't take everything or nothing more has arrived.
+bool AsyncMqttTransport::streamPublish()
+{
+    for (;;)
+    {
+        while (_streamOffset < _streamLength)
+        {
+            size_t taken = _streamHandler->writeMessage(_streamChunk + _streamOffset, _streamLength - _streamOffset);
+            if (taken == 0)
+                return false;
+            _streamOffset += taken;
+        }
+        if (_inRemaining == 0)
+            break;
+
+        int available = _client->available();
+        if (available <= 0)
+            return false;
+        size_t wanted = (size_t)available < _inRemaining ? available : _inRemaining;
+        int count = _client->read(_streamChunk, wanted < sizeof(_streamChunk) ? wanted : sizeof(_streamChunk));
+        if (count <= 0)
+            return false;
+        _streamOffset = 0;
+        _streamLength = count;
+        _inRemaining -= count;
+        _lastReadMs = millis();
+    }
+
+    _readState = READ_HEADER;
+    _streamHandler->endMessage(true);
+    if (_streamPacketId != 0 && beginPacket(PACKET_PUBACK, 2))
+        putUint16(_streamPacketId);
+    _streamPacketId = 0;
+    return true;
+}
+
+void AsyncMqttTransport::abortStream()
+{
+    if (_readState == READ_STREAM)
+        _streamHandler->endMessage(false);
+    _readState = READ_HEADER;
+}
+
+void AsyncMqttTransport::handlePacket()
+{
+    switch (_inHeader & 0xF0)
+    {
+    case PACKET_CONNACK:
+        if (_inLength < 2)
+            break;
+        if (_in[1] != 0)
+        {
+            CLOG(MQTT_REFUSED, (int)_in[1]);
+            close(_in[1]);
+            break;
+        }
+        _accepted = true;
+        _sessionPresent = _in[0] & 0x01;
+        break;
+
+    case PACKET_PUBLISH:
+    {
+        uint8_t qos = (_inHeader >> 1) & 0x03;
+        if (_inLength < 2 || qos > 1)
+            break;
+        size_t topicLength = (_in[0] << 8) | _in[1];
+        size_t offset = 2 + topicLength;
+        uint16_t packetId = 0;
+        if (qos == 1)
+        {
+            if (offset + 2 > _inLength)
+                break;
+            packetId = (_in[offset] << 8) | _in[offset + 1];
+            offset += 2;
+        }
+        if (offset > _inLength)
+            break;
+
+        // The topic moves over its length so it can be terminated in place,
+        // the payload stays where it is
+        memmove(_in, _in + 2, topicLength);
+        _in[topicLength] = '\0';
+
+        if (qos == 1 && beginPacket(PACKET_PUBACK, 2))
+            putUint16(packetId);
+        if (_callback)
+            _callback((char *)_in, _in + offset, _inLength - offset);
+        break;
+    }
+
+    case PACKET_PUBACK:
+    {
+        if (_inLength < 2)
+            break;
+        uint16_t packetId = (_in[0] << 8) | _in[1];
+        for (uint8_t i = 0; i < _inflightCount; i++)
+        {
+            if (_inflight[i].packetId != packetId)
+                continue;
+
+            uint32_t latencyUs = micros() - _inflight[i].queuedUs;
+            _inflightCount--;
+            memmove(&_inflight[i], &_inflight[i + 1], (_inflightCount - i) * sizeof(_inflight[0]));
+            if (_ackCallback)
+                _ackCallback(packetId, true, latencyUs);
+            break;
+        }
+        break;
+    }
+
+    case PACKET_SUBACK:
+        if (_pendingSubacks > 0)
+            _pendingSubacks--;
+        for (uint32_t i = 2; i < _inLength; i++)
+        {
+            if (_in[i] == SUBACK_FAILURE)
+                CLOG(SUBSCRIBE_REFUSED, (_in[0] << 8) | _in[1]);
+        }
+        break;
+
+    case PACKET_PINGRESP:
+        _pingPending = false;
+        break;
+    }
+}
+
+void AsyncMqttTransport::close(int state)
+{
+    CLOG(MQTT_CLOSED, state, (int)_inflightCount);
+    abortStream();
+    _client->stop();
+    _state = state;
+    _accepted = false;
+    _outHead = 0;
+    _outLength = 0;
+    _pendingSubacks = 0;
+    _readState = READ_HEADER;
+    dropInflight();
+}
+
+// Reports the publishes still waiting for their PUBACK as lost. The list
+// is emptied first, the callback may publish again.
+void AsyncMqttTransport::dropInflight()
+{
+    InflightPublish lost[MQTT_MAX_INFLIGHT];
+    uint8_t count = _inflightCount;
+    memcpy(lost, _inflight, count * sizeof(_inflight[0]));
+    _inflightCount = 0;
+
+    uint32_t now = micros();
+    for (uint8_t i = 0; i < count && _ackCallback; i++)
+        _ackCallback(lost[i].packetId, false, now - lost[i].queuedUs);
+}
@@ -0,0 +1,163 @@
+#ifndef __ASYNC_MQTT_TRANSPORT_H
+#define __ASYNC_MQTT_TRANSPORT_H
+
+#include "mqtt_transport.h"
+
+// Encoded packets waiting to be written. A publish that doesn't fit fails
+// at once instead of waiting for the link.
+#ifndef MQTT_OUTBOX_SIZE
+#define MQTT_OUTBOX_SIZE 2048
+#endif
+
+// QoS 1 publishes sent and not yet acknowledged
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+#ifndef MQTT_KEEPALIVE
+#define MQTT_KEEPALIVE 15 // s, PubSubClient's default
+#endif
+
+// Streamed payloads are read in pieces of this size
+#ifndef MQTT_STREAM_CHUNK
+#define MQTT_STREAM_CHUNK 128
+#endif
+
+static_assert(MQTT_OUTBOX_SIZE <= 0xFFFF, "Outbox offsets are 16 bits");
+static_assert(MQTT_STREAM_CHUNK <= 0xFF, "Stream chunk offsets are 8 bits");
+
+// Called when a QoS 1 publish is acknowledged, or lost with the connection
+// (isAcknowledged false), with the time since it was queued
+typedef std::function<void(uint16_t packetId, bool isAcknowledged, uint32_t latencyUs)> MqttAckCallback;
+
+// MQTT 3.1.1 over a Client, without waiting for the broker. Packets are
+// encoded into an outbox and loop() writes as much of it as the connection
+// says it takes (availableForWrite()), picking up mid-packet the next
+// time. Incoming bytes are decoded as they arrive, so a packet can span
+// any number of loop() calls. Several QoS 1 publishes can be in flight.
+//
+// connect() queues the CONNECT and returns: the client may send packets
+// before the CONNACK arrives (MQTT-3.1.4), so subscriptions and publishes
+// queue up behind it. A refusal shows up as connected() going false with
+// the CONNACK code as state(). flush() waits for it when that matters.
+// Subscriptions are batched into one SUBSCRIBE the same way; isSubscribed()
+// says when the SUBACKs are all in.
+//
+// QoS 1 publishes are not kept once written, so they aren't sent again
+// with DUP after a reconnect, not even when the broker kept the session:
+// the ones still unacknowledged when the connection goes down are reported
+// to the ack callback as lost, for the caller to send again if it cares.
+//
+// Publishes for a stream handler only need their topic to fit the receive
+// buffer, the payload goes to the handler MQTT_STREAM_CHUNK bytes at a time
+// and a QoS 1 one is acknowledged once it's all taken. A handler that holds
+// back for longer than the keepalive loses the connection: the PINGRESP is
+// queued behind what it didn't take.
+//
+// The TLS handshake, done by the caller, still blocks, and so can writes:
+// the ESP8266 core's WiFiClientSecure::write() encrypts and pushes the
+// record to TCP before returning, and waits there while the TCP send window
+// is full. availableForWrite() only bounds each write to one TLS record's
+// worth of room, so on a slow link a loop() can still take as long as the
+// link needs to accept that record (up to the client's timeout). Nothing
+// waits for the broker's answers, though.
+class AsyncMqttTransport : public MqttTransport
+{
+  public:
+    AsyncMqttTransport();
+
+    void setCallback(MqttMessageCallback callback) { _callback = callback; }
+    void setAckCallback(MqttAckCallback callback) { _ackCallback = callback; }
+    bool connect(Client &client, const char *host, uint16_t port, const char *id, const char *user, const char *password,
+                 bool cleanSession = true);
+    void disconnect();
+    bool connected();
+    int state() { return _state; }
+    bool isAccepted() { return _accepted; }
+    bool isSessionPresent() { return _sessionPresent; }
+    bool reportsSessionPresent() { return true; }
+
+    bool loop();
+    bool publish(const char *topic, const uint8_t *payload, size_t length, uint8_t qos = 0);
+    bool subscribe(const char *topic, uint8_t qos = 0);
+    bool subscribe(const char *const *topics, const uint8_t *qos, size_t count);
+    bool isSubscribed() { return connected() && _accepted && _pendingSubacks == 0; }
+    bool setStreamHandler(const char *topicPrefix, size_t prefixLength, MqttStreamHandler *handler);
+    bool flush(uint32_t timeoutMs);
+
+    size_t getQueuedBytes() { return _outLength; }
+    uint8_t getInflightCount() { return _inflightCount; }
+
+  private:
+    enum ReadState
+    {
+        READ_HEADER,
+        READ_LENGTH,
+        READ_TOPIC, // of a publish, to see if it's streamed
+        READ_BODY,
+        READ_STREAM,
+        READ_SKIP // too large for the buffer, or the handler didn't want it
+    };
+
+    typedef struct tagInflightPublish
+    {
+        uint16_t packetId;
+        uint32_t queuedUs;
+    } InflightPublish;
+
+    // Room for a packet with this remaining length, false if there isn't any
+    bool beginPacket(uint8_t header, size_t remainingLength);
+    void put(const uint8_t *data, size_t length);
+    void putByte(uint8_t value) { put(&value, 1); }
+    void putUint16(uint16_t value);
+    void putString(const char *text);
+
+    uint16_t nextPacketId();
+    void writeOutbox();
+    void readInbox();
+    size_t getPublishHeaderLength();
+    void routePublish();
+    bool streamPublish();
+    void abortStream();
+    void dropInflight();
+    void handlePacket();
+    void close(int state);
+
+    Client *_client;
+    MqttMessageCallback _callback;
+    MqttAckCallback _ackCallback;
+    int _state;
+    bool _accepted;
+    bool _sessionPresent;
+    bool _pingPending;
+    bool _inLoop;
+    uint16_t _lastPacketId;
+    uint32_t _connectedMs;
+    uint32_t _lastWriteMs;
+    uint32_t _lastReadMs;
+
+    uint8_t _out[MQTT_OUTBOX_SIZE];
+    uint16_t _outHead;
+    uint16_t _outLength;
+
+    InflightPublish _inflight[MQTT_MAX_INFLIGHT];
+    uint8_t _inflightCount;
+    uint8_t _pendingSubacks;
+
+    ReadState _readState;
+    uint8_t _inHeader;
+    uint32_t _inRemaining; // body bytes still to come
+    uint32_t _inLength;    // body bytes received
+    uint8_t _inShift;      // of the next remaining length byte
+    uint8_t _in[MQTT_MAX_PACKET_SIZE];
+
+    const char *_streamPrefix;
+    size_t _streamPrefixLength;
+    MqttStreamHandler *_streamHandler;
+    uint16_t _streamPacketId; // to acknowledge once streamed or skipped, 0 for QoS 0
+    uint8_t _streamChunk[MQTT_STREAM_CHUNK];
+    uint8_t _streamOffset; // taken by the handler
+    uint8_t _streamLength;
+};
+
+#endif // __ASYNC_MQTT_TRANSPORT_H
@@ -2,10 +2,11 @@
 
 #include "defines.h"
 #include "string_buffer.h"
+#include "profiler.h"
+#include "binary_log.h"
 // #include "ntphelper.h"
 
 #include <ESP8266WiFi.h>
-#include <ArduinoLog.h>
 #include <assert.h>
 #include <stddef.h>
 
@@ -33,7 +34,7 @@ int AzureDpsClass::getDPSAuthString(const char *scopeId, const char *deviceId, c
     stringToSign.hash(*keyDecoded, keyDecoded.getLength());
     if (!stringToSign.base64Encode() || !stringToSign.urlEncode())
     {
-        Log.error("ERROR: stringToSign base64Encode / urlEncode has failed.");
+        CLOG(SIGNATURE_ENCODING_FAILED);
         return 1;
     }
 
@@ -61,7 +62,7 @@ int AzureDpsClass::getOperationId(const char *dpsEndpoint, const char *scopeId,
         retry++;
     if (!client.connected())
     {
-        Log.error("ERROR: DPS endpoint %s call has failed.", hostName == NULL ? "PUT" : "GET");
+        CLOG(DPS_CALL_FAILED, hostName == NULL ? "PUT" : "GET");
         return 1;
     }
 
@@ -115,7 +116,7 @@ connection: close\r\n\
         {
             // 20 secs..
             client.stop();
-            Log.error("ERROR: DPS (%s) request has failed. (Server didn't answer within 20 secs.)", hostName == NULL ? "PUT" : "GET");
+            CLOG(DPS_TIMEOUT, hostName == NULL ? "PUT" : "GET");
             return 1;
         }
     }
@@ -142,7 +143,7 @@ connection: close\r\n\
     if (index == -1)
     {
     error_exit:
-        Log.error("ERROR: DPS (%s) request has failed.\r\n%s", hostName == NULL ? "PUT" : "GET", *tmpBuffer);
+        CLOG(DPS_REQUEST_FAILED, hostName == NULL ? "PUT" : "GET", *tmpBuffer);
         exitCode = 1;
         goto exit_operationId;
     }
@@ -163,26 +164,26 @@ exit_operationId:
 
 int AzureDpsClass::getHubHostName(const char *dpsEndpoint, const char *scopeId, const char *deviceId, const char *key, char *hostName)
 {
+    PROFILE_SCOPE(DPS);
     StringBuffer authHeader(256);
     size_t size = 0;
 
-    Log.trace("Getting auth string" CR);
+    CLOG(DPS_AUTH);
     if (getDPSAuthString(scopeId, deviceId, key, *authHeader, 256, size))
     {
-        Log.error("ERROR: getDPSAuthString has failed" CR);
+        CLOG(DPS_AUTH_FAILED);
         return 1;
     }
-    Log.trace("Getting operation id for DPS" CR);
+    CLOG(DPS_OPERATION);
     StringBuffer operationId(64);
     int retval = 0;
 
     if ((retval = getOperationId(dpsEndpoint, scopeId, deviceId, *authHeader, *operationId, NULL)) == 0)
     {
         delay(250);
-        Log.trace("Getting host name from DPS" CR);
+        CLOG(DPS_HOST);
         for (int i = 0; i < 5; i++)
         {
-            // Log.trace("Stuff: %s : %s : %s : %s : %s : %s" CR, dpsEndpoint, scopeId, deviceId, *authHeader, *operationId, hostName);
             retval = getOperationId(dpsEndpoint, scopeId, deviceId, *authHeader, *operationId, hostName);
             if (retval == 0)
                 break;
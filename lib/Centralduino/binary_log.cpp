@@ -0,0 +1,137 @@
+#include "binary_log.h"
+
+#include <string.h>
+
+void BinaryLogClass::begin(Print *output, uint8_t echoLevel)
+{
+    _echo = output;
+    _echoLevel = echoLevel;
+}
+
+void BinaryLogClass::putUnsigned(uint8_t *record, size_t &length, uint32_t value)
+{
+    // Tag and up to 5 varint bytes
+    if (length + 6 > CLOG_MAX_RECORD)
+        return;
+
+    record[length++] = CLOG_TAG_UINT;
+    while (value >= 0x80)
+    {
+        record[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    record[length++] = (uint8_t)value;
+}
+
+void BinaryLogClass::putSigned(uint8_t *record, size_t &length, int32_t value)
+{
+    size_t start = length;
+    putUnsigned(record, length, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    if (length > start)
+        record[start] = CLOG_TAG_INT;
+}
+
+void BinaryLogClass::encodeArgument(uint8_t *record, size_t &length, double value)
+{
+    if (length + 5 > CLOG_MAX_RECORD)
+        return;
+
+    float number = (float)value;
+    uint32_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+
+    record[length++] = CLOG_TAG_FLOAT;
+    for (int shift = 0; shift < 32; shift += 8)
+        record[length++] = (uint8_t)(bits >> shift);
+}
+
+void BinaryLogClass::encodeArgument(uint8_t *record, size_t &length, const char *value)
+{
+    if (length + 2 > CLOG_MAX_RECORD)
+        return;
+    if (value == NULL)
+        value = "(null)";
+
+    size_t stringLength = strnlen(value, CLOG_MAX_STRING);
+    if (stringLength > CLOG_MAX_RECORD - length - 2)
+        stringLength = CLOG_MAX_RECORD - length - 2;
+
+    record[length++] = CLOG_TAG_STRING;
+    record[length++] = (uint8_t)stringLength;
+    memcpy(record + length, value, stringLength);
+    length += stringLength;
+}
+
+void BinaryLogClass::commit(uint8_t *record, size_t length, ClogMessage id, uint8_t level)
+{
+    uint32_t now = millis();
+    record[0] = (uint8_t)length;
+    record[1] = (uint8_t)id;
+    record[2] = (uint8_t)(id >> 8);
+    for (int i = 0; i < 4; i++)
+        record[3 + i] = (uint8_t)(now >> (8 * i));
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+
+    // Make room by dropping whole records from the tail
+    while (CLOG_BUFFER_SIZE - _used < length)
+    {
+        size_t tail = (_head + CLOG_BUFFER_SIZE - _used) % CLOG_BUFFER_SIZE;
+        _used -= _buffer[tail];
+        _dropped++;
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        _buffer[_head] = record[i];
+        _head = (_head + 1) % CLOG_BUFFER_SIZE;
+    }
+    _used += length;
+    _written++;
+
+    if (_echo != NULL && level <= _echoLevel)
+    {
+        char line[CLOG_ECHO_LENGTH];
+        if (clogFormatRecord(record, length, line, sizeof(line)) > 0)
+            _echo->println(line);
+    }
+}
+
+void BinaryLogClass::dump(Print &output, bool clear)
+{
+    static const char digits[] = "0123456789abcdef";
+    char line[2 * CLOG_MAX_RECORD + 2];
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    std::lock_guard<std::mutex> lock(_lock);
+#endif
+
+    size_t position = (_head + CLOG_BUFFER_SIZE - _used) % CLOG_BUFFER_SIZE;
+    size_t remaining = _used;
+    while (remaining > 0)
+    {
+        uint8_t length = _buffer[position];
+        size_t lineLength = 0;
+        line[lineLength++] = '~';
+        for (uint8_t i = 0; i < length; i++)
+        {
+            uint8_t value = _buffer[(position + i) % CLOG_BUFFER_SIZE];
+            line[lineLength++] = digits[value >> 4];
+            line[lineLength++] = digits[value & 0x0f];
+        }
+        line[lineLength] = '\0';
+        output.println(line);
+
+        position = (position + length) % CLOG_BUFFER_SIZE;
+        remaining -= length;
+    }
+
+    if (clear)
+        _used = 0;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+BinaryLogClass BinaryLog;
@@ -0,0 +1,100 @@
+#ifndef __BINARY_LOG_H
+#define __BINARY_LOG_H
+
+#include <Arduino.h>
+
+#include "log_record.h"
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+#include <mutex>
+#endif
+
+// Messages less severe than this are compiled out, arguments included
+#ifndef CENTRALDUINO_LOG_LEVEL
+#define CENTRALDUINO_LOG_LEVEL CLOG_TRACE
+#endif
+
+// RAM kept for records, the oldest are dropped when it's full
+#ifndef CLOG_BUFFER_SIZE
+#define CLOG_BUFFER_SIZE 1024
+#endif
+
+// Longest line echoed to the serial port
+#define CLOG_ECHO_LENGTH 160
+
+// CLOG(SUBSCRIBE_FAILED, topic, rc) logs the catalog message with that id.
+// The level test is a constant, so messages above CENTRALDUINO_LOG_LEVEL
+// leave no code behind.
+#define CLOG(id, ...)                                                           \
+    do                                                                          \
+    {                                                                           \
+        if (CLOG_LEVEL_OF_##id <= CENTRALDUINO_LOG_LEVEL)                       \
+            BinaryLog.write(CLOG_##id, CLOG_LEVEL_OF_##id, ##__VA_ARGS__);      \
+    } while (0)
+
+// Structured log kept as compact binary records (see log_record.h) in a RAM
+// ring buffer. Nothing is formatted on the device unless the record is at or
+// above the echo level given to begin(); dump() prints the buffer as hex
+// lines for log_decoder to expand on the host.
+class BinaryLogClass
+{
+  public:
+    // Records at echoLevel or more severe are also formatted to output,
+    // pass NULL to keep everything binary
+    void begin(Print *output, uint8_t echoLevel = CLOG_NOTICE);
+
+    template <typename... Args>
+    void write(ClogMessage id, uint8_t level, Args... args)
+    {
+        uint8_t record[CLOG_MAX_RECORD];
+        size_t length = CLOG_HEADER_LENGTH;
+        encode(record, length, args...);
+        commit(record, length, id, level);
+    }
+
+    // Prints each record as a "~<hex>" line and optionally empties the buffer
+    void dump(Print &output, bool clear = true);
+
+    uint32_t getWrittenCount() { return _written; }
+    uint32_t getDroppedCount() { return _dropped; }
+
+  private:
+    void encode(uint8_t *, size_t &) {}
+
+    template <typename T, typename... Args>
+    void encode(uint8_t *record, size_t &length, T value, Args... args)
+    {
+        encodeArgument(record, length, value);
+        encode(record, length, args...);
+    }
+
+    void encodeArgument(uint8_t *record, size_t &length, int value) { putSigned(record, length, value); }
+    void encodeArgument(uint8_t *record, size_t &length, long value) { putSigned(record, length, value); }
+    void encodeArgument(uint8_t *record, size_t &length, unsigned int value) { putUnsigned(record, length, value); }
+    void encodeArgument(uint8_t *record, size_t &length, unsigned long value) { putUnsigned(record, length, value); }
+    void encodeArgument(uint8_t *record, size_t &length, bool value) { putUnsigned(record, length, value); }
+    void encodeArgument(uint8_t *record, size_t &length, double value);
+    void encodeArgument(uint8_t *record, size_t &length, const char *value);
+
+    void putSigned(uint8_t *record, size_t &length, int32_t value);
+    void putUnsigned(uint8_t *record, size_t &length, uint32_t value);
+    void commit(uint8_t *record, size_t length, ClogMessage id, uint8_t level);
+
+    uint8_t _buffer[CLOG_BUFFER_SIZE];
+    size_t _head; // next byte to write
+    size_t _used;
+    uint32_t _written;
+    uint32_t _dropped;
+
+    Print *_echo;
+    uint8_t _echoLevel;
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Both threads log
+    std::mutex _lock;
+#endif
+};
+
+extern BinaryLogClass BinaryLog;
+
+#endif // __BINARY_LOG_H
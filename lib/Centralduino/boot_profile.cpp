@@ -0,0 +1,117 @@
+#include "boot_profile.h"
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "binary_log.h"
+
+#define BOOT_PHASE_KEY(id, key) key,
+static const char *phaseKeys[] = {BOOT_PHASES(BOOT_PHASE_KEY)};
+#undef BOOT_PHASE_KEY
+
+#define BOOT_PHASE_KEY_LENGTH(id, key) \
+    static_assert(sizeof(key) - 1 <= BOOT_PHASE_KEY_MAX_LEN, "Boot phase key " key " is too long");
+BOOT_PHASES(BOOT_PHASE_KEY_LENGTH)
+#undef BOOT_PHASE_KEY_LENGTH
+
+typedef struct tagBootHistory
+{
+    uint32_t magic;
+    uint32_t count;
+    BootRecord records[BOOT_PROFILE_HISTORY]; // newest first
+} BootHistory;
+
+void BootProfileClass::mark(BootPhase phase)
+{
+    if (!_finished && _current.phaseEndMs[phase] == 0)
+        _current.phaseEndMs[phase] = millis();
+}
+
+static void loadHistory(BootHistory &history)
+{
+    File file = SPIFFS.open(BOOT_PROFILE_PATH, "r");
+    if (!file || file.read((uint8_t *)&history, sizeof(history)) != sizeof(history) ||
+        history.magic != BOOT_PROFILE_MAGIC || history.count > BOOT_PROFILE_HISTORY)
+    {
+        history.magic = BOOT_PROFILE_MAGIC;
+        history.count = 0;
+    }
+
+    if (file)
+        file.close();
+}
+
+static void saveHistory(const BootHistory &history)
+{
+    File file = SPIFFS.open(BOOT_PROFILE_PATH, "w");
+    if (!file || file.write((const uint8_t *)&history, sizeof(history)) != sizeof(history))
+        CLOG(BOOT_PROFILE_SAVE_FAILED);
+
+    if (file)
+        file.close();
+}
+
+size_t BootProfileClass::finish(char *buffer, size_t size)
+{
+    _finished = true;
+
+    BootHistory history;
+    loadHistory(history);
+
+    _current.sequence = history.count > 0 ? history.records[0].sequence + 1 : 1;
+    _current.resetReason = ESP.getResetInfoPtr()->reason;
+    memmove(&history.records[1], &history.records[0], sizeof(BootRecord) * (BOOT_PROFILE_HISTORY - 1));
+    history.records[0] = _current;
+    if (history.count < BOOT_PROFILE_HISTORY)
+        history.count++;
+    saveHistory(history);
+
+    CLOG(BOOT_TOOK, (unsigned long)_current.phaseEndMs[BOOT_PHASE_COUNT - 1]);
+
+    size_t length = 0;
+    int written = snprintf(buffer, size, "{\"phases\":[");
+    for (uint8_t i = 0; i < BOOT_PHASE_COUNT && written >= 0 && length + written < size; i++)
+    {
+        length += written;
+        written = snprintf(buffer + length, size - length, "%s\"%s\"", i == 0 ? "" : ",", phaseKeys[i]);
+    }
+
+    // Durations rather than timestamps, a skipped phase takes 0 ms
+    for (uint32_t boot = 0; boot < history.count && written >= 0 && length + written < size; boot++)
+    {
+        length += written;
+        const BootRecord &record = history.records[boot];
+        written = snprintf(buffer + length, size - length, "%s[%lu,%lu", boot == 0 ? "],\"boots\":[" : ",",
+                           (unsigned long)record.sequence, (unsigned long)record.resetReason);
+
+        uint32_t previousMs = 0;
+        for (uint8_t i = 0; i < BOOT_PHASE_COUNT && written >= 0 && length + written < size; i++)
+        {
+            length += written;
+            uint32_t endMs = record.phaseEndMs[i];
+            written = snprintf(buffer + length, size - length, ",%lu",
+                               (unsigned long)(endMs > previousMs ? endMs - previousMs : 0));
+            if (endMs > previousMs)
+                previousMs = endMs;
+        }
+
+        if (written >= 0 && length + written < size)
+        {
+            length += written;
+            written = snprintf(buffer + length, size - length, "]");
+        }
+    }
+
+    if (written < 0 || length + written >= size)
+        return 0;
+    length += written;
+
+    written = snprintf(buffer + length, size - length, "]}");
+    if (written < 0 || length + written >= size)
+        return 0;
+    return length + written;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+BootProfileClass BootProfile;
@@ -0,0 +1,74 @@
+#ifndef __BOOT_PROFILE_H
+#define __BOOT_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Where the time from reset to the first hub connection goes.
+//
+// Each phase records millis() when it ends, the first time it ends this
+// boot; phases that didn't happen (DPS with a cached hub) stay 0. The
+// profile is finished on the first hub connection, appended to the last
+// BOOT_PROFILE_HISTORY boots kept on SPIFFS (RTC memory would lose the
+// cold boots, which are the interesting ones) and sent as the
+// "boot_profile" reported property.
+//
+// BOOT_PHASE(id, json key)
+#define BOOT_PHASES(BOOT_PHASE)              \
+    BOOT_PHASE(STARTUP_DELAY, "delay")       \
+    BOOT_PHASE(CONFIG, "config")             \
+    BOOT_PHASE(WIFI, "wifi")                 \
+    BOOT_PHASE(TIME, "ntp")                  \
+    BOOT_PHASE(DPS, "dps")                   \
+    BOOT_PHASE(TLS, "tls")                   \
+    BOOT_PHASE(MQTT, "mqtt")                 \
+    BOOT_PHASE(SUBSCRIBE, "subscribe")       \
+    BOOT_PHASE(TWIN, "twin_get")
+
+#ifndef BOOT_PROFILE_HISTORY
+#define BOOT_PROFILE_HISTORY 4
+#endif
+
+#define BOOT_PROFILE_PATH "/boot_profile.bin"
+#define BOOT_PROFILE_MAGIC 0x50544f42 // "BOTP"
+#define BOOT_PHASE_KEY_MAX_LEN 9
+
+// Worst case, every number 10 digits: {"phases":[..],"boots":[..]} around
+// ,"key" per phase and ,[seq,reset,ms,..] per boot
+#define BOOT_PROFILE_JSON_MAX_LENGTH \
+    (32 + (BOOT_PHASE_KEY_MAX_LEN + 3) * BOOT_PHASE_COUNT + BOOT_PROFILE_HISTORY * (24 + 11 * BOOT_PHASE_COUNT))
+
+#define BOOT_PHASE_ENUM(id, key) BOOT_PHASE_##id,
+enum BootPhase
+{
+    BOOT_PHASES(BOOT_PHASE_ENUM)
+    BOOT_PHASE_COUNT
+};
+#undef BOOT_PHASE_ENUM
+
+typedef struct tagBootRecord
+{
+    uint32_t sequence;
+    uint32_t resetReason;
+    uint32_t phaseEndMs[BOOT_PHASE_COUNT]; // millis() since reset, 0 if skipped
+} BootRecord;
+
+class BootProfileClass
+{
+  public:
+    void mark(BootPhase phase);
+    bool isFinished() { return _finished; }
+
+    // Saves this boot with the previous ones and writes them as
+    // {"phases":["delay",...],"boots":[[seq,reset,ms,...],...]}, newest
+    // first, with the duration of each phase. Returns 0 if it doesn't fit.
+    size_t finish(char *buffer, size_t size);
+
+  private:
+    BootRecord _current;
+    bool _finished;
+};
+
+extern BootProfileClass BootProfile;
+
+#endif // __BOOT_PROFILE_H
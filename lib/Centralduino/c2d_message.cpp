@@ -0,0 +1,119 @@
+#include "c2d_message.h"
+
+#include <Arduino.h>
+
+#include "binary_log.h"
+#include "metrics.h"
+#include "string_buffer.h"
+
+#define DEVICEBOUND_SEGMENT "/messages/devicebound/"
+
+bool C2dMessage::parse(const char *topic, uint32_t length)
+{
+    _count = 0;
+    _length = length;
+
+    const char *bag = strstr(topic, DEVICEBOUND_SEGMENT);
+    if (strncmp(topic, "devices/", 8) != 0 || bag == NULL)
+        return false;
+    bag += sizeof(DEVICEBOUND_SEGMENT) - 1;
+    if (strlcpy(_bag, bag, sizeof(_bag)) >= sizeof(_bag))
+        return false;
+
+    // name=value&name=value, a name without a value gets ""
+    char *next = _bag;
+    while (*next != '\0' && _count < C2D_MAX_PROPERTIES)
+    {
+        char *pair = next;
+        char *end = strchr(pair, '&');
+        next = end != NULL ? end + 1 : pair + strlen(pair);
+        if (end != NULL)
+            *end = '\0';
+        if (*pair == '\0')
+            continue;
+
+        char *value = strchr(pair, '=');
+        if (value != NULL)
+            *value++ = '\0';
+        else
+            value = pair + strlen(pair);
+        // Percent-encoded, a '+' is a '+'
+        urlDecodeInPlace(pair, strlen(pair), false);
+        urlDecodeInPlace(value, strlen(value), false);
+        _properties[_count].name = pair;
+        _properties[_count].value = value;
+        _count++;
+    }
+    return true;
+}
+
+const char *C2dMessage::getProperty(const char *name) const
+{
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (strcmp(_properties[i].name, name) == 0)
+            return _properties[i].value;
+    }
+    return NULL;
+}
+
+void C2dReceiver::setCallbacks(C2dStartCallback start, C2dDataCallback data, C2dEndCallback end, uint32_t maxLength)
+{
+    _start = start;
+    _data = data;
+    _end = end;
+    _maxLength = maxLength;
+}
+
+void C2dReceiver::deliver(char *topic, const uint8_t *payload, size_t length)
+{
+    if (!beginMessage(topic, length))
+        return;
+
+    size_t offset = 0;
+    while (offset < length)
+    {
+        size_t taken = writeMessage(payload + offset, length - offset);
+        if (taken == 0)
+            break;
+        offset += taken;
+    }
+    if (offset < length)
+        CLOG(C2D_TRUNCATED, (unsigned long)(length - offset));
+    endMessage(offset == length);
+}
+
+bool C2dReceiver::beginMessage(char *topic, uint32_t length)
+{
+    CLOG(INCOMING_MESSAGE, topic, (unsigned long)length);
+    Metrics.increment(METRIC_RECEIVED_C2D);
+
+    if (!_start)
+        return false;
+    if (length > _maxLength)
+    {
+        CLOG(C2D_TOO_LARGE, (unsigned long)length);
+        return false;
+    }
+    if (!_message.parse(topic, length))
+    {
+        CLOG(MALFORMED_TOPIC, 3, topic);
+        return false;
+    }
+    return _start(_message);
+}
+
+size_t C2dReceiver::writeMessage(const uint8_t *data, size_t length)
+{
+    size_t taken = _data ? _data(data, length) : length;
+    if (taken > length)
+        taken = length;
+    Metrics.increment(METRIC_RECEIVED_BYTES, taken);
+    return taken;
+}
+
+void C2dReceiver::endMessage(bool complete)
+{
+    if (_end)
+        _end(_message, complete);
+}
@@ -0,0 +1,85 @@
+#ifndef __C2D_MESSAGE_H
+#define __C2D_MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#include "mqtt_transport.h"
+
+// Larger cloud-to-device messages are acknowledged and discarded (the hub
+// allows up to 64 KB). onCloudMessage() can set another limit.
+#ifndef C2D_MAX_MESSAGE_SIZE
+#define C2D_MAX_MESSAGE_SIZE 16384
+#endif
+
+// Properties decoded from a message's topic, the rest are ignored
+#ifndef C2D_MAX_PROPERTIES
+#define C2D_MAX_PROPERTIES 12
+#endif
+
+#define C2D_PROPERTY_BAG_MAX_LEN 256
+
+typedef struct tagC2dProperty
+{
+    const char *name;
+    const char *value;
+} C2dProperty;
+
+// A cloud-to-device message as it starts: the property bag the hub puts in
+// the topic (the sender's properties and system ones like $.mid, $.ct),
+// URL decoded, and the payload length. The payload comes separately.
+class C2dMessage
+{
+  public:
+    C2dMessage() : _count(0), _length(0) {}
+
+    // devices/{id}/messages/devicebound/{property bag}, false if the topic
+    // isn't one or the bag is too long
+    bool parse(const char *topic, uint32_t length);
+
+    // NULL if the message doesn't have it
+    const char *getProperty(const char *name) const;
+    uint8_t getPropertyCount() const { return _count; }
+    const C2dProperty &getProperty(uint8_t index) const { return _properties[index]; }
+    uint32_t getLength() const { return _length; }
+
+  private:
+    char _bag[C2D_PROPERTY_BAG_MAX_LEN];
+    C2dProperty _properties[C2D_MAX_PROPERTIES];
+    uint8_t _count;
+    uint32_t _length;
+};
+
+// Returns false to discard the message
+typedef std::function<bool(const C2dMessage &message)> C2dStartCallback;
+// Returns how much of the payload it took, see CentralduinoClass::onCloudMessage()
+typedef std::function<size_t(const uint8_t *data, size_t length)> C2dDataCallback;
+typedef std::function<void(const C2dMessage &message, bool complete)> C2dEndCallback;
+
+// Hands cloud-to-device messages to the application's callbacks, streamed
+// by the transport as the payload is read, or whole through deliver() when
+// the transport can't stream.
+class C2dReceiver : public MqttStreamHandler
+{
+  public:
+    C2dReceiver() : _maxLength(C2D_MAX_MESSAGE_SIZE) {}
+
+    void setCallbacks(C2dStartCallback start, C2dDataCallback data, C2dEndCallback end, uint32_t maxLength);
+
+    // A whole message. Whatever the data callback doesn't take is dropped.
+    void deliver(char *topic, const uint8_t *payload, size_t length);
+
+    bool beginMessage(char *topic, uint32_t length);
+    size_t writeMessage(const uint8_t *data, size_t length);
+    void endMessage(bool complete);
+
+  private:
+    C2dMessage _message;
+    C2dStartCallback _start;
+    C2dDataCallback _data;
+    C2dEndCallback _end;
+    uint32_t _maxLength;
+};
+
+#endif // __C2D_MESSAGE_H
@@ -0,0 +1,144 @@
+#include "cbor_writer.h"
+
+#include <string.h>
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_TAG_DECIMAL_FRACTION 4
+
+void CborWriter::put(uint8_t byte)
+{
+    if (_length < _size)
+        _buffer[_length++] = byte;
+    else
+        _overflowed = true;
+}
+
+void CborWriter::writeHeader(uint8_t majorType, uint64_t argument)
+{
+    majorType <<= 5;
+    if (argument < 24)
+    {
+        put(majorType | (uint8_t)argument);
+    }
+    else if (argument <= 0xff)
+    {
+        put(majorType | 24);
+        put((uint8_t)argument);
+    }
+    else if (argument <= 0xffff)
+    {
+        put(majorType | 25);
+        put((uint8_t)(argument >> 8));
+        put((uint8_t)argument);
+    }
+    else if (argument <= 0xffffffffULL)
+    {
+        put(majorType | 26);
+        for (int shift = 24; shift >= 0; shift -= 8)
+            put((uint8_t)(argument >> shift));
+    }
+    else
+    {
+        put(majorType | 27);
+        for (int shift = 56; shift >= 0; shift -= 8)
+            put((uint8_t)(argument >> shift));
+    }
+}
+
+void CborWriter::writeMap(size_t count)
+{
+    writeHeader(CBOR_MAP, count);
+}
+
+void CborWriter::writeArray(size_t count)
+{
+    writeHeader(CBOR_ARRAY, count);
+}
+
+void CborWriter::writeText(const char *text, size_t length)
+{
+    writeHeader(CBOR_TEXT, length);
+    for (size_t i = 0; i < length; i++)
+        put((uint8_t)text[i]);
+}
+
+void CborWriter::writeBytes(const uint8_t *data, size_t length)
+{
+    writeHeader(CBOR_BYTES, length);
+    for (size_t i = 0; i < length; i++)
+        put(data[i]);
+}
+
+void CborWriter::writeInt(int64_t value)
+{
+    if (value < 0)
+        writeHeader(CBOR_NEGATIVE, (uint64_t)(-(value + 1)));
+    else
+        writeHeader(CBOR_UNSIGNED, (uint64_t)value);
+}
+
+// Returns true and the half precision bits if value converts without loss
+static bool floatToHalf(uint32_t bits, uint16_t &half)
+{
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if ((bits & 0x7fffffff) == 0)
+    {
+        half = sign;
+        return true;
+    }
+
+    // Normal halves only, and the dropped mantissa bits must be zero
+    if (exponent <= 0 || exponent >= 31 || (mantissa & 0x1fff) != 0)
+        return false;
+
+    half = sign | (uint16_t)(exponent << 10) | (uint16_t)(mantissa >> 13);
+    return true;
+}
+
+void CborWriter::writeFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t half;
+    if (floatToHalf(bits, half))
+    {
+        put((CBOR_SIMPLE << 5) | 25);
+        put((uint8_t)(half >> 8));
+        put((uint8_t)half);
+        return;
+    }
+
+    put((CBOR_SIMPLE << 5) | 26);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        put((uint8_t)(bits >> shift));
+}
+
+void CborWriter::writeBool(bool value)
+{
+    put((CBOR_SIMPLE << 5) | (value ? 21 : 20));
+}
+
+void CborWriter::writeNull()
+{
+    put((CBOR_SIMPLE << 5) | 22);
+}
+
+void CborWriter::writeDecimal(int32_t mantissa, int8_t exponent)
+{
+    writeHeader(CBOR_TAG, CBOR_TAG_DECIMAL_FRACTION);
+    writeArray(2);
+    writeInt(exponent);
+    writeInt(mantissa);
+}
@@ -0,0 +1,39 @@
+#ifndef __CBOR_WRITER_H
+#define __CBOR_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal CBOR (RFC 7049) encoder writing into a caller supplied buffer.
+// Only the item types needed for telemetry are supported. Writes past the
+// end of the buffer are dropped and flagged, check hasOverflowed() before
+// sending the result.
+class CborWriter
+{
+  public:
+    CborWriter(uint8_t *buffer, size_t size) : _buffer(buffer), _size(size), _length(0), _overflowed(false) {}
+
+    void writeMap(size_t count);
+    void writeArray(size_t count);
+    void writeText(const char *text, size_t length);
+    void writeBytes(const uint8_t *data, size_t length);
+    void writeInt(int64_t value);
+    void writeFloat(float value); // as half precision when that is lossless
+    void writeBool(bool value);
+    void writeNull();
+    void writeDecimal(int32_t mantissa, int8_t exponent); // mantissa * 10^exponent
+
+    size_t getLength() { return _length; }
+    bool hasOverflowed() { return _overflowed; }
+
+  private:
+    void writeHeader(uint8_t majorType, uint64_t argument);
+    void put(uint8_t byte);
+
+    uint8_t *_buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflowed;
+};
+
+#endif // __CBOR_WRITER_H
@@ -1,122 +1,862 @@
 #include "centralduino.h"
 #include <FS.h>
-#include <ArduinoLog.h>
 #include <assert.h>
 
 #include "defines.h"
 #include "config.h"
 #include "string_buffer.h"
 #include "azure_dps.h"
+#include "base64.h"
+#include "cbor_writer.h"
+#include "gzip_compressor.h"
+#include "time_service.h"
+#include "rtc_store.h"
+#include "crc32.h"
+#include "wifi_connection.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "boot_profile.h"
+#include "binary_log.h"
+#include "crash_report.h"
+
+CentralduinoClass *CentralduinoClass::_first = NULL;
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+std::thread *CentralduinoClass::_worker = NULL;
+std::atomic<bool> CentralduinoClass::_isWorkerRunning(false);
+std::mutex CentralduinoClass::_instancesLock;
+CentralduinoClass *CentralduinoClass::_connecting = NULL;
+std::condition_variable CentralduinoClass::_connectDone;
+static thread_local bool isWorkerThread = false;
+
+// Held while the application thread changes what the worker uses. The
+// worker connects without it, so this also waits for a connection attempt
+// on this instance to finish.
+#define NETWORK_WORKER_LOCK()                                 \
+    std::unique_lock<std::mutex> workerLock(_instancesLock); \
+    _connectDone.wait(workerLock, [this]() { return _connecting != this; })
+#else
+#define NETWORK_WORKER_LOCK()
+#endif
+
+CentralduinoClass::CentralduinoClass()
+    : _isDeviceIdentity(false), _isStarted(false), _isHubConnected(false), _isOtaEnabled(false), _methodCount(0),
+      _methodSerial(0), _ridSerial(0), _tokenExpires(0), _tokenRefreshAt(0), _retryAtMs(0), _connectFailures(0),
+      _hasSession(false),
+      _isResumePending(false), _isReadyPending(false), _connectStartedMs(0), _next(NULL)
+#ifdef CENTRALDUINO_NETWORK_WORKER
+      , _isOnline(false)
+#endif
+{
+    memset(&_hub, 0, sizeof(_hub));
+    memset(_pendingMethods, 0, sizeof(_pendingMethods));
+    _telemetryTopic[0] = '\0';
+    _deviceBoundTopic[0] = '\0';
+    _hubHostName[0] = '\0';
+    _rules.onAlert([this](const Rule &rule, const char *stream, bool raised, float value) {
+        publishAlert(rule, stream, raised, value);
+    });
+}
+
+CentralduinoClass::~CentralduinoClass()
+{
+    end();
+}
+
+// Every publish goes through here to be counted
+bool CentralduinoClass::mqttPublish(const char *topic, const uint8_t *payload, size_t length)
+{
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Off the worker, publishes are queued for it and counted when it sends them
+    if (_worker != NULL && !isWorkerThread)
+    {
+        if (_isOnline && pushWorkerMessage(_outbound, WORKER_MESSAGE_PUBLISH, topic, payload, length))
+            return true;
+        Metrics.increment(METRIC_PUBLISH_FAILURES);
+        return false;
+    }
+#endif
+
+    bool published = _mqttClient.publish(topic, payload, length);
+    if (published)
+    {
+        Metrics.increment(METRIC_PUBLISHES);
+        Metrics.increment(METRIC_PUBLISH_BYTES, length);
+    }
+    else
+    {
+        Metrics.increment(METRIC_PUBLISH_FAILURES);
+    }
+    return published;
+}
+
+bool CentralduinoClass::mqttPublish(const char *topic, const char *payload)
+{
+    return mqttPublish(topic, (const uint8_t *)payload, strlen(payload));
+}
+
+bool CentralduinoClass::isHubOnline()
+{
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    if (_worker != NULL)
+        return _isOnline;
+#endif
+    return _mqttClient.connected();
+}
+
+// Assigned hub and the SAS signature for it (RTC memory)
+typedef struct tagHubCache
+{
+    uint32_t identity;
+    uint32_t expires;
+    char hostName[HUB_HOST_CACHE_LEN];
+    uint8_t signature[HUB_SIGNATURE_LENGTH];
+} HubCache;
+
+static_assert(sizeof(HubCache) <= RTC_SLOT_CAPACITY(RTC_SLOT_HUB, RTC_SLOT_DUTY_CYCLE), "Hub cache doesn't fit its RTC slot");
+
+// Host names are cached without the usual hub domain, so every IoT Hub name
+// (up to 50 characters) fits. Hub names have no dots, a host name that
+// keeps one is cached whole. False if it doesn't fit.
+static bool packHubHostName(const char *hostName, char *packed, size_t size)
+{
+    size_t length = strlen(hostName);
+    size_t domainLength = sizeof(HUB_HOST_DOMAIN) - 1;
+    if (length > domainLength && strcmp(hostName + length - domainLength, HUB_HOST_DOMAIN) == 0 &&
+        memchr(hostName, '.', length - domainLength) == NULL)
+        length -= domainLength;
+    if (length >= size)
+        return false;
+    memcpy(packed, hostName, length);
+    packed[length] = '\0';
+    return true;
+}
 
-#define MAX_REGISTERED_METHODS 10
-typedef struct tagMethodRegistration
+static void unpackHubHostName(const char *packed, char *hostName, size_t size)
 {
-    const char *name;
-    MethodCallbackFunctionType callback;
-} MethodRegistrationEntry;
+    snprintf(hostName, size, "%s%s", packed, strchr(packed, '.') == NULL ? HUB_HOST_DOMAIN : "");
+}
 
-PubSubClient _mqttClient;
-WiFiClientSecure _wifiClient;
+// Shared by all instances, they never publish concurrently
+#if TELEMETRY_COMPRESSION_THRESHOLD > 0
+GzipCompressor _gzipCompressor;
+uint8_t _compressionBuffer[MQTT_MAX_PACKET_SIZE];
+#endif
 
-MethodRegistrationEntry methodRegistry[MAX_REGISTERED_METHODS];
+// Parsed on first use and kept for every instance's TLS connections
+static BearSSL::X509List *getTrustAnchors()
+{
+    static BearSSL::X509List *trustAnchors = NULL;
+    if (trustAnchors == NULL)
+        trustAnchors = new BearSSL::X509List(SSL_CA_PEM_DEF);
+    return trustAnchors;
+}
 
 void CentralduinoClass::setup(const char *configFilePath)
 {
-    Log.notice(CR "********* Centralduino starting *********" CR);
-    delay(1000);
+    CLOG(STARTING);
+    CrashReport.begin();
+    delay(CENTRALDUINO_STARTUP_DELAY);
+    BootProfile.mark(BOOT_PHASE_STARTUP_DELAY);
 
     CentralduinoConfig.loadConfig(configFilePath);
     CentralduinoConfig.dumpConfigToLog();
+    BootProfile.mark(BOOT_PHASE_CONFIG);
 
+    setIdentity(CentralduinoConfig.hub, true);
     ensureWiFiConnected();
-    syncNtpTime(); // setup the internal NTP stuff
-    ensureHubConnected();
-    registerCallbacks();
-    sendTwinUpdateRequest();
+    BootProfile.mark(BOOT_PHASE_WIFI);
+    startServices();
+
+#if METRICS_REPORT_INTERVAL > 0
+    Scheduler.every(METRICS_REPORT_INTERVAL, [this]() {
+        if (!isHubOnline())
+            return;
+
+        Metrics.sampleSystem();
+        char buffer[METRICS_JSON_MAX_LENGTH];
+        size_t length = Metrics.toJson(buffer, sizeof(buffer));
+        publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, 0);
+    }, "metrics");
+#endif
+
+#ifdef CENTRALDUINO_PROFILING
+    Scheduler.every(PROFILE_REPORT_INTERVAL, [this]() {
+        Profiler.dumpToLog();
+        char buffer[PROFILE_JSON_MAX_LENGTH];
+        size_t length = Profiler.toJson(buffer, sizeof(buffer));
+        if (isHubOnline())
+            publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, 0);
+        Profiler.reset();
+    }, "profile");
+#endif
 }
 
-void CentralduinoClass::loop()
+// Shared by every instance, started by the first one
+void CentralduinoClass::startServices()
+{
+    static bool started = false;
+    if (started)
+        return;
+    started = true;
+
+    TimeService.begin(); // NTP runs in the background
+    Scheduler.every(TIME_SERVICE_INTERVAL, []() { TimeService.loop(); }, "time");
+    Scheduler.every(METHOD_CHECK_INTERVAL, []() {
+        for (CentralduinoClass *instance = _first; instance != NULL; instance = instance->_next)
+            instance->expirePendingMethods();
+    }, "methods");
+#if RULE_SUMMARY_INTERVAL > 0
+    Scheduler.every(RULE_SUMMARY_INTERVAL, []() {
+        for (CentralduinoClass *instance = _first; instance != NULL; instance = instance->_next)
+            instance->publishRuleSummary();
+    }, "rules");
+#endif
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    _isWorkerRunning = true;
+    _worker = new std::thread(runNetworkWorker);
+#else
+    // One task connects every instance, gateways can have more of them
+    // than the scheduler has tasks
+    Scheduler.every(HUB_CHECK_INTERVAL, []() {
+        for (CentralduinoClass *instance = _first; instance != NULL; instance = instance->_next)
+            instance->ensureHubConnected();
+    }, "hub");
+#endif
+}
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+// Connects and services every instance's hub connection. Instances take
+// the lock only for begin() and end(), a publish never does. Connecting
+// (DPS, the TLS handshake) takes seconds, so it's done without the lock:
+// only end() on that same instance waits for it.
+void CentralduinoClass::runNetworkWorker()
+{
+    isWorkerThread = true;
+    uint32_t checkedAtMs = millis() - HUB_CHECK_INTERVAL;
+    while (_isWorkerRunning)
+    {
+        bool busy = false;
+        {
+            std::unique_lock<std::mutex> workerLock(_instancesLock);
+            bool check = millis() - checkedAtMs >= HUB_CHECK_INTERVAL;
+            if (check)
+                checkedAtMs = millis();
+            for (CentralduinoClass *instance = _first; instance != NULL; instance = instance->_next)
+            {
+                if (check)
+                {
+                    // Still listed when the lock is back: end() waits for
+                    // it, and unlinking another instance fixes up _next
+                    _connecting = instance;
+                    workerLock.unlock();
+                    instance->ensureHubConnected();
+                    workerLock.lock();
+                    _connecting = NULL;
+                    _connectDone.notify_all();
+                }
+                busy |= instance->serviceNetwork();
+            }
+        }
+        if (!busy)
+            std::this_thread::sleep_for(std::chrono::milliseconds(NETWORK_WORKER_IDLE));
+    }
+}
+
+// Worker side: sends what the application queued, then services the connection
+bool CentralduinoClass::serviceNetwork()
 {
-    // Log.trace("Heap free: %d" CR, ESP.getFreeHeap());
-    ensureHubConnected();
+    bool busy = false;
+    WorkerMessage *message;
+    while ((message = _outbound.front()) != NULL)
+    {
+        mqttPublish(message->topic(), message->payload(), message->payloadLength);
+        _outbound.pop();
+        busy = true;
+    }
+
     _mqttClient.loop();
+    checkHubSession();
+    _isOnline = _mqttClient.connected();
+    return busy;
+}
+
+// Application side: what the worker received, in order
+void CentralduinoClass::dispatchInbound()
+{
+    WorkerMessage *message;
+    while ((message = _inbound.front()) != NULL)
+    {
+        if (message->kind == WORKER_MESSAGE_CONNECTED)
+            handleHubConnected();
+        else
+            handleIncomingMessage(message->topic(), message->payload(), message->payloadLength);
+        _inbound.pop();
+    }
+}
+
+void CentralduinoClass::stopNetworkWorker()
+{
+    if (_worker == NULL)
+        return;
+    _isWorkerRunning = false;
+    _worker->join();
+    delete _worker;
+    _worker = NULL;
+}
+#endif
+
+void CentralduinoClass::begin(const _HubConfig &identity, const char *hubHostName)
+{
+    setIdentity(identity, false);
+    if (hubHostName != NULL)
+        strlcpy(_hubHostName, hubHostName, sizeof(_hubHostName));
+    startServices();
+}
+
+void CentralduinoClass::end()
+{
+    NETWORK_WORKER_LOCK();
+    if (!_isStarted)
+        return;
+
+    if (_mqttClient.connected())
+        _mqttClient.disconnect();
+    _isHubConnected = false;
+    _tokenRefreshAt = 0;
+    _hasSession = false;
+    _isResumePending = false;
+    _isReadyPending = false;
+    memset(_pendingMethods, 0, sizeof(_pendingMethods));
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    _isOnline = false;
+#endif
+
+    CentralduinoClass **link = &_first;
+    while (*link != NULL && *link != this)
+        link = &(*link)->_next;
+    if (*link != NULL)
+        *link = _next;
+    _next = NULL;
+    _isStarted = false;
+}
+
+void CentralduinoClass::setIdentity(const _HubConfig &identity, bool isDeviceIdentity)
+{
+    NETWORK_WORKER_LOCK();
+    if (&identity != &_hub)
+        memcpy(&_hub, &identity, sizeof(_hub));
+    _isDeviceIdentity = isDeviceIdentity;
+    _hubHostName[0] = '\0';
+
+    snprintf(_telemetryTopic, sizeof(_telemetryTopic), MEASUREMENT_TOPIC_FMT, _hub.device_id);
+    snprintf(_deviceBoundTopic, sizeof(_deviceBoundTopic), "devices/%s/messages/devicebound/#", _hub.device_id);
+
+    _mqttClient.setCallback([this](char *topic, byte *data, unsigned int length) {
+#ifdef CENTRALDUINO_NETWORK_WORKER
+        // Handled on the application thread, in poll(). The worker can't
+        // wait for room: the application may be waiting for the worker.
+        if (_worker != NULL)
+        {
+            if (!pushWorkerMessage(_inbound, WORKER_MESSAGE_RECEIVED, topic, data, length))
+                CLOG(WORKER_QUEUE_FULL, topic);
+            return;
+        }
+#endif
+        handleIncomingMessage(topic, data, length);
+    });
+#ifndef CENTRALDUINO_NETWORK_WORKER
+    // Without the "#". The worker hands messages over whole.
+    _mqttClient.setStreamHandler(_deviceBoundTopic, strlen(_deviceBoundTopic) - 1, &_c2d);
+#endif
+
+    if (!_isStarted)
+    {
+        _next = _first;
+        _first = this;
+        _isStarted = true;
+    }
+}
+
+void CentralduinoClass::loop()
+{
+    uint32_t idle = poll();
+
+    // Sleeping in delay() lets the WiFi modem doze until the next task
+    delay(idle);
+}
+
+uint32_t CentralduinoClass::poll()
+{
+    PROFILE_SCOPE(LOOP);
+    {
+        PROFILE_SCOPE(MQTT_LOOP);
+        for (CentralduinoClass *instance = _first; instance != NULL; instance = instance->_next)
+        {
+#ifdef CENTRALDUINO_NETWORK_WORKER
+            instance->dispatchInbound();
+#else
+            instance->_mqttClient.loop();
+            instance->checkHubSession();
+#endif
+        }
+    }
+
+    PROFILE_SCOPE(SCHEDULER);
+    return Scheduler.loop();
 }
 
 void CentralduinoClass::sendProperty(const char *name, const char *value)
 {
     char topic[128];
-    int rid = 123; // TODO
-    sprintf(topic, PROPERTY_TOPIC_FMT, CentralduinoConfig.hub.device_id, rid);
+    snprintf(topic, sizeof(topic), PROPERTY_TOPIC_FMT, nextRid());
 
     StaticJsonDocument<MQTT_MAX_PACKET_SIZE> payload;
     payload[name] = value;
 
     char buffer[MQTT_MAX_PACKET_SIZE];
     serializeJson(payload, buffer);
-    Log.trace("MQTT Publishing to %s" CR, topic);
-    Log.trace("Payload %s" CR, buffer);
-    _mqttClient.publish(topic, buffer);
+    CLOG(PROPERTY_PUBLISH, name);
+    mqttPublish(topic, buffer);
+}
+
+void CentralduinoClass::onHubConnected(ConnectedCallbackType callback)
+{
+    _connectedCallback = callback;
+}
+
+void CentralduinoClass::onCloudMessage(C2dStartCallback start, C2dDataCallback data, C2dEndCallback end,
+                                       uint32_t maxLength)
+{
+    _c2d.setCallbacks(start, data, end, maxLength);
 }
 
-void CentralduinoClass::sendMeasurement(const char *name, double value)
+void CentralduinoClass::sendMeasurement(const char *name, double value, uint64_t sampledAtMs)
 {
-    char topic[128]; // TODO
-    sprintf(topic, MEASUREMENT_TOPIC_FMT, CentralduinoConfig.hub.device_id);
+    _rules.record(name, value, sampleTimeMs(sampledAtMs));
 
     StaticJsonDocument<MQTT_MAX_PACKET_SIZE> payload;
     payload[name] = value;
 
     char buffer[MQTT_MAX_PACKET_SIZE];
-    serializeJson(payload, buffer);
-    Log.trace("MQTT Publishing to: %s" CR, topic);
-    Log.trace("Payload: %s" CR, buffer);
-    _mqttClient.publish(topic, buffer);
+    size_t length = serializeJson(payload, buffer);
+    publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, sampleTimeToUtc(sampledAtMs));
+}
+
+uint64_t CentralduinoClass::sampleTimeToUtc(uint64_t sampledAtMs)
+{
+    return sampledAtMs != 0 && TimeService.isSynced() ? TimeService.toUtcMs(sampledAtMs) : 0;
+}
+
+// The rules only need the low bits, for hold times and rates
+uint32_t CentralduinoClass::sampleTimeMs(uint64_t sampledAtMs)
+{
+    return (uint32_t)(sampledAtMs != 0 ? sampledAtMs : TimeService.monotonicMs());
+}
+
+void CentralduinoClass::recordSample(const char *name, double value, uint64_t sampledAtMs)
+{
+    _rules.record(name, value, sampleTimeMs(sampledAtMs));
+}
+
+void CentralduinoClass::publishAlert(const Rule &rule, const char *stream, bool raised, float value)
+{
+    CLOG(RULE_ALERT, rule.name, raised ? "raised" : "cleared");
+    Metrics.increment(METRIC_RULE_ALERTS);
+
+    char buffer[RULE_ALERT_JSON_MAX_LEN];
+    size_t length = RuleEngine::alertToJson(buffer, sizeof(buffer), rule, stream, raised, value);
+    publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, 0);
+}
+
+// While offline the samples keep adding up to the next one that can be sent
+void CentralduinoClass::publishRuleSummary()
+{
+    if (!isHubOnline())
+        return;
+
+    char buffer[MQTT_MAX_PACKET_SIZE];
+    size_t length = _rules.summaryToJson(buffer, sizeof(buffer));
+    if (length > 0)
+        publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, 0);
+}
+
+// The alert rules and the firmware update, from the whole twin or a patch
+void CentralduinoClass::applyDesiredProperties(byte *data, unsigned int length, bool isWholeTwin)
+{
+    StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(2)> filter;
+    if (isWholeTwin)
+    {
+        filter["desired"][RULES_PROPERTY] = true;
+        filter["desired"][OTA_PROPERTY] = true;
+    }
+    else
+    {
+        filter[RULES_PROPERTY] = true;
+        filter[OTA_PROPERTY] = true;
+    }
+
+    StaticJsonDocument<DESIRED_JSON_CAPACITY> document;
+    DeserializationError error =
+        deserializeJson(document, (const char *)data, length, DeserializationOption::Filter(filter));
+    if (error)
+    {
+        CLOG(DESIRED_UNREADABLE, error.c_str());
+        return;
+    }
+
+    JsonObject desired = isWholeTwin ? document["desired"].as<JsonObject>() : document.as<JsonObject>();
+    if (isWholeTwin || desired.containsKey(RULES_PROPERTY))
+        applyRules(desired[RULES_PROPERTY].as<JsonObject>(), isWholeTwin);
+
+    JsonObject ota = desired[OTA_PROPERTY].as<JsonObject>();
+    if (_isOtaEnabled && !ota.isNull())
+        startOta(ota, true);
+}
+
+// The whole twin replaces the rules (it comes again on every reconnect,
+// unchanged rules keep their state), a patch changes the ones it names and
+// removes those set to null ("rules": null removes them all)
+void CentralduinoClass::applyRules(JsonObject rules, bool isWholeTwin)
+{
+    if (isWholeTwin || rules.isNull())
+        _rules.markRules();
+    for (JsonPair rule : rules)
+    {
+        const char *text = rule.value().as<const char *>();
+        if (text == NULL)
+            _rules.removeRule(rule.key().c_str());
+        else if (!_rules.setRule(rule.key().c_str(), text))
+            CLOG(RULE_INVALID, rule.key().c_str());
+    }
+    _rules.sweepRules();
+    CLOG(RULES_LOADED, _rules.getRuleCount());
+}
+
+// A status like a direct method's: 202 started, 200 that version runs
+// already, 409 another download is under way. The twin comes again on every
+// reconnect, so it doesn't start a version already tried since boot.
+int CentralduinoClass::startOta(JsonObject request, bool isFromTwin)
+{
+    const char *version = request["version"];
+    if (isFromTwin && version != NULL && strcmp(version, OtaUpdate.getTargetVersion()) == 0)
+        return 200;
+
+    int status;
+    switch (OtaUpdate.start(request["url"], request["size"].as<uint32_t>(), request["sha256"], version))
+    {
+    case OTA_STARTED:
+        return 202;
+    case OTA_CURRENT:
+        return 200;
+    case OTA_BUSY:
+        status = 409;
+        break;
+    case OTA_NO_ROOM:
+        status = 507;
+        break;
+    case OTA_NO_MEMORY:
+        status = 503;
+        break;
+    default:
+        status = 400;
+        break;
+    }
+    CLOG(OTA_REFUSED, version != NULL ? version : "", status);
+    return status;
+}
+
+void CentralduinoClass::publishOtaReport(const char *json, size_t length)
+{
+    if (!isHubOnline() || length == 0)
+        return;
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), PROPERTY_TOPIC_FMT, nextRid());
+    mqttPublish(topic, (const uint8_t *)json, length);
+}
+
+bool CentralduinoClass::sendSampleBlock(const char *name, SampleBlockEncoder &block, TelemetryEncoding encoding)
+{
+    uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+    size_t length = 0;
+    size_t nameLength = strlen(name);
+
+    if (encoding == TELEMETRY_ENCODING_CBOR)
+    {
+        CborWriter writer(buffer, sizeof(buffer));
+        writer.writeMap(1);
+        writer.writeText(name, nameLength);
+        writer.writeBytes(block.getData(), block.getLength());
+        if (!writer.hasOverflowed())
+            length = writer.getLength();
+    }
+    else
+    {
+        // {"name":"<base64>"}, the name escaped by ArduinoJson like in the
+        // other telemetry
+        StaticJsonDocument<16> key;
+        key.set(name);
+        size_t keyLength = measureJson(key);
+        if (keyLength + base64_enc_len(block.getLength()) + 5 <= sizeof(buffer))
+        {
+            char *p = (char *)buffer;
+            *p++ = '{';
+            p += serializeJson(key, p, keyLength + 1);
+            *p++ = ':';
+            *p++ = '"';
+            p += base64_encode(p, (char *)block.getData(), block.getLength());
+            *p++ = '"';
+            *p++ = '}';
+            *p = 0;
+            length = p - (char *)buffer;
+        }
+    }
+
+    if (length == 0)
+    {
+        CLOG(SAMPLE_BLOCK_TOO_LARGE, name, block.getLength());
+        return false;
+    }
+
+    return publishTelemetry(buffer, length, encoding, 0);
+}
+
+bool CentralduinoClass::publishTelemetry(const uint8_t *payload, size_t length, TelemetryEncoding encoding, uint64_t creationTimeUtcMs)
+{
+    PROFILE_SCOPE(PUBLISH);
+    if (length == 0)
+    {
+        CLOG(PAYLOAD_TOO_LARGE);
+        return false;
+    }
+
+    const char *contentEncoding = encoding == TELEMETRY_ENCODING_JSON ? UTF8_CONTENT_ENCODING : "";
+#if TELEMETRY_COMPRESSION_THRESHOLD > 0
+    if (length >= TELEMETRY_COMPRESSION_THRESHOLD)
+    {
+        // Limiting the output to length - 1 keeps only results that are smaller
+        size_t limit = length - 1 < sizeof(_compressionBuffer) ? length - 1 : sizeof(_compressionBuffer);
+        size_t compressedLength = _gzipCompressor.compress(payload, length, _compressionBuffer, limit);
+        if (compressedLength > 0)
+        {
+            CLOG(PAYLOAD_COMPRESSED, length, compressedLength);
+            payload = _compressionBuffer;
+            length = compressedLength;
+            contentEncoding = GZIP_CONTENT_ENCODING;
+        }
+    }
+#endif
+
+    char topic[256];
+    int topicLength = snprintf(topic, sizeof(topic), "%s%s%s", _telemetryTopic,
+                               encoding == TELEMETRY_ENCODING_CBOR ? CBOR_CONTENT_TYPE : JSON_CONTENT_TYPE, contentEncoding);
+
+    // Stamp the message with the time it was sampled rather than ingested
+    char creationTime[40];
+    if (creationTimeUtcMs == 0 && TimeService.isSynced())
+        creationTimeUtcMs = TimeService.nowUtcMs();
+    if (topicLength > 0 && (size_t)topicLength < sizeof(topic) && creationTimeUtcMs != 0 &&
+        TimeService.formatIso8601(creationTimeUtcMs, creationTime, sizeof(creationTime), "%3A"))
+        snprintf(topic + topicLength, sizeof(topic) - topicLength, CREATION_TIME_PROPERTY "%s", creationTime);
+
+    CLOG(TELEMETRY_PUBLISH, length, encoding == TELEMETRY_ENCODING_CBOR ? "cbor" : "json");
+    return mqttPublish(topic, payload, length);
 }
 
 void CentralduinoClass::registerDeviceMethod(const char *name, MethodCallbackFunctionType callback)
 {
-    // add the name & callback to our map
-    methodRegistry[0].name = name;
-    methodRegistry[0].callback = callback;
+    MethodRegistrationEntry *method = addMethod(name);
+    if (method == NULL)
+        return;
+    method->callback = callback;
+    method->deferred = NULL;
+}
+
+void CentralduinoClass::registerDeferredMethod(const char *name, DeferredMethodCallbackType callback, uint32_t timeoutMs)
+{
+    MethodRegistrationEntry *method = addMethod(name);
+    if (method == NULL)
+        return;
+    method->callback = NULL;
+    method->deferred = callback;
+    method->timeoutMs = timeoutMs < METHOD_MAX_TIMEOUT ? timeoutMs : METHOD_MAX_TIMEOUT;
+}
+
+bool CentralduinoClass::completeMethod(MethodToken token, int status, const char *response)
+{
+    for (int i = 0; token != 0 && i < MAX_PENDING_METHODS; i++)
+    {
+        PendingMethod &pending = _pendingMethods[i];
+        if (pending.token != token)
+            continue;
+
+        pending.token = 0;
+        CLOG(METHOD_COMPLETED, _methodRegistry[pending.method].name, status);
+        return sendMethodResponse(pending.rid, status, response);
+    }
+    CLOG(METHOD_NOT_PENDING, (int)token);
+    return false;
+}
+
+void CentralduinoClass::enableOta(const char *currentVersion, const BearSSL::X509List *trustAnchors)
+{
+    _isOtaEnabled = true;
+    OtaUpdate.begin(currentVersion, trustAnchors);
+    OtaUpdate.onReport([this](const char *json, size_t length) {
+        publishOtaReport(json, length);
+        // Once the report had time to go out, boot the new firmware
+        if (OtaUpdate.getState() == OTA_APPLIED)
+            Scheduler.after(OTA_RESTART_DELAY, []() { ESP.restart(); }, "restart");
+    });
+
+    // Answered at once, the download carries on and reports its progress
+    registerDeferredMethod(OTA_PROPERTY, [this](MethodToken, const uint8_t *payload, size_t length) {
+        StaticJsonDocument<OTA_JSON_CAPACITY> request;
+        if (deserializeJson(request, (const char *)payload, length))
+            return 400;
+        return startOta(request.as<JsonObject>(), false);
+    });
 }
 
 ///////////////////////////////////////////////////////////////////
 // Private helper methods
 
-static void handleIncomingDirectMethod(char *methodName, byte *data, unsigned int length, char* rid)
+// The registry entry for name, added if it isn't there, NULL when full
+MethodRegistrationEntry *CentralduinoClass::addMethod(const char *name)
 {
-    char responseTopic[100];
-    // $iothub/methods/res/{status}/?$rid={request id}
-    sprintf(responseTopic, "$iothub/methods/res/200/?$rid=%s", rid);
+    uint8_t index = 0;
+    while (index < _methodCount && strcmp(_methodRegistry[index].name, name) != 0)
+        index++;
+    if (index == MAX_REGISTERED_METHODS)
+    {
+        CLOG(METHOD_REGISTRY_FULL, name);
+        return NULL;
+    }
+
+    _methodRegistry[index].name = name;
+    if (index == _methodCount)
+        _methodCount++;
+    return &_methodRegistry[index];
+}
+
+void CentralduinoClass::handleIncomingDirectMethod(char *methodName, byte *data, unsigned int length, char *rid)
+{
+    if (methodName == NULL || rid == NULL)
+    {
+        CLOG(MALFORMED_TOPIC, 4, methodName != NULL ? methodName : "");
+        return;
+    }
 
-    Log.notice("Handling incoming direct method: %s (%s)" CR, methodName, rid);
-    for (int i = 0; i < MAX_REGISTERED_METHODS; ++i)
+    CLOG(DIRECT_METHOD, methodName, rid);
+    for (int i = 0; i < _methodCount; ++i)
     {
-        if (strcmp(methodRegistry[i].name, methodName) == 0)
+        if (strcmp(_methodRegistry[i].name, methodName) == 0)
         {
+            if (_methodRegistry[i].deferred)
+            {
+                startDeferredMethod(i, rid, data, length);
+                return;
+            }
+
             // Found it! Call it and bail.
-            methodRegistry[i].callback();
-            // TODO: Send back a response
-            
-            _mqttClient.publish(responseTopic, "{}");
-            break;
+            _methodRegistry[i].callback();
+            sendMethodResponse(rid, 200, "{}");
+            return;
         }
     }
+    CLOG(UNKNOWN_METHOD, methodName);
+}
+
+void CentralduinoClass::startDeferredMethod(uint8_t method, const char *rid, byte *data, unsigned int length)
+{
+    PendingMethod *pending = NULL;
+    for (int i = 0; pending == NULL && i < MAX_PENDING_METHODS; i++)
+    {
+        if (_pendingMethods[i].token == 0)
+            pending = &_pendingMethods[i];
+    }
+    if (pending == NULL || strlen(rid) >= sizeof(pending->rid))
+    {
+        CLOG(METHOD_REFUSED, _methodRegistry[method].name);
+        sendMethodResponse(rid, 429, "{}");
+        return;
+    }
+
+    // The slot in the low bits, a serial number above it so a stale token
+    // doesn't answer a later call in the same slot
+    if ((++_methodSerial & 0x0FFF) == 0)
+        _methodSerial++;
+    MethodToken token = (MethodToken)((_methodSerial & 0x0FFF) << 4 | (pending - _pendingMethods));
+    pending->token = token;
+    pending->method = method;
+    pending->deadlineMs = millis() + _methodRegistry[method].timeoutMs;
+    strlcpy(pending->rid, rid, sizeof(pending->rid));
+
+    // The callback may complete it right away, or answer with a status
+    int status = _methodRegistry[method].deferred(token, data, length);
+    if (status == METHOD_PENDING)
+        CLOG(METHOD_DEFERRED, _methodRegistry[method].name, (int)token);
+    else if (pending->token == token)
+        completeMethod(token, status);
+}
+
+bool CentralduinoClass::sendMethodResponse(const char *rid, int status, const char *response)
+{
+    char topic[48 + METHOD_RID_MAX_LEN];
+    // $iothub/methods/res/{status}/?$rid={request id}
+    snprintf(topic, sizeof(topic), "$iothub/methods/res/%d/?$rid=%s", status, rid);
+    return mqttPublish(topic, response);
+}
+
+void CentralduinoClass::expirePendingMethods()
+{
+    uint32_t now = millis();
+    for (int i = 0; i < MAX_PENDING_METHODS; i++)
+    {
+        PendingMethod &pending = _pendingMethods[i];
+        if (pending.token == 0 || (int32_t)(now - pending.deadlineMs) < 0)
+            continue;
+
+        const MethodRegistrationEntry &method = _methodRegistry[pending.method];
+        pending.token = 0;
+        Metrics.increment(METRIC_METHOD_TIMEOUTS);
+        CLOG(METHOD_TIMED_OUT, method.name, (unsigned long)method.timeoutMs);
+        sendMethodResponse(pending.rid, 504, "{}");
+    }
 }
 
-static void handleIncomingMessage(char *topic, byte *data, unsigned int length)
+void CentralduinoClass::handleIncomingMessage(char *topic, byte *data, unsigned int length)
 {
-    Log.trace("Incoming message received:" CR);
-    Log.trace("- topic: %s" CR, topic);
-    Log.trace("- data: %s" CR, data);
+    // Cloud-to-device messages the transport couldn't stream
+    if (strncmp(topic, _deviceBoundTopic, strlen(_deviceBoundTopic) - 1) == 0)
+    {
+        _c2d.deliver(topic, data, length);
+        return;
+    }
+
+    CLOG(INCOMING_MESSAGE, topic, length);
+
+    Metrics.increment(METRIC_RECEIVED_BYTES, length);
+    if (strncmp(topic, "$iothub/methods/", 16) == 0)
+        Metrics.increment(METRIC_RECEIVED_METHODS);
+    else if (strncmp(topic, "$iothub/twin/res/", 17) == 0)
+        Metrics.increment(METRIC_RECEIVED_TWIN_RESPONSES);
+    else if (strncmp(topic, "$iothub/twin/PATCH/", 19) == 0)
+        Metrics.increment(METRIC_RECEIVED_TWIN_PATCHES);
+    else if (strncmp(topic, "devices/", 8) == 0)
+        Metrics.increment(METRIC_RECEIVED_C2D);
+    else
+        Metrics.increment(METRIC_RECEIVED_OTHER);
 
     // Process the topic string, tokenizing it by the /
     char *pch;
     pch = strtok(topic, "/");
-    // Log.trace("pch=%s" CR, pch);
     if (pch == NULL)
     {
-        Log.warning("Malformed topic string received (1): %s" CR, topic);
+        CLOG(MALFORMED_TOPIC, 1, topic);
         return;
     }
 
@@ -130,267 +870,499 @@ static void handleIncomingMessage(char *topic, byte *data, unsigned int length)
             pch = strtok(NULL, "/");
             if (strcmp(pch, "POST") != 0)
             {
-                Log.warning("Malformed topic string received (2): %s" CR, topic);
+                CLOG(MALFORMED_TOPIC, 2, topic);
                 return;
             }
             // followed by the method name
             pch = strtok(NULL, "/");
             char* rpch = strtok(NULL, "=");
             rpch = strtok(NULL, "=");
-            Log.notice("Direct method received. Sending to handler." CR);
+            CLOG(DIRECT_METHOD_RECEIVED);
             handleIncomingDirectMethod(pch, data, length, rpch);
         }
+        else if (strcmp(pch, "twin") == 0)
+        {
+            // res/200 answers the GET with the whole twin (other statuses
+            // answer reported property updates), PATCH is a desired change
+            pch = strtok(NULL, "/");
+            if (pch != NULL && strcmp(pch, "PATCH") == 0)
+                applyDesiredProperties(data, length, false);
+            else if (pch != NULL && strcmp(pch, "res") == 0 && (pch = strtok(NULL, "/")) != NULL &&
+                     strcmp(pch, "200") == 0)
+                applyDesiredProperties(data, length, true);
+        }
     }
 }
 
+void CentralduinoClass::reportBootProfile()
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), PROPERTY_TOPIC_FMT, nextRid());
+
+    // {"boot_profile":{...}}
+    const char prefix[] = "{\"boot_profile\":";
+    char buffer[sizeof(prefix) + BOOT_PROFILE_JSON_MAX_LENGTH + 1];
+    strcpy(buffer, prefix);
+    size_t length = BootProfile.finish(buffer + sizeof(prefix) - 1, sizeof(buffer) - sizeof(prefix));
+    if (length == 0)
+    {
+        CLOG(BOOT_PROFILE_TOO_LARGE);
+        return;
+    }
+
+    length += sizeof(prefix) - 1;
+    buffer[length++] = '}';
+    buffer[length] = '\0';
+    CLOG(BOOT_PROFILE_REPORTED, length);
+    mqttPublish(topic, (const uint8_t *)buffer, length);
+}
+
+void CentralduinoClass::reportCrash()
+{
+    char buffer[CRASH_JSON_MAX_LENGTH];
+    size_t length = CrashReport.toJson(buffer, sizeof(buffer));
+    if (publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, 0))
+    {
+        CLOG(CRASH_REPORTED, length);
+        CrashReport.clear();
+    }
+}
+
+// Request ids of reported property updates, so their responses can be
+// told apart. 0 is left to the twin GET.
+int CentralduinoClass::nextRid()
+{
+    if (++_ridSerial == 0)
+        _ridSerial = 1;
+    return _ridSerial;
+}
+
 void CentralduinoClass::sendTwinUpdateRequest()
 {
     const char *twin_topic = "$iothub/twin/GET/?$rid=0";
-    if (!_mqttClient.publish(twin_topic, " "))
-        Log.error("Failed to send Device Twin update request." CR);
+    if (!mqttPublish(twin_topic, " "))
+        CLOG(TWIN_REQUEST_FAILED);
     _mqttClient.loop();
 }
 
+// One SUBSCRIBE for everything. Cloud-to-device messages are taken at
+// QoS 1, the ones sent while the device was away wait in its session.
 void CentralduinoClass::registerCallbacks()
 {
-    StringBuffer buffer(64);
-    buffer.setLength(snprintf(*buffer, 63, "devices/%s/messages/events/#", CentralduinoConfig.hub.device_id));
-
-    int errorCode = 0;
-    if ((errorCode = _mqttClient.subscribe(*buffer)) == 0)
-        Log.error("ERROR: mqttClient couldn't subscribe to %s. error code => %d" CR, *buffer, errorCode);
-
-    buffer.setLength(snprintf(*buffer, 63, "devices/%s/messages/devicebound/#", CentralduinoConfig.hub.device_id));
-
-    if ((errorCode = _mqttClient.subscribe(*buffer)) == 0)
-        Log.error("ERROR: mqttClient couldn't subscribe to %s. error code => %d" CR, *buffer, errorCode);
-
-    errorCode = _mqttClient.subscribe("$iothub/twin/PATCH/properties/desired/#"); // twin desired property changes
-    errorCode += _mqttClient.subscribe("$iothub/twin/res/#");                     // twin properties response
-    errorCode += _mqttClient.subscribe("$iothub/methods/POST/#");                 // direct method calls
-
-    if (errorCode < 3)
-        Log.error("ERROR: mqttClient couldn't subscribe to twin/methods etc. error code sum => %d", errorCode);
+    const char *topics[] = {
+        _deviceBoundTopic,
+        "$iothub/twin/PATCH/properties/desired/#", // twin desired property changes
+        "$iothub/twin/res/#",                      // twin properties response
+        "$iothub/methods/POST/#"                   // direct method calls
+    };
+    static const uint8_t qos[] = {1, 0, 0, 0};
+    if (!_mqttClient.subscribe(topics, qos, sizeof(qos)))
+        CLOG(SUBSCRIBE_BATCH_FAILED, (int)sizeof(qos));
 }
 
-void CentralduinoClass::ensureWiFiConnected()
+// The twin request goes out right behind the SUBSCRIBE, the hub handles
+// them in order
+void CentralduinoClass::startHubSession()
 {
-    if (WiFi.status() == WL_CONNECTED)
-        return;
-
-    Log.notice("Connecting to WiFi." CR);
-    WiFi.mode(WIFI_STA);
-
-    // Dump available networks to terminal
-    // WiFi.disconnect();
-    // Log.notice("-------------------" CR);
-    // Log.notice("Scan starting... ");
-    // int numNets = WiFi.scanNetworks();
-    // Log.notice("%d networks found" CR, numNets);
-    // for (int i = 0; i < numNets; ++i)
-    //     Log.notice("- %s" CR, WiFi.SSID(i).c_str());
-    // Log.notice("-------------------" CR);
-    // delay(1000);
+    registerCallbacks();
+    if (_isDeviceIdentity)
+        BootProfile.mark(BOOT_PHASE_SUBSCRIBE);
+    sendTwinUpdateRequest();
 
-    WiFi.begin(CentralduinoConfig.network.ssid, CentralduinoConfig.network.password);
+    if (_isDeviceIdentity)
+        BootProfile.mark(BOOT_PHASE_TWIN);
+}
 
-    unsigned long startingMillis = millis();
-    while (WiFi.status() != WL_CONNECTED)
+// Called after the transport was serviced, until the connection is ready
+// for commands: accepted and subscribed, when onHubConnected() fires
+void CentralduinoClass::checkHubSession()
+{
+    if (_isResumePending && _mqttClient.isAccepted())
     {
-        // bail out after 30sec
-        if ((millis() - startingMillis) > 30 * 1000)
+        _isResumePending = false;
+        if (_mqttClient.isSessionPresent())
         {
-            Log.error("Unable to connect to WiFi. Restarting device.");
-            ESP.restart();
-            break; // shouldn't get here?
+            // Desired properties may have changed while away
+            sendTwinUpdateRequest();
         }
+        else
+        {
+            CLOG(SESSION_LOST);
+            startHubSession();
+        }
+    }
+
+    if (_isReadyPending && !_isResumePending && _mqttClient.isSubscribed())
+    {
+        _isReadyPending = false;
+        _hasSession = MQTT_PERSISTENT_SESSION;
+        _retryAtMs = 0;
+        _connectFailures = 0;
+        uint32_t readyMs = millis() - _connectStartedMs;
+        Metrics.set(METRIC_HUB_READY_MS, readyMs);
+        CLOG(HUB_READY, (unsigned long)readyMs, _mqttClient.isSessionPresent());
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+        // The reports and the callback run on the application thread
+        if (!pushWorkerMessage(_inbound, WORKER_MESSAGE_CONNECTED, "", (const uint8_t *)"", 0))
+            CLOG(WORKER_QUEUE_FULL, "");
+#else
+        handleHubConnected();
+#endif
+    }
+}
 
-        delay(1000);
+void CentralduinoClass::ensureWiFiConnected()
+{
+    if (!WiFiConnection.connect(WIFI_CONNECT_TIMEOUT))
+    {
+        CLOG(WIFI_RESTART);
+        ESP.restart();
     }
-    Log.trace("WiFi connected successfully" CR);
 }
 
 void CentralduinoClass::ensureHubConnected()
 {
     if (_mqttClient.connected())
-        return;
-
-    StringBuffer hostName, username, password;
-    StringBuffer tmpHostname(128);
-
-    Log.notice("Getting connection info");
-    if (AzureDps.getHubHostName(DEFAULT_ENDPOINT, CentralduinoConfig.hub.scope_id, CentralduinoConfig.hub.device_id, CentralduinoConfig.hub.sas_key, *tmpHostname))
     {
-        Log.error("Failed to get hub host from DPS. Unable to continue." CR);
+        // Reconnect with a new SAS token before the hub drops us
+        if (_tokenRefreshAt != 0 && (uint32_t)time(NULL) >= _tokenRefreshAt)
+        {
+            CLOG(TOKEN_REFRESH);
+            Metrics.increment(METRIC_TOKEN_REFRESHES);
+            _tokenRefreshAt = 0;
+            _mqttClient.disconnect();
+        }
         return;
     }
 
-    // StringBuffer cstr(128);
-    char cstr[CONN_STR_MAX_LEN];
-    int rc = snprintf(cstr, CONN_STR_MAX_LEN,
-                      "HostName=%s;DeviceId=%s;SharedAccessKey=%s", *tmpHostname, CentralduinoConfig.hub.device_id, CentralduinoConfig.hub.sas_key);
-    assert(rc > 0 && rc < CONN_STR_MAX_LEN);
-
-    // TODO: move into iotc_dps and do not re-parse from connection string
-    StringBuffer deviceId;
-    getUsernameAndPasswordFromConnectionString(cstr, rc, hostName, deviceId, username, password);
+    // The asynchronous transport is only refused, or given up on for want
+    // of a CONNACK, once connect() has returned: a connection that went
+    // down before it was ready failed like any other
+    if (_isReadyPending)
+    {
+        int state = _mqttClient.state();
+        _isReadyPending = false;
+        _isResumePending = false;
+        Metrics.increment(METRIC_HUB_CONNECT_FAILURES);
+        CLOG(MQTT_CONNECT_FAILED, state);
+        // The cached SAS signature or hub may be stale, like when the
+        // device was moved to another hub
+        if (state == MQTT_CONNECT_BAD_CREDENTIALS || state == MQTT_CONNECT_UNAUTHORIZED)
+            forgetHub();
+        scheduleHubRetry();
+    }
 
-    Log.trace("** Generated MQTT connection strings **" CR);
-    Log.trace("hostname: %s" CR, *hostName);
-    Log.trace("deviceId: %s" CR, *deviceId);
-    Log.trace("username: %s" CR, *username);
-    Log.trace("password: %s" CR, *password);
+    // TLS certificate checks and SAS tokens both need the real time
+    if (!TimeService.isSynced())
+        return;
+    if (_isDeviceIdentity)
+        BootProfile.mark(BOOT_PHASE_TIME);
 
-    Log.notice("Setting up MQTT client..." CR);
-    BearSSL::X509List certList(SSL_CA_PEM_DEF);
-    _wifiClient.setX509Time(time(NULL));
-    _wifiClient.setTrustAnchors(&certList);
-    _mqttClient.setClient(_wifiClient);
-    _mqttClient.setServer(*hostName, AZURE_MQTT_SERVER_PORT);
-    _mqttClient.setCallback(handleIncomingMessage);
+    // One try per check, then back off, rather than block the other
+    // instances and the tasks sharing this one
+    if (_retryAtMs != 0 && (int32_t)(millis() - _retryAtMs) < 0)
+        return;
 
-    this->_isHubConnected = false;
-    // Loop until we're connected
-    Log.trace("Attempting MQTT connection: %s, %s, %s" CR, *deviceId, *username, *password);
-    while (!_mqttClient.connected())
     {
-        if (_mqttClient.connect(*deviceId, *username, *password))
-        {
-            Log.trace("MQTT connected");
-            break;
-        }
-        else
+        PROFILE_SCOPE(HUB_CONNECT);
+        _connectStartedMs = millis();
+        if (!connectToHub(1, !MQTT_PERSISTENT_SESSION))
         {
-            Log.error("MQTT connection failed, rc=%d. Will try again in 5 sec." CR, _mqttClient.state());
-            delay(5000);
+            scheduleHubRetry();
+            return;
         }
     }
-    this->_isHubConnected = true;
+
+    // The back off is only reset once the connection is ready (see
+    // checkHubSession()). Only the CONNACK says whether the hub kept the
+    // session, so the first connection subscribes right behind the CONNECT
+    // rather than wait for it. So does every connection when the transport
+    // can't tell.
+    _isReadyPending = true;
+    _isResumePending = _hasSession && _mqttClient.reportsSessionPresent();
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    _isOnline = true;
+#endif
+    uint32_t now = time(NULL);
+    _tokenRefreshAt = _tokenExpires > now + AUTH_REFRESH_MARGIN ? _tokenExpires - AUTH_REFRESH_MARGIN : now;
+
+    if (!_isResumePending)
+        startHubSession();
+    checkHubSession();
 }
 
-void CentralduinoClass::syncNtpTime()
+// See HUB_RETRY_INTERVAL
+void CentralduinoClass::scheduleHubRetry()
 {
-    time_t epochTime;
+    if (_connectFailures < UINT8_MAX)
+        _connectFailures++;
+    uint32_t retryMs = HUB_RETRY_INTERVAL;
+    for (uint8_t i = 1; i < _connectFailures && retryMs < HUB_RETRY_MAX_INTERVAL; i++)
+        retryMs *= 2;
+    if (retryMs > HUB_RETRY_MAX_INTERVAL)
+        retryMs = HUB_RETRY_MAX_INTERVAL;
+    _retryAtMs = millis() + retryMs;
+}
 
-    Log.notice("Configuring NTP..." CR);
-    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+// The next connection looks the hub up again through DPS and signs a new
+// token
+void CentralduinoClass::forgetHub()
+{
+    if (_isDeviceIdentity)
+        RtcStore.invalidate(RTC_SLOT_HUB);
+    _hubHostName[0] = '\0';
+}
 
-    while (true)
+void CentralduinoClass::handleHubConnected()
+{
+    if (_isDeviceIdentity)
     {
-        epochTime = time(NULL);
-
-        if (epochTime < MIN_EPOCH)
-        {
-            Log.warning("Fetching NTP epoch time failed! Waiting 2 seconds to retry." CR);
-            delay(2000);
-        }
-        else
-        {
-            Log.notice("Fetched NTP epoch time is: %d" CR, epochTime);
-            break;
-        }
+        if (!BootProfile.isFinished())
+            reportBootProfile();
+        if (CrashReport.isPending())
+            reportCrash();
+    }
 
-        delay(10);
+    // Tells the cloud which version runs, and how a download is going
+    if (_isOtaEnabled)
+    {
+        char buffer[OTA_REPORT_JSON_MAX_LEN];
+        size_t length = OtaUpdate.toJson(buffer, sizeof(buffer));
+        publishOtaReport(buffer, length);
     }
 
-    struct timeval tv;
-    tv.tv_sec = epochTime;
-    tv.tv_usec = 0;
+    if (_connectedCallback)
+        _connectedCallback();
+}
 
-    settimeofday(&tv, NULL);
+// Identifies the credentials a cached hub entry was made for
+static uint32_t getHubIdentity(const _HubConfig &hub)
+{
+    uint32_t crc = crc32Update(0, hub.scope_id, strlen(hub.scope_id));
+    crc = crc32Update(crc, hub.device_id, strlen(hub.device_id));
+    return crc32Update(crc, hub.sas_key, strlen(hub.sas_key));
 }
 
-// JsonObject CentralduinoClass::getConfigJson()
-// {
-//     if (!SPIFFS.exists(CONFIG_FILE))
-//     {
-//         Log.error("Config file not found in SPIFFS! Unable to continue." CR);
-//         delay(1000);
-//         ESP.restart();
-//     }
+// HMAC-SHA256 of "{host}/devices/{deviceId}\n{expiry}" with the device key
+static bool signHubToken(const char *hostName, const char *deviceId, const char *key, uint32_t expires, uint8_t *signature)
+{
+    StringBuffer hostURLEncoded(hostName, strlen(hostName));
+    hostURLEncoded.urlEncode();
+    StringBuffer deviceIdEncoded(deviceId, strlen(deviceId));
+    deviceIdEncoded.urlEncode();
 
-//     File file = SPIFFS.open(CONFIG_FILE, "r");
-//     deserializeJson(this->_jsonDocument, file);
-//     return this->_jsonDocument.as<JsonObject>();
-// }
+    StringBuffer stringToSign(hostURLEncoded.getLength() + deviceIdEncoded.getLength() + 32);
+    size_t size = snprintf(*stringToSign, stringToSign.getLength(), "%s%s%s\n%lu000",
+                           *hostURLEncoded, "%2Fdevices%2F", *deviceIdEncoded, (unsigned long)expires);
+    if (size == 0 || size >= stringToSign.getLength())
+        return false;
+    stringToSign.setLength(size);
+
+    StringBuffer keyBuffer(key, strlen(key));
+    keyBuffer.base64Decode();
+    stringToSign.hash(*keyBuffer, keyBuffer.getLength());
+    memcpy(signature, *stringToSign, HUB_SIGNATURE_LENGTH);
+    return true;
+}
 
-int CentralduinoClass::getUsernameAndPasswordFromConnectionString(const char *connectionString, size_t connectionStringLength,
-                                                                  StringBuffer &hostName, StringBuffer &deviceId,
-                                                                  StringBuffer &username, StringBuffer &password)
+static bool buildHubCredentials(const char *hostName, const char *deviceId, const uint8_t *signature, uint32_t expires,
+                                StringBuffer &username, StringBuffer &password)
 {
-    // TODO: improve this so we don't depend on a particular order in connection string
-    StringBuffer connStr(connectionString, connectionStringLength);
+    StringBuffer hostURLEncoded(hostName, strlen(hostName));
+    hostURLEncoded.urlEncode();
+    StringBuffer deviceIdEncoded(deviceId, strlen(deviceId));
+    deviceIdEncoded.urlEncode();
 
-    int32_t hostIndex = connStr.indexOf(HOSTNAME_STRING, HOSTNAME_LENGTH);
-    size_t length = connStr.getLength();
-    if (hostIndex != 0)
+    StringBuffer sig((const char *)signature, HUB_SIGNATURE_LENGTH);
+    if (!sig.base64Encode() || !sig.urlEncode())
     {
-        Log.error("ERROR: connectionString doesn't start with HostName=  RESULT:%d", hostIndex);
-        return 1;
+        CLOG(SIGNATURE_ENCODING_FAILED);
+        return false;
     }
 
-    int32_t deviceIndex = connStr.indexOf(DEVICEID_STRING, DEVICEID_LENGTH);
-    if (deviceIndex == -1)
+    StringBuffer passwordBuffer(512);
+    size_t passLength = snprintf(*passwordBuffer, 512,
+                                 "SharedAccessSignature sr=%s%s%s&sig=%s&se=%lu000",
+                                 *hostURLEncoded, "%2Fdevices%2F", *deviceIdEncoded, *sig, (unsigned long)expires);
+    if (passLength == 0 || passLength >= 512)
+        return false;
+    password.initialize(*passwordBuffer, passLength);
+
+    StringBuffer usernameBuffer(strlen(hostName) + strlen(deviceId) + 32);
+    size_t userLength = snprintf(*usernameBuffer, usernameBuffer.getLength(), "%s/%s/api-version=2016-11-14", hostName, deviceId);
+    if (userLength == 0 || userLength >= usernameBuffer.getLength())
+        return false;
+    username.initialize(*usernameBuffer, userLength);
+
+    return true;
+}
+
+// Tries up to attempts times. A cached hub gets a single try, then it is
+// looked up again in case the device was moved to another hub.
+bool CentralduinoClass::connectToHub(int attempts, bool cleanSession)
+{
+    bool fromCache;
+    if (connectToAssignedHub(attempts, cleanSession, fromCache))
+        return true;
+    if (!fromCache)
+        return false;
+
+    forgetHub();
+    return connectToAssignedHub(attempts, cleanSession, fromCache);
+}
+
+bool CentralduinoClass::connectToAssignedHub(int attempts, bool cleanSession, bool &fromCache)
+{
+    // The assigned hub and the last SAS signature are kept in RTC memory, so
+    // a restart or deep sleep wake skips DPS and the token signing. Gateway
+    // instances only remember their hub, and sign a new token every time.
+    HubCache cache;
+    bool isCacheable = true;
+    if (_isDeviceIdentity)
+    {
+        fromCache = RtcStore.read(RTC_SLOT_HUB, &cache, sizeof(cache)) && cache.identity == getHubIdentity(_hub);
+        if (fromCache)
+            unpackHubHostName(cache.hostName, _hubHostName, sizeof(_hubHostName));
+    }
+    else
     {
-        Log.error("ERROR: ;DeviceId= not found in the connectionString");
-        return 1;
+        memset(&cache, 0, sizeof(cache));
+        fromCache = _hubHostName[0] != '\0';
     }
 
-    int32_t keyIndex = connStr.indexOf(KEY_STRING, KEY_LENGTH);
-    if (keyIndex == -1)
+    if (!fromCache)
     {
-        Log.error("ERROR: ;SharedAccessKey= not found in the connectionString");
-        return 1;
+        CLOG(DPS_LOOKUP);
+        uint32_t startedMs = millis();
+        Metrics.increment(METRIC_DPS_CALLS);
+        int result = AzureDps.getHubHostName(DEFAULT_ENDPOINT, _hub.scope_id, _hub.device_id, _hub.sas_key, _hubHostName);
+        Metrics.set(METRIC_DPS_MS, millis() - startedMs);
+        if (_isDeviceIdentity)
+            BootProfile.mark(BOOT_PHASE_DPS);
+        if (result)
+        {
+            _hubHostName[0] = '\0';
+            Metrics.increment(METRIC_DPS_FAILURES);
+            CLOG(DPS_FAILED);
+            return false;
+        }
+
+        memset(&cache, 0, sizeof(cache));
+        cache.identity = getHubIdentity(_hub);
+        isCacheable = packHubHostName(_hubHostName, cache.hostName, sizeof(cache.hostName));
     }
 
-    hostName.initialize(connectionString + HOSTNAME_LENGTH, deviceIndex - HOSTNAME_LENGTH);
-    deviceId.initialize(connectionString + (deviceIndex + DEVICEID_LENGTH), keyIndex - (deviceIndex + DEVICEID_LENGTH));
+    uint32_t now = time(NULL);
+    if (!fromCache || cache.expires < now + AUTH_RENEW_MARGIN)
+    {
+        cache.expires = now + AUTH_EXPIRES;
+        if (!signHubToken(_hubHostName, _hub.device_id, _hub.sas_key, cache.expires, cache.signature))
+        {
+            CLOG(SIGNING_FAILED);
+            return false;
+        }
+        if (_isDeviceIdentity && isCacheable)
+            RtcStore.write(RTC_SLOT_HUB, &cache, sizeof(cache));
+    }
 
-    StringBuffer keyBuffer(length - (keyIndex + KEY_LENGTH));
-    memcpy(*keyBuffer, connectionString + (keyIndex + KEY_LENGTH), keyBuffer.getLength());
+    _tokenExpires = cache.expires;
+    StringBuffer username, password;
+    if (!buildHubCredentials(_hubHostName, _hub.device_id, cache.signature, cache.expires, username, password))
+        return false;
 
-    StringBuffer hostURLEncoded(hostName);
-    hostURLEncoded.urlEncode();
+    // The username and password (a SAS token) are never logged
+    CLOG(HUB_CONNECTING, _hubHostName, _hub.device_id);
+    CLOG(MQTT_SETUP);
+    _wifiClient.setX509Time(time(NULL));
+    _wifiClient.setTrustAnchors(getTrustAnchors());
 
-    // size_t expires = time(NULL) + AUTH_EXPIRES;
-    size_t expires = time(NULL) + AUTH_EXPIRES;
-    Log.trace("Expires time is %ld" CR, expires);
+    this->_isHubConnected = false;
+    int maxAttempts = fromCache ? 1 : attempts;
+    for (int attempt = 1; !_mqttClient.connected(); attempt++)
+    {
+        // The TLS connection is made first so the handshake can be timed,
+        // the MQTT transport then takes it over
+        uint32_t startedMs = millis();
+        bool connected = _wifiClient.connect(_hubHostName, AZURE_MQTT_SERVER_PORT);
+        if (connected)
+        {
+            Metrics.set(METRIC_TLS_HANDSHAKE_MS, millis() - startedMs);
+            if (_isDeviceIdentity)
+                BootProfile.mark(BOOT_PHASE_TLS);
+            connected = _mqttClient.connect(_wifiClient, _hubHostName, AZURE_MQTT_SERVER_PORT, _hub.device_id, *username,
+                                            *password, cleanSession);
+        }
 
-    StringBuffer stringToSign(hostURLEncoded.getLength() + 128);
-    StringBuffer deviceIdEncoded(deviceId);
-    deviceIdEncoded.urlEncode();
+        if (connected)
+        {
+            Metrics.increment(METRIC_HUB_CONNECTS);
+            if (_isDeviceIdentity)
+                BootProfile.mark(BOOT_PHASE_MQTT);
+            CLOG(MQTT_CONNECTED);
+            break;
+        }
+        Metrics.increment(METRIC_HUB_CONNECT_FAILURES);
 
-    size_t keyLength = snprintf(*stringToSign, stringToSign.getLength(), "%s%s%s\n%zu000",
-                                *hostURLEncoded, "%2Fdevices%2F", *deviceIdEncoded, expires);
-    stringToSign.setLength(keyLength);
+        if (attempt >= maxAttempts)
+        {
+            CLOG(MQTT_CONNECT_FAILED, _mqttClient.state());
+            return false;
+        }
 
-    keyBuffer.base64Decode();
-    stringToSign.hash(*keyBuffer, keyBuffer.getLength());
-    if (!stringToSign.base64Encode() || !stringToSign.urlEncode())
-    {
-        Log.error("ERROR: stringToSign base64Encode / urlEncode has failed.");
-        return 1;
+        CLOG(MQTT_CONNECT_RETRY, _mqttClient.state());
+        delay(5000);
     }
+    this->_isHubConnected = true;
+    return true;
+}
 
-    StringBuffer passwordBuffer(512);
-    size_t passLength = snprintf(*passwordBuffer, 512,
-                                 "SharedAccessSignature sr=%s%s%s&sig=%s&se=%zu000",
-                                 *hostURLEncoded, "%2Fdevices%2F", *deviceIdEncoded, *stringToSign, expires);
+bool CentralduinoClass::connectForDutyCycle(const char *configFilePath)
+{
+    if (!CentralduinoConfig.loadConfig(configFilePath) || !WiFiConnection.connect(WIFI_CONNECT_TIMEOUT))
+        return false;
+    setIdentity(CentralduinoConfig.hub, true);
 
-    assert(passLength && passLength < 512);
-    passwordBuffer.setLength(passLength);
-    password.initialize(*passwordBuffer, passwordBuffer.getLength());
+    // Only a cold start has no clock to restore
+    if (!TimeService.isSynced())
+    {
+        TimeService.begin();
+        unsigned long startingMillis = millis();
+        while (!TimeService.isSynced() && millis() - startingMillis < DUTY_CYCLE_TIME_SYNC_TIMEOUT)
+        {
+            delay(10);
+            TimeService.loop();
+        }
+        if (!TimeService.isSynced())
+        {
+            CLOG(NO_TIME);
+            return false;
+        }
+    }
 
-    const char *usernameTemplate = "%s/%s/api-version=2016-11-14";
-    StringBuffer usernameBuffer((strlen(usernameTemplate) - 3 /* %s twice */) + hostName.getLength() + deviceId.getLength());
+    // Nothing else runs in a duty cycle, so it waits for the CONNACK here
+    // rather than find out after the samples were handed over
+    return connectToHub(DUTY_CYCLE_CONNECT_ATTEMPTS, true) && _mqttClient.flush(MQTT_SOCKET_TIMEOUT * 1000UL);
+}
 
-    size_t expLength = snprintf(*usernameBuffer, usernameBuffer.getLength(),
-                                usernameTemplate, *hostName, *deviceId);
-    assert(expLength <= usernameBuffer.getLength());
+size_t CentralduinoClass::appendCycleTime(char *json, size_t length, uint32_t cycleMs)
+{
+    if (length < 2 || cycleMs == 0)
+        return length;
 
-    username.initialize(*usernameBuffer, usernameBuffer.getLength());
+    // Replace the closing brace: {...} -> {...,"prev_cycle_ms":123}
+    return length - 1 + sprintf(json + length - 1, DUTY_CYCLE_FIELD "%lu}", (unsigned long)cycleMs);
+}
 
-    return 0;
+void CentralduinoClass::finishDutyCycle(uint32_t sleepSeconds, uint8_t samplesPerPublish)
+{
+    if (_mqttClient.connected())
+    {
+        // Publishes may still be queued
+        _mqttClient.flush(MQTT_SOCKET_TIMEOUT * 1000UL);
+        _mqttClient.disconnect();
+    }
+    DutyCycle.sleep(sleepSeconds, samplesPerPublish);
 }
 
 ///////////////////////////////////////////////////////////////////
@@ -21,33 +21,383 @@
 // See https://docs.platformio.org/en/latest/projectconf/section_env_build.html
 #include <PubSubClient.h>
 
+#include "mqtt_transport.h"
+#include "async_mqtt_transport.h"
+#include "c2d_message.h"
+#include "config.h"
+#include "ota_update.h"
+#include "rule_engine.h"
 #include "string_buffer.h"
+#include "telemetry_schema.h"
+#include "sample_block.h"
+#include "duty_cycle.h"
+#include "scheduler.h"
+#include "binary_log.h"
+
+// Multi-threaded targets (the Linux host build, RTOS ports) can move the
+// hub connection to a network worker thread: the application thread only
+// queues encoded messages and handles what the worker queues back (direct
+// methods, twin responses, onHubConnected()), so a slow TLS write never
+// holds up sampling. Publishing never blocks the application thread; a
+// full queue fails the publish instead. Build with
+// -DCENTRALDUINO_NETWORK_WORKER (and -pthread).
+#ifdef CENTRALDUINO_NETWORK_WORKER
+#ifdef ARDUINO_ARCH_ESP8266
+#error "The network worker needs threads, the ESP8266 core has none"
+#endif
+#ifdef CENTRALDUINO_PROFILING
+#error "The profiler can't time two threads, build without CENTRALDUINO_PROFILING"
+#endif
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "network_worker.h"
+#endif
+
+#define HUB_HOST_MAX_LEN 128
+#define HUB_TOPIC_MAX_LEN (HUB_DEVID_MAX_LEN + 32)
+
+#ifndef MAX_REGISTERED_METHODS
+#define MAX_REGISTERED_METHODS 10
+#endif
+
+// Deferred direct methods (see registerDeferredMethod()) in flight at once
+#ifndef MAX_PENDING_METHODS
+#define MAX_PENDING_METHODS 4
+#endif
+
+// A deferred method not completed in time is answered with a 504. IoT Hub
+// waits 30 s for the answer unless the caller asked for longer (up to 300 s),
+// so the default answers before the caller gives up.
+#ifndef METHOD_TIMEOUT
+#define METHOD_TIMEOUT 25000 // ms
+#endif
+#define METHOD_MAX_TIMEOUT 295000 // ms, under the hub's limit
+
+#define METHOD_RID_MAX_LEN 24
+
+// What a deferred method's callback returns to answer later
+#define METHOD_PENDING 0
+
+// Alert rules come from this desired property, an object of named rules
+// (see rule_engine.h), e.g. {"rules": {"overheat": "temp > 40 for 60s"}}
+#define RULES_PROPERTY "rules"
+
+// How often the summary of the recorded samples is sent (e.g. 900000 for
+// every 15 minutes), 0 to never send it
+#ifndef RULE_SUMMARY_INTERVAL
+#define RULE_SUMMARY_INTERVAL 0 // ms
+#endif
+
+// Firmware updates (see enableOta()) are started from this desired property
+// or the direct method of the same name, both taking
+// {"version": "1.2", "url": "https://...", "size": 412345, "sha256": "<hex>"}.
+// The progress is reported in the reported property of the same name.
+#define OTA_PROPERTY "ota"
+
+// Time for the last progress report to go out before restarting into the
+// new firmware
+#ifndef OTA_RESTART_DELAY
+#define OTA_RESTART_DELAY 3000 // ms
+#endif
+
+// An instance that fails to connect (DPS, TLS, or MQTT until the hub has
+// accepted it and its subscriptions) waits this long
+// before trying again, doubled after each failure in a row up to
+// HUB_RETRY_MAX_INTERVAL, so a bad identity or an unreachable hub doesn't
+// hold up the others or hammer DPS
+#ifndef HUB_RETRY_INTERVAL
+#define HUB_RETRY_INTERVAL 5000 // ms
+#endif
+#ifndef HUB_RETRY_MAX_INTERVAL
+#define HUB_RETRY_MAX_INTERVAL 300000 // ms
+#endif
+
+// Connect with a persistent session (cleanSession=false), so the hub keeps
+// the subscriptions and queued cloud-to-device messages across reconnects.
+// Set to 0 for a broker that doesn't keep sessions. Battery mode always
+// connects with a clean session, it never subscribes.
+#ifndef MQTT_PERSISTENT_SESSION
+#define MQTT_PERSISTENT_SESSION 1
+#endif
+
+// The hub connection goes through AsyncMqttTransport, which never waits on
+// the link. Define CENTRALDUINO_MQTT_PUBSUBCLIENT for the blocking
+// PubSubClient instead (the host builds do, their fakes are built on it).
+#ifdef CENTRALDUINO_MQTT_PUBSUBCLIENT
+typedef PubSubTransport HubMqttTransport;
+#else
+typedef AsyncMqttTransport HubMqttTransport;
+#endif
 
 typedef std::function<bool()> MethodCallbackFunctionType;
+typedef std::function<void()> ConnectedCallbackType;
+
+// Identifies a deferred method call until it is answered
+typedef uint16_t MethodToken;
+// Gets the request payload. Returns a status (200, 400...) to answer at
+// once, or METHOD_PENDING to answer later with completeMethod(token).
+typedef std::function<int(MethodToken token, const uint8_t *payload, size_t length)> DeferredMethodCallbackType;
+
+typedef struct tagMethodRegistration
+{
+    const char *name;
+    MethodCallbackFunctionType callback;
+    DeferredMethodCallbackType deferred; // instead of callback
+    uint32_t timeoutMs;
+} MethodRegistrationEntry;
+
+typedef struct tagPendingMethod
+{
+    MethodToken token; // 0 when the slot is free
+    uint8_t method;    // in the registry
+    uint32_t deadlineMs;
+    char rid[METHOD_RID_MAX_LEN];
+} PendingMethod;
+
+static_assert(MAX_PENDING_METHODS <= 16, "Method tokens keep the slot in 4 bits");
+
+// Wire format of telemetry messages. The content type is sent as the $.ct
+// system property so hub message routing can tell them apart.
+enum TelemetryEncoding
+{
+    TELEMETRY_ENCODING_JSON,
+    TELEMETRY_ENCODING_CBOR
+};
 
 // Public API functions here
+//
+// Centralduino is the device's own identity. A gateway creates one more
+// instance per leaf device and calls begin() on each after
+// Centralduino.setup() (or without it, on a host whose network is already
+// up). Every instance has its own MQTT connection, credentials, topics and
+// direct methods; the WiFi connection, clock, scheduler and TLS trust
+// anchors are shared, and loop() on any instance services all of them.
+// The boot profile, crash reports, metrics and the RTC hub cache belong to
+// the device identity only.
 class CentralduinoClass
 {
   public:
+    CentralduinoClass();
+    ~CentralduinoClass();
+    CentralduinoClass(const CentralduinoClass &) = delete;
+    CentralduinoClass &operator=(const CentralduinoClass &) = delete;
+
     void setup(const char* configFilePath);
-    void sendMeasurement(const char *name, double value);
+    // Gateway mode, connects this instance as another device (see above).
+    // Give the hub if it is already known to skip the DPS lookup.
+    void begin(const _HubConfig &identity, const char *hubHostName = NULL);
+    // Disconnects and stops servicing this instance
+    void end();
+    // sampledAtMs is a TimeService.monotonicMs() timestamp taken when the value
+    // was sampled; it is sent as iothub-creation-time-utc. 0 means now.
+    void sendMeasurement(const char *name, double value, uint64_t sampledAtMs = 0);
+    // Checks a sample against the alert rules and adds it to the periodic
+    // summary without sending it. sendMeasurement() and sendTelemetry() do
+    // the same for what they send.
+    void recordSample(const char *name, double value, uint64_t sampledAtMs = 0);
     void registerDeviceMethod(const char *name, MethodCallbackFunctionType callback);
+    // For methods that take a while (a calibration, a flash erase): the
+    // callback starts the work and returns METHOD_PENDING, and loop() keeps
+    // running meanwhile. The answer goes out when completeMethod() is called
+    // with the token, or as a 504 after timeoutMs (at most METHOD_MAX_TIMEOUT).
+    void registerDeferredMethod(const char *name, DeferredMethodCallbackType callback,
+                                uint32_t timeoutMs = METHOD_TIMEOUT);
+    // Answers a deferred method. False if it had already timed out or the
+    // answer couldn't be sent.
+    bool completeMethod(MethodToken token, int status, const char *response = "{}");
+    // Firmware updates over the air (see ota_update.h), for the device
+    // identity. currentVersion is the version of the running firmware, the
+    // one the images are tagged with: a request for another version
+    // downloads it, checks its hash and restarts into it. trustAnchors are
+    // the CAs of the servers the images come from, kept by the caller; with
+    // NULL only http:// images are taken.
+    void enableOta(const char *currentVersion, const BearSSL::X509List *trustAnchors);
     void loop();
+    // loop() without the sleep, for hosts with their own event loop.
+    // Returns how long (in ms) the caller can wait before the next call.
+    uint32_t poll();
     void sendProperty(const char *name, const char *value );
 
+    // Called every time the hub connection is (re)established, once the hub
+    // has accepted it and acknowledged the subscriptions (or kept them in
+    // its session), so commands can arrive. The connection is made from loop() as
+    // soon as the clock has been set, so setup() doesn't block on NTP.
+    void onHubConnected(ConnectedCallbackType callback);
+
+    // Cloud-to-device messages, streamed so they can be much larger than
+    // MQTT_MAX_PACKET_SIZE. start gets the decoded properties and length
+    // and returns false to discard the message. data gets the payload as it
+    // is read and returns how much it took: taking less holds the rest on
+    // the connection (and the hub waits) until the next loop(). end says
+    // whether it all arrived. Messages over maxLength are discarded. With
+    // PubSubClient or the network worker they come whole, up to
+    // MQTT_MAX_PACKET_SIZE, and what data doesn't take is dropped.
+    void onCloudMessage(C2dStartCallback start, C2dDataCallback data, C2dEndCallback end,
+                        uint32_t maxLength = C2D_MAX_MESSAGE_SIZE);
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Stops the network worker (started by setup() or begin()), for a
+    // clean exit; nothing is sent or received after it
+    static void stopNetworkWorker();
+#endif
+
+    // Sends a message declared with TELEMETRY_SCHEMA (see telemetry_schema.h)
+    template <typename T>
+    void sendTelemetry(const T &telemetry, TelemetryEncoding encoding = TELEMETRY_ENCODING_JSON,
+                       uint64_t sampledAtMs = 0)
+    {
+        uint32_t sampledAt = sampleTimeMs(sampledAtMs);
+        telemetry.forEachValue([this, sampledAt](const char *name, float value) {
+            _rules.record(name, value, sampledAt);
+        });
+
+        if (encoding == TELEMETRY_ENCODING_CBOR)
+        {
+            uint8_t buffer[T::MAX_CBOR_LENGTH];
+            size_t length = telemetry.toCbor(buffer, sizeof(buffer));
+            publishTelemetry(buffer, length, encoding, sampleTimeToUtc(sampledAtMs));
+        }
+        else
+        {
+            char buffer[T::MAX_JSON_LENGTH + 1];
+            size_t length = telemetry.toJson(buffer, sizeof(buffer));
+            publishTelemetry((const uint8_t *)buffer, length, encoding, sampleTimeToUtc(sampledAtMs));
+        }
+    }
+
+    // Sends a compressed block of samples as {"name": <block>}. The block is
+    // base64 encoded for JSON and sent as a byte string for CBOR.
+    bool sendSampleBlock(const char *name, SampleBlockEncoder &block, TelemetryEncoding encoding = TELEMETRY_ENCODING_JSON);
+
+    // Battery mode, call it from setup() instead of setup(configFilePath).
+    // Every wake takes one sample, queues it in RTC memory and every
+    // samplesPerPublish wakes connects straight to the cached hub, publishes
+    // the queue and goes back to deep sleep (wire GPIO16 to RST). No
+    // subscriptions, twin or callbacks. Each message carries the
+    // wake-to-sleep time of the cycle before it. Never returns.
+    template <typename T>
+    void runDutyCycle(const char *configFilePath, void (*sample)(T &telemetry), uint32_t sleepSeconds,
+                      uint8_t samplesPerPublish = 1)
+    {
+        static_assert(sizeof(T) + DUTY_CYCLE_RECORD_OVERHEAD <= DUTY_CYCLE_PENDING_BYTES,
+                      "Telemetry struct is too large to queue in RTC memory");
+
+        DutyCycle.begin();
+        T telemetry;
+        sample(telemetry);
+        DutyCycle.queueSample(&telemetry, sizeof(telemetry));
+
+        if (DutyCycle.canPublish(samplesPerPublish) && connectForDutyCycle(configFilePath))
+        {
+            uint64_t sampledAtUtcMs;
+            uint32_t previousCycleMs;
+            while (DutyCycle.peekSample(&telemetry, sizeof(telemetry), sampledAtUtcMs, previousCycleMs))
+            {
+                char buffer[T::MAX_JSON_LENGTH + DUTY_CYCLE_FIELD_MAX_LENGTH + 1];
+                size_t length = telemetry.toJson(buffer, sizeof(buffer));
+                length = appendCycleTime(buffer, length, previousCycleMs);
+                if (!publishTelemetry((const uint8_t *)buffer, length, TELEMETRY_ENCODING_JSON, sampledAtUtcMs))
+                    break;
+                DutyCycle.popSample(sizeof(telemetry));
+            }
+        }
+        finishDutyCycle(sleepSeconds, samplesPerPublish);
+    }
+
   private:
+    static void startServices();
+    void setIdentity(const _HubConfig &identity, bool isDeviceIdentity);
+    bool mqttPublish(const char *topic, const uint8_t *payload, size_t length);
+    bool mqttPublish(const char *topic, const char *payload);
+    bool isHubOnline();
+    void handleIncomingMessage(char *topic, byte *data, unsigned int length);
+    void handleIncomingDirectMethod(char *methodName, byte *data, unsigned int length, char *rid);
+    MethodRegistrationEntry *addMethod(const char *name);
+    void startDeferredMethod(uint8_t method, const char *rid, byte *data, unsigned int length);
+    bool sendMethodResponse(const char *rid, int status, const char *response);
+    void expirePendingMethods();
+    bool publishTelemetry(const uint8_t *payload, size_t length, TelemetryEncoding encoding, uint64_t creationTimeUtcMs);
+    uint64_t sampleTimeToUtc(uint64_t sampledAtMs);
+    uint32_t sampleTimeMs(uint64_t sampledAtMs);
+    void applyDesiredProperties(byte *data, unsigned int length, bool isWholeTwin);
+    void applyRules(JsonObject rules, bool isWholeTwin);
+    void publishAlert(const Rule &rule, const char *stream, bool raised, float value);
+    void publishRuleSummary();
+    int startOta(JsonObject request, bool isFromTwin);
+    void publishOtaReport(const char *json, size_t length);
+    bool connectToHub(int attempts, bool cleanSession);
+    bool connectToAssignedHub(int attempts, bool cleanSession, bool &fromCache);
+    bool connectForDutyCycle(const char *configFilePath);
+    size_t appendCycleTime(char *json, size_t length, uint32_t cycleMs);
+    void finishDutyCycle(uint32_t sleepSeconds, uint8_t samplesPerPublish);
     void sendTwinUpdateRequest();
+    int nextRid();
+    void handleHubConnected();
+    void reportBootProfile();
+    void reportCrash();
     void ensureWiFiConnected();
-    void syncNtpTime();
     void ensureHubConnected();
+    void scheduleHubRetry();
+    void forgetHub();
     void registerCallbacks();
-    int getUsernameAndPasswordFromConnectionString(const char *connectionString, size_t connectionStringLength,
-                                                                      StringBuffer &hostName, StringBuffer &deviceId,
-                                                                      StringBuffer &username, StringBuffer &password);
+    void startHubSession();
+    void checkHubSession();
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    static void runNetworkWorker();
+    bool serviceNetwork();
+    void dispatchInbound();
+#endif
 
   private:
+    HubMqttTransport _mqttClient;
+    WiFiClientSecure _wifiClient;
+    _HubConfig _hub;
+    bool _isDeviceIdentity;
+    bool _isStarted;
     bool _isHubConnected;
-    StaticJsonDocument<1024> _jsonDocument;
+    bool _isOtaEnabled;
+    ConnectedCallbackType _connectedCallback;
+    C2dReceiver _c2d;
+    RuleEngine _rules;
+    MethodRegistrationEntry _methodRegistry[MAX_REGISTERED_METHODS];
+    uint8_t _methodCount;
+    PendingMethod _pendingMethods[MAX_PENDING_METHODS];
+    uint16_t _methodSerial;
+    uint16_t _ridSerial; // $rid of the last reported property update, 0 is the twin GET
+
+    // Topics with the device id filled in
+    char _telemetryTopic[HUB_TOPIC_MAX_LEN];
+    char _deviceBoundTopic[HUB_TOPIC_MAX_LEN];
+
+    char _hubHostName[HUB_HOST_MAX_LEN];
+    uint32_t _tokenExpires;
+    uint32_t _tokenRefreshAt; // time(), 0 when not connected
+    uint32_t _retryAtMs;
+    uint8_t _connectFailures; // in a row
+
+    // Reconnects skip the subscriptions if the hub kept the session
+    bool _hasSession;         // subscribed on a persistent session before
+    bool _isResumePending;    // waiting for the CONNACK to say if it still has it
+    bool _isReadyPending;     // waiting for the SUBACKs
+    uint32_t _connectStartedMs;
+
+    // Instances serviced by loop()
+    static CentralduinoClass *_first;
+    CentralduinoClass *_next;
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    WorkerQueue _outbound; // application -> worker
+    WorkerQueue _inbound;  // worker -> application
+    std::atomic<bool> _isOnline;
+
+    static std::thread *_worker;
+    static std::atomic<bool> _isWorkerRunning;
+    static std::mutex _instancesLock; // the instance list and everything the worker uses of them
+    static CentralduinoClass *_connecting; // connected by the worker without the lock
+    static std::condition_variable _connectDone;
+#endif
 };
 
 // Declare the global singleton
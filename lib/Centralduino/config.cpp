@@ -1,54 +1,239 @@
 #include "config.h"
 #include <FS.h>
 #include <ArduinoJson.h>
-#include <ArduinoLog.h>
+#include <spi_flash.h>
 
-bool CentralduinoConfigClass::loadConfig(const char *path)
+#include "binary_log.h"
+#include "crc32.h"
+
+#if CONFIG_IMAGE_ENABLED
+// The image lives in the sector the EEPROM library would use
+extern "C" uint32_t _EEPROM_start;
+#define CONFIG_IMAGE_SECTOR (((uintptr_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE)
+
+typedef struct tagConfigImageHeader
 {
-    DynamicJsonDocument doc(2048);
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length; // of the whole image, catches layout changes
+    uint32_t sourceSize;
+    uint32_t sourceCrc;
+} ConfigImageHeader;
+
+// Header, networks, network count, hub, then the CRC of all of it
+#define CONFIG_IMAGE_LENGTH (sizeof(ConfigImageHeader) + sizeof(CentralduinoConfig.networks) + 4 + \
+                             sizeof(CentralduinoConfig.hub) + 4)
+
+static_assert(sizeof(_NetworkConfig) % 4 == 0 && sizeof(_HubConfig) % 4 == 0,
+              "Config image sections must be whole flash words");
+static_assert(CONFIG_IMAGE_LENGTH <= SPI_FLASH_SEC_SIZE, "Config image doesn't fit a flash sector");
+
+// Flash is read and written in aligned words, so everything goes through
+// a small word buffer
+static bool readImage(uint32_t &address, void *data, size_t size, uint32_t &crc)
+{
+    uint32_t buffer[16];
+    uint8_t *bytes = (uint8_t *)data;
+    while (size > 0)
+    {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (!ESP.flashRead(address, buffer, chunk))
+            return false;
+
+        memcpy(bytes, buffer, chunk);
+        crc = crc32Update(crc, buffer, chunk);
+        address += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool writeImage(uint32_t &address, const void *data, size_t size, uint32_t &crc)
+{
+    uint32_t buffer[16];
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (size > 0)
+    {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        memcpy(buffer, bytes, chunk);
+        if (!ESP.flashWrite(address, buffer, chunk))
+            return false;
+
+        crc = crc32Update(crc, buffer, chunk);
+        address += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static uint32_t hashFile(File &file)
+{
+    uint8_t buffer[64];
+    uint32_t crc = 0;
+    size_t length;
+    while ((length = file.read(buffer, sizeof(buffer))) > 0)
+        crc = crc32Update(crc, buffer, length);
+    return crc;
+}
+
+bool CentralduinoConfigClass::loadImage(uint32_t sourceSize, uint32_t sourceCrc)
+{
+    uint32_t address = CONFIG_IMAGE_SECTOR * SPI_FLASH_SEC_SIZE;
+    uint32_t crc = 0;
+
+    ConfigImageHeader header;
+    if (!readImage(address, &header, sizeof(header), crc) || header.magic != CONFIG_IMAGE_MAGIC ||
+        header.version != CONFIG_IMAGE_VERSION || header.length != CONFIG_IMAGE_LENGTH ||
+        header.sourceSize != sourceSize || header.sourceCrc != sourceCrc)
+        return false;
+
+    uint32_t count;
+    if (!readImage(address, networks, sizeof(networks), crc) || !readImage(address, &count, sizeof(count), crc) ||
+        !readImage(address, &hub, sizeof(hub), crc))
+        return false;
+
+    uint32_t expectedCrc = crc;
+    uint32_t storedCrc;
+    if (!readImage(address, &storedCrc, sizeof(storedCrc), crc) || storedCrc != expectedCrc ||
+        count == 0 || count > NET_MAX_NETWORKS)
+        return false;
+
+    networkCount = count;
+    return true;
+}
+
+void CentralduinoConfigClass::saveImage(uint32_t sourceSize, uint32_t sourceCrc)
+{
+    uint32_t address = CONFIG_IMAGE_SECTOR * SPI_FLASH_SEC_SIZE;
+    uint32_t crc = 0;
+
+    ConfigImageHeader header;
+    header.magic = CONFIG_IMAGE_MAGIC;
+    header.version = CONFIG_IMAGE_VERSION;
+    header.length = CONFIG_IMAGE_LENGTH;
+    header.sourceSize = sourceSize;
+    header.sourceCrc = sourceCrc;
+    uint32_t count = networkCount;
 
+    if (!ESP.flashEraseSector(CONFIG_IMAGE_SECTOR) ||
+        !writeImage(address, &header, sizeof(header), crc) ||
+        !writeImage(address, networks, sizeof(networks), crc) ||
+        !writeImage(address, &count, sizeof(count), crc) ||
+        !writeImage(address, &hub, sizeof(hub), crc))
+    {
+        CLOG(CONFIG_IMAGE_WRITE_FAILED);
+        return;
+    }
+
+    uint32_t imageCrc = crc;
+    writeImage(address, &imageCrc, sizeof(imageCrc), crc);
+}
+#endif
+
+bool CentralduinoConfigClass::loadConfig(const char *path)
+{
     if (!SPIFFS.begin())
     {
-        Log.error("Failed to mount SPIFFS filesystem. Unable to continue." CR);
+        CLOG(SPIFFS_MOUNT_FAILED);
         return false;
     }
 
     if (!SPIFFS.exists(path))
     {
-        Log.error("Config file not found in SPIFFS! Unable to continue." CR);
+        CLOG(CONFIG_NOT_FOUND);
         return false;
     }
 
     File file = SPIFFS.open(path, "r");
+
+#if CONFIG_IMAGE_ENABLED
+    // Only parse the JSON again when it changed
+    uint32_t sourceSize = file.size();
+    uint32_t sourceCrc = hashFile(file);
+    if (loadImage(sourceSize, sourceCrc))
+    {
+        CLOG(CONFIG_FROM_IMAGE);
+        file.close();
+        return true;
+    }
+
+    file.seek(0);
+#endif
+
+    bool parsed = parseConfig(file);
+    file.close();
+
+#if CONFIG_IMAGE_ENABLED
+    if (parsed)
+        saveImage(sourceSize, sourceCrc);
+#endif
+
+    return parsed;
+}
+
+bool CentralduinoConfigClass::parseConfig(File &file)
+{
+    DynamicJsonDocument doc(2048);
     DeserializationError error = deserializeJson(doc, file);
 
     if (error)
     {
-        Log.error("Failed to read config file. Unable to continue." CR);
+        CLOG(CONFIG_READ_FAILED);
         return false;
     }
 
-    strlcpy(network.ssid, doc["network"]["ssid"], sizeof(network.ssid));
-    strlcpy(network.password, doc["network"]["password"], sizeof(network.password));
+    // "network" is either a single {ssid, password} or a list of them
+    networkCount = 0;
+    if (doc["network"].is<JsonArray>())
+    {
+        for (JsonVariant network : doc["network"].as<JsonArray>())
+            loadNetwork(network);
+    }
+    else
+    {
+        loadNetwork(doc["network"]);
+    }
+
+    if (networkCount == 0)
+    {
+        CLOG(CONFIG_NO_NETWORK);
+        return false;
+    }
 
     strlcpy(hub.device_id, doc["hub"]["device_id"], sizeof(hub.device_id));
     strlcpy(hub.scope_id, doc["hub"]["scope_id"], sizeof(hub.scope_id));
     strlcpy(hub.sas_key, doc["hub"]["sas_key"], sizeof(hub.sas_key));
 
-    file.close();
-
     return true;
 }
 
+void CentralduinoConfigClass::loadNetwork(JsonVariant network)
+{
+    if (networkCount == NET_MAX_NETWORKS)
+    {
+        CLOG(CONFIG_TOO_MANY_NETWORKS, NET_MAX_NETWORKS);
+        return;
+    }
+
+    strlcpy(networks[networkCount].ssid, network["ssid"], sizeof(networks[networkCount].ssid));
+    strlcpy(networks[networkCount].password, network["password"], sizeof(networks[networkCount].password));
+    networkCount++;
+}
+
 void CentralduinoConfigClass::dumpConfigToLog()
 {
-    Log.trace("*** BEGIN CONFIG ***" CR);
-    Log.trace("network.ssid: %s" CR, network.ssid);
-    Log.trace("network.password: %s" CR, network.password);
-    Log.trace("hub.device_id: %s" CR, hub.device_id);
-    Log.trace("hub.scope_id: %s" CR, hub.scope_id);
-    Log.trace("hub.sas_key: %s" CR, hub.sas_key);
-    Log.trace("*** END CONFIG ***" CR);
+    CLOG(CONFIG_BEGIN);
+    for (uint8_t i = 0; i < networkCount; i++)
+    {
+        CLOG(CONFIG_SSID, (int)i, networks[i].ssid);
+        CLOG(CONFIG_PASSWORD, (int)i, *networks[i].password ? "(set)" : "(empty)");
+    }
+    CLOG(CONFIG_DEVICE_ID, hub.device_id);
+    CLOG(CONFIG_SCOPE_ID, hub.scope_id);
+    CLOG(CONFIG_SAS_KEY, *hub.sas_key ? "(set)" : "(empty)");
+    CLOG(CONFIG_END);
 }
 
 // Allocate the singleton
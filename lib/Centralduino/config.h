@@ -1,8 +1,12 @@
 #ifndef __CONFIG_H
 #define __CONFIG_H
 
+#include <ArduinoJson.h>
+#include <FS.h>
+
 #define NET_SSID_MAX_LEN    64
 #define NET_PASS_MAX_LEN    64
+#define NET_MAX_NETWORKS    4
 
 #define HUB_SCOPE_MAX_LEN   128
 #define HUB_DEVID_MAX_LEN   128
@@ -10,6 +14,18 @@
 
 // TODO - Check if these string lengths are reasonable
 
+// Set to 1 to keep the parsed config as a binary image, so config.json is
+// only parsed again when its size or CRC changes. The image takes the 4 KB
+// flash sector of the EEPROM library (_EEPROM_start, right after SPIFFS)
+// and overwrites whatever is there: leave it off if the sketch or anything
+// else uses EEPROM.
+#ifndef CONFIG_IMAGE_ENABLED
+#define CONFIG_IMAGE_ENABLED 0
+#endif
+
+#define CONFIG_IMAGE_MAGIC 0x47464343 // "CCFG"
+#define CONFIG_IMAGE_VERSION 1
+
 typedef struct _NetworkConfigStruct
 {
     char ssid[NET_SSID_MAX_LEN];
@@ -26,11 +42,18 @@ typedef struct _HubConfigStruct
 class CentralduinoConfigClass
 {
   public:
-    _NetworkConfig network;
+    _NetworkConfig networks[NET_MAX_NETWORKS];
+    uint8_t networkCount;
     _HubConfig hub;
 
     bool loadConfig(const char* path);
     void dumpConfigToLog();
+
+  private:
+    bool parseConfig(File &file);
+    void loadNetwork(JsonVariant network);
+    bool loadImage(uint32_t sourceSize, uint32_t sourceCrc);
+    void saveImage(uint32_t sourceSize, uint32_t sourceCrc);
 };
 
 // Declare the singleton
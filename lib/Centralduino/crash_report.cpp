@@ -0,0 +1,97 @@
+#include "crash_report.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "binary_log.h"
+
+static bool isCodeAddress(uint32_t value)
+{
+    // IRAM, then the memory mapped flash
+    return (value >= 0x40100000 && value < 0x40108000) || (value >= 0x40201000 && value < 0x40300000);
+}
+
+// Called by the core's postmortem handler on exceptions, software watchdog
+// resets and panics, before it prints the stack and restarts
+extern "C" void custom_crash_callback(struct rst_info *info, uint32_t stack, uint32_t stackEnd)
+{
+    CrashRecord record;
+    memset(&record, 0, sizeof(record));
+    record.reason = info->reason;
+    record.cause = info->exccause;
+    record.epc1 = info->epc1;
+    record.epc2 = info->epc2;
+    record.epc3 = info->epc3;
+    record.excvaddr = info->excvaddr;
+    record.depc = info->depc;
+    record.uptimeMs = millis();
+
+    size_t depth = 0;
+    const uint32_t *word = (const uint32_t *)(uintptr_t)stack;
+    for (size_t i = 0; i < CRASH_STACK_SCAN_WORDS && (uint32_t)(uintptr_t)word < stackEnd && depth < CRASH_STACK_DEPTH; i++, word++)
+    {
+        if (isCodeAddress(*word))
+            record.stack[depth++] = *word;
+    }
+
+    RtcStore.write(RTC_SLOT_CRASH, &record, sizeof(record));
+}
+
+void CrashReportClass::begin()
+{
+    _pending = RtcStore.read(RTC_SLOT_CRASH, &_record, sizeof(_record));
+
+    // The callback doesn't run on hardware watchdog resets, so a crash
+    // reset without a matching record is taken from the reset info
+    struct rst_info *info = ESP.getResetInfoPtr();
+    bool crashed = info->reason == REASON_WDT_RST || info->reason == REASON_EXCEPTION_RST || info->reason == REASON_SOFT_WDT_RST;
+    if (crashed && (!_pending || _record.reason != info->reason))
+    {
+        memset(&_record, 0, sizeof(_record));
+        _record.reason = info->reason;
+        _record.cause = info->exccause;
+        _record.epc1 = info->epc1;
+        _record.epc2 = info->epc2;
+        _record.epc3 = info->epc3;
+        _record.excvaddr = info->excvaddr;
+        _record.depc = info->depc;
+        RtcStore.write(RTC_SLOT_CRASH, &_record, sizeof(_record));
+        _pending = true;
+    }
+
+    if (_pending)
+        CLOG(CRASH_FOUND, _record.reason, _record.cause);
+}
+
+size_t CrashReportClass::toJson(char *buffer, size_t size)
+{
+    // Hex keeps the addresses recognizable, the sketch MD5 picks the ELF
+    int length = snprintf(buffer, size,
+                          "{\"crash\":{\"reason\":%u,\"cause\":%u,\"epc1\":\"0x%08x\",\"epc2\":\"0x%08x\",\"epc3\":\"0x%08x\","
+                          "\"excvaddr\":\"0x%08x\",\"depc\":\"0x%08x\",\"uptime_ms\":%u,\"sketch\":\"%s\",\"stack\":[",
+                          (unsigned)_record.reason, (unsigned)_record.cause, (unsigned)_record.epc1, (unsigned)_record.epc2,
+                          (unsigned)_record.epc3, (unsigned)_record.excvaddr, (unsigned)_record.depc,
+                          (unsigned)_record.uptimeMs, ESP.getSketchMD5().c_str());
+
+    for (size_t i = 0; i < CRASH_STACK_DEPTH && _record.stack[i] != 0; i++)
+    {
+        if (length <= 0 || (size_t)length >= size)
+            return 0;
+        length += snprintf(buffer + length, size - length, "%s\"0x%08x\"", i > 0 ? "," : "", (unsigned)_record.stack[i]);
+    }
+
+    if (length <= 0 || (size_t)length >= size)
+        return 0;
+    length += snprintf(buffer + length, size - length, "]}}");
+    return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+void CrashReportClass::clear()
+{
+    RtcStore.invalidate(RTC_SLOT_CRASH);
+    _pending = false;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+CrashReportClass CrashReport;
@@ -0,0 +1,63 @@
+#ifndef __CRASH_REPORT_H
+#define __CRASH_REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rtc_store.h"
+
+// Code addresses kept from the stack of a crash, innermost first
+#define CRASH_STACK_DEPTH 12
+
+// Stack words searched for them
+#define CRASH_STACK_SCAN_WORDS 1024
+
+#define CRASH_JSON_MAX_LENGTH 512
+
+typedef struct tagCrashRecord
+{
+    uint32_t reason; // rst_info.reason
+    uint32_t cause;  // rst_info.exccause
+    uint32_t epc1;
+    uint32_t epc2;
+    uint32_t epc3;
+    uint32_t excvaddr;
+    uint32_t depc;
+    uint32_t uptimeMs;
+    uint32_t stack[CRASH_STACK_DEPTH]; // 0 past the last one
+} CrashRecord;
+
+static_assert(sizeof(CrashRecord) <= RTC_SLOT_CAPACITY(RTC_SLOT_CRASH, RTC_SLOT_END),
+              "Crash record doesn't fit its RTC slot");
+
+// Keeps the last crash for upload after the reboot.
+//
+// The core's crash callback saves the exception registers and the code
+// addresses found on the stack (the return addresses a backtrace would
+// show) to RTC memory. Hardware watchdog resets don't run the callback, so
+// begin() records those from the reset info. The record stays in RTC
+// memory until it has been sent, so it survives further resets, and a
+// newer crash replaces it. symbolize.py at the repo root resolves the
+// addresses of many reports at once.
+class CrashReportClass
+{
+  public:
+    // Call early in setup()
+    void begin();
+
+    bool isPending() { return _pending; }
+
+    // Writes {"crash":{...}}, returns 0 if it doesn't fit
+    size_t toJson(char *buffer, size_t size);
+
+    // Call once the report has been sent
+    void clear();
+
+  private:
+    CrashRecord _record;
+    bool _pending;
+};
+
+extern CrashReportClass CrashReport;
+
+#endif // __CRASH_REPORT_H
@@ -0,0 +1,11 @@
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, as used by gzip and zip). Pass the previous result as
+// crc to checksum data in several pieces, starting from 0.
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length);
+
+#endif // __CRC32_H
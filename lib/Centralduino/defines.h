@@ -7,8 +7,25 @@
 #define KEY_STRING ";SharedAccessKey="
 #define KEY_LENGTH (sizeof(KEY_STRING) - 1)
 #define AUTH_EXPIRES 21600 // 6 hours
+#define AUTH_RENEW_MARGIN 600 // sign a new token when the cached one has less left
+#define AUTH_REFRESH_MARGIN 300 // reconnect with a new token this long before the old one expires
+#define HUB_HOST_CACHE_LEN 64 // longer host names aren't cached, the hub domain below doesn't count
+#define HUB_HOST_DOMAIN ".azure-devices.net"
+#define HUB_SIGNATURE_LENGTH 32
+#define WIFI_CONNECT_TIMEOUT 30000 // ms
+#define DUTY_CYCLE_CONNECT_ATTEMPTS 2
+#define HUB_CHECK_INTERVAL 250 // ms
+#define METHOD_CHECK_INTERVAL 250 // ms, for deferred method timeouts
+#define TIME_SERVICE_INTERVAL 100 // ms
+#ifndef AZURE_MQTT_SERVER_PORT
 #define AZURE_MQTT_SERVER_PORT 8883
+#endif
+#ifndef CENTRALDUINO_STARTUP_DELAY
+#define CENTRALDUINO_STARTUP_DELAY 1000 // ms, time to attach a serial monitor
+#endif
+#ifndef AZURE_HTTPS_SERVER_PORT
 #define AZURE_HTTPS_SERVER_PORT 443
+#endif
 
 #define TO_STRING_(s) #s
 #define TO_STRING(s) TO_STRING_(s)
@@ -20,8 +37,16 @@
 "-msiotc"
 #define AZURE_IOT_CENTRAL_CLIENT_SIGNATURE "user-agent: iot-central-client/" AZIOTC_API_VERSION
 #define IOTC_SERVER_RESPONSE_TIMEOUT 20 // seconds
+#ifndef DEFAULT_ENDPOINT
 #define DEFAULT_ENDPOINT "global.azure-devices-provisioning.net"
+#endif
 
+// The ports, DPS endpoint and CA can be pointed at the stand-in server:
+// standin/make_certs.sh writes a header defining SSL_CA_PEM_DEF, given
+// here as -DCENTRALDUINO_CA_HEADER=\"standin_ca.h\"
+#ifdef CENTRALDUINO_CA_HEADER
+#include CENTRALDUINO_CA_HEADER
+#else
 /* Baltimore CA */
 #define SSL_CA_PEM_DEF                                                     \
     "-----BEGIN CERTIFICATE-----\r\n"                                      \
@@ -45,6 +70,30 @@
     "ksLi4xaNmjICq44Y3ekQEe5+NauQrz4wlHrQMz2nZQ/1/I6eYs9HRCwBXbsdtTLS\r\n" \
     "R9I4LtD+gdwyah617jzV/OeBHRnDJELqYzmp\r\n"                             \
     "-----END CERTIFICATE-----\r\n"
+#endif
 
 #define MEASUREMENT_TOPIC_FMT "devices/%s/messages/events/"
-#define PROPERTY_TOPIC_FMT "$iothub/twin/PATCH/properties/reported/?$rid=%d"
\ No newline at end of file
+// System properties appended to the measurement topic ($.ct content type, $.ce content encoding)
+#define JSON_CONTENT_TYPE "$.ct=application%2Fjson"
+#define CBOR_CONTENT_TYPE "$.ct=application%2Fcbor"
+#define UTF8_CONTENT_ENCODING "&$.ce=utf-8"
+#define GZIP_CONTENT_ENCODING "&$.ce=gzip"
+#define CREATION_TIME_PROPERTY "&iothub-creation-time-utc="
+
+// Telemetry payloads of at least this many bytes are gzip compressed when
+// that makes them smaller. Set to 0 to compile compression out (it keeps a
+// MQTT_MAX_PACKET_SIZE output buffer and the compressor's hash table in RAM).
+#ifndef TELEMETRY_COMPRESSION_THRESHOLD
+#define TELEMETRY_COMPRESSION_THRESHOLD 384
+#endif
+#define PROPERTY_TOPIC_FMT "$iothub/twin/PATCH/properties/reported/?$rid=%d"
+
+// The rules property of a desired properties document, filtered from the rest
+#define RULES_JSON_CAPACITY (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(RULE_MAX_RULES) + \
+                             RULE_MAX_RULES * (RULE_NAME_MAX_LEN + RULE_TEXT_MAX_LEN))
+
+// A firmware update request, from the ota direct method or desired property
+#define OTA_JSON_CAPACITY (JSON_OBJECT_SIZE(4) + OTA_URL_MAX_LEN + OTA_VERSION_MAX_LEN + 2 * HASH_LENGTH + 64)
+
+// The desired properties the client reads, filtered from the rest
+#define DESIRED_JSON_CAPACITY (RULES_JSON_CAPACITY + OTA_JSON_CAPACITY)
@@ -0,0 +1,112 @@
+#include "duty_cycle.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "binary_log.h"
+#include "time_service.h"
+
+#define UNKNOWN_SAMPLE_TIME 0xffffffff
+
+void DutyCycleClass::begin()
+{
+    _warmWake = RtcStore.read(RTC_SLOT_DUTY_CYCLE, &_state, sizeof(_state));
+    if (!_warmWake)
+    {
+        CLOG(DUTY_CYCLE_COLD_START);
+        memset(&_state, 0, sizeof(_state));
+        _state.radioOn = 1;
+        return;
+    }
+
+    _state.wakeCount++;
+    CLOG(DUTY_CYCLE_WAKE, (unsigned long)_state.wakeCount, (int)_state.pendingCount, (unsigned long)_state.lastCycleMs);
+
+    // The RTC timer kept running while we slept; SNTP corrects the rest
+    if (_state.utcMsAtSleep != 0)
+        TimeService.restore(_state.utcMsAtSleep + _state.sleepMs + TimeService.monotonicMs());
+}
+
+bool DutyCycleClass::canPublish(uint8_t samplesPerPublish)
+{
+    return _state.radioOn && (!_warmWake || _state.pendingCount >= samplesPerPublish);
+}
+
+bool DutyCycleClass::queueSample(const void *sample, size_t size)
+{
+    size_t recordLength = DUTY_CYCLE_RECORD_OVERHEAD + size;
+    if (recordLength > DUTY_CYCLE_PENDING_BYTES)
+        return false;
+
+    while (_state.pendingLength + recordLength > DUTY_CYCLE_PENDING_BYTES)
+    {
+        CLOG(DUTY_CYCLE_QUEUE_FULL);
+        popSample(size);
+    }
+
+    uint32_t offset = UNKNOWN_SAMPLE_TIME;
+    uint64_t now = TimeService.isSynced() ? TimeService.nowUtcMs() : 0;
+    if (now != 0)
+    {
+        if (_state.pendingCount == 0 || _state.pendingBaseUtcMs == 0)
+            _state.pendingBaseUtcMs = now;
+        if (now >= _state.pendingBaseUtcMs &&
+            now - _state.pendingBaseUtcMs < UNKNOWN_SAMPLE_TIME)
+            offset = (uint32_t)(now - _state.pendingBaseUtcMs);
+    }
+
+    uint16_t previousCycleMs = _state.lastCycleMs > 0xffff ? 0xffff : (uint16_t)_state.lastCycleMs;
+
+    uint8_t *record = _state.pending + _state.pendingLength;
+    memcpy(record, &offset, 4);
+    memcpy(record + 4, &previousCycleMs, 2);
+    memcpy(record + DUTY_CYCLE_RECORD_OVERHEAD, sample, size);
+    _state.pendingLength += recordLength;
+    _state.pendingCount++;
+    return true;
+}
+
+bool DutyCycleClass::peekSample(void *sample, size_t size, uint64_t &sampledAtUtcMs, uint32_t &previousCycleMs)
+{
+    if (_state.pendingCount == 0 || _state.pendingLength < DUTY_CYCLE_RECORD_OVERHEAD + size)
+        return false;
+
+    uint32_t offset;
+    uint16_t cycleMs;
+    memcpy(&offset, _state.pending, 4);
+    memcpy(&cycleMs, _state.pending + 4, 2);
+    memcpy(sample, _state.pending + DUTY_CYCLE_RECORD_OVERHEAD, size);
+
+    sampledAtUtcMs = offset == UNKNOWN_SAMPLE_TIME ? 0 : _state.pendingBaseUtcMs + offset;
+    previousCycleMs = cycleMs;
+    return true;
+}
+
+void DutyCycleClass::popSample(size_t size)
+{
+    size_t recordLength = DUTY_CYCLE_RECORD_OVERHEAD + size;
+    if (_state.pendingCount == 0 || _state.pendingLength < recordLength)
+        return;
+
+    memmove(_state.pending, _state.pending + recordLength, _state.pendingLength - recordLength);
+    _state.pendingLength -= recordLength;
+    _state.pendingCount--;
+}
+
+void DutyCycleClass::sleep(uint32_t sleepSeconds, uint8_t samplesPerPublish)
+{
+    _state.lastCycleMs = millis();
+    _state.sleepMs = sleepSeconds * 1000;
+    _state.utcMsAtSleep = TimeService.isSynced() ? TimeService.nowUtcMs() : 0;
+
+    // The next wake adds one more sample to the queue
+    _state.radioOn = _state.pendingCount + 1 >= samplesPerPublish;
+    RtcStore.write(RTC_SLOT_DUTY_CYCLE, &_state, sizeof(_state));
+
+    CLOG(DUTY_CYCLE_SLEEP, (unsigned long)_state.lastCycleMs, (unsigned long)sleepSeconds);
+    ESP.deepSleep((uint64_t)sleepSeconds * 1000000, _state.radioOn ? WAKE_RF_DEFAULT : WAKE_RF_DISABLED);
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+DutyCycleClass DutyCycle;
@@ -0,0 +1,67 @@
+#ifndef __DUTY_CYCLE_H
+#define __DUTY_CYCLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rtc_store.h"
+
+// Room for queued samples in RTC memory. Each one takes
+// DUTY_CYCLE_RECORD_OVERHEAD bytes plus the size of the telemetry struct.
+#define DUTY_CYCLE_PENDING_BYTES 96
+#define DUTY_CYCLE_RECORD_OVERHEAD 6
+
+// How long a cold boot may wait for NTP before giving up and sleeping
+#define DUTY_CYCLE_TIME_SYNC_TIMEOUT 10000 // ms
+
+// Appended to every published sample: wake-to-sleep time of the cycle before it
+#define DUTY_CYCLE_FIELD ",\"prev_cycle_ms\":"
+#define DUTY_CYCLE_FIELD_MAX_LENGTH (sizeof(DUTY_CYCLE_FIELD) - 1 + 10)
+
+typedef struct tagDutyCycleState
+{
+    uint64_t utcMsAtSleep;     // 0 if the clock was never set
+    uint64_t pendingBaseUtcMs; // sample times are stored relative to this
+    uint32_t sleepMs;
+    uint32_t lastCycleMs;
+    uint32_t wakeCount;
+    uint16_t pendingCount;
+    uint16_t pendingLength;
+    uint8_t radioOn;
+    uint8_t reserved[3];
+    uint8_t pending[DUTY_CYCLE_PENDING_BYTES];
+} DutyCycleState;
+
+static_assert(sizeof(DutyCycleState) <= RTC_SLOT_CAPACITY(RTC_SLOT_DUTY_CYCLE, RTC_SLOT_CRASH),
+              "Duty cycle state doesn't fit its RTC slot");
+
+// Wake -> sample -> publish -> deep sleep bookkeeping for battery nodes,
+// see CentralduinoClass::runDutyCycle(). Everything that has to survive
+// deep sleep lives in RTC memory; a power loss simply means a cold start.
+class DutyCycleClass
+{
+  public:
+    // Loads the state saved before sleeping and restores the clock from it
+    void begin();
+    bool isWarmWake() { return _warmWake; }
+
+    bool canPublish(uint8_t samplesPerPublish);
+
+    // Queues a sample taken now. Drops the oldest samples when full.
+    bool queueSample(const void *sample, size_t size);
+    bool peekSample(void *sample, size_t size, uint64_t &sampledAtUtcMs, uint32_t &previousCycleMs);
+    void popSample(size_t size);
+    uint16_t getPendingCount() { return _state.pendingCount; }
+
+    // Saves the state and goes to deep sleep. Never returns. The radio is
+    // only powered on the next wake if that wake is going to publish.
+    void sleep(uint32_t sleepSeconds, uint8_t samplesPerPublish);
+
+  private:
+    DutyCycleState _state;
+    bool _warmWake;
+};
+
+extern DutyCycleClass DutyCycle;
+
+#endif // __DUTY_CYCLE_H
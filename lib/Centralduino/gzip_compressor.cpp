@@ -0,0 +1,179 @@
+#include "gzip_compressor.h"
+
+#include <string.h>
+
+#include "crc32.h"
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define NO_POSITION 0xffff
+#define END_OF_BLOCK 256
+
+static const uint16_t lengthBase[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+static const uint16_t distanceBase[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static inline uint16_t hashOf(const uint8_t *p)
+{
+    uint32_t key = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (uint16_t)((key * 2654435761u) >> (32 - GZIP_HASH_BITS));
+}
+
+void GzipCompressor::putByte(uint8_t value)
+{
+    if (_outputLength < _outputSize)
+        _output[_outputLength++] = value;
+    else
+        _overflowed = true;
+}
+
+void GzipCompressor::putBits(uint32_t value, uint8_t count)
+{
+    _bitBuffer |= value << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8)
+    {
+        putByte((uint8_t)_bitBuffer);
+        _bitBuffer >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+void GzipCompressor::putCode(uint16_t code, uint8_t count)
+{
+    uint16_t reversed = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    putBits(reversed, count);
+}
+
+void GzipCompressor::flushBits()
+{
+    if (_bitCount > 0)
+        putByte((uint8_t)_bitBuffer);
+    _bitBuffer = 0;
+    _bitCount = 0;
+}
+
+void GzipCompressor::putLiteral(uint8_t value)
+{
+    if (value < 144)
+        putCode(0x30 + value, 8);
+    else
+        putCode(0x190 + (value - 144), 9);
+}
+
+void GzipCompressor::putMatch(uint16_t length, uint16_t distance)
+{
+    uint8_t code = sizeof(lengthBase) / sizeof(lengthBase[0]) - 1;
+    while (lengthBase[code] > length)
+        code--;
+
+    uint16_t symbol = 257 + code;
+    if (symbol < 280)
+        putCode(symbol - 256, 7);
+    else
+        putCode(0xc0 + (symbol - 280), 8);
+    putBits(length - lengthBase[code], lengthExtra[code]);
+
+    code = sizeof(distanceBase) / sizeof(distanceBase[0]) - 1;
+    while (distanceBase[code] > distance)
+        code--;
+
+    putCode(code, 5);
+    putBits(distance - distanceBase[code], distanceExtra[code]);
+}
+
+size_t GzipCompressor::compress(const uint8_t *input, size_t length, uint8_t *output, size_t outputSize)
+{
+    if (length >= NO_POSITION)
+        return 0;
+
+    _output = output;
+    _outputSize = outputSize;
+    _outputLength = 0;
+    _overflowed = false;
+    _bitBuffer = 0;
+    _bitCount = 0;
+    memset(_hashTable, 0xff, sizeof(_hashTable));
+
+    // Header: magic, deflate, no flags, no mtime, no extra flags, unknown OS
+    static const uint8_t header[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+    for (size_t i = 0; i < sizeof(header); i++)
+        putByte(header[i]);
+
+    // One final block with the fixed codes
+    putBits(1, 1);
+    putBits(1, 2);
+
+    size_t position = 0;
+    while (position < length && !_overflowed)
+    {
+        uint16_t matchLength = 0;
+        uint16_t matchDistance = 0;
+
+        if (position + MIN_MATCH <= length)
+        {
+            uint16_t hash = hashOf(input + position);
+            uint16_t candidate = _hashTable[hash];
+            _hashTable[hash] = (uint16_t)position;
+
+            if (candidate != NO_POSITION && position - candidate <= GZIP_WINDOW_SIZE)
+            {
+                size_t limit = length - position;
+                if (limit > MAX_MATCH)
+                    limit = MAX_MATCH;
+
+                size_t matched = 0;
+                while (matched < limit && input[candidate + matched] == input[position + matched])
+                    matched++;
+
+                if (matched >= MIN_MATCH)
+                {
+                    matchLength = (uint16_t)matched;
+                    matchDistance = (uint16_t)(position - candidate);
+                }
+            }
+        }
+
+        if (matchLength == 0)
+        {
+            putLiteral(input[position++]);
+            continue;
+        }
+
+        putMatch(matchLength, matchDistance);
+
+        // Index the positions the match skipped over
+        size_t end = position + matchLength;
+        for (position++; position < end; position++)
+        {
+            if (position + MIN_MATCH <= length)
+                _hashTable[hashOf(input + position)] = (uint16_t)position;
+        }
+    }
+
+    putCode(END_OF_BLOCK - 256, 7);
+    flushBits();
+
+    uint32_t crc = crc32Update(0, input, length);
+    for (int shift = 0; shift < 32; shift += 8)
+        putByte((uint8_t)(crc >> shift));
+    for (int shift = 0; shift < 32; shift += 8)
+        putByte((uint8_t)(length >> shift));
+
+    return _overflowed ? 0 : _outputLength;
+}
@@ -0,0 +1,51 @@
+#ifndef __GZIP_COMPRESSOR_H
+#define __GZIP_COMPRESSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small-footprint gzip (RFC 1952) compressor for telemetry payloads.
+//
+// Produces a single DEFLATE block with the fixed Huffman codes and greedy
+// LZ77 matching, in the spirit of uzlib. Matches are looked up through a
+// hash table of the last position of each 3-byte prefix, so the working
+// memory is fixed at (1 << GZIP_HASH_BITS) * 2 bytes regardless of input
+// size, and matches reach back at most GZIP_WINDOW_SIZE bytes.
+//
+// The input must be contiguous (it is already, in the packet buffer), and
+// compress() reports 0 when the result would not fit the output buffer.
+
+#ifndef GZIP_WINDOW_SIZE
+#define GZIP_WINDOW_SIZE 2048
+#endif
+
+#ifndef GZIP_HASH_BITS
+#define GZIP_HASH_BITS 9
+#endif
+
+#define GZIP_OVERHEAD 18 // 10 byte header, 8 byte trailer
+
+class GzipCompressor
+{
+  public:
+    size_t compress(const uint8_t *input, size_t length, uint8_t *output, size_t outputSize);
+
+  private:
+    void putBits(uint32_t value, uint8_t count);
+    void putCode(uint16_t code, uint8_t count); // Huffman codes go MSB first
+    void putByte(uint8_t value);
+    void putLiteral(uint8_t value);
+    void putMatch(uint16_t length, uint16_t distance);
+    void flushBits();
+
+    uint16_t _hashTable[1 << GZIP_HASH_BITS];
+
+    uint8_t *_output;
+    size_t _outputSize;
+    size_t _outputLength;
+    bool _overflowed;
+    uint32_t _bitBuffer;
+    uint8_t _bitCount;
+};
+
+#endif // __GZIP_COMPRESSOR_H
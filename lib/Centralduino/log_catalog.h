@@ -0,0 +1,134 @@
+#ifndef __LOG_CATALOG_H
+#define __LOG_CATALOG_H
+
+// Every message the library logs through CLOG(), with its level and format.
+// Only the message id and the arguments are stored on the device; this
+// header is also compiled into log_decoder (at the repo root) to expand
+// them on the host. Append new messages at the end, the ids are the
+// positions in this list. Messages no longer logged stay where they are,
+// marked reserved, so the ids after them don't move.
+//
+// Never pass secrets (passwords, keys, SAS tokens) to a message.
+//
+// CLOG_MESSAGE(id, level, format)
+#define CLOG_CATALOG(CLOG_MESSAGE)                                                                            \
+    CLOG_MESSAGE(STARTING, CLOG_NOTICE, "********* Centralduino starting *********")                          \
+    CLOG_MESSAGE(PROPERTY_PUBLISH, CLOG_TRACE, "Publishing property %s")                                    \
+    CLOG_MESSAGE(SAMPLE_BLOCK_TOO_LARGE, CLOG_ERROR, "Sample block %s is too large to send (%d bytes).")    \
+    CLOG_MESSAGE(PAYLOAD_TOO_LARGE, CLOG_ERROR, "Telemetry payload did not fit its buffer. Dropping it.")   \
+    CLOG_MESSAGE(TELEMETRY_PUBLISH, CLOG_TRACE, "Publishing %d bytes of %s telemetry")                      \
+    CLOG_MESSAGE(PAYLOAD_COMPRESSED, CLOG_TRACE, "Compressed payload: %d -> %d bytes")                      \
+    CLOG_MESSAGE(DIRECT_METHOD, CLOG_NOTICE, "Handling incoming direct method: %s (%s)")                    \
+    CLOG_MESSAGE(INCOMING_MESSAGE, CLOG_TRACE, "Incoming message on %s (%d bytes)")                         \
+    CLOG_MESSAGE(MALFORMED_TOPIC, CLOG_WARNING, "Malformed topic string received (%d): %s")                 \
+    CLOG_MESSAGE(BOOT_PROFILE_TOO_LARGE, CLOG_ERROR, "Boot profile didn't fit its buffer.")                 \
+    CLOG_MESSAGE(BOOT_PROFILE_REPORTED, CLOG_TRACE, "Boot profile reported (%d bytes)")                     \
+    CLOG_MESSAGE(TWIN_REQUEST_FAILED, CLOG_ERROR, "Failed to send Device Twin update request.")             \
+    CLOG_MESSAGE(SUBSCRIBE_FAILED, CLOG_ERROR, "mqttClient couldn't subscribe to %s. error code => %d")     \
+    /* Reserved, SUBSCRIBE_BATCH_FAILED replaced it */                                                      \
+    CLOG_MESSAGE(SUBSCRIBE_SUM_FAILED, CLOG_ERROR, "mqttClient couldn't subscribe to twin/methods etc. error code sum => %d") \
+    CLOG_MESSAGE(WIFI_RESTART, CLOG_ERROR, "Unable to connect to WiFi. Restarting device.")                 \
+    CLOG_MESSAGE(TOKEN_REFRESH, CLOG_NOTICE, "SAS token about to expire, reconnecting.")                    \
+    CLOG_MESSAGE(SIGNATURE_ENCODING_FAILED, CLOG_ERROR, "stringToSign base64Encode / urlEncode has failed.") \
+    CLOG_MESSAGE(DPS_LOOKUP, CLOG_NOTICE, "Getting connection info")                                        \
+    CLOG_MESSAGE(DPS_FAILED, CLOG_ERROR, "Failed to get hub host from DPS. Unable to continue.")            \
+    CLOG_MESSAGE(SIGNING_FAILED, CLOG_ERROR, "Failed to sign the hub SAS token.")                           \
+    CLOG_MESSAGE(HUB_CONNECTING, CLOG_TRACE, "Connecting to hub %s as %s")                                  \
+    CLOG_MESSAGE(MQTT_SETUP, CLOG_NOTICE, "Setting up MQTT client...")                                      \
+    CLOG_MESSAGE(MQTT_CONNECTED, CLOG_TRACE, "MQTT connected")                                              \
+    CLOG_MESSAGE(MQTT_CONNECT_FAILED, CLOG_ERROR, "MQTT connection failed, rc=%d.")                         \
+    CLOG_MESSAGE(MQTT_CONNECT_RETRY, CLOG_ERROR, "MQTT connection failed, rc=%d. Will try again in 5 sec.") \
+    CLOG_MESSAGE(NO_TIME, CLOG_ERROR, "No NTP time, can't connect to the hub.")                             \
+    CLOG_MESSAGE(DIRECT_METHOD_RECEIVED, CLOG_NOTICE, "Direct method received. Sending to handler.")         \
+    CLOG_MESSAGE(CRASH_FOUND, CLOG_WARNING, "Last reset was a crash (reason %d, cause %d), will report it")  \
+    CLOG_MESSAGE(CRASH_REPORTED, CLOG_NOTICE, "Crash report sent (%d bytes)")                               \
+    CLOG_MESSAGE(METHOD_REGISTRY_FULL, CLOG_ERROR, "No room to register direct method %s")                  \
+    CLOG_MESSAGE(UNKNOWN_METHOD, CLOG_WARNING, "No handler registered for direct method %s")                \
+    CLOG_MESSAGE(MQTT_REFUSED, CLOG_ERROR, "Hub refused the MQTT connection, rc=%d.")                       \
+    CLOG_MESSAGE(MQTT_CLOSED, CLOG_WARNING, "MQTT connection closed, rc=%d, %d publishes unacked")          \
+    CLOG_MESSAGE(MQTT_PACKET_DROPPED, CLOG_WARNING, "Dropped a %d byte MQTT packet, too large")             \
+    CLOG_MESSAGE(SUBSCRIBE_REFUSED, CLOG_ERROR, "Hub refused subscription %d")                              \
+    CLOG_MESSAGE(WORKER_QUEUE_FULL, CLOG_WARNING, "Network worker queue full, dropped a message on %s")     \
+    CLOG_MESSAGE(SUBSCRIBE_BATCH_FAILED, CLOG_ERROR, "mqttClient couldn't subscribe to %d topics")          \
+    CLOG_MESSAGE(SESSION_LOST, CLOG_NOTICE, "Hub didn't keep the MQTT session, subscribing again")          \
+    CLOG_MESSAGE(HUB_READY, CLOG_NOTICE, "Ready for commands %d ms after connecting, session present %d")   \
+    CLOG_MESSAGE(C2D_TOO_LARGE, CLOG_WARNING, "Cloud-to-device message too large (%d bytes), discarded")    \
+    CLOG_MESSAGE(C2D_TRUNCATED, CLOG_WARNING, "Cloud-to-device handler left %d bytes, dropped")             \
+    CLOG_MESSAGE(METHOD_DEFERRED, CLOG_NOTICE, "Direct method %s deferred, token %d")                       \
+    CLOG_MESSAGE(METHOD_COMPLETED, CLOG_NOTICE, "Direct method %s answered with %d")                        \
+    CLOG_MESSAGE(METHOD_NOT_PENDING, CLOG_WARNING, "Direct method token %d isn't pending")                  \
+    CLOG_MESSAGE(METHOD_REFUSED, CLOG_WARNING, "Too many direct methods in flight, refused %s")             \
+    CLOG_MESSAGE(METHOD_TIMED_OUT, CLOG_WARNING, "Direct method %s not answered in %d ms, sent 504")        \
+    CLOG_MESSAGE(RULES_LOADED, CLOG_NOTICE, "%d alert rules loaded")                                        \
+    CLOG_MESSAGE(RULE_INVALID, CLOG_WARNING, "Alert rule %s is invalid or doesn't fit, ignored")            \
+    CLOG_MESSAGE(DESIRED_UNREADABLE, CLOG_WARNING, "Can't read the desired properties: %s")                 \
+    CLOG_MESSAGE(RULE_ALERT, CLOG_NOTICE, "Alert %s %s")                                                    \
+    CLOG_MESSAGE(OTA_STARTED, CLOG_NOTICE, "Firmware %s download started, %d bytes")                        \
+    CLOG_MESSAGE(OTA_RESUMED, CLOG_NOTICE, "Firmware download resumed at byte %d")                          \
+    CLOG_MESSAGE(OTA_RETRYING, CLOG_WARNING, "Firmware download stopped (%s) at byte %d, retrying")         \
+    CLOG_MESSAGE(OTA_FAILED, CLOG_ERROR, "Firmware %s update failed: %s")                                   \
+    CLOG_MESSAGE(OTA_APPLIED, CLOG_NOTICE, "Firmware %s verified and committed, %d bytes/s")                \
+    CLOG_MESSAGE(OTA_REFUSED, CLOG_WARNING, "Firmware %s update refused, answered %d")                      \
+    CLOG_MESSAGE(DPS_CALL_FAILED, CLOG_ERROR, "DPS endpoint %s call has failed.")                           \
+    CLOG_MESSAGE(DPS_TIMEOUT, CLOG_ERROR, "DPS (%s) request has failed. (Server didn't answer within 20 secs.)") \
+    CLOG_MESSAGE(DPS_REQUEST_FAILED, CLOG_ERROR, "DPS (%s) request has failed: %s")                         \
+    CLOG_MESSAGE(DPS_AUTH, CLOG_TRACE, "Getting auth string")                                               \
+    CLOG_MESSAGE(DPS_AUTH_FAILED, CLOG_ERROR, "getDPSAuthString has failed")                                \
+    CLOG_MESSAGE(DPS_OPERATION, CLOG_TRACE, "Getting operation id for DPS")                                 \
+    CLOG_MESSAGE(DPS_HOST, CLOG_TRACE, "Getting host name from DPS")                                        \
+    CLOG_MESSAGE(BOOT_PROFILE_SAVE_FAILED, CLOG_ERROR, "Failed to save the boot profile.")                  \
+    CLOG_MESSAGE(BOOT_TOOK, CLOG_NOTICE, "Boot took %d ms")                                                 \
+    CLOG_MESSAGE(CONFIG_IMAGE_WRITE_FAILED, CLOG_ERROR, "Failed to write the config image.")                \
+    CLOG_MESSAGE(SPIFFS_MOUNT_FAILED, CLOG_ERROR, "Failed to mount SPIFFS filesystem. Unable to continue.") \
+    CLOG_MESSAGE(CONFIG_NOT_FOUND, CLOG_ERROR, "Config file not found in SPIFFS! Unable to continue.")      \
+    CLOG_MESSAGE(CONFIG_FROM_IMAGE, CLOG_TRACE, "Config loaded from the compiled image.")                   \
+    CLOG_MESSAGE(CONFIG_READ_FAILED, CLOG_ERROR, "Failed to read config file. Unable to continue.")         \
+    CLOG_MESSAGE(CONFIG_NO_NETWORK, CLOG_ERROR, "No network in the config file. Unable to continue.")       \
+    CLOG_MESSAGE(CONFIG_TOO_MANY_NETWORKS, CLOG_WARNING, "Only the first %d networks of the config file are used.") \
+    CLOG_MESSAGE(CONFIG_BEGIN, CLOG_TRACE, "*** BEGIN CONFIG ***")                                          \
+    CLOG_MESSAGE(CONFIG_SSID, CLOG_TRACE, "network[%d].ssid: %s")                                           \
+    CLOG_MESSAGE(CONFIG_PASSWORD, CLOG_TRACE, "network[%d].password: %s")                                   \
+    CLOG_MESSAGE(CONFIG_DEVICE_ID, CLOG_TRACE, "hub.device_id: %s")                                         \
+    CLOG_MESSAGE(CONFIG_SCOPE_ID, CLOG_TRACE, "hub.scope_id: %s")                                           \
+    CLOG_MESSAGE(CONFIG_SAS_KEY, CLOG_TRACE, "hub.sas_key: %s")                                             \
+    CLOG_MESSAGE(CONFIG_END, CLOG_TRACE, "*** END CONFIG ***")                                              \
+    CLOG_MESSAGE(DUTY_CYCLE_COLD_START, CLOG_NOTICE, "Duty cycle: cold start")                              \
+    CLOG_MESSAGE(DUTY_CYCLE_WAKE, CLOG_NOTICE, "Duty cycle: wake %d, %d samples pending, last cycle took %d ms") \
+    CLOG_MESSAGE(DUTY_CYCLE_QUEUE_FULL, CLOG_WARNING, "Duty cycle: queue full, dropping the oldest sample") \
+    CLOG_MESSAGE(DUTY_CYCLE_SLEEP, CLOG_NOTICE, "Duty cycle: awake for %d ms, sleeping %d s")               \
+    CLOG_MESSAGE(PROFILE_BLOCKED, CLOG_WARNING, "%s blocked for %d ms")                                     \
+    CLOG_MESSAGE(PROFILE_BEGIN, CLOG_NOTICE, "*** PROFILE (us) ***")                                        \
+    CLOG_MESSAGE(PROFILE_PHASE, CLOG_NOTICE, "%s: n=%d avg=%d max=%d hist=%d/%d/%d/%d/%d/%d/%d/%d")         \
+    CLOG_MESSAGE(SCHEDULER_FULL, CLOG_ERROR, "Too many scheduled tasks, increase SCHEDULER_MAX_TASKS.")     \
+    CLOG_MESSAGE(TASK_LATE, CLOG_WARNING, "Task %s is late, skipped %d runs")                               \
+    CLOG_MESSAGE(TASK_OVER_BUDGET, CLOG_WARNING, "Task %s ran for %d us, over its %d us budget")            \
+    CLOG_MESSAGE(NTP_REQUEST, CLOG_NOTICE, "Requesting NTP time...")                                        \
+    CLOG_MESSAGE(NTP_RESYNC, CLOG_NOTICE, "NTP resync, local clock was off by %d ms")                       \
+    CLOG_MESSAGE(NTP_TIME, CLOG_NOTICE, "Fetched NTP epoch time is: %d")                                    \
+    CLOG_MESSAGE(WIFI_CONNECTING, CLOG_NOTICE, "Connecting to WiFi.")                                       \
+    CLOG_MESSAGE(WIFI_CONNECTED, CLOG_TRACE, "WiFi connected to %s in %d ms")                               \
+    CLOG_MESSAGE(WIFI_CACHE_MISSED, CLOG_WARNING, "Cached access point didn't answer, scanning.")           \
+    CLOG_MESSAGE(WIFI_SCAN, CLOG_TRACE, "WiFi scan found %d networks")                                      \
+    CLOG_MESSAGE(WIFI_TRYING, CLOG_TRACE, "Trying %s (RSSI %d)")
+
+#define CLOG_ERROR 1
+#define CLOG_WARNING 2
+#define CLOG_NOTICE 3
+#define CLOG_TRACE 4
+
+#define CLOG_MESSAGE_ENUM(id, level, format) CLOG_##id,
+enum ClogMessage
+{
+    CLOG_CATALOG(CLOG_MESSAGE_ENUM)
+    CLOG_MESSAGE_COUNT
+};
+#undef CLOG_MESSAGE_ENUM
+
+#define CLOG_MESSAGE_LEVEL(id, level, format) CLOG_LEVEL_OF_##id = level,
+enum ClogMessageLevel
+{
+    CLOG_CATALOG(CLOG_MESSAGE_LEVEL)
+};
+#undef CLOG_MESSAGE_LEVEL
+
+#endif // __LOG_CATALOG_H
@@ -0,0 +1,146 @@
+#include "log_record.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_ptr(p) (*(const void *const *)(p))
+#endif
+
+#define CLOG_FORMAT_STRING(id, level, format) static const char clogFormat_##id[] PROGMEM = format;
+CLOG_CATALOG(CLOG_FORMAT_STRING)
+#undef CLOG_FORMAT_STRING
+
+#define CLOG_FORMAT_ENTRY(id, level, format) clogFormat_##id,
+static const char *const clogFormats[] PROGMEM = {CLOG_CATALOG(CLOG_FORMAT_ENTRY)};
+#undef CLOG_FORMAT_ENTRY
+
+#define CLOG_LEVEL_ENTRY(id, level, format) level,
+static const uint8_t clogLevels[] PROGMEM = {CLOG_CATALOG(CLOG_LEVEL_ENTRY)};
+#undef CLOG_LEVEL_ENTRY
+
+static const char levelNames[] = "?EWNT";
+
+static void append(char *buffer, size_t size, size_t &length, const char *format, ...)
+{
+    if (length >= size)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + length, size - length, format, args);
+    va_end(args);
+
+    if (written > 0)
+        length = length + written < size ? length + written : size - 1;
+}
+
+static bool readVarint(const uint8_t *&position, const uint8_t *end, uint32_t &value)
+{
+    value = 0;
+    for (uint8_t shift = 0; position < end && shift < 35; shift += 7)
+    {
+        uint8_t byte = *position++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+size_t clogFormatRecord(const uint8_t *record, size_t length, char *buffer, size_t size)
+{
+    if (size == 0 || length < CLOG_HEADER_LENGTH || record[0] != length)
+        return 0;
+
+    uint16_t id = record[1] | (record[2] << 8);
+    uint32_t timestamp = record[3] | (record[4] << 8) | ((uint32_t)record[5] << 16) | ((uint32_t)record[6] << 24);
+    if (id >= CLOG_MESSAGE_COUNT)
+        return 0;
+
+    size_t written = 0;
+    append(buffer, size, written, "%c %lu: ", levelNames[pgm_read_byte(&clogLevels[id])], (unsigned long)timestamp);
+
+    const uint8_t *position = record + CLOG_HEADER_LENGTH;
+    const uint8_t *end = record + length;
+    const char *format = (const char *)pgm_read_ptr(&clogFormats[id]);
+    for (char c = pgm_read_byte(format++); c != '\0'; c = pgm_read_byte(format++))
+    {
+        if (c != '%')
+        {
+            append(buffer, size, written, "%c", c);
+            continue;
+        }
+
+        // Flags, width and precision are kept, the conversion follows the
+        // argument's own type
+        char spec[8] = "%";
+        size_t specLength = 1;
+        while ((c = pgm_read_byte(format++)) != '\0' && strchr("-+ #0123456789.", c) != NULL)
+        {
+            if (specLength < sizeof(spec) - 3)
+                spec[specLength++] = c;
+        }
+
+        if (c == '\0')
+            break;
+        if (c == '%')
+        {
+            append(buffer, size, written, "%%");
+            continue;
+        }
+        if (position >= end)
+            return 0;
+
+        uint32_t value;
+        uint8_t tag = *position++;
+        switch (tag)
+        {
+        case CLOG_TAG_INT:
+        case CLOG_TAG_UINT:
+            if (!readVarint(position, end, value))
+                return 0;
+            if (tag == CLOG_TAG_INT)
+                value = (value >> 1) ^ -(value & 1);
+            strcpy(spec + specLength, c == 'x' || c == 'X' ? "lx" : (tag == CLOG_TAG_INT && c != 'u' ? "ld" : "lu"));
+            if (tag == CLOG_TAG_INT && c != 'u' && c != 'x' && c != 'X')
+                append(buffer, size, written, spec, (long)(int32_t)value);
+            else
+                append(buffer, size, written, spec, (unsigned long)value);
+            break;
+
+        case CLOG_TAG_FLOAT:
+        {
+            if (end - position < 4)
+                return 0;
+            uint32_t bits = position[0] | (position[1] << 8) | ((uint32_t)position[2] << 16) | ((uint32_t)position[3] << 24);
+            float number;
+            memcpy(&number, &bits, sizeof(number));
+            position += 4;
+            strcpy(spec + specLength, "f");
+            append(buffer, size, written, spec, (double)number);
+            break;
+        }
+
+        case CLOG_TAG_STRING:
+        {
+            if (position >= end || end - position - 1 < *position)
+                return 0;
+            uint8_t stringLength = *position++;
+            append(buffer, size, written, "%.*s", (int)stringLength, (const char *)position);
+            position += stringLength;
+            break;
+        }
+
+        default:
+            return 0;
+        }
+    }
+
+    return written;
+}
@@ -0,0 +1,30 @@
+#ifndef __LOG_RECORD_H
+#define __LOG_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "log_catalog.h"
+
+// Binary log record, shared by the device and the host decoder:
+//
+//   u8 record length, u16 message id, u32 millis, then the arguments,
+//   each a type tag followed by its value:
+//     'i' signed integer, zigzag varint
+//     'u' unsigned integer, varint
+//     'f' float, 4 bytes little endian
+//     's' string, u8 length then the bytes (truncated to CLOG_MAX_STRING)
+#define CLOG_HEADER_LENGTH 7
+#define CLOG_MAX_RECORD 96
+#define CLOG_MAX_STRING 40
+
+#define CLOG_TAG_INT 'i'
+#define CLOG_TAG_UINT 'u'
+#define CLOG_TAG_FLOAT 'f'
+#define CLOG_TAG_STRING 's'
+
+// Expands a record into "LEVEL millis: message" (without a line break),
+// returns 0 if the record is malformed
+size_t clogFormatRecord(const uint8_t *record, size_t length, char *buffer, size_t size);
+
+#endif // __LOG_RECORD_H
@@ -0,0 +1,38 @@
+#include "metrics.h"
+
+#include <Arduino.h>
+
+#define METRIC_KEY(id, key) key,
+static const char *metricKeys[] = {CENTRALDUINO_METRICS(METRIC_KEY)};
+#undef METRIC_KEY
+
+void MetricsClass::sampleSystem()
+{
+    _values[METRIC_FREE_HEAP] = ESP.getFreeHeap();
+    _values[METRIC_HEAP_FRAGMENTATION] = ESP.getHeapFragmentation();
+    _values[METRIC_MAX_FREE_BLOCK] = ESP.getMaxFreeBlockSize();
+    _values[METRIC_UPTIME] = micros64() / 1000000;
+}
+
+size_t MetricsClass::toJson(char *buffer, size_t size)
+{
+    size_t length = 0;
+    for (uint8_t i = 0; i < METRIC_COUNT; i++)
+    {
+        int written = snprintf(buffer + length, size - length, "%c\"%s\":%lu",
+                               i == 0 ? '{' : ',', metricKeys[i], (unsigned long)_values[i]);
+        if (written < 0 || length + written >= size)
+            return 0;
+        length += written;
+    }
+
+    if (length + 2 > size)
+        return 0;
+    buffer[length++] = '}';
+    buffer[length] = '\0';
+    return length;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+MetricsClass Metrics;
@@ -0,0 +1,83 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+#include <atomic>
+#endif
+
+// Counters and gauges describing what the client and its link are doing.
+// Updating one is a plain integer store, the formatting only happens when
+// they are reported (every METRICS_REPORT_INTERVAL, as one telemetry
+// message). Counters run from boot, so the cloud side can diff them.
+//
+// METRIC(id, json key)
+#define CENTRALDUINO_METRICS(METRIC)                 \
+    /* counters */                                   \
+    METRIC(PUBLISHES, "pub")                         \
+    METRIC(PUBLISH_BYTES, "pub_bytes")               \
+    METRIC(PUBLISH_FAILURES, "pub_fail")             \
+    METRIC(RECEIVED_BYTES, "rx_bytes")               \
+    METRIC(RECEIVED_METHODS, "rx_method")            \
+    METRIC(RECEIVED_TWIN_RESPONSES, "rx_twin_res")   \
+    METRIC(RECEIVED_TWIN_PATCHES, "rx_twin_patch")   \
+    METRIC(RECEIVED_C2D, "rx_c2d")                   \
+    METRIC(RECEIVED_OTHER, "rx_other")               \
+    METRIC(HUB_CONNECTS, "hub_connects")             \
+    METRIC(HUB_CONNECT_FAILURES, "hub_connect_fail") \
+    METRIC(DPS_CALLS, "dps_calls")                   \
+    METRIC(DPS_FAILURES, "dps_fail")                 \
+    METRIC(TOKEN_REFRESHES, "token_refresh")         \
+    METRIC(METHOD_TIMEOUTS, "method_timeout")        \
+    METRIC(RULE_ALERTS, "rule_alert")                \
+    METRIC(OTA_BYTES, "ota_bytes")                   \
+    /* gauges */                                     \
+    METRIC(DPS_MS, "dps_ms")                         \
+    METRIC(TLS_HANDSHAKE_MS, "tls_ms")               \
+    METRIC(HUB_READY_MS, "hub_ready_ms")             \
+    METRIC(FREE_HEAP, "heap_free")                   \
+    METRIC(HEAP_FRAGMENTATION, "heap_frag")          \
+    METRIC(MAX_FREE_BLOCK, "heap_max_block")         \
+    METRIC(UPTIME, "uptime_s")
+
+#ifndef METRICS_REPORT_INTERVAL
+#define METRICS_REPORT_INTERVAL 300000 // ms, 0 to not report
+#endif
+
+#define METRICS_JSON_MAX_LENGTH 640
+
+#define METRIC_ENUM(id, key) METRIC_##id,
+enum Metric
+{
+    CENTRALDUINO_METRICS(METRIC_ENUM)
+    METRIC_COUNT
+};
+#undef METRIC_ENUM
+
+class MetricsClass
+{
+  public:
+    void increment(Metric metric, uint32_t amount = 1) { _values[metric] += amount; }
+    void set(Metric metric, uint32_t value) { _values[metric] = value; }
+    uint32_t get(Metric metric) { return _values[metric]; }
+
+    // Updates the heap and uptime gauges
+    void sampleSystem();
+
+    // {"pub":12,"pub_bytes":3400,...}, returns 0 if it doesn't fit
+    size_t toJson(char *buffer, size_t size);
+
+  private:
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Counted on both threads
+    std::atomic<uint32_t> _values[METRIC_COUNT];
+#else
+    uint32_t _values[METRIC_COUNT];
+#endif
+};
+
+extern MetricsClass Metrics;
+
+#endif // __METRICS_H
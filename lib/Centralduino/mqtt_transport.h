@@ -0,0 +1,122 @@
+#ifndef __MQTT_TRANSPORT_H
+#define __MQTT_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+typedef std::function<void(char *topic, uint8_t *payload, unsigned int length)> MqttMessageCallback;
+
+// Takes incoming publishes on some topics as they are read off the
+// connection instead of whole, so they can be larger than the receive
+// buffer (see MqttTransport::setStreamHandler())
+class MqttStreamHandler
+{
+  public:
+    virtual ~MqttStreamHandler() {}
+
+    // The topic has arrived, length is the payload's. False to skip it.
+    virtual bool beginMessage(char *topic, uint32_t length) = 0;
+    // Takes what it can of the next payload bytes and returns how many.
+    // What it doesn't take is offered again from the next loop(), and
+    // nothing more is read from the connection until then.
+    virtual size_t writeMessage(const uint8_t *data, size_t length) = 0;
+    // complete is false when the connection went down first
+    virtual void endMessage(bool complete) = 0;
+};
+
+// What the client needs from its MQTT connection to the hub. The TLS
+// connection is opened by the caller (so the handshake can be timed) and
+// handed over, already connected, to connect(). States are PubSubClient's
+// MQTT_* codes.
+//
+// With cleanSession false the broker keeps the session (subscriptions and
+// undelivered QoS 1 messages) between connections; isSessionPresent()
+// tells, once the connection is accepted, whether it still had one, if
+// reportsSessionPresent().
+class MqttTransport
+{
+  public:
+    virtual ~MqttTransport() {}
+
+    virtual void setCallback(MqttMessageCallback callback) = 0;
+    virtual bool connect(Client &client, const char *host, uint16_t port, const char *id, const char *user,
+                         const char *password, bool cleanSession = true) = 0;
+    virtual void disconnect() = 0;
+    virtual bool connected() = 0;
+    virtual int state() = 0;
+    virtual bool isAccepted() = 0; // CONNACK received
+    virtual bool isSessionPresent() = 0;
+    virtual bool reportsSessionPresent() = 0; // false if isSessionPresent() can't tell
+
+    // Writes what is queued, reads what arrived and hands messages to the
+    // callback. False once the connection is down.
+    virtual bool loop() = 0;
+    virtual bool publish(const char *topic, const uint8_t *payload, size_t length, uint8_t qos = 0) = 0;
+    virtual bool subscribe(const char *topic, uint8_t qos = 0) = 0;
+    // All of them in one SUBSCRIBE where the transport can
+    virtual bool subscribe(const char *const *topics, const uint8_t *qos, size_t count) = 0;
+    // Accepted, and every SUBSCRIBE acknowledged
+    virtual bool isSubscribed() = 0;
+
+    // Publishes whose topic starts with the prefix (kept by the caller) go
+    // to the handler instead of the callback. False if the transport can
+    // only hand over whole messages.
+    virtual bool setStreamHandler(const char *topicPrefix, size_t prefixLength, MqttStreamHandler *handler) = 0;
+
+    // Services the connection until everything queued is written (and
+    // acknowledged, for QoS 1) or timeoutMs runs out. False if it didn't
+    // get there or the connection went down.
+    virtual bool flush(uint32_t timeoutMs) = 0;
+};
+
+// The blocking PubSubClient, kept as a compatibility backend: connect()
+// waits for the CONNACK and every publish waits until the whole packet has
+// been written (up to MQTT_SOCKET_TIMEOUT each). QoS 1 publishes go out as
+// QoS 0, PubSubClient can't send them. It doesn't report the session
+// present flag or SUBACKs: a session is never present, and subscriptions
+// count as acknowledged once written, one SUBSCRIBE per topic. Messages
+// are only handed over whole, up to MQTT_MAX_PACKET_SIZE.
+class PubSubTransport : public MqttTransport
+{
+  public:
+    void setCallback(MqttMessageCallback callback) { _client.setCallback(callback); }
+    bool connect(Client &client, const char *host, uint16_t port, const char *id, const char *user, const char *password,
+                 bool cleanSession = true)
+    {
+        _client.setClient(client);
+        _client.setServer(host, port);
+        return _client.connect(id, user, password, NULL, 0, false, NULL, cleanSession);
+    }
+    void disconnect() { _client.disconnect(); }
+    bool connected() { return _client.connected(); }
+    int state() { return _client.state(); }
+    bool isAccepted() { return _client.connected(); }
+    bool isSessionPresent() { return false; }
+    bool reportsSessionPresent() { return false; }
+
+    bool loop() { return _client.loop(); }
+    bool publish(const char *topic, const uint8_t *payload, size_t length, uint8_t qos = 0)
+    {
+        return _client.publish(topic, payload, length);
+    }
+    bool subscribe(const char *topic, uint8_t qos = 0) { return _client.subscribe(topic, qos); }
+    bool subscribe(const char *const *topics, const uint8_t *qos, size_t count)
+    {
+        bool subscribed = true;
+        for (size_t i = 0; i < count; i++)
+            subscribed &= _client.subscribe(topics[i], qos[i]);
+        return subscribed;
+    }
+    bool isSubscribed() { return _client.connected(); }
+    bool setStreamHandler(const char *topicPrefix, size_t prefixLength, MqttStreamHandler *handler) { return false; }
+    bool flush(uint32_t timeoutMs) { return _client.connected(); }
+
+  private:
+    PubSubClient _client;
+};
+
+#endif // __MQTT_TRANSPORT_H
@@ -0,0 +1,65 @@
+#ifndef __NETWORK_WORKER_H
+#define __NETWORK_WORKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <PubSubClient.h>
+
+#include "spsc_queue.h"
+
+// Messages queued each way between the application thread and the
+// network worker, per client instance (see CENTRALDUINO_NETWORK_WORKER)
+#ifndef NETWORK_QUEUE_LENGTH
+#define NETWORK_QUEUE_LENGTH 16
+#endif
+
+// How long the worker sleeps when it had nothing to do
+#ifndef NETWORK_WORKER_IDLE
+#define NETWORK_WORKER_IDLE 1 // ms
+#endif
+
+#define NETWORK_TOPIC_MAX_LEN 256
+
+enum WorkerMessageKind
+{
+    WORKER_MESSAGE_PUBLISH,   // to the hub
+    WORKER_MESSAGE_RECEIVED,  // from the hub
+    WORKER_MESSAGE_CONNECTED  // the connection is up, no topic or payload
+};
+
+// The topic, its NUL and the payload, in one slot of the queue
+typedef struct tagWorkerMessage
+{
+    uint8_t kind;
+    uint16_t topicLength;
+    uint16_t payloadLength;
+    char data[NETWORK_TOPIC_MAX_LEN + MQTT_MAX_PACKET_SIZE];
+
+    char *topic() { return data; }
+    uint8_t *payload() { return (uint8_t *)data + topicLength + 1; }
+} WorkerMessage;
+
+typedef SpscQueue<WorkerMessage, NETWORK_QUEUE_LENGTH> WorkerQueue;
+
+// Copies a message into the next free slot, false if the queue is full or
+// the message is too large for a slot
+static inline bool pushWorkerMessage(WorkerQueue &queue, uint8_t kind, const char *topic, const uint8_t *payload,
+                                     size_t length)
+{
+    size_t topicLength = strlen(topic);
+    WorkerMessage *message = queue.beginPush();
+    if (message == NULL || topicLength + 1 + length > sizeof(message->data))
+        return false;
+
+    message->kind = kind;
+    message->topicLength = topicLength;
+    message->payloadLength = length;
+    memcpy(message->data, topic, topicLength + 1);
+    memcpy(message->payload(), payload, length);
+    queue.endPush();
+    return true;
+}
+
+#endif // __NETWORK_WORKER_H
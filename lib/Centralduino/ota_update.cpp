@@ -0,0 +1,484 @@
+#include "ota_update.h"
+
+#include <Arduino.h>
+#include <Updater.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binary_log.h"
+#include "metrics.h"
+#include "string_buffer.h"
+
+OtaUpdateClass OtaUpdate;
+
+static const char *const stateNames[] = {"idle", "downloading", "applied", "failed"};
+
+// Versions go into the reports as they are
+static bool isValidVersion(const char *version)
+{
+    size_t length = strlen(version);
+    if (length == 0 || length >= OTA_VERSION_MAX_LEN)
+        return false;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (version[i] < ' ' || version[i] == '"' || version[i] == '\\')
+            return false;
+    }
+    return true;
+}
+
+OtaUpdateClass::OtaUpdateClass()
+    : _currentVersion(""), _trustAnchors(NULL), _testClient(NULL), _client(NULL), _task(SCHEDULER_NO_TASK),
+      _state(OTA_IDLE), _phase(PHASE_CONNECT), _port(0), _isSecure(false), _size(0), _offset(0), _skip(0),
+      _failures(0), _resumes(0), _waitUntilMs(0), _lastDataMs(0), _startedMs(0), _reportedMs(0), _reportedBytes(0),
+      _bytesPerSecond(0), _lineLength(0), _status(0), _rangeStart(0), _totalLength(0), _isChunked(false),
+      _chunk(NULL), _chunkLength(0)
+{
+    _host[0] = '\0';
+    _path[0] = '\0';
+    _targetVersion[0] = '\0';
+    _error[0] = '\0';
+}
+
+void OtaUpdateClass::begin(const char *currentVersion, const BearSSL::X509List *trustAnchors)
+{
+    _currentVersion = currentVersion != NULL ? currentVersion : "";
+    _trustAnchors = trustAnchors;
+}
+
+OtaResult OtaUpdateClass::start(const char *url, uint32_t size, const char *sha256, const char *version)
+{
+    if (_state == OTA_DOWNLOADING)
+        return OTA_BUSY;
+    if (version == NULL || !isValidVersion(version))
+        return OTA_INVALID;
+    if (strcmp(version, _currentVersion) == 0)
+        return OTA_CURRENT;
+    if (url == NULL || !parseUrl(url) || size == 0 || sha256 == NULL || strlen(sha256) != 2 * HASH_LENGTH)
+        return OTA_INVALID;
+    if (_isSecure && _trustAnchors == NULL && _testClient == NULL)
+        return OTA_INVALID;
+    for (int i = 0; i < HASH_LENGTH; i++)
+    {
+        int high = hexDigitValue(sha256[2 * i]);
+        int low = hexDigitValue(sha256[2 * i + 1]);
+        if (high < 0 || low < 0)
+            return OTA_INVALID;
+        _expectedHash[i] = (uint8_t)(high << 4 | low);
+    }
+
+    if (!allocate())
+        return OTA_NO_MEMORY;
+    if (!Update.begin(size))
+    {
+        release();
+        return OTA_NO_ROOM;
+    }
+    _task = Scheduler.every(OTA_STEP_INTERVAL, []() { OtaUpdate.loop(); }, "ota");
+    if (_task == SCHEDULER_NO_TASK)
+    {
+        Update.end();
+        release();
+        return OTA_BUSY;
+    }
+
+    strcpy(_targetVersion, version);
+    _error[0] = '\0';
+    _size = size;
+    _offset = 0;
+    _skip = 0;
+    _chunkLength = 0;
+    _failures = 0;
+    _resumes = 0;
+    _hash.init();
+
+    _state = OTA_DOWNLOADING;
+    _phase = PHASE_CONNECT;
+    _startedMs = millis();
+    _reportedMs = _startedMs;
+    _reportedBytes = 0;
+    _bytesPerSecond = 0;
+    CLOG(OTA_STARTED, version, (unsigned long)size);
+    report();
+    return OTA_STARTED;
+}
+
+// http://host[:port]/path or https://...
+bool OtaUpdateClass::parseUrl(const char *url)
+{
+    if (strncmp(url, "https://", 8) == 0)
+    {
+        _isSecure = true;
+        _port = 443;
+        url += 8;
+    }
+    else if (strncmp(url, "http://", 7) == 0)
+    {
+        _isSecure = false;
+        _port = 80;
+        url += 7;
+    }
+    else
+    {
+        return false;
+    }
+
+    const char *path = strchr(url, '/');
+    if (path == NULL)
+        path = url + strlen(url);
+    const char *port = (const char *)memchr(url, ':', path - url);
+    size_t hostLength = (port != NULL ? port : path) - url;
+    if (hostLength == 0 || hostLength >= sizeof(_host))
+        return false;
+    if (port != NULL)
+    {
+        char *end;
+        unsigned long value = strtoul(port + 1, &end, 10);
+        if (end != path || value == 0 || value > 65535)
+            return false;
+        _port = (uint16_t)value;
+    }
+
+    if (*path == '\0')
+        path = "/";
+    if (strlen(path) >= sizeof(_path))
+        return false;
+    memcpy(_host, url, hostLength);
+    _host[hostLength] = '\0';
+    strcpy(_path, path);
+    return true;
+}
+
+// The connection (a TLS client is a few KB once connected) and the chunk
+// only exist while downloading
+bool OtaUpdateClass::allocate()
+{
+    _chunk = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+    if (_testClient != NULL)
+    {
+        _client = _testClient;
+    }
+    else if (_isSecure)
+    {
+        WiFiClientSecure *client = new WiFiClientSecure();
+        if (client != NULL)
+            client->setTrustAnchors(_trustAnchors);
+        _client = client;
+    }
+    else
+    {
+        _client = new WiFiClient();
+    }
+
+    if (_chunk == NULL || _client == NULL)
+    {
+        release();
+        return false;
+    }
+    return true;
+}
+
+void OtaUpdateClass::release()
+{
+    if (_client != NULL)
+    {
+        _client->stop();
+        if (_client != _testClient)
+            delete _client;
+        _client = NULL;
+    }
+    free(_chunk);
+    _chunk = NULL;
+}
+
+void OtaUpdateClass::loop()
+{
+    if (_state != OTA_DOWNLOADING)
+        return;
+
+    if (_phase == PHASE_WAIT && (int32_t)(millis() - _waitUntilMs) >= 0)
+        _phase = PHASE_CONNECT;
+    if (_phase == PHASE_CONNECT)
+        connect();
+    if (_phase == PHASE_HEAD)
+        readHead();
+    if (_phase == PHASE_BODY)
+        readBody();
+    if (_state != OTA_DOWNLOADING)
+        return;
+
+    // The server closed before the end, or went quiet
+    if (_phase == PHASE_HEAD || _phase == PHASE_BODY)
+    {
+        if (!_client->connected() && _client->available() <= 0)
+            retry("connection lost");
+        else if ((int32_t)(millis() - _lastDataMs) >= OTA_RESPONSE_TIMEOUT)
+            retry("timed out");
+    }
+
+    if ((int32_t)(millis() - _reportedMs) >= OTA_REPORT_INTERVAL)
+        report();
+}
+
+// Requests the rest of the image, from the first byte not received yet
+void OtaUpdateClass::connect()
+{
+    if (_isSecure && _client != _testClient)
+        static_cast<WiFiClientSecure *>(_client)->setX509Time(time(NULL));
+    if (!_client->connect(_host, _port))
+    {
+        retry("connect failed");
+        return;
+    }
+
+    uint32_t from = getReceived();
+    char request[OTA_URL_MAX_LEN + OTA_HOST_MAX_LEN + 96];
+    int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s", _path, _host);
+    if (_port != (_isSecure ? 443 : 80))
+        length += snprintf(request + length, sizeof(request) - length, ":%u", (unsigned)_port);
+    if (from > 0)
+        length += snprintf(request + length, sizeof(request) - length, "\r\nRange: bytes=%lu-", (unsigned long)from);
+    length += snprintf(request + length, sizeof(request) - length, "\r\nConnection: close\r\n\r\n");
+    if (_client->write((const uint8_t *)request, length) != (size_t)length)
+    {
+        retry("request failed");
+        return;
+    }
+
+    if (from > 0)
+    {
+        _resumes++;
+        CLOG(OTA_RESUMED, (unsigned long)from);
+    }
+    _phase = PHASE_HEAD;
+    _lineLength = 0;
+    _status = 0;
+    _rangeStart = 0;
+    _totalLength = 0;
+    _isChunked = false;
+    _lastDataMs = millis();
+}
+
+// What has arrived of the response head, a line at a time
+void OtaUpdateClass::readHead()
+{
+    while (_phase == PHASE_HEAD && _client->available() > 0)
+    {
+        int value = _client->read();
+        if (value < 0)
+            return;
+        _lastDataMs = millis();
+
+        if (value != '\n')
+        {
+            if (_lineLength < sizeof(_line) - 1)
+                _line[_lineLength++] = (char)value;
+            continue;
+        }
+
+        if (_lineLength > 0 && _line[_lineLength - 1] == '\r')
+            _lineLength--;
+        _line[_lineLength] = '\0';
+        if (_lineLength == 0 && _status != 0)
+            checkHead();
+        else
+            parseHeadLine();
+        _lineLength = 0;
+    }
+}
+
+void OtaUpdateClass::parseHeadLine()
+{
+    // HTTP/1.1 206 Partial Content
+    if (_status == 0)
+    {
+        const char *code = strchr(_line, ' ');
+        _status = strncmp(_line, "HTTP/", 5) == 0 && code != NULL ? atoi(code + 1) : -1;
+        return;
+    }
+
+    if (strncasecmp(_line, "content-length:", 15) == 0 && _status == 200)
+    {
+        _totalLength = strtoul(_line + 15, NULL, 10);
+    }
+    else if (strncasecmp(_line, "content-range:", 14) == 0)
+    {
+        // bytes <first>-<last>/<total>, the total may be *
+        const char *first = strpbrk(_line + 14, "0123456789");
+        const char *total = strchr(_line, '/');
+        _rangeStart = first != NULL ? strtoul(first, NULL, 10) : 0;
+        _totalLength = total != NULL ? strtoul(total + 1, NULL, 10) : 0;
+    }
+    else if (strncasecmp(_line, "transfer-encoding:", 18) == 0 && strstr(_line + 18, "chunked") != NULL)
+    {
+        _isChunked = true;
+    }
+}
+
+void OtaUpdateClass::checkHead()
+{
+    if (_status == 200 || _status == 206)
+    {
+        if (_totalLength != 0 && _totalLength != _size)
+            fail("size mismatch");
+        else if (_status == 206 && _rangeStart != getReceived())
+            fail("bad range");
+        else if (_isChunked)
+            fail("chunked response");
+        else
+        {
+            // A server that ignores Range sends it all again
+            _skip = _status == 200 ? getReceived() : 0;
+            _phase = PHASE_BODY;
+        }
+        return;
+    }
+
+    char reason[OTA_ERROR_MAX_LEN];
+    if (_status > 0)
+        snprintf(reason, sizeof(reason), "HTTP %d", _status);
+    else
+        strcpy(reason, "bad response");
+
+    // Worth another try: the server being busy or down, not a bad URL
+    if (_status <= 0 || _status == 408 || _status == 429 || _status >= 500)
+        retry(reason);
+    else
+        fail(reason);
+}
+
+void OtaUpdateClass::readBody()
+{
+    size_t budget = OTA_STEP_BYTES;
+    while (budget > 0 && _state == OTA_DOWNLOADING)
+    {
+        int available = _client->available();
+        if (available <= 0)
+            return;
+
+        // Into the free end of the chunk; what is skipped there is overwritten
+        size_t length = OTA_CHUNK_SIZE - _chunkLength;
+        size_t wanted = _skip > 0 ? _skip : _size - getReceived();
+        if (length > wanted)
+            length = wanted;
+        if (length > (size_t)available)
+            length = available;
+        if (length > budget)
+            length = budget;
+        int read = _client->read(_chunk + _chunkLength, length);
+        if (read <= 0)
+            return;
+
+        budget -= read;
+        _lastDataMs = millis();
+        Metrics.increment(METRIC_OTA_BYTES, read);
+        if (_skip > 0)
+        {
+            _skip -= read;
+            continue;
+        }
+
+        _failures = 0;
+        _chunkLength += read;
+        if (_chunkLength == OTA_CHUNK_SIZE || getReceived() == _size)
+            writeChunk();
+    }
+}
+
+// The last chunk is only written, and the image committed, if the hash matches
+void OtaUpdateClass::writeChunk()
+{
+    _hash.write(_chunk, _chunkLength);
+    bool isLast = getReceived() == _size;
+    if (isLast && memcmp(_hash.result(), _expectedHash, HASH_LENGTH) != 0)
+    {
+        fail("hash mismatch");
+        return;
+    }
+    if (Update.write(_chunk, _chunkLength) != _chunkLength)
+    {
+        fail("flash write");
+        return;
+    }
+
+    _offset += _chunkLength;
+    _chunkLength = 0;
+    if (!isLast)
+        return;
+    if (Update.end())
+        finish(OTA_APPLIED);
+    else
+        fail("flash commit");
+}
+
+void OtaUpdateClass::retry(const char *reason)
+{
+    _client->stop();
+    if (++_failures > OTA_MAX_RETRIES)
+    {
+        fail(reason);
+        return;
+    }
+
+    CLOG(OTA_RETRYING, reason, (unsigned long)getReceived());
+    _phase = PHASE_WAIT;
+    _waitUntilMs = millis() + (_failures > 1 ? (uint32_t)OTA_RETRY_DELAY << (_failures - 2) : 0);
+}
+
+void OtaUpdateClass::fail(const char *reason)
+{
+    // With bytes missing, end() drops what was written instead of committing it
+    Update.end();
+    strlcpy(_error, reason, sizeof(_error));
+    CLOG(OTA_FAILED, _targetVersion, reason);
+    finish(OTA_FAILED);
+}
+
+void OtaUpdateClass::finish(OtaState state)
+{
+    release();
+    Scheduler.cancel(_task);
+    _task = SCHEDULER_NO_TASK;
+    _state = state;
+
+    // The average over the whole download
+    uint32_t elapsedMs = millis() - _startedMs;
+    _bytesPerSecond = elapsedMs > 0 ? (uint32_t)((uint64_t)getReceived() * 1000 / elapsedMs) : 0;
+    if (state == OTA_APPLIED)
+        CLOG(OTA_APPLIED, _targetVersion, (unsigned long)_bytesPerSecond);
+    report();
+}
+
+void OtaUpdateClass::report()
+{
+    // The rate since the last report while downloading
+    uint32_t now = millis();
+    if (_state == OTA_DOWNLOADING && now != _reportedMs)
+        _bytesPerSecond = (uint32_t)((uint64_t)(getReceived() - _reportedBytes) * 1000 / (now - _reportedMs));
+    _reportedMs = now;
+    _reportedBytes = getReceived();
+
+    if (!_report)
+        return;
+    char buffer[OTA_REPORT_JSON_MAX_LEN];
+    size_t length = toJson(buffer, sizeof(buffer));
+    if (length > 0)
+        _report(buffer, length);
+}
+
+size_t OtaUpdateClass::toJson(char *buffer, size_t size)
+{
+    size_t length = snprintf(buffer, size, "{\"ota\":{\"state\":\"%s\",\"current\":\"%s\"", stateNames[_state],
+                             _currentVersion);
+    if (length < size && _state != OTA_IDLE)
+        length += snprintf(buffer + length, size - length,
+                           ",\"target\":\"%s\",\"bytes\":%lu,\"size\":%lu,\"bps\":%lu,\"resumes\":%u", _targetVersion,
+                           (unsigned long)getReceived(), (unsigned long)_size, (unsigned long)_bytesPerSecond,
+                           (unsigned)_resumes);
+    if (length < size && _state == OTA_FAILED)
+        length += snprintf(buffer + length, size - length, ",\"error\":\"%s\"", _error);
+    if (length < size)
+        length += snprintf(buffer + length, size - length, "}}");
+    return length < size ? length : 0;
+}
@@ -0,0 +1,180 @@
+#ifndef __OTA_UPDATE_H
+#define __OTA_UPDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#include <ESP8266WiFi.h>
+
+#include "scheduler.h"
+#include "sha256.h"
+
+// Firmware updates over the air. The image is downloaded over HTTP(S) a
+// chunk at a time, straight into the update partition through the core's
+// Updater, and hashed as it goes: nothing holds more than one chunk. The
+// last chunk is only written once the SHA-256 of the whole image matches,
+// so an image that doesn't is never committed. A dropped connection is
+// picked up where it stopped with a Range request.
+//
+// The download runs from a scheduler task, a few chunks per tick, so the
+// hub connection and sampling carry on meanwhile.
+
+// Bytes read and written to flash at a time, the only buffer of the image.
+// It and the connection are only allocated while downloading.
+#ifndef OTA_CHUNK_SIZE
+#define OTA_CHUNK_SIZE 1024
+#endif
+
+// How often the download is serviced and how much it may read per tick
+#define OTA_STEP_INTERVAL 10 // ms
+#ifndef OTA_STEP_BYTES
+#define OTA_STEP_BYTES (4 * OTA_CHUNK_SIZE)
+#endif
+
+// How often progress is reported while downloading
+#ifndef OTA_REPORT_INTERVAL
+#define OTA_REPORT_INTERVAL 5000 // ms
+#endif
+
+// A connection that drops, or sends nothing for OTA_RESPONSE_TIMEOUT, is
+// made again at once, then after OTA_RETRY_DELAY, doubled each time. The
+// download gives up after OTA_MAX_RETRIES attempts in a row that got no
+// data.
+#ifndef OTA_MAX_RETRIES
+#define OTA_MAX_RETRIES 5
+#endif
+#define OTA_RETRY_DELAY 2000       // ms
+#define OTA_RESPONSE_TIMEOUT 20000 // ms
+
+#define OTA_URL_MAX_LEN 256
+#define OTA_HOST_MAX_LEN 128
+#define OTA_VERSION_MAX_LEN 32
+#define OTA_ERROR_MAX_LEN 24
+#define OTA_LINE_MAX_LEN 128 // longer response header lines are cut
+
+// {"ota":{"state":"downloading","current":"..","target":"..","bytes":..,
+// "size":..,"bps":..,"resumes":..,"error":".."}}
+#define OTA_REPORT_JSON_MAX_LEN (128 + 2 * OTA_VERSION_MAX_LEN + OTA_ERROR_MAX_LEN)
+
+enum OtaState
+{
+    OTA_IDLE,
+    OTA_DOWNLOADING,
+    OTA_APPLIED, // verified and committed, applied on the next boot
+    OTA_FAILED
+};
+
+enum OtaResult
+{
+    OTA_STARTED,
+    OTA_CURRENT, // that version is already running
+    OTA_BUSY,    // another download is under way
+    OTA_INVALID, // bad URL, size or hash, or https:// without trust anchors
+    OTA_NO_ROOM,  // the image doesn't fit the update partition
+    OTA_NO_MEMORY // no heap for the connection and the chunk
+};
+
+// Gets {"ota":{...}}, on every state change and every OTA_REPORT_INTERVAL
+// while downloading
+typedef std::function<void(const char *json, size_t length)> OtaReportCallback;
+
+class OtaUpdateClass
+{
+  public:
+    OtaUpdateClass();
+
+    // The version running now, and the trust anchors for https:// images
+    // (NULL refuses them)
+    void begin(const char *currentVersion, const BearSSL::X509List *trustAnchors);
+    void onReport(OtaReportCallback callback) { _report = callback; }
+    // Downloads over this client instead, whatever the scheme (for host
+    // tests), NULL to go back to WiFi
+    void setClient(Client *client) { _testClient = client; }
+
+    // Starts downloading the image at url (http:// or https://) of size
+    // bytes and SHA-256 sha256 (hex). Only the hash needs to be trusted:
+    // it comes over the authenticated hub connection and the image isn't
+    // committed unless it matches.
+    OtaResult start(const char *url, uint32_t size, const char *sha256, const char *version);
+    // Services the download, called by its scheduler task
+    void loop();
+
+    OtaState getState() { return _state; }
+    bool isBusy() { return _state == OTA_DOWNLOADING; }
+    const char *getCurrentVersion() { return _currentVersion; }
+    // The version of the last download started, "" if none
+    const char *getTargetVersion() { return _targetVersion; }
+    uint32_t getReceived() { return _offset + _chunkLength; }
+    uint8_t getResumes() { return _resumes; }
+
+    size_t toJson(char *buffer, size_t size);
+
+  private:
+    enum Phase
+    {
+        PHASE_CONNECT,
+        PHASE_HEAD,
+        PHASE_BODY,
+        PHASE_WAIT // before connecting again
+    };
+
+    bool parseUrl(const char *url);
+    bool allocate();
+    void release();
+    void connect();
+    void readHead();
+    void parseHeadLine();
+    void checkHead();
+    void readBody();
+    void writeChunk();
+    void retry(const char *reason);
+    void fail(const char *reason);
+    void finish(OtaState state);
+    void report();
+
+    const char *_currentVersion;
+    const BearSSL::X509List *_trustAnchors;
+    OtaReportCallback _report;
+    Client *_testClient;
+    Client *_client; // _testClient, or a WiFiClient(Secure) made for the download
+    SchedulerTaskId _task;
+
+    OtaState _state;
+    Phase _phase;
+    char _host[OTA_HOST_MAX_LEN];
+    char _path[OTA_URL_MAX_LEN];
+    uint16_t _port;
+    bool _isSecure;
+    char _targetVersion[OTA_VERSION_MAX_LEN];
+    uint8_t _expectedHash[HASH_LENGTH];
+    char _error[OTA_ERROR_MAX_LEN];
+
+    uint32_t _size;
+    uint32_t _offset;     // hashed and written to flash
+    uint32_t _skip;       // to discard, when a Range request was ignored
+    uint8_t _failures;    // attempts in a row that got no data
+    uint8_t _resumes;
+    uint32_t _waitUntilMs;
+    uint32_t _lastDataMs;
+    uint32_t _startedMs;
+    uint32_t _reportedMs;
+    uint32_t _reportedBytes;
+    uint32_t _bytesPerSecond;
+
+    // The response head, a line at a time
+    char _line[OTA_LINE_MAX_LEN];
+    uint8_t _lineLength;
+    int _status;
+    uint32_t _rangeStart;
+    uint32_t _totalLength; // of the image, 0 if the response didn't say
+    bool _isChunked;
+
+    Sha256 _hash;
+    uint8_t *_chunk;       // OTA_CHUNK_SIZE bytes
+    uint16_t _chunkLength; // received, not written yet
+};
+
+extern OtaUpdateClass OtaUpdate;
+
+#endif // __OTA_UPDATE_H
@@ -0,0 +1,91 @@
+#include "profiler.h"
+
+#ifdef CENTRALDUINO_PROFILING
+
+#include <string.h>
+
+#include "binary_log.h"
+
+#define PROFILE_PHASE_NAME(id, name) name,
+static const char *phaseNames[] = {PROFILE_PHASES(PROFILE_PHASE_NAME)};
+#undef PROFILE_PHASE_NAME
+
+void ProfilerClass::record(ProfilePhase phase, uint32_t elapsedUs)
+{
+    ProfileStats &stats = _stats[phase];
+    stats.count++;
+    stats.totalUs += elapsedUs;
+
+    uint8_t bucket = 0;
+    for (uint32_t limit = 10; bucket < PROFILE_BUCKETS - 1 && elapsedUs >= limit; limit *= 10)
+        bucket++;
+    stats.buckets[bucket]++;
+
+    if (elapsedUs > stats.maxUs)
+    {
+        stats.maxUs = elapsedUs;
+        if (elapsedUs >= PROFILE_BLOCKING_WARNING)
+            CLOG(PROFILE_BLOCKED, phaseNames[phase], (unsigned long)(elapsedUs / 1000));
+    }
+}
+
+void ProfilerClass::dumpToLog()
+{
+    CLOG(PROFILE_BEGIN);
+    for (uint8_t i = 0; i < PROFILE_PHASE_COUNT; i++)
+    {
+        const ProfileStats &stats = _stats[i];
+        if (stats.count == 0)
+            continue;
+
+        CLOG(PROFILE_PHASE, phaseNames[i], (unsigned long)stats.count, (unsigned long)(stats.totalUs / stats.count),
+             (unsigned long)stats.maxUs, (unsigned long)stats.buckets[0], (unsigned long)stats.buckets[1],
+             (unsigned long)stats.buckets[2], (unsigned long)stats.buckets[3], (unsigned long)stats.buckets[4],
+             (unsigned long)stats.buckets[5], (unsigned long)stats.buckets[6], (unsigned long)stats.buckets[7]);
+    }
+}
+
+size_t ProfilerClass::toJson(char *buffer, size_t size)
+{
+    int written = snprintf(buffer, size, "{\"diag\":{");
+    if (written < 0 || (size_t)written >= size)
+        return 0;
+
+    size_t length = written;
+    bool first = true;
+    for (uint8_t i = 0; i < PROFILE_PHASE_COUNT; i++)
+    {
+        const ProfileStats &stats = _stats[i];
+        if (stats.count == 0)
+            continue;
+
+        written = snprintf(buffer + length, size - length,
+                           "%s\"%s\":{\"n\":%lu,\"avg_us\":%lu,\"max_us\":%lu,\"hist\":[%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu]}",
+                           first ? "" : ",", phaseNames[i], (unsigned long)stats.count,
+                           (unsigned long)(stats.totalUs / stats.count), (unsigned long)stats.maxUs,
+                           (unsigned long)stats.buckets[0], (unsigned long)stats.buckets[1],
+                           (unsigned long)stats.buckets[2], (unsigned long)stats.buckets[3],
+                           (unsigned long)stats.buckets[4], (unsigned long)stats.buckets[5],
+                           (unsigned long)stats.buckets[6], (unsigned long)stats.buckets[7]);
+        if (written < 0 || length + written >= size)
+            return 0;
+        length += written;
+        first = false;
+    }
+
+    written = snprintf(buffer + length, size - length, "}}");
+    if (written < 0 || length + written >= size)
+        return 0;
+    return length + written;
+}
+
+void ProfilerClass::reset()
+{
+    memset(_stats, 0, sizeof(_stats));
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+ProfilerClass Profiler;
+
+#endif // CENTRALDUINO_PROFILING
@@ -0,0 +1,105 @@
+#ifndef __PROFILER_H
+#define __PROFILER_H
+
+// Phase timing for hunting long blocking calls (and the WDT resets they
+// cause). Build with -DCENTRALDUINO_PROFILING to enable it; otherwise
+// PROFILE_SCOPE() expands to nothing and none of this is compiled.
+//
+// Each PROFILE_SCOPE(phase) times the rest of its block with the CPU cycle
+// counter and records it in the phase's histogram and watermark. The stats
+// are logged and sent as a "diag" telemetry message every
+// PROFILE_REPORT_INTERVAL, then start over.
+
+#define PROFILE_PHASES(PHASE)            \
+    PHASE(LOOP, "loop")                  \
+    PHASE(MQTT_LOOP, "mqtt_loop")        \
+    PHASE(SCHEDULER, "scheduler")        \
+    PHASE(WIFI_CONNECT, "wifi_connect")  \
+    PHASE(HUB_CONNECT, "hub_connect")    \
+    PHASE(DPS, "dps")                    \
+    PHASE(PUBLISH, "publish")
+
+#ifdef CENTRALDUINO_PROFILING
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PROFILE_REPORT_INTERVAL
+#define PROFILE_REPORT_INTERVAL 60000 // ms
+#endif
+
+// New watermarks above this are logged as they happen
+#ifndef PROFILE_BLOCKING_WARNING
+#define PROFILE_BLOCKING_WARNING 500000 // us
+#endif
+
+#define PROFILE_JSON_MAX_LENGTH 768
+
+// Histogram buckets are decades: <10us, <100us, ... <10s, >=10s
+#define PROFILE_BUCKETS 8
+
+// The cycle counter wraps every 26 s at 160 MHz, longer scopes use micros()
+#define PROFILE_CYCLE_LIMIT 20000 // ms
+
+#define PROFILE_PHASE_ENUM(id, name) PROFILE_##id,
+enum ProfilePhase
+{
+    PROFILE_PHASES(PROFILE_PHASE_ENUM)
+    PROFILE_PHASE_COUNT
+};
+#undef PROFILE_PHASE_ENUM
+
+typedef struct tagProfileStats
+{
+    uint32_t count;
+    uint64_t totalUs;
+    uint32_t maxUs;
+    uint32_t buckets[PROFILE_BUCKETS];
+} ProfileStats;
+
+class ProfilerClass
+{
+  public:
+    void record(ProfilePhase phase, uint32_t elapsedUs);
+    void dumpToLog();
+    // {"diag":{"loop":{"n":..,"avg_us":..,"max_us":..,"hist":[..]},...}},
+    // returns 0 if it doesn't fit
+    size_t toJson(char *buffer, size_t size);
+    void reset();
+
+  private:
+    ProfileStats _stats[PROFILE_PHASE_COUNT];
+};
+
+extern ProfilerClass Profiler;
+
+class ProfileScope
+{
+  public:
+    ProfileScope(ProfilePhase phase) : _phase(phase), _startCycles(ESP.getCycleCount()), _startUs(micros()) {}
+    ~ProfileScope()
+    {
+        uint32_t elapsedUs = micros() - _startUs;
+        if (elapsedUs < PROFILE_CYCLE_LIMIT * 1000UL)
+            elapsedUs = (ESP.getCycleCount() - _startCycles) / ESP.getCpuFreqMHz();
+        Profiler.record(_phase, elapsedUs);
+    }
+
+  private:
+    ProfilePhase _phase;
+    uint32_t _startCycles;
+    uint32_t _startUs;
+};
+
+#define PROFILE_SCOPE_NAME_(line) _profileScope##line
+#define PROFILE_SCOPE_NAME(line) PROFILE_SCOPE_NAME_(line)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_SCOPE_NAME(__LINE__)(PROFILE_##phase)
+
+#else
+
+#define PROFILE_SCOPE(phase)
+
+#endif // CENTRALDUINO_PROFILING
+
+#endif // __PROFILER_H
@@ -0,0 +1,61 @@
+#include "rtc_store.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#define RTC_RECORD_MAGIC 0xcd01
+#define RTC_MAX_RECORD_WORDS (RTC_SLOT_END - RTC_SLOT_WIFI)
+
+typedef struct tagRtcRecordHeader
+{
+    uint16_t magic;
+    uint16_t size;
+    uint32_t crc;
+} RtcRecordHeader;
+
+bool RtcStoreClass::read(uint32_t slot, void *data, size_t size)
+{
+    uint32_t words[RTC_MAX_RECORD_WORDS];
+    size_t wordCount = (RTC_RECORD_HEADER_LENGTH + size + 3) / 4;
+    if (slot + wordCount > RTC_SLOT_END || !ESP.rtcUserMemoryRead(slot, words, wordCount * 4))
+        return false;
+
+    RtcRecordHeader header;
+    memcpy(&header, words, sizeof(header));
+    const uint8_t *payload = (const uint8_t *)words + RTC_RECORD_HEADER_LENGTH;
+    if (header.magic != RTC_RECORD_MAGIC || header.size != size || header.crc != crc32Update(0, payload, size))
+        return false;
+
+    memcpy(data, payload, size);
+    return true;
+}
+
+bool RtcStoreClass::write(uint32_t slot, const void *data, size_t size)
+{
+    uint32_t words[RTC_MAX_RECORD_WORDS];
+    size_t wordCount = (RTC_RECORD_HEADER_LENGTH + size + 3) / 4;
+    if (slot + wordCount > RTC_SLOT_END)
+        return false;
+
+    RtcRecordHeader header;
+    header.magic = RTC_RECORD_MAGIC;
+    header.size = (uint16_t)size;
+    header.crc = crc32Update(0, data, size);
+
+    memset(words, 0, wordCount * 4);
+    memcpy(words, &header, sizeof(header));
+    memcpy((uint8_t *)words + RTC_RECORD_HEADER_LENGTH, data, size);
+    return ESP.rtcUserMemoryWrite(slot, words, wordCount * 4);
+}
+
+void RtcStoreClass::invalidate(uint32_t slot)
+{
+    uint32_t empty[2] = {0, 0};
+    ESP.rtcUserMemoryWrite(slot, empty, sizeof(empty));
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+RtcStoreClass RtcStore;
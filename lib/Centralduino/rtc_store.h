@@ -0,0 +1,35 @@
+#ifndef __RTC_STORE_H
+#define __RTC_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Records kept in the RTC user memory, which survives deep sleep, resets
+// and restarts but not a power loss. Each record carries a CRC so garbage
+// left after power-up is rejected.
+//
+// Layout of the 512 bytes of user memory, in 4-byte blocks. The first 128
+// bytes are left to the bootloader, which uses them to pass OTA commands.
+#define RTC_SLOT_WIFI 32
+#define RTC_SLOT_HUB 42
+#define RTC_SLOT_DUTY_CYCLE 70
+#define RTC_SLOT_CRASH 106
+#define RTC_SLOT_END 128
+
+#define RTC_RECORD_HEADER_LENGTH 8
+
+// Largest record that fits between a slot and the next one
+#define RTC_SLOT_CAPACITY(slot, nextSlot) (((nextSlot) - (slot)) * 4 - RTC_RECORD_HEADER_LENGTH)
+
+class RtcStoreClass
+{
+  public:
+    // read() fails if the slot holds no valid record of exactly this size
+    bool read(uint32_t slot, void *data, size_t size);
+    bool write(uint32_t slot, const void *data, size_t size);
+    void invalidate(uint32_t slot);
+};
+
+extern RtcStoreClass RtcStore;
+
+#endif // __RTC_STORE_H
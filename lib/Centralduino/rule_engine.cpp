@@ -0,0 +1,421 @@
+#include "rule_engine.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry_schema.h"
+
+// ,"<stream>":{"n":<count>,"min":<value>,"max":<value>,"avg":<value>}
+#define RULE_STREAM_JSON_MAX_LEN (20 + RULE_NAME_MAX_LEN + 3 * (19 + RULE_JSON_DECIMALS))
+
+// Letters, digits and _ - . so they go into JSON as they are
+static bool isValidName(const char *name)
+{
+    size_t length = strlen(name);
+    if (length == 0 || length >= RULE_NAME_MAX_LEN)
+        return false;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-' ||
+              c == '.'))
+            return false;
+    }
+    return true;
+}
+
+static bool parseNumber(const char *token, float &value, const char **end)
+{
+    char *stop;
+    double parsed = token != NULL ? strtod(token, &stop) : 0;
+    if (token == NULL || stop == token || !isfinite(parsed))
+        return false;
+    value = (float)parsed;
+    *end = stop;
+    return true;
+}
+
+static bool parseOperator(const char *token, uint8_t &op)
+{
+    if (token == NULL)
+        return false;
+    if (strcmp(token, ">") == 0)
+        op = RULE_ABOVE;
+    else if (strcmp(token, ">=") == 0)
+        op = RULE_AT_OR_ABOVE;
+    else if (strcmp(token, "<") == 0)
+        op = RULE_BELOW;
+    else if (strcmp(token, "<=") == 0)
+        op = RULE_AT_OR_BELOW;
+    else
+        return false;
+    return true;
+}
+
+// [rate] <stream> <op> <threshold> [for <n>s|m] [hyst <band>], see rule_engine.h
+static bool compileRule(const char *text, Rule &rule, char *stream)
+{
+    char copy[RULE_TEXT_MAX_LEN];
+    size_t length = strlen(text);
+    if (length >= sizeof(copy))
+        return false;
+    memcpy(copy, text, length + 1);
+
+    // strtok's state is shared with the sketch and any other thread
+    const char *end;
+    char *save;
+    char *token = strtok_r(copy, " ", &save);
+    rule.isRate = token != NULL && strcmp(token, "rate") == 0;
+    if (rule.isRate)
+        token = strtok_r(NULL, " ", &save);
+    if (token == NULL || !isValidName(token))
+        return false;
+    strcpy(stream, token);
+
+    if (!parseOperator(strtok_r(NULL, " ", &save), rule.op) ||
+        !parseNumber(strtok_r(NULL, " ", &save), rule.threshold, &end) || *end != '\0')
+        return false;
+
+    while ((token = strtok_r(NULL, " ", &save)) != NULL)
+    {
+        float value;
+        if (strcmp(token, "for") == 0 && parseNumber(strtok_r(NULL, " ", &save), value, &end))
+        {
+            float scale = strcmp(end, "m") == 0 ? 60000 : strcmp(end, "s") == 0 || *end == '\0' ? 1000 : 0;
+            if (scale == 0 || value < 0 || value * scale > RULE_MAX_HOLD)
+                return false;
+            rule.holdMs = (uint32_t)(value * scale);
+        }
+        else if (strcmp(token, "hyst") == 0 && parseNumber(strtok_r(NULL, " ", &save), value, &end) && *end == '\0' &&
+                 value >= 0)
+        {
+            rule.band = value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isSameRule(const Rule &rule, const Rule &other, const char *stream, const char *otherStream)
+{
+    return rule.op == other.op && rule.isRate == other.isRate && rule.threshold == other.threshold &&
+           rule.band == other.band && rule.holdMs == other.holdMs && strcmp(stream, otherStream) == 0;
+}
+
+static bool conditionHolds(uint8_t op, float value, float threshold)
+{
+    switch (op)
+    {
+    case RULE_ABOVE:
+        return value > threshold;
+    case RULE_AT_OR_ABOVE:
+        return value >= threshold;
+    case RULE_BELOW:
+        return value < threshold;
+    default:
+        return value <= threshold;
+    }
+}
+
+// Appends ,"key":value
+static size_t writeValue(char *out, const char *key, float value)
+{
+    size_t length = sprintf(out, ",\"%s\":", key);
+    return length + telemetryWriteFLOAT(out + length, value, RULE_JSON_DECIMALS);
+}
+
+RuleEngine::RuleEngine()
+{
+    memset(_rules, 0, sizeof(_rules));
+    memset(_streams, 0, sizeof(_streams));
+    for (uint8_t i = 0; i < RULE_MAX_STREAMS; i++)
+        _streams[i].firstRule = RULE_NONE;
+}
+
+bool RuleEngine::setRule(const char *name, const char *text)
+{
+    Rule rule;
+    memset(&rule, 0, sizeof(rule));
+    char streamName[RULE_NAME_MAX_LEN];
+    if (!isValidName(name) || !compileRule(text, rule, streamName))
+        return false;
+
+    uint8_t index = findRule(name);
+    if (index != RULE_NONE && isSameRule(_rules[index], rule, _streams[_rules[index].stream].name, streamName))
+    {
+        _rules[index].isSweeping = false;
+        return true;
+    }
+    for (uint8_t i = 0; index == RULE_NONE && i < RULE_MAX_RULES; i++)
+    {
+        if (_rules[i].name[0] == '\0')
+            index = i;
+    }
+    uint8_t stream = findStream(streamName);
+    if (stream == RULE_NONE)
+        stream = addStream(streamName, true);
+    if (index == RULE_NONE || stream == RULE_NONE)
+        return false;
+
+    if (_rules[index].name[0] != '\0')
+        unlinkRule(index);
+    strcpy(rule.name, name);
+    rule.stream = stream;
+    rule.next = _streams[stream].firstRule;
+    rule.state = RULE_CLEAR;
+    _rules[index] = rule;
+    _streams[stream].firstRule = index;
+    updateStream(_streams[stream]);
+    return true;
+}
+
+void RuleEngine::removeRule(const char *name)
+{
+    uint8_t index = findRule(name);
+    if (index != RULE_NONE)
+        unlinkRule(index);
+}
+
+void RuleEngine::clearRules()
+{
+    for (uint8_t i = 0; i < RULE_MAX_RULES; i++)
+    {
+        if (_rules[i].name[0] != '\0')
+            unlinkRule(i);
+    }
+}
+
+void RuleEngine::markRules()
+{
+    for (uint8_t i = 0; i < RULE_MAX_RULES; i++)
+        _rules[i].isSweeping = true;
+}
+
+void RuleEngine::sweepRules()
+{
+    for (uint8_t i = 0; i < RULE_MAX_RULES; i++)
+    {
+        if (_rules[i].name[0] != '\0' && _rules[i].isSweeping)
+            unlinkRule(i);
+    }
+}
+
+uint8_t RuleEngine::getRuleCount()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < RULE_MAX_RULES; i++)
+    {
+        if (_rules[i].name[0] != '\0')
+            count++;
+    }
+    return count;
+}
+
+uint8_t RuleEngine::findRule(const char *name)
+{
+    for (uint8_t i = 0; i < RULE_MAX_RULES; i++)
+    {
+        if (_rules[i].name[0] != '\0' && strcmp(_rules[i].name, name) == 0)
+            return i;
+    }
+    return RULE_NONE;
+}
+
+uint8_t RuleEngine::findStream(const char *name)
+{
+    for (uint8_t i = 0; i < RULE_MAX_STREAMS; i++)
+    {
+        if (_streams[i].name[0] != '\0' && strcmp(_streams[i].name, name) == 0)
+            return i;
+    }
+    return RULE_NONE;
+}
+
+uint8_t RuleEngine::addStream(const char *name, bool forRule)
+{
+    if (!isValidName(name))
+        return RULE_NONE;
+
+    // A free slot, or for a rule one no rule reads
+    uint8_t index = RULE_NONE;
+    for (uint8_t i = 0; index == RULE_NONE && i < RULE_MAX_STREAMS; i++)
+    {
+        if (_streams[i].name[0] == '\0')
+            index = i;
+    }
+    for (uint8_t i = 0; index == RULE_NONE && forRule && i < RULE_MAX_STREAMS; i++)
+    {
+        if (_streams[i].firstRule == RULE_NONE)
+            index = i;
+    }
+    if (index == RULE_NONE)
+        return RULE_NONE;
+
+    RuleStream &stream = _streams[index];
+    memset(&stream, 0, sizeof(stream));
+    strcpy(stream.name, name);
+    stream.firstRule = RULE_NONE;
+    return index;
+}
+
+void RuleEngine::unlinkRule(uint8_t index)
+{
+    RuleStream &stream = _streams[_rules[index].stream];
+    // Whoever heard it was raised hears it no longer is
+    if (_rules[index].state == RULE_RAISED && _alert)
+        _alert(_rules[index], stream.name, false, NAN);
+
+    uint8_t *link = &stream.firstRule;
+    while (*link != index)
+        link = &_rules[*link].next;
+    *link = _rules[index].next;
+
+    _rules[index].name[0] = '\0';
+    updateStream(stream);
+}
+
+void RuleEngine::updateStream(RuleStream &stream)
+{
+    stream.hasRates = false;
+    for (uint8_t i = stream.firstRule; i != RULE_NONE; i = _rules[i].next)
+        stream.hasRates |= _rules[i].isRate;
+    if (!stream.hasRates)
+        stream.hasPrevious = false;
+}
+
+void RuleEngine::record(const char *name, float value, uint32_t nowMs)
+{
+    if (isnan(value))
+        return;
+
+    uint8_t index = findStream(name);
+    if (index == RULE_NONE && (index = addStream(name, false)) == RULE_NONE)
+        return;
+    RuleStream &stream = _streams[index];
+
+    // The change per second since the previous sample
+    float rate = 0;
+    bool hasRate = false;
+    if (stream.hasRates)
+    {
+        int32_t elapsedMs = nowMs - stream.previousMs;
+        hasRate = stream.hasPrevious && elapsedMs > 0;
+        if (hasRate)
+            rate = (value - stream.previous) * 1000 / elapsedMs;
+        if (hasRate || !stream.hasPrevious)
+        {
+            stream.previous = value;
+            stream.previousMs = nowMs;
+            stream.hasPrevious = true;
+        }
+    }
+
+    for (uint8_t i = stream.firstRule; i != RULE_NONE; i = _rules[i].next)
+    {
+        if (!_rules[i].isRate)
+            evaluate(_rules[i], stream.name, value, nowMs);
+        else if (hasRate)
+            evaluate(_rules[i], stream.name, rate, nowMs);
+    }
+
+    if (stream.count == 0 || value < stream.min)
+        stream.min = value;
+    if (stream.count == 0 || value > stream.max)
+        stream.max = value;
+    stream.sum += value;
+    stream.count++;
+}
+
+void RuleEngine::evaluate(Rule &rule, const char *stream, float value, uint32_t nowMs)
+{
+    bool holds = conditionHolds(rule.op, value, rule.threshold);
+    if (rule.state == RULE_RAISED)
+    {
+        bool isUpper = rule.op == RULE_ABOVE || rule.op == RULE_AT_OR_ABOVE;
+        bool clears = rule.band == 0 ? !holds
+                                     : isUpper ? value < rule.threshold - rule.band : value > rule.threshold + rule.band;
+        if (clears)
+        {
+            rule.state = RULE_CLEAR;
+            if (_alert)
+                _alert(rule, stream, false, value);
+        }
+        return;
+    }
+
+    if (!holds)
+    {
+        rule.state = RULE_CLEAR;
+        return;
+    }
+    if (rule.state == RULE_CLEAR)
+    {
+        rule.state = RULE_HOLDING;
+        rule.sinceMs = nowMs;
+    }
+    if (nowMs - rule.sinceMs >= rule.holdMs)
+    {
+        rule.state = RULE_RAISED;
+        if (_alert)
+            _alert(rule, stream, true, value);
+    }
+}
+
+size_t RuleEngine::summaryToJson(char *buffer, size_t size)
+{
+    const char prefix[] = "{\"summary\":{";
+    size_t length = sizeof(prefix) - 1;
+    if (size < length)
+        return 0;
+    memcpy(buffer, prefix, length);
+
+    bool isEmpty = true;
+    for (uint8_t i = 0; i < RULE_MAX_STREAMS; i++)
+    {
+        const RuleStream &stream = _streams[i];
+        if (stream.count == 0)
+            continue;
+        if (size - length < RULE_STREAM_JSON_MAX_LEN + 3)
+            return 0;
+
+        length += sprintf(buffer + length, "%s\"%s\":{\"n\":%lu", isEmpty ? "" : ",", stream.name,
+                          (unsigned long)stream.count);
+        length += writeValue(buffer + length, "min", stream.min);
+        length += writeValue(buffer + length, "max", stream.max);
+        length += writeValue(buffer + length, "avg", (float)(stream.sum / stream.count));
+        buffer[length++] = '}';
+        isEmpty = false;
+    }
+    if (isEmpty)
+        return 0;
+
+    buffer[length++] = '}';
+    buffer[length++] = '}';
+    buffer[length] = '\0';
+
+    for (uint8_t i = 0; i < RULE_MAX_STREAMS; i++)
+    {
+        _streams[i].count = 0;
+        _streams[i].sum = 0;
+    }
+    return length;
+}
+
+size_t RuleEngine::alertToJson(char *buffer, size_t size, const Rule &rule, const char *stream, bool raised,
+                               float value)
+{
+    if (size < RULE_ALERT_JSON_MAX_LEN)
+        return 0;
+
+    size_t length = sprintf(buffer, "{\"alert\":\"%s\",\"stream\":\"%s\",\"raised\":%s", rule.name, stream,
+                            raised ? "true" : "false");
+    length += writeValue(buffer + length, "value", value);
+    buffer[length++] = '}';
+    buffer[length] = '\0';
+    return length;
+}
@@ -0,0 +1,142 @@
+#ifndef __RULE_ENGINE_H
+#define __RULE_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+// Local alert rules, evaluated against every sample the application records,
+// so only alerts and a periodic summary have to go to the hub instead of
+// every reading. A rule is one line of text:
+//
+//   [rate] <stream> <op> <threshold> [for <n>s|m] [hyst <band>]
+//
+//   temp > 40 for 60s          above 40 for a whole minute
+//   rate temp > 0.5            rising faster than 0.5 per second
+//   battery < 3.3 hyst 0.1     raised below 3.3, cleared above 3.4
+//
+// op is one of > >= < <=. Rules are compiled into a fixed table and each
+// stream keeps a list of the rules that read it, so a sample costs the
+// lookup of its stream and one comparison per rule on that stream. A rule
+// raises once its condition has held for the hold time and clears when the
+// value is back past the threshold by the hysteresis band (with no band,
+// as soon as the condition stops holding).
+//
+// This file has no Arduino dependencies.
+
+#ifndef RULE_MAX_RULES
+#define RULE_MAX_RULES 8
+#endif
+
+// Streams read by rules or recorded for the summary. Once it is full, new
+// streams are only taken for rules, in place of one no rule reads.
+#ifndef RULE_MAX_STREAMS
+#define RULE_MAX_STREAMS 8
+#endif
+
+#define RULE_NAME_MAX_LEN 16
+#define RULE_TEXT_MAX_LEN 64
+#define RULE_MAX_HOLD 86400000 // ms
+#define RULE_NONE 0xFF
+
+// Decimals of the values in alerts and summaries
+#define RULE_JSON_DECIMALS 3
+
+// {"alert":"<name>","stream":"<stream>","raised":false,"value":<value>}
+#define RULE_ALERT_JSON_MAX_LEN (56 + 2 * RULE_NAME_MAX_LEN + 12 + RULE_JSON_DECIMALS)
+
+enum RuleOperator
+{
+    RULE_ABOVE,
+    RULE_AT_OR_ABOVE,
+    RULE_BELOW,
+    RULE_AT_OR_BELOW
+};
+
+enum RuleState
+{
+    RULE_CLEAR,
+    RULE_HOLDING, // the condition holds, not for long enough yet
+    RULE_RAISED
+};
+
+typedef struct tagRule
+{
+    char name[RULE_NAME_MAX_LEN]; // "" when the slot is free
+    uint8_t stream;
+    uint8_t next; // the next rule on the same stream
+    uint8_t op;
+    uint8_t state;
+    bool isRate;     // compares the change per second
+    bool isSweeping; // removed by sweepRules() unless set again
+    float threshold;
+    float band;
+    uint32_t holdMs;
+    uint32_t sinceMs; // when the condition started to hold
+} Rule;
+
+typedef struct tagRuleStream
+{
+    char name[RULE_NAME_MAX_LEN]; // "" when the slot is free
+    uint8_t firstRule;
+    bool hasRates; // a rule on it reads the rate
+    bool hasPrevious;
+    float previous;
+    uint32_t previousMs;
+
+    // Since the last summary
+    uint32_t count;
+    float min;
+    float max;
+    double sum;
+} RuleStream;
+
+// raised is false when the alert clears; value is what the rule compared,
+// the sample or its rate, or NAN when the rule was replaced or removed
+typedef std::function<void(const Rule &rule, const char *stream, bool raised, float value)> RuleAlertCallback;
+
+class RuleEngine
+{
+  public:
+    RuleEngine();
+
+    void onAlert(RuleAlertCallback callback) { _alert = callback; }
+
+    // Compiles text into the named rule, replacing the one of the same name
+    // (a raised alert stays raised if the rule is the same, and is cleared
+    // otherwise). False, leaving the table as it was, if the text doesn't
+    // parse or there's no room.
+    bool setRule(const char *name, const char *text);
+    void removeRule(const char *name);
+    void clearRules();
+    // To replace the whole set: the rules not set again between the two
+    // calls are removed, the others keep their state
+    void markRules();
+    void sweepRules();
+    uint8_t getRuleCount();
+
+    // Evaluates the rules on the stream and adds the value to its summary
+    void record(const char *stream, float value, uint32_t nowMs);
+
+    // {"summary":{"<stream>":{"n":12,"min":..,"max":..,"avg":..},...}} of
+    // the streams recorded since the last call, which starts a new period.
+    // 0 if nothing was recorded or the buffer is too small (the period
+    // carries on then).
+    size_t summaryToJson(char *buffer, size_t size);
+
+    static size_t alertToJson(char *buffer, size_t size, const Rule &rule, const char *stream, bool raised, float value);
+
+  private:
+    uint8_t findRule(const char *name);
+    uint8_t findStream(const char *name);
+    uint8_t addStream(const char *name, bool forRule);
+    void unlinkRule(uint8_t index);
+    void updateStream(RuleStream &stream);
+    void evaluate(Rule &rule, const char *stream, float value, uint32_t nowMs);
+
+    Rule _rules[RULE_MAX_RULES];
+    RuleStream _streams[RULE_MAX_STREAMS];
+    RuleAlertCallback _alert;
+};
+
+#endif // __RULE_ENGINE_H
@@ -0,0 +1,409 @@
+#include "sample_block.h"
+
+#include <string.h>
+
+static uint64_t zigzagEncode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzagDecode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint32_t floatBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Delta-of-delta buckets: prefix bits, prefix length, value bits, bias
+struct DeltaBucket
+{
+    uint8_t prefix;
+    uint8_t prefixLength;
+    uint8_t valueBits;
+    int32_t bias;
+};
+
+static const DeltaBucket deltaBuckets[] = {
+    {0x2, 2, 7, 63},   // 10   [-63, 64]
+    {0x6, 3, 9, 255},  // 110  [-255, 256]
+    {0xe, 4, 12, 2047} // 1110 [-2047, 2048]
+};
+#define DELTA_BUCKET_COUNT (sizeof(deltaBuckets) / sizeof(deltaBuckets[0]))
+#define DELTA_ESCAPE 0xf // 1111 followed by a zigzag varint
+#define DELTA_ESCAPE_LENGTH 4
+
+#define NO_WINDOW 0xff
+
+///////////////////////////////////////////////////////////////////
+// Encoder
+
+SampleBlockEncoder::SampleBlockEncoder(uint8_t *buffer, size_t size, SampleBlockType type)
+    : _buffer(buffer), _size(size), _type(type)
+{
+    reset();
+}
+
+void SampleBlockEncoder::reset()
+{
+    _bitLength = 0;
+    _overflowed = _size < SAMPLE_BLOCK_HEADER_LENGTH;
+    _count = 0;
+    _lastTimestamp = 0;
+    _lastDelta = 0;
+    _lastValue = 0;
+    _lastLeading = NO_WINDOW;
+    _lastTrailing = 0;
+
+    if (!_overflowed)
+    {
+        memset(_buffer, 0, SAMPLE_BLOCK_HEADER_LENGTH);
+        _buffer[0] = (SAMPLE_BLOCK_VERSION << 4) | _type;
+    }
+}
+
+void SampleBlockEncoder::writeBits(uint64_t value, uint8_t count)
+{
+    if (_overflowed || SAMPLE_BLOCK_HEADER_LENGTH + (_bitLength + count + 7) / 8 > _size)
+    {
+        _overflowed = true;
+        return;
+    }
+
+    uint8_t *stream = _buffer + SAMPLE_BLOCK_HEADER_LENGTH;
+    while (count--)
+    {
+        uint8_t mask = 0x80 >> (_bitLength & 7);
+        if ((value >> count) & 1)
+            stream[_bitLength >> 3] |= mask;
+        else
+            stream[_bitLength >> 3] &= ~mask;
+        _bitLength++;
+    }
+}
+
+void SampleBlockEncoder::writeVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        writeBits((value & 0x7f) | 0x80, 8);
+        value >>= 7;
+    }
+    writeBits(value, 8);
+}
+
+bool SampleBlockEncoder::appendTimestamp(uint64_t timestampMs)
+{
+    if (_count == 0)
+    {
+        for (int i = 0; i < 8; i++)
+            _buffer[3 + i] = (uint8_t)(timestampMs >> (56 - 8 * i));
+    }
+    else
+    {
+        int64_t delta = (int64_t)(timestampMs - _lastTimestamp);
+        if (_count == 1)
+        {
+            writeVarint(zigzagEncode(delta));
+        }
+        else
+        {
+            int64_t deltaOfDelta = delta - _lastDelta;
+            if (deltaOfDelta == 0)
+            {
+                writeBits(0, 1);
+            }
+            else
+            {
+                size_t i = 0;
+                for (; i < DELTA_BUCKET_COUNT; i++)
+                {
+                    const DeltaBucket &bucket = deltaBuckets[i];
+                    if (deltaOfDelta >= -bucket.bias && deltaOfDelta <= bucket.bias + 1)
+                    {
+                        writeBits(bucket.prefix, bucket.prefixLength);
+                        writeBits((uint64_t)(deltaOfDelta + bucket.bias), bucket.valueBits);
+                        break;
+                    }
+                }
+                if (i == DELTA_BUCKET_COUNT)
+                {
+                    writeBits(DELTA_ESCAPE, DELTA_ESCAPE_LENGTH);
+                    writeVarint(zigzagEncode(deltaOfDelta));
+                }
+            }
+        }
+        _lastDelta = delta;
+    }
+    _lastTimestamp = timestampMs;
+    return !_overflowed;
+}
+
+bool SampleBlockEncoder::append(uint64_t timestampMs, float value)
+{
+    if (_type != SAMPLE_BLOCK_FLOAT || _count == 0xffff || _overflowed)
+        return false;
+
+    // Keep the state so a sample that doesn't fit can be rolled back
+    size_t bitLength = _bitLength;
+    uint64_t lastTimestamp = _lastTimestamp;
+    int64_t lastDelta = _lastDelta;
+    uint32_t lastValue = _lastValue;
+    uint8_t lastLeading = _lastLeading;
+    uint8_t lastTrailing = _lastTrailing;
+
+    appendTimestamp(timestampMs);
+
+    uint32_t bits = floatBits(value);
+    if (_count == 0)
+    {
+        writeBits(bits, 32);
+    }
+    else
+    {
+        uint32_t xorValue = bits ^ _lastValue;
+        if (xorValue == 0)
+        {
+            writeBits(0, 1);
+        }
+        else
+        {
+            uint8_t leading = __builtin_clz(xorValue);
+            uint8_t trailing = __builtin_ctz(xorValue);
+            if (leading > 31)
+                leading = 31;
+
+            writeBits(1, 1);
+            if (_lastLeading != NO_WINDOW && leading >= _lastLeading && trailing >= _lastTrailing)
+            {
+                // Meaningful bits fit in the previous window
+                writeBits(0, 1);
+                writeBits(xorValue >> _lastTrailing, 32 - _lastLeading - _lastTrailing);
+            }
+            else
+            {
+                uint8_t meaningful = 32 - leading - trailing;
+                writeBits(1, 1);
+                writeBits(leading, 5);
+                writeBits(meaningful - 1, 5);
+                writeBits(xorValue >> trailing, meaningful);
+                _lastLeading = leading;
+                _lastTrailing = trailing;
+            }
+        }
+    }
+
+    if (_overflowed)
+    {
+        _overflowed = false;
+        _bitLength = bitLength;
+        _lastTimestamp = lastTimestamp;
+        _lastDelta = lastDelta;
+        _lastValue = lastValue;
+        _lastLeading = lastLeading;
+        _lastTrailing = lastTrailing;
+        return false;
+    }
+
+    _lastValue = bits;
+    _count++;
+    _buffer[1] = _count >> 8;
+    _buffer[2] = _count & 0xff;
+    return true;
+}
+
+bool SampleBlockEncoder::append(uint64_t timestampMs, int32_t value)
+{
+    if (_type != SAMPLE_BLOCK_INT || _count == 0xffff || _overflowed)
+        return false;
+
+    size_t bitLength = _bitLength;
+    uint64_t lastTimestamp = _lastTimestamp;
+    int64_t lastDelta = _lastDelta;
+
+    appendTimestamp(timestampMs);
+
+    int64_t previous = _count == 0 ? 0 : (int32_t)_lastValue;
+    writeVarint(zigzagEncode((int64_t)value - previous));
+
+    if (_overflowed)
+    {
+        _overflowed = false;
+        _bitLength = bitLength;
+        _lastTimestamp = lastTimestamp;
+        _lastDelta = lastDelta;
+        return false;
+    }
+
+    _lastValue = (uint32_t)value;
+    _count++;
+    _buffer[1] = _count >> 8;
+    _buffer[2] = _count & 0xff;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////
+// Decoder
+
+SampleBlockDecoder::SampleBlockDecoder(const uint8_t *data, size_t length)
+    : _data(data), _length(length), _valid(false), _type(SAMPLE_BLOCK_FLOAT), _count(0), _index(0),
+      _bitPosition(0), _lastTimestamp(0), _lastDelta(0), _lastValue(0), _lastLeading(NO_WINDOW), _lastTrailing(0)
+{
+    if (length < SAMPLE_BLOCK_HEADER_LENGTH || (data[0] >> 4) != SAMPLE_BLOCK_VERSION)
+        return;
+
+    uint8_t type = data[0] & 0x0f;
+    if (type != SAMPLE_BLOCK_FLOAT && type != SAMPLE_BLOCK_INT)
+        return;
+
+    _type = (SampleBlockType)type;
+    _count = (data[1] << 8) | data[2];
+    for (int i = 0; i < 8; i++)
+        _lastTimestamp = (_lastTimestamp << 8) | data[3 + i];
+    _valid = true;
+}
+
+bool SampleBlockDecoder::readBits(uint8_t count, uint64_t &value)
+{
+    if (_bitPosition + count > (_length - SAMPLE_BLOCK_HEADER_LENGTH) * 8)
+        return false;
+
+    const uint8_t *stream = _data + SAMPLE_BLOCK_HEADER_LENGTH;
+    value = 0;
+    while (count--)
+    {
+        value = (value << 1) | ((stream[_bitPosition >> 3] >> (7 - (_bitPosition & 7))) & 1);
+        _bitPosition++;
+    }
+    return true;
+}
+
+bool SampleBlockDecoder::readVarint(uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint64_t byte;
+        if (!readBits(8, byte))
+            return false;
+        value |= (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool SampleBlockDecoder::nextTimestamp(uint64_t &timestampMs)
+{
+    if (_index == 1)
+    {
+        uint64_t delta;
+        if (!readVarint(delta))
+            return false;
+        _lastDelta = zigzagDecode(delta);
+    }
+    else if (_index > 1)
+    {
+        // Count the leading ones of the bucket prefix
+        uint64_t bit;
+        uint8_t ones = 0;
+        while (ones < DELTA_ESCAPE_LENGTH)
+        {
+            if (!readBits(1, bit))
+                return false;
+            if (bit == 0)
+                break;
+            ones++;
+        }
+
+        if (ones == DELTA_ESCAPE_LENGTH)
+        {
+            uint64_t deltaOfDelta;
+            if (!readVarint(deltaOfDelta))
+                return false;
+            _lastDelta += zigzagDecode(deltaOfDelta);
+        }
+        else if (ones > 0)
+        {
+            const DeltaBucket &bucket = deltaBuckets[ones - 1];
+            uint64_t deltaOfDelta;
+            if (!readBits(bucket.valueBits, deltaOfDelta))
+                return false;
+            _lastDelta += (int64_t)deltaOfDelta - bucket.bias;
+        }
+    }
+
+    if (_index > 0)
+        _lastTimestamp += _lastDelta;
+    timestampMs = _lastTimestamp;
+    return true;
+}
+
+bool SampleBlockDecoder::next(uint64_t &timestampMs, float &value)
+{
+    if (!_valid || _type != SAMPLE_BLOCK_FLOAT || _index >= _count || !nextTimestamp(timestampMs))
+        return false;
+
+    uint64_t bits;
+    if (_index == 0)
+    {
+        if (!readBits(32, bits))
+            return false;
+        _lastValue = (uint32_t)bits;
+    }
+    else
+    {
+        uint64_t controlBit;
+        if (!readBits(1, controlBit))
+            return false;
+
+        if (controlBit)
+        {
+            if (!readBits(1, controlBit))
+                return false;
+
+            if (controlBit)
+            {
+                uint64_t leading, meaningful;
+                if (!readBits(5, leading) || !readBits(5, meaningful))
+                    return false;
+                // Only a corrupt block has a window past the value's 32 bits
+                if (leading + meaningful + 1 > 32)
+                {
+                    _valid = false;
+                    return false;
+                }
+                _lastLeading = (uint8_t)leading;
+                _lastTrailing = (uint8_t)(32 - leading - (meaningful + 1));
+            }
+
+            if (_lastLeading == NO_WINDOW || !readBits(32 - _lastLeading - _lastTrailing, bits))
+                return false;
+            _lastValue ^= (uint32_t)bits << _lastTrailing;
+        }
+    }
+
+    memcpy(&value, &_lastValue, sizeof(value));
+    _index++;
+    return true;
+}
+
+bool SampleBlockDecoder::next(uint64_t &timestampMs, int32_t &value)
+{
+    if (!_valid || _type != SAMPLE_BLOCK_INT || _index >= _count || !nextTimestamp(timestampMs))
+        return false;
+
+    uint64_t delta;
+    if (!readVarint(delta))
+        return false;
+
+    int64_t previous = _index == 0 ? 0 : (int32_t)_lastValue;
+    _lastValue = (uint32_t)(int32_t)(previous + zigzagDecode(delta));
+    memcpy(&value, &_lastValue, sizeof(value));
+    _index++;
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef __SAMPLE_BLOCK_H
+#define __SAMPLE_BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed blocks of samples from a single stream (vibration, waveforms
+// etc.), sent as one message instead of one JSON double per value.
+//
+// Timestamps are stored as delta-of-delta, so a fixed sample rate costs one
+// bit per sample. Float values use Gorilla style XOR compression against the
+// previous value and integer values are stored as zigzag varint deltas.
+//
+// Block layout (big endian):
+//   byte 0      version (high nibble) | SampleBlockType (low nibble)
+//   bytes 1-2   sample count
+//   bytes 3-10  timestamp of the first sample (ms)
+//   bytes 11-   bit stream
+//
+// This file has no Arduino dependencies; the ingestion side can build it
+// as is and read blocks back with SampleBlockDecoder.
+
+#define SAMPLE_BLOCK_VERSION 1
+#define SAMPLE_BLOCK_HEADER_LENGTH 11
+
+enum SampleBlockType
+{
+    SAMPLE_BLOCK_FLOAT = 1,
+    SAMPLE_BLOCK_INT = 2
+};
+
+class SampleBlockEncoder
+{
+  public:
+    SampleBlockEncoder(uint8_t *buffer, size_t size, SampleBlockType type);
+
+    // Both return false, leaving the block untouched, when the sample does
+    // not fit. Use the matching overload for the block type.
+    bool append(uint64_t timestampMs, float value);
+    bool append(uint64_t timestampMs, int32_t value);
+
+    void reset();
+
+    const uint8_t *getData() { return _buffer; }
+    size_t getLength() { return SAMPLE_BLOCK_HEADER_LENGTH + (_bitLength + 7) / 8; }
+    uint16_t getCount() { return _count; }
+    SampleBlockType getType() { return _type; }
+
+  private:
+    bool appendTimestamp(uint64_t timestampMs);
+    void writeBits(uint64_t value, uint8_t count);
+    void writeVarint(uint64_t value);
+
+    uint8_t *_buffer;
+    size_t _size;
+    SampleBlockType _type;
+    size_t _bitLength;
+    bool _overflowed;
+    uint16_t _count;
+
+    uint64_t _lastTimestamp;
+    int64_t _lastDelta;
+    uint32_t _lastValue;
+    uint8_t _lastLeading;
+    uint8_t _lastTrailing;
+};
+
+class SampleBlockDecoder
+{
+  public:
+    SampleBlockDecoder(const uint8_t *data, size_t length);
+
+    // False if the header is damaged or of an unknown version, or once a
+    // damaged sample was read
+    bool isValid() { return _valid; }
+    SampleBlockType getType() { return _type; }
+    uint16_t getCount() { return _count; }
+
+    // Return false once all samples are read or the stream is truncated
+    bool next(uint64_t &timestampMs, float &value);
+    bool next(uint64_t &timestampMs, int32_t &value);
+
+  private:
+    bool nextTimestamp(uint64_t &timestampMs);
+    bool readBits(uint8_t count, uint64_t &value);
+    bool readVarint(uint64_t &value);
+
+    const uint8_t *_data;
+    size_t _length;
+    bool _valid;
+    SampleBlockType _type;
+    uint16_t _count;
+    uint16_t _index;
+    size_t _bitPosition;
+
+    uint64_t _lastTimestamp;
+    int64_t _lastDelta;
+    uint32_t _lastValue;
+    uint8_t _lastLeading;
+    uint8_t _lastTrailing;
+};
+
+#endif // __SAMPLE_BLOCK_H
@@ -0,0 +1,282 @@
+#include "scheduler.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "binary_log.h"
+
+#define NO_INDEX 0xff
+#define NO_SLOT 0xffff
+#define RUNNING_SLOT SCHEDULER_SLOT_COUNT
+#define FREE_SLOT (SCHEDULER_SLOT_COUNT + 1)
+#define ROOT_MASK (SCHEDULER_ROOT_SIZE - 1)
+#define LEVEL_MASK (SCHEDULER_LEVEL_SIZE - 1)
+
+// First slot of a level above the root
+#define LEVEL_START(level) (SCHEDULER_ROOT_SIZE + ((level)-1) * SCHEDULER_LEVEL_SIZE)
+#define LEVEL_SHIFT(level) (SCHEDULER_ROOT_BITS + ((level)-1) * SCHEDULER_LEVEL_BITS)
+
+SchedulerClass::SchedulerClass()
+{
+    memset(_heads, NO_INDEX, sizeof(_heads));
+    for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+    {
+        _tasks[i].generation = 1;
+        link(i, FREE_SLOT);
+    }
+
+    _nextTick = 0;
+    _taskCount = 0;
+    _overrunCount = 0;
+    _current = NO_INDEX;
+    _currentCancelled = false;
+    _running = false;
+}
+
+SchedulerTaskId SchedulerClass::every(uint32_t periodMs, SchedulerCallback callback, const char *name, uint32_t budgetUs)
+{
+    return add(periodMs, periodMs > 0 ? periodMs : 1, callback, name, budgetUs);
+}
+
+SchedulerTaskId SchedulerClass::after(uint32_t delayMs, SchedulerCallback callback, const char *name, uint32_t budgetUs)
+{
+    return add(delayMs, 0, callback, name, budgetUs);
+}
+
+SchedulerTaskId SchedulerClass::add(uint32_t delayMs, uint32_t periodMs, SchedulerCallback &callback, const char *name, uint32_t budgetUs)
+{
+    uint8_t index = _heads[FREE_SLOT];
+    if (index == NO_INDEX)
+    {
+        CLOG(SCHEDULER_FULL);
+        return SCHEDULER_NO_TASK;
+    }
+
+    // An empty wheel doesn't need to catch up on the ticks it skipped
+    if (_taskCount == 0 && !_running)
+        _nextTick = millis();
+
+    unlink(index);
+    _taskCount++;
+    SchedulerTask &task = _tasks[index];
+    task.callback = callback;
+    task.name = name != NULL ? name : "?";
+    task.expires = millis() + delayMs;
+    task.period = periodMs;
+    task.budgetUs = budgetUs;
+    task.overruns = 0;
+    addToWheel(index);
+
+    return (SchedulerTaskId)((task.generation << 8) | index);
+}
+
+int SchedulerClass::find(SchedulerTaskId id)
+{
+    uint8_t index = id & 0xff;
+    if (index >= SCHEDULER_MAX_TASKS || _tasks[index].generation != (id >> 8) || _tasks[index].slot == FREE_SLOT)
+        return -1;
+    return index;
+}
+
+bool SchedulerClass::cancel(SchedulerTaskId id)
+{
+    int index = find(id);
+    if (index < 0)
+        return false;
+
+    // A task cancelling itself is released once its callback returns
+    if (index == _current)
+    {
+        if (_tasks[index].slot != NO_SLOT)
+            unlink(index);
+        _currentCancelled = true;
+        return true;
+    }
+
+    unlink(index);
+    release(index);
+    return true;
+}
+
+void SchedulerClass::link(uint8_t index, uint16_t slot)
+{
+    SchedulerTask &task = _tasks[index];
+    task.slot = slot;
+    task.prev = NO_INDEX;
+    task.next = _heads[slot];
+    if (task.next != NO_INDEX)
+        _tasks[task.next].prev = index;
+    _heads[slot] = index;
+}
+
+void SchedulerClass::unlink(uint8_t index)
+{
+    SchedulerTask &task = _tasks[index];
+    if (task.prev != NO_INDEX)
+        _tasks[task.prev].next = task.next;
+    else
+        _heads[task.slot] = task.next;
+
+    if (task.next != NO_INDEX)
+        _tasks[task.next].prev = task.prev;
+
+    task.slot = NO_SLOT;
+}
+
+void SchedulerClass::release(uint8_t index)
+{
+    SchedulerTask &task = _tasks[index];
+    task.callback = nullptr;
+    _taskCount--;
+    task.generation = task.generation == 0xff ? 1 : task.generation + 1; // stale ids no longer match
+    link(index, FREE_SLOT);
+}
+
+void SchedulerClass::addToWheel(uint8_t index)
+{
+    uint32_t expires = _tasks[index].expires;
+
+    // While a slot runs, its tick is done: due tasks go to the next one
+    int32_t minimum = _running ? 1 : 0;
+    int32_t delta = (int32_t)(expires - _nextTick);
+    if (delta < minimum)
+    {
+        expires = _nextTick + minimum;
+        delta = minimum;
+    }
+
+    if (delta < SCHEDULER_ROOT_SIZE)
+    {
+        link(index, expires & ROOT_MASK);
+        return;
+    }
+
+    // Too far for the top level, park it at its end. It is placed again
+    // with its real expiry when that slot cascades.
+    if ((uint32_t)delta > SCHEDULER_MAX_DELAY)
+    {
+        expires = _nextTick + SCHEDULER_MAX_DELAY;
+        delta = SCHEDULER_MAX_DELAY;
+    }
+
+    uint8_t level = 1;
+    while (level < SCHEDULER_LEVELS - 1 && (uint32_t)delta >= (1UL << LEVEL_SHIFT(level + 1)))
+        level++;
+
+    link(index, LEVEL_START(level) + ((expires >> LEVEL_SHIFT(level)) & LEVEL_MASK));
+}
+
+// Moves the tasks of the current slot of a level down the wheel, returns
+// true when the level wrapped around and the next one up has to cascade too
+bool SchedulerClass::cascade(uint8_t level)
+{
+    uint8_t position = (_nextTick >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+    uint16_t slot = LEVEL_START(level) + position;
+
+    while (_heads[slot] != NO_INDEX)
+    {
+        uint8_t index = _heads[slot];
+        unlink(index);
+        addToWheel(index);
+    }
+
+    return position == 0;
+}
+
+uint32_t SchedulerClass::loop()
+{
+    uint32_t now = millis();
+    while ((int32_t)(now - _nextTick) >= 0)
+    {
+        uint16_t slot = _nextTick & ROOT_MASK;
+        if (slot == 0)
+        {
+            for (uint8_t level = 1; level < SCHEDULER_LEVELS && cascade(level); level++)
+                ;
+        }
+
+        if (_heads[slot] != NO_INDEX)
+            runSlot(slot);
+
+        _nextTick++;
+    }
+
+    return getIdleTime();
+}
+
+void SchedulerClass::runSlot(uint16_t slot)
+{
+    // Move the due tasks aside first, tasks added meanwhile go in the wheel
+    while (_heads[slot] != NO_INDEX)
+    {
+        uint8_t index = _heads[slot];
+        unlink(index);
+        link(index, RUNNING_SLOT);
+    }
+
+    _running = true;
+    while (_heads[RUNNING_SLOT] != NO_INDEX)
+    {
+        uint8_t index = _heads[RUNNING_SLOT];
+        SchedulerTask &task = _tasks[index];
+        unlink(index);
+
+        // Reschedule before running, so the task can cancel itself
+        if (task.period > 0)
+        {
+            uint32_t now = millis();
+            uint16_t missed = 0;
+            task.expires += task.period;
+            while ((int32_t)(now - task.expires) >= 0)
+            {
+                task.expires += task.period;
+                missed++;
+            }
+            addToWheel(index);
+
+            if (missed > 0)
+            {
+                task.overruns++;
+                _overrunCount++;
+                CLOG(TASK_LATE, task.name, (unsigned long)missed);
+            }
+        }
+
+        _current = index;
+        _currentCancelled = false;
+        uint32_t startedUs = micros();
+        task.callback();
+        uint32_t elapsedUs = micros() - startedUs;
+        _current = NO_INDEX;
+
+        if (task.budgetUs > 0 && elapsedUs > task.budgetUs)
+        {
+            task.overruns++;
+            _overrunCount++;
+            CLOG(TASK_OVER_BUDGET, task.name, (unsigned long)elapsedUs, (unsigned long)task.budgetUs);
+        }
+
+        if (task.period == 0 || _currentCancelled)
+            release(index);
+    }
+    _running = false;
+}
+
+uint32_t SchedulerClass::getIdleTime()
+{
+    // Sleep until the next occupied slot, but not past a cascade, which may
+    // bring tasks down to the root
+    uint32_t idle = 0;
+    while (idle < SCHEDULER_MAX_IDLE)
+    {
+        uint16_t slot = (_nextTick + idle) & ROOT_MASK;
+        if (slot == 0 || _heads[slot] != NO_INDEX)
+            break;
+        idle++;
+    }
+    return idle;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+SchedulerClass Scheduler;
@@ -0,0 +1,100 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS 32
+#endif
+
+// Longest Centralduino.loop() sleeps waiting for the next task. MQTT is only
+// serviced in between, so keep it short.
+#ifndef SCHEDULER_MAX_IDLE
+#define SCHEDULER_MAX_IDLE 10 // ms
+#endif
+
+// Wheel geometry: 256 slots of 1 ms, then three levels of 64 slots, each
+// level 64 times coarser than the one below (up to ~18.6 hours). Longer
+// delays work too, they just cascade through the top level more than once.
+#define SCHEDULER_ROOT_BITS 8
+#define SCHEDULER_LEVEL_BITS 6
+#define SCHEDULER_LEVELS 4
+#define SCHEDULER_ROOT_SIZE (1 << SCHEDULER_ROOT_BITS)
+#define SCHEDULER_LEVEL_SIZE (1 << SCHEDULER_LEVEL_BITS)
+#define SCHEDULER_SLOT_COUNT (SCHEDULER_ROOT_SIZE + (SCHEDULER_LEVELS - 1) * SCHEDULER_LEVEL_SIZE)
+#define SCHEDULER_MAX_DELAY ((1UL << (SCHEDULER_ROOT_BITS + (SCHEDULER_LEVELS - 1) * SCHEDULER_LEVEL_BITS)) - 1)
+
+#define SCHEDULER_NO_TASK 0
+
+static_assert(SCHEDULER_MAX_TASKS < 255, "Task indexes are 8 bits");
+
+typedef uint16_t SchedulerTaskId;
+typedef std::function<void()> SchedulerCallback;
+
+typedef struct tagSchedulerTask
+{
+    SchedulerCallback callback;
+    const char *name;
+    uint32_t expires; // in ms ticks
+    uint32_t period;  // 0 for one-shot tasks
+    uint32_t budgetUs;
+    uint16_t overruns;
+    uint16_t slot;
+    uint8_t prev;
+    uint8_t next;
+    uint8_t generation;
+} SchedulerTask;
+
+// Cooperative scheduler for periodic and one-shot tasks, driven from
+// Centralduino.loop().
+//
+// Tasks live in a hierarchical timer wheel (as in the Linux kernel): every
+// slot is a doubly linked list, so scheduling and cancelling are O(1), and
+// a task far in the future is only moved down a level when its slot comes
+// up. Tasks run from loop(), never from an interrupt, so they can do
+// anything loop() can.
+//
+// Give a task a budget (in us) to have runs that take longer reported as
+// overruns. Periodic tasks that fall behind skip the runs they missed, and
+// that is reported too.
+class SchedulerClass
+{
+  public:
+    SchedulerClass();
+
+    SchedulerTaskId every(uint32_t periodMs, SchedulerCallback callback, const char *name = NULL, uint32_t budgetUs = 0);
+    SchedulerTaskId after(uint32_t delayMs, SchedulerCallback callback, const char *name = NULL, uint32_t budgetUs = 0);
+    bool cancel(SchedulerTaskId id);
+
+    // Runs the tasks that are due, returns how long (in ms) the caller can
+    // sleep before the next one, at most SCHEDULER_MAX_IDLE
+    uint32_t loop();
+
+    uint32_t getOverrunCount() { return _overrunCount; }
+
+  private:
+    SchedulerTaskId add(uint32_t delayMs, uint32_t periodMs, SchedulerCallback &callback, const char *name, uint32_t budgetUs);
+    int find(SchedulerTaskId id);
+    void link(uint8_t index, uint16_t slot);
+    void unlink(uint8_t index);
+    void release(uint8_t index);
+    void addToWheel(uint8_t index);
+    bool cascade(uint8_t level);
+    void runSlot(uint16_t slot);
+    uint32_t getIdleTime();
+
+    SchedulerTask _tasks[SCHEDULER_MAX_TASKS];
+    uint8_t _heads[SCHEDULER_SLOT_COUNT + 2]; // plus the running and free lists
+    uint32_t _nextTick;
+    uint8_t _taskCount;
+    uint32_t _overrunCount;
+    uint8_t _current;
+    bool _currentCancelled;
+    bool _running;
+};
+
+extern SchedulerClass Scheduler;
+
+#endif // __SCHEDULER_H
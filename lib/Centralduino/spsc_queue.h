@@ -0,0 +1,57 @@
+#ifndef __SPSC_QUEUE_H
+#define __SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Wait-free ring of Capacity slots (a power of two) between exactly one
+// producer thread and one consumer thread. The producer fills the slot
+// from beginPush() in place and hands it over with endPush(); the consumer
+// reads front() and frees it with pop(). Each side only stores its own
+// index, with release ordering, so a slot's contents are visible before
+// the index that hands it over. Neither side ever waits: a full queue
+// returns NULL from beginPush(), an empty one from front().
+template <typename T, uint32_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    SpscQueue() : _head(0), _tail(0) {}
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer side
+    T *beginPush()
+    {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == Capacity)
+            return NULL;
+        return &_slots[tail & (Capacity - 1)];
+    }
+    void endPush() { _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer side
+    T *front()
+    {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire))
+            return NULL;
+        return &_slots[head & (Capacity - 1)];
+    }
+    void pop() { _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Either side, a snapshot
+    uint32_t size() { return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire); }
+
+  private:
+    T _slots[Capacity];
+
+    // On separate cache lines, each is written by one side only
+    std::atomic<uint32_t> _head;
+    uint8_t _padding[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> _tail;
+};
+
+#endif // __SPSC_QUEUE_H
@@ -18,19 +18,34 @@ static char convertToHex(char ch) {
     return *(lst + (ch & 15));
 }
 
-static char convertFromHex(char ch) {
-    assert(isdigit(ch) || isalpha(ch)); // isalnum ?
-    if (ch <= '9') {
-       return ch - '0';
-    } else {
-        if (ch <= 'Z') {
-            ch = ch - 'A';
+int hexDigitValue(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+size_t urlDecodeInPlace(char *text, size_t length, bool plusIsSpace) {
+    char *tmp = text;
+
+    for (size_t i = 0; i < length; i++) {
+        char ch = text[i];
+        int high, low;
+        if (ch == '%' && i + 2 < length &&
+            (high = hexDigitValue(text[i + 1])) >= 0 &&
+            (low = hexDigitValue(text[i + 2])) >= 0) {
+            *tmp = (char)(high << 4 | low);
+            i += 2;
+        } else if (ch == '+' && plusIsSpace) {
+            *tmp = ' ';
         } else {
-            ch = ch - 'a';
+            *tmp = ch;
         }
-
-        return ch + 10;
+        tmp++;
     }
+    *tmp = 0;
+
+    return (size_t)tmp - (size_t)text;
 }
 
 bool StringBuffer::startsWith(const char* str, size_t len) {
@@ -111,25 +126,7 @@ bool StringBuffer::urlEncode() {
 
 bool StringBuffer::urlDecode() { // in-memory
     assert(data != NULL);
-    char *tmp = data; // fast
-
-    for (size_t i = 0; i < length; i++) {
-        char ch = data[i];
-        if (ch == '%') {
-            if (i + 2 < length) {
-                *tmp = convertFromHex(data[i + 1]) << 4 |
-                       convertFromHex(data[i + 2]);
-                i += 2;
-            }
-        } else if (ch == '+') {
-            *tmp = ' ';
-        } else {
-            *tmp = ch;
-        }
-        tmp++;
-    }
-    *tmp = 0;
-    length = (size_t)tmp - (size_t)data;
+    length = urlDecodeInPlace(data, length, true);
 
     return true;
 }
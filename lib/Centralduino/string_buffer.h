@@ -4,8 +4,17 @@
 #ifndef __STRING_BUFFER_H
 #define __STRING_BUFFER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+// The value of a hex digit, -1 if it isn't one
+int hexDigitValue(char ch);
+
+// Decodes %XX escapes (and '+' to ' ' if plusIsSpace) in place, the result
+// is never longer. A '%' without two hex digits after it is kept as it is.
+// Returns the new length, text is NUL terminated there.
+size_t urlDecodeInPlace(char *text, size_t length, bool plusIsSpace);
+
 class StringBuffer
 {
     char *data;
@@ -0,0 +1,89 @@
+#include "telemetry_schema.h"
+
+#include <math.h>
+
+// Writes the decimal digits of value, most significant first
+static size_t writeDigits(char *out, uint32_t value)
+{
+    char digits[10];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (size_t i = 0; i < count; i++)
+        out[i] = digits[count - 1 - i];
+    return count;
+}
+
+// Writes whole.fraction with fraction zero-padded to the given decimals
+static size_t writeScaled(char *out, bool negative, uint32_t whole, uint32_t fraction, uint8_t decimals)
+{
+    char *p = out;
+    if (negative)
+        *p++ = '-';
+    p += writeDigits(p, whole);
+
+    if (decimals > 0)
+    {
+        *p++ = '.';
+        for (int i = decimals - 1; i >= 0; i--)
+        {
+            p[i] = '0' + (fraction % 10);
+            fraction /= 10;
+        }
+        p += decimals;
+    }
+    return p - out;
+}
+
+static const uint32_t powersOfTen[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+size_t telemetryWriteINT(char *out, int32_t value, uint8_t decimals)
+{
+    (void)decimals;
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    return writeScaled(out, value < 0, magnitude, 0, 0);
+}
+
+size_t telemetryWriteFIXED(char *out, int32_t value, uint8_t decimals)
+{
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    uint32_t scale = powersOfTen[decimals];
+    return writeScaled(out, value < 0, magnitude / scale, magnitude % scale, decimals);
+}
+
+float telemetryValueFIXED(int32_t value, uint8_t decimals)
+{
+    return (float)value / powersOfTen[decimals];
+}
+
+size_t telemetryWriteFLOAT(char *out, float value, uint8_t decimals)
+{
+    if (isnan(value) || isinf(value) || fabsf(value) >= 4e9f)
+    {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+
+    // Round once in fixed point so 0.999 with 2 decimals becomes 1.00
+    uint32_t scale = powersOfTen[decimals];
+    uint64_t scaled = (uint64_t)(fabs((double)value) * scale + 0.5);
+    bool negative = value < 0 && scaled != 0;
+    return writeScaled(out, negative, (uint32_t)(scaled / scale), (uint32_t)(scaled % scale), decimals);
+}
+
+size_t telemetryWriteBOOL(char *out, bool value, uint8_t decimals)
+{
+    (void)decimals;
+    if (value)
+    {
+        memcpy(out, "true", 4);
+        return 4;
+    }
+    memcpy(out, "false", 5);
+    return 5;
+}
@@ -0,0 +1,161 @@
+#ifndef __TELEMETRY_SCHEMA_H
+#define __TELEMETRY_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cbor_writer.h"
+
+/*
+ * Compile-time typed telemetry messages.
+ *
+ * Declare the fields of a message once with an X-macro and let
+ * TELEMETRY_SCHEMA generate a plain struct for it:
+ *
+ *   #define ENVIRONMENT_FIELDS(FIELD) \
+ *       FIELD(FLOAT, temp, 1)         \
+ *       FIELD(INT, lux, 0)            \
+ *       FIELD(BOOL, door_open, 0)     \
+ *       FIELD(FIXED, power_kw, 3)
+ *
+ *   TELEMETRY_SCHEMA(EnvironmentTelemetry, ENVIRONMENT_FIELDS)
+ *
+ *   EnvironmentTelemetry t;
+ *   t.temp = 21.5; t.lux = 300; t.door_open = false; t.power_kw = 1250; // 1.250
+ *   Centralduino.sendTelemetry(t);
+ *
+ * The keys, quotes and separators of the JSON payload are string literals
+ * baked in at compile time; only the field values are formatted at runtime.
+ * MAX_JSON_LENGTH is the exact worst-case payload size, so the caller can
+ * size the buffer on the stack without going through ArduinoJson.
+ *
+ * The same struct can be sent as CBOR (toCbor/MAX_CBOR_LENGTH), which drops
+ * the quotes and punctuation and packs the values in binary:
+ *
+ *   Centralduino.sendTelemetry(t, TELEMETRY_ENCODING_CBOR);
+ *
+ * Field kinds (the third argument is the number of decimals):
+ *   INT   - int32_t
+ *   FLOAT - float, printed with a fixed number of decimals (0-9). Non-finite
+ *           values and values outside +/-4e9 are sent as null.
+ *   BOOL  - bool
+ *   FIXED - int32_t holding value * 10^decimals (0-9), e.g. milli-units.
+ *           In CBOR it is sent as a decimal fraction (tag 4).
+ *
+ * forEachValue(visit) calls visit(name, value) for each field with the value
+ * as a float (FIXED scaled back, BOOL as 0 or 1), for the alert rules.
+ */
+
+typedef int32_t TELEMETRY_TYPE_INT;
+typedef float TELEMETRY_TYPE_FLOAT;
+typedef bool TELEMETRY_TYPE_BOOL;
+typedef int32_t TELEMETRY_TYPE_FIXED;
+
+// Worst-case formatted length of each kind, without the terminating zero
+#define TELEMETRY_MAX_CHARS_INT(decimals) 11
+#define TELEMETRY_MAX_CHARS_FLOAT(decimals) (12 + (decimals))
+#define TELEMETRY_MAX_CHARS_BOOL(decimals) 5
+#define TELEMETRY_MAX_CHARS_FIXED(decimals) 12
+
+// Worst-case CBOR encoded size of each kind
+#define TELEMETRY_MAX_CBOR_INT 5
+#define TELEMETRY_MAX_CBOR_FLOAT 5
+#define TELEMETRY_MAX_CBOR_BOOL 1
+#define TELEMETRY_MAX_CBOR_FIXED 8
+
+// Value formatters. Each writes at most TELEMETRY_MAX_CHARS_<kind> characters
+// (no terminating zero) and returns the number of characters written.
+size_t telemetryWriteINT(char *out, int32_t value, uint8_t decimals);
+size_t telemetryWriteFLOAT(char *out, float value, uint8_t decimals);
+size_t telemetryWriteBOOL(char *out, bool value, uint8_t decimals);
+size_t telemetryWriteFIXED(char *out, int32_t value, uint8_t decimals);
+
+// Field values as floats
+inline float telemetryValueINT(int32_t value, uint8_t) { return (float)value; }
+inline float telemetryValueFLOAT(float value, uint8_t) { return value; }
+inline float telemetryValueBOOL(bool value, uint8_t) { return value ? 1 : 0; }
+float telemetryValueFIXED(int32_t value, uint8_t decimals);
+
+inline void telemetryCborINT(CborWriter &writer, int32_t value, uint8_t) { writer.writeInt(value); }
+inline void telemetryCborFLOAT(CborWriter &writer, float value, uint8_t) { writer.writeFloat(value); }
+inline void telemetryCborBOOL(CborWriter &writer, bool value, uint8_t) { writer.writeBool(value); }
+inline void telemetryCborFIXED(CborWriter &writer, int32_t value, uint8_t decimals) { writer.writeDecimal(value, -(int8_t)decimals); }
+
+// Every field is emitted as ,"name":value - the leading comma of the first
+// field is overwritten with the opening brace once all fields are written.
+#define TELEMETRY_KEY_(name) ",\"" #name "\":"
+
+#define TELEMETRY_MEMBER_(kind, name, decimals) TELEMETRY_TYPE_##kind name;
+
+#define TELEMETRY_COUNT_(kind, name, decimals) +1
+
+// Text header (names are shorter than 256 characters) + name + value
+#define TELEMETRY_CBOR_BOUND_(kind, name, decimals) \
+    +(sizeof(#name) - 1 < 24 ? 1 : 2) + (sizeof(#name) - 1) + TELEMETRY_MAX_CBOR_##kind
+
+#define TELEMETRY_JSON_BOUND_(kind, name, decimals) \
+    +(sizeof(TELEMETRY_KEY_(name)) - 1) + TELEMETRY_MAX_CHARS_##kind(decimals)
+
+#define TELEMETRY_CHECK_(kind, name, decimals) \
+    static_assert((decimals) >= 0 && (decimals) <= 9, "Telemetry field " #name " has too many decimals");
+
+#define TELEMETRY_JSON_WRITE_(kind, name, decimals)                          \
+    memcpy(p, TELEMETRY_KEY_(name), sizeof(TELEMETRY_KEY_(name)) - 1);      \
+    p += sizeof(TELEMETRY_KEY_(name)) - 1;                                  \
+    p += telemetryWrite##kind(p, name, decimals);
+
+#define TELEMETRY_CBOR_WRITE_(kind, name, decimals)    \
+    writer.writeText(#name, sizeof(#name) - 1);        \
+    telemetryCbor##kind(writer, name, decimals);
+
+#define TELEMETRY_VISIT_(kind, name, decimals) \
+    visit(#name, telemetryValue##kind(name, decimals));
+
+#define TELEMETRY_SCHEMA(type_name, FIELDS)                                 \
+    struct type_name                                                        \
+    {                                                                       \
+        FIELDS(TELEMETRY_MEMBER_)                                           \
+        FIELDS(TELEMETRY_CHECK_)                                            \
+                                                                            \
+        /* Braces included: "{" + fields + "}" (or "{}" when empty) */      \
+        enum                                                                \
+        {                                                                   \
+            FIELD_COUNT = 0 FIELDS(TELEMETRY_COUNT_),                       \
+            MAX_JSON_LENGTH = 2 FIELDS(TELEMETRY_JSON_BOUND_),              \
+            MAX_CBOR_LENGTH = (FIELD_COUNT < 24 ? 1 : 3)                    \
+                FIELDS(TELEMETRY_CBOR_BOUND_)                               \
+        };                                                                  \
+                                                                            \
+        /* Returns the payload length, or 0 if the buffer is too small */   \
+        size_t toJson(char *buffer, size_t size) const                      \
+        {                                                                   \
+            if (size < MAX_JSON_LENGTH + 1)                                 \
+                return 0;                                                   \
+            char *p = buffer;                                               \
+            FIELDS(TELEMETRY_JSON_WRITE_)                                   \
+            if (p == buffer)                                                \
+                p++;                                                        \
+            buffer[0] = '{';                                                \
+            *p++ = '}';                                                     \
+            *p = 0;                                                         \
+            return p - buffer;                                              \
+        }                                                                   \
+                                                                            \
+        /* Returns the payload length, or 0 if the buffer is too small */   \
+        size_t toCbor(uint8_t *buffer, size_t size) const                   \
+        {                                                                   \
+            CborWriter writer(buffer, size);                                \
+            writer.writeMap(FIELD_COUNT);                                   \
+            FIELDS(TELEMETRY_CBOR_WRITE_)                                   \
+            return writer.hasOverflowed() ? 0 : writer.getLength();         \
+        }                                                                   \
+                                                                            \
+        template <typename Visitor>                                         \
+        void forEachValue(Visitor visit) const                              \
+        {                                                                   \
+            FIELDS(TELEMETRY_VISIT_)                                        \
+        }                                                                   \
+    };
+
+#endif // __TELEMETRY_SCHEMA_H
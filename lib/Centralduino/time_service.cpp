@@ -0,0 +1,118 @@
+#include "time_service.h"
+
+#include <Arduino.h>
+#include <coredecls.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "binary_log.h"
+#include "defines.h"
+
+// Set from the SNTP callback, handled in loop()
+static volatile bool timeWasSet = false;
+
+static void onTimeSet()
+{
+    timeWasSet = true;
+}
+
+void TimeServiceClass::begin()
+{
+    settimeofday_cb(onTimeSet);
+    CLOG(NTP_REQUEST);
+    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+}
+
+void TimeServiceClass::loop()
+{
+    if (timeWasSet)
+    {
+        timeWasSet = false;
+        applySync();
+    }
+}
+
+void TimeServiceClass::applySync()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < MIN_EPOCH)
+        return;
+
+    uint64_t utcMs = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    uint64_t monotonic = monotonicMs();
+
+    if (_synced && !_estimated)
+    {
+        int64_t elapsed = (int64_t)(monotonic - _anchorMonotonicMs);
+        int64_t error = (int64_t)(utcMs - toUtcMs(monotonic));
+        CLOG(NTP_RESYNC, (int)error);
+
+        if (elapsed >= (int64_t)TIME_MIN_DRIFT_SAMPLE)
+        {
+            // Drift of the raw oscillator over the interval, averaged with
+            // the previous estimate (the first one is taken as it is). Big
+            // jumps are steps, not drift.
+            int64_t measured = ((int64_t)(utcMs - _anchorUtcMs) - elapsed) * 1000000 / elapsed;
+            if (measured > -TIME_MAX_DRIFT_PPM && measured < TIME_MAX_DRIFT_PPM)
+            {
+                _driftPpm = (int32_t)(_hasDrift ? (_driftPpm + measured) / 2 : measured);
+                _hasDrift = true;
+            }
+        }
+    }
+    else
+    {
+        CLOG(NTP_TIME, (unsigned long)tv.tv_sec);
+    }
+
+    _anchorUtcMs = utcMs;
+    _anchorMonotonicMs = monotonic;
+    _synced = true;
+    _estimated = false;
+}
+
+void TimeServiceClass::restore(uint64_t utcMs)
+{
+    _anchorUtcMs = utcMs;
+    _anchorMonotonicMs = monotonicMs();
+    _synced = true;
+    _estimated = true;
+
+    // TLS and the SAS tokens read the system clock
+    struct timeval tv;
+    tv.tv_sec = (time_t)(utcMs / 1000);
+    tv.tv_usec = (utcMs % 1000) * 1000;
+    settimeofday(&tv, NULL);
+    timeWasSet = false; // that was us, not SNTP
+}
+
+uint64_t TimeServiceClass::monotonicMs()
+{
+    return micros64() / 1000;
+}
+
+uint64_t TimeServiceClass::toUtcMs(uint64_t monotonic)
+{
+    if (!_synced)
+        return 0;
+
+    int64_t elapsed = (int64_t)(monotonic - _anchorMonotonicMs);
+    return _anchorUtcMs + elapsed + elapsed * _driftPpm / 1000000;
+}
+
+bool TimeServiceClass::formatIso8601(uint64_t utcMs, char *buffer, size_t size, const char *timeSeparator)
+{
+    time_t seconds = (time_t)(utcMs / 1000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+
+    int length = snprintf(buffer, size, "%04d-%02d-%02dT%02d%s%02d%s%02d.%03dZ",
+                          utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+                          utc.tm_hour, timeSeparator, utc.tm_min, timeSeparator, utc.tm_sec, (int)(utcMs % 1000));
+    return length > 0 && (size_t)length < size;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+TimeServiceClass TimeService;
@@ -0,0 +1,65 @@
+#ifndef __TIME_SERVICE_H
+#define __TIME_SERVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+#include <atomic>
+#endif
+
+// Syncs further apart than this are used to estimate the clock drift
+#define TIME_MIN_DRIFT_SAMPLE (10UL * 60 * 1000) // 10 minutes, in ms
+#define TIME_MAX_DRIFT_PPM 500
+
+// Background SNTP time keeping.
+//
+// begin() starts SNTP without waiting for an answer; SNTP then resyncs on
+// its own schedule (SNTP_UPDATE_DELAY, an hour). Every sync anchors the
+// UTC time to the monotonic clock (micros64, which doesn't wrap) and the
+// error between consecutive syncs is used to estimate the drift of the
+// local oscillator. Converting a monotonic timestamp to UTC is then a single
+// multiply-add, cheap enough to stamp every sample.
+//
+// Take timestamps with monotonicMs() when sampling and convert them with
+// toUtcMs() when sending; samples taken before the first sync get the
+// correct UTC time as long as they are converted after it.
+class TimeServiceClass
+{
+  public:
+    void begin();
+    void loop();
+
+    bool isSynced() { return _synced; }
+    uint64_t monotonicMs();
+    uint64_t toUtcMs(uint64_t monotonic);
+    uint64_t nowUtcMs() { return toUtcMs(monotonicMs()); }
+    int32_t getDriftPpm() { return _driftPpm; }
+
+    // Sets the clock from a saved estimate (e.g. after deep sleep) without
+    // waiting for NTP. The next sync replaces it but isn't used for drift.
+    void restore(uint64_t utcMs);
+
+    // Writes "YYYY-MM-DDThh:mm:ss.sssZ", returns false if the buffer is too
+    // small. Pass "%3A" as the separator for use in a topic property.
+    bool formatIso8601(uint64_t utcMs, char *buffer, size_t size, const char *timeSeparator = ":");
+
+  private:
+    void applySync();
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Checked by the network worker before it signs a token
+    std::atomic<bool> _synced;
+#else
+    bool _synced;
+#endif
+    bool _estimated;
+    bool _hasDrift; // _driftPpm was measured at least once
+    uint64_t _anchorUtcMs;
+    uint64_t _anchorMonotonicMs;
+    int32_t _driftPpm;
+};
+
+extern TimeServiceClass TimeService;
+
+#endif // __TIME_SERVICE_H
@@ -0,0 +1,174 @@
+#include "wifi_connection.h"
+
+#include <ESP8266WiFi.h>
+
+#include "binary_log.h"
+#include "crc32.h"
+#include "profiler.h"
+#include "rtc_store.h"
+
+static_assert(sizeof(WiFiCache) <= RTC_SLOT_CAPACITY(RTC_SLOT_WIFI, RTC_SLOT_HUB), "WiFi cache doesn't fit its RTC slot");
+
+static uint32_t getNetworksCrc()
+{
+    uint32_t crc = 0;
+    for (uint8_t i = 0; i < CentralduinoConfig.networkCount; i++)
+        crc = crc32Update(crc, CentralduinoConfig.networks[i].ssid, strlen(CentralduinoConfig.networks[i].ssid) + 1);
+    return crc;
+}
+
+static bool waitForConnection(unsigned long timeoutMs)
+{
+    unsigned long startingMillis = millis();
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        if ((millis() - startingMillis) > timeoutMs)
+            return false;
+
+        delay(WIFI_POLL_INTERVAL);
+    }
+    return true;
+}
+
+bool WiFiConnectionClass::connect(unsigned long timeoutMs)
+{
+    if (WiFi.status() == WL_CONNECTED)
+        return true;
+
+    PROFILE_SCOPE(WIFI_CONNECT);
+    CLOG(WIFI_CONNECTING);
+    unsigned long startingMillis = millis();
+    WiFi.persistent(false); // we keep our own cache, don't rewrite the flash on every begin()
+    WiFi.mode(WIFI_STA);
+
+    loadCache();
+    if (!connectToCachedAccessPoint() && !connectToBestNetwork(timeoutMs))
+        return false;
+
+    saveCache();
+    CLOG(WIFI_CONNECTED, CentralduinoConfig.networks[_cache.network].ssid, (unsigned long)(millis() - startingMillis));
+    return true;
+}
+
+void WiFiConnectionClass::loadCache()
+{
+    uint32_t crc = getNetworksCrc();
+    if (RtcStore.read(RTC_SLOT_WIFI, &_cache, sizeof(_cache)) && _cache.configCrc == crc)
+        return;
+
+    memset(&_cache, 0, sizeof(_cache));
+    _cache.configCrc = crc;
+    for (uint8_t i = 0; i < NET_MAX_NETWORKS; i++)
+        _cache.lastRssi[i] = WIFI_RSSI_UNKNOWN;
+}
+
+void WiFiConnectionClass::saveCache()
+{
+    memcpy(_cache.bssid, WiFi.BSSID(), sizeof(_cache.bssid));
+    _cache.channel = WiFi.channel();
+    _cache.lastRssi[_cache.network] = (int8_t)WiFi.RSSI();
+#if WIFI_REUSE_DHCP_LEASE
+    _cache.ip = WiFi.localIP();
+    _cache.gateway = WiFi.gatewayIP();
+    _cache.subnet = WiFi.subnetMask();
+    _cache.dns = WiFi.dnsIP();
+#endif
+    RtcStore.write(RTC_SLOT_WIFI, &_cache, sizeof(_cache));
+}
+
+bool WiFiConnectionClass::connectToCachedAccessPoint()
+{
+    if (_cache.channel == 0 || _cache.network >= CentralduinoConfig.networkCount)
+        return false;
+
+#if WIFI_REUSE_DHCP_LEASE
+    if (_cache.ip != 0)
+        WiFi.config(IPAddress(_cache.ip), IPAddress(_cache.gateway), IPAddress(_cache.subnet), IPAddress(_cache.dns));
+#endif
+
+    if (connectToNetwork(_cache.network, _cache.bssid, _cache.channel, WIFI_FAST_CONNECT_TIMEOUT))
+        return true;
+
+    CLOG(WIFI_CACHE_MISSED);
+    _cache.channel = 0;
+#if WIFI_REUSE_DHCP_LEASE
+    _cache.ip = 0;
+    WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u)); // back to DHCP
+#endif
+    return false;
+}
+
+bool WiFiConnectionClass::connectToBestNetwork(unsigned long timeoutMs)
+{
+    uint8_t count = CentralduinoConfig.networkCount;
+    if (count == 1)
+        return connectToNetwork(0, NULL, 0, timeoutMs);
+
+    // Strongest access point of each configured network, -1 if not found
+    int8_t found = WiFi.scanNetworks();
+    int8_t strongest[NET_MAX_NETWORKS];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        strongest[i] = -1;
+        for (int8_t j = 0; j < found; j++)
+        {
+            if (strcmp(WiFi.SSID(j).c_str(), CentralduinoConfig.networks[i].ssid) == 0 &&
+                (strongest[i] < 0 || WiFi.RSSI(j) > WiFi.RSSI(strongest[i])))
+                strongest[i] = j;
+        }
+
+        if (strongest[i] >= 0)
+            _cache.lastRssi[i] = (int8_t)WiFi.RSSI(strongest[i]);
+    }
+    CLOG(WIFI_SCAN, (int)found);
+
+    // The networks found first, then the others (may be hidden), each group
+    // by the RSSI they were last seen at
+    uint8_t order[NET_MAX_NETWORKS];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t k = i;
+        for (; k > 0; k--)
+        {
+            uint8_t other = order[k - 1];
+            bool before = (strongest[i] >= 0) != (strongest[other] >= 0) ? strongest[i] >= 0
+                                                                         : _cache.lastRssi[i] > _cache.lastRssi[other];
+            if (!before)
+                break;
+            order[k] = other;
+        }
+        order[k] = i;
+    }
+
+    bool connected = false;
+    for (uint8_t k = 0; k < count && !connected; k++)
+    {
+        uint8_t i = order[k];
+        CLOG(WIFI_TRYING, CentralduinoConfig.networks[i].ssid, (int)_cache.lastRssi[i]);
+        if (strongest[i] >= 0)
+            connected = connectToNetwork(i, WiFi.BSSID(strongest[i]), WiFi.channel(strongest[i]), timeoutMs / count);
+        else
+            connected = connectToNetwork(i, NULL, 0, timeoutMs / count);
+    }
+
+    WiFi.scanDelete();
+    return connected;
+}
+
+bool WiFiConnectionClass::connectToNetwork(uint8_t index, const uint8_t *bssid, int32_t channel, unsigned long timeoutMs)
+{
+    // Channel 0 and no BSSID is a plain connection by SSID
+    WiFi.begin(CentralduinoConfig.networks[index].ssid, CentralduinoConfig.networks[index].password, channel, bssid);
+    if (!waitForConnection(timeoutMs))
+    {
+        WiFi.disconnect();
+        return false;
+    }
+
+    _cache.network = index;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////
+// Allocate the global singleton declared in the .h file
+WiFiConnectionClass WiFiConnection;
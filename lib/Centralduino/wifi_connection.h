@@ -0,0 +1,59 @@
+#ifndef __WIFI_CONNECTION_H
+#define __WIFI_CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define WIFI_FAST_CONNECT_TIMEOUT 5000 // ms, direct association with the cached access point
+#define WIFI_POLL_INTERVAL 10          // ms
+#define WIFI_RSSI_UNKNOWN -128
+
+// Reuse the last DHCP lease as a static address on the next connection,
+// which saves the DHCP round trips. Off by default: the lease's expiry
+// isn't tracked, so the address may have been given to someone else
+// meanwhile. Only turn it on where addresses are reserved or leases long.
+#ifndef WIFI_REUSE_DHCP_LEASE
+#define WIFI_REUSE_DHCP_LEASE 0
+#endif
+
+// Kept in RTC memory between connections
+typedef struct tagWiFiCache
+{
+    uint32_t configCrc; // SSIDs the cache was made for
+    uint32_t ip;        // last DHCP lease, 0 if none
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint8_t bssid[6]; // last access point, channel 0 if none
+    uint8_t channel;
+    uint8_t network; // index in CentralduinoConfig.networks
+    int8_t lastRssi[NET_MAX_NETWORKS];
+} WiFiCache;
+
+// Station mode connection to one of the configured networks.
+//
+// The first try associates directly with the access point (and address) of
+// the last connection, skipping the channel scan and DHCP. When that fails
+// the configured networks are tried by the RSSI they were last seen at: a
+// single network is simply joined by SSID, several are scanned for first
+// and joined through the strongest access point found.
+class WiFiConnectionClass
+{
+  public:
+    bool connect(unsigned long timeoutMs);
+
+  private:
+    void loadCache();
+    void saveCache();
+    bool connectToCachedAccessPoint();
+    bool connectToBestNetwork(unsigned long timeoutMs);
+    bool connectToNetwork(uint8_t index, const uint8_t *bssid, int32_t channel, unsigned long timeoutMs);
+
+    WiFiCache _cache;
+};
+
+extern WiFiConnectionClass WiFiConnection;
+
+#endif // __WIFI_CONNECTION_H
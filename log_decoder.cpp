@@ -0,0 +1,72 @@
+// Centralduino binary log decoder
+//
+// Expands the "~<hex>" lines printed by BinaryLog.dump() using the message
+// catalog the firmware was built with. Other lines pass through unchanged,
+// so a whole serial capture can be piped through it.
+//
+//   g++ -O2 -Ilib/Centralduino -o log_decoder log_decoder.cpp lib/Centralduino/log_record.cpp
+//   ./log_decoder < serial.log
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log_record.h"
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = (char)tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static bool decodeLine(const char *hex, char *text, size_t size)
+{
+    uint8_t record[CLOG_MAX_RECORD];
+    size_t length = 0;
+    while (hex[0] != '\0' && hex[0] != '\r' && hex[0] != '\n')
+    {
+        int high = hexValue(hex[0]);
+        int low = hex[1] != '\0' ? hexValue(hex[1]) : -1;
+        if (high < 0 || low < 0 || length >= sizeof(record))
+            return false;
+        record[length++] = (uint8_t)(high << 4 | low);
+        hex += 2;
+    }
+    return clogFormatRecord(record, length, text, size) > 0;
+}
+
+int main()
+{
+    char line[1024];
+    char text[512];
+    unsigned long undecoded = 0;
+
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+        // Serial captures can carry noise in front of the record
+        const char *start = strchr(line, '~');
+        if (start == NULL)
+        {
+            fputs(line, stdout);
+            continue;
+        }
+
+        if (decodeLine(start + 1, text, sizeof(text)))
+        {
+            puts(text);
+        }
+        else
+        {
+            undecoded++;
+            fputs(line, stdout);
+        }
+    }
+
+    if (undecoded > 0)
+        fprintf(stderr, "%lu record(s) couldn't be decoded, is the catalog from the same build?\n", undecoded);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include "dps_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "defines.h"
+#include "fleet.h"
+
+#define READ_CHUNK 4096
+
+DpsClient::DpsClient(Fleet &fleet) : _fleet(fleet), _addressLength(0)
+{
+    memset(&_address, 0, sizeof(_address));
+}
+
+bool DpsClient::resolve(const std::string &host, uint16_t port)
+{
+    _host = host;
+    return resolveAddress(host, port, _address, _addressLength);
+}
+
+// The part of a JSON body after "name":" up to the next quote
+static std::string jsonString(const std::string &body, const char *name)
+{
+    std::string key = std::string("\"") + name + "\":\"";
+    size_t start = body.find(key);
+    if (start == std::string::npos)
+        return std::string();
+    start += key.size();
+    size_t end = body.find('"', start);
+    return end == std::string::npos ? std::string() : body.substr(start, end - start);
+}
+
+void DpsClient::provision(VirtualDevice *device, const std::string &authorization, uint64_t startedUs)
+{
+    // The library's request, byte for byte
+    const _HubConfig &identity = device->getIdentity();
+    char body[128];
+    int bodyLength = snprintf(body, sizeof(body), "{\"registrationId\":\"%s\"}", identity.device_id);
+    char request[1024];
+    snprintf(request, sizeof(request),
+             "PUT /%s/registrations/%s/register?api-version=2018-11-01 HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "content-type: application/json; charset=utf-8\r\n"
+             "%s\r\n"
+             "accept: */*\r\n"
+             "content-length: %d\r\n"
+             "%s\r\n"
+             "connection: close\r\n"
+             "\r\n"
+             "%s\r\n"
+             "    \r\n",
+             identity.scope_id, identity.device_id, _host.c_str(), AZURE_IOT_CENTRAL_CLIENT_SIGNATURE, bodyLength,
+             authorization.c_str(), body);
+
+    send(request, [this, device, authorization, startedUs](int status, uint32_t retryAfterS, const std::string &response) {
+        std::string operationId = jsonString(response, "operationId");
+        if ((status == 200 || status == 202) && !operationId.empty())
+        {
+            _fleet.getLoop().after(DPS_POLL_INTERVAL, [this, device, authorization, operationId, startedUs]() {
+                poll(device, authorization, operationId, startedUs, 0);
+            });
+            return;
+        }
+
+        // A throttled registration tries again when the service says to,
+        // spread over a second so the retries don't all land together
+        uint32_t delayMs = DPS_RETRY_INTERVAL;
+        if (status == 429)
+            delayMs = std::max(retryAfterS, (uint32_t)1) * 1000 +
+                      std::uniform_int_distribution<uint32_t>(0, 1000)(_fleet.getRandom());
+        retry(device, authorization, startedUs, delayMs);
+    });
+}
+
+void DpsClient::poll(VirtualDevice *device, const std::string &authorization, const std::string &operationId,
+                     uint64_t startedUs, uint32_t attempt)
+{
+    const _HubConfig &identity = device->getIdentity();
+    char request[1024];
+    snprintf(request, sizeof(request),
+             "GET /%s/registrations/%s/operations/%s?api-version=2018-11-01 HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "content-type: application/json; charset=utf-8\r\n"
+             "%s\r\n"
+             "accept: */*\r\n"
+             "%s\r\n"
+             "connection: close\r\n"
+             "\r\n"
+             "\r\n",
+             identity.scope_id, identity.device_id, operationId.c_str(), _host.c_str(),
+             AZURE_IOT_CENTRAL_CLIENT_SIGNATURE, authorization.c_str());
+
+    send(request, [this, device, authorization, operationId, startedUs, attempt](int status, uint32_t,
+                                                                                  const std::string &response) {
+        std::string hub = jsonString(response, "assignedHub");
+        if (status == 200 && !hub.empty())
+        {
+            device->getStats().provisionLatency.add(EventLoop::nowUs() - startedUs);
+            device->getClient().begin(device->getIdentity(), hub.c_str());
+            return;
+        }
+        if (status == 202 && attempt + 1 < DPS_MAX_POLLS)
+        {
+            _fleet.getLoop().after(DPS_POLL_INTERVAL, [this, device, authorization, operationId, startedUs, attempt]() {
+                poll(device, authorization, operationId, startedUs, attempt + 1);
+            });
+            return;
+        }
+        retry(device, authorization, startedUs, DPS_RETRY_INTERVAL);
+    });
+}
+
+void DpsClient::retry(VirtualDevice *device, const std::string &authorization, uint64_t startedUs, uint32_t delayMs)
+{
+    device->getStats().provisionRetries++;
+    _fleet.getLoop().after(delayMs, [this, device, authorization, startedUs]() {
+        provision(device, authorization, startedUs);
+    });
+}
+
+void DpsClient::send(const std::string &request, ResponseHandler onResponse)
+{
+    Exchange *exchange = new Exchange;
+    exchange->connecting = true;
+    exchange->out = request;
+    exchange->onResponse = onResponse;
+    exchange->fd = socket(_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (exchange->fd >= 0 && connect(exchange->fd, (const struct sockaddr *)&_address, _addressLength) != 0 &&
+        errno != EINPROGRESS)
+    {
+        close(exchange->fd);
+        exchange->fd = -1;
+    }
+
+    if (exchange->fd < 0 ||
+        !_fleet.getLoop().add(exchange->fd, EPOLLIN | EPOLLOUT, [this, exchange](uint32_t events) { onEvent(exchange, events); }))
+    {
+        // Reported from the loop, like any other failure
+        _fleet.getLoop().after(0, [this, exchange]() { finish(exchange, false); });
+    }
+}
+
+void DpsClient::onEvent(Exchange *exchange, uint32_t events)
+{
+    if (exchange->connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(exchange->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            finish(exchange, false);
+            return;
+        }
+        exchange->connecting = false;
+    }
+
+    if ((events & EPOLLOUT) && !exchange->out.empty())
+    {
+        ssize_t sent = ::send(exchange->fd, exchange->out.data(), exchange->out.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            finish(exchange, false);
+            return;
+        }
+        if (sent > 0)
+            exchange->out.erase(0, sent);
+        if (exchange->out.empty())
+            _fleet.getLoop().modify(exchange->fd, EPOLLIN);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        char chunk[READ_CHUNK];
+        for (;;)
+        {
+            ssize_t result = recv(exchange->fd, chunk, sizeof(chunk), 0);
+            if (result > 0)
+            {
+                exchange->in.append(chunk, result);
+                continue;
+            }
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            // The server closes the connection after the response
+            finish(exchange, result == 0);
+            return;
+        }
+    }
+}
+
+void DpsClient::finish(Exchange *exchange, bool complete)
+{
+    if (exchange->fd >= 0)
+    {
+        _fleet.getLoop().remove(exchange->fd);
+        close(exchange->fd);
+    }
+
+    int status = 0;
+    uint32_t retryAfterS = 0;
+    std::string body;
+    size_t headEnd = exchange->in.find("\r\n\r\n");
+    if (complete && headEnd != std::string::npos && exchange->in.compare(0, 5, "HTTP/") == 0)
+    {
+        size_t space = exchange->in.find(' ');
+        status = atoi(exchange->in.c_str() + space + 1);
+        for (size_t line = exchange->in.find("\r\n"); line < headEnd; line = exchange->in.find("\r\n", line + 2))
+        {
+            if (strncasecmp(exchange->in.c_str() + line + 2, "retry-after:", 12) == 0)
+                retryAfterS = strtoul(exchange->in.c_str() + line + 14, NULL, 10);
+        }
+        body = exchange->in.substr(headEnd + 4);
+    }
+
+    ResponseHandler onResponse = exchange->onResponse;
+    delete exchange;
+    onResponse(status, retryAfterS, body);
+}
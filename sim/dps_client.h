@@ -0,0 +1,62 @@
+#ifndef __DPS_CLIENT_H
+#define __DPS_CLIENT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <functional>
+#include <string>
+
+class Fleet;
+class VirtualDevice;
+
+// Polls for the assignment this often, like the library
+#define DPS_POLL_INTERVAL 250 // ms
+#define DPS_MAX_POLLS 20
+
+// After a failed registration; the library's gateway retry
+#define DPS_RETRY_INTERVAL 5000 // ms
+
+// Registers devices with a DPS endpoint in the clear, e.g. the stand-in
+// server's. The requests and SAS token are the library's, but they go out
+// from the event loop: the library's own client blocks until the answer,
+// which would stall every other device.
+class DpsClient
+{
+  public:
+    DpsClient(Fleet &fleet);
+
+    bool resolve(const std::string &host, uint16_t port);
+
+    // PUT the registration, poll it until it's assigned, then begin the
+    // device on the hub it was assigned
+    void provision(VirtualDevice *device, const std::string &authorization, uint64_t startedUs);
+
+  private:
+    // status 0 when the exchange failed
+    typedef std::function<void(int status, uint32_t retryAfterS, const std::string &body)> ResponseHandler;
+
+    typedef struct tagExchange
+    {
+        int fd;
+        bool connecting;
+        std::string out;
+        std::string in;
+        ResponseHandler onResponse;
+    } Exchange;
+
+    void poll(VirtualDevice *device, const std::string &authorization, const std::string &operationId,
+              uint64_t startedUs, uint32_t attempt);
+    void retry(VirtualDevice *device, const std::string &authorization, uint64_t startedUs, uint32_t delayMs);
+
+    // One request on its own connection (connection: close)
+    void send(const std::string &request, ResponseHandler onResponse);
+    void onEvent(Exchange *exchange, uint32_t events);
+    void finish(Exchange *exchange, bool complete);
+
+    Fleet &_fleet;
+    std::string _host;
+    struct sockaddr_storage _address;
+    socklen_t _addressLength;
+};
+
+#endif // __DPS_CLIENT_H
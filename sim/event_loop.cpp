@@ -0,0 +1,137 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EVENT_LOOP_BATCH 256
+
+EventLoop::EventLoop() : _generation(0), _nextTimer(1)
+{
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0)
+        perror("epoll_create1");
+}
+
+EventLoop::~EventLoop()
+{
+    if (_epoll >= 0)
+        close(_epoll);
+}
+
+uint64_t EventLoop::nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t EventLoop::nowMs()
+{
+    return nowUs() / 1000;
+}
+
+bool EventLoop::add(int fd, uint32_t events, EventHandler handler)
+{
+    // The generation keeps events of a closed descriptor from reaching the
+    // next one given the same number in the same batch
+    Registration &registration = _registrations[fd];
+    registration.generation = ++_generation;
+    registration.handler = handler;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = (uint64_t)registration.generation << 32 | (uint32_t)fd;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        _registrations.erase(fd);
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events)
+{
+    std::unordered_map<int, Registration>::iterator found = _registrations.find(fd);
+    if (found == _registrations.end())
+        return false;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = (uint64_t)found->second.generation << 32 | (uint32_t)fd;
+    return epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void EventLoop::remove(int fd)
+{
+    if (_registrations.erase(fd) > 0)
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, NULL);
+}
+
+TimerId EventLoop::after(uint32_t delayMs, TimerCallback callback)
+{
+    TimerId id = _nextTimer++;
+    _timers[id] = callback;
+    _timerQueue.push(TimerEntry(nowMs() + delayMs, id));
+    return id;
+}
+
+void EventLoop::cancel(TimerId id)
+{
+    // Left in the queue, skipped when it comes up
+    _timers.erase(id);
+}
+
+void EventLoop::runTimers()
+{
+    uint64_t now = nowMs();
+    while (!_timerQueue.empty() && _timerQueue.top().first <= now)
+    {
+        TimerId id = _timerQueue.top().second;
+        _timerQueue.pop();
+
+        std::unordered_map<TimerId, TimerCallback>::iterator found = _timers.find(id);
+        if (found == _timers.end())
+            continue;
+        TimerCallback callback = found->second;
+        _timers.erase(found);
+        callback();
+    }
+}
+
+void EventLoop::runOnce(uint32_t maxWaitMs)
+{
+    runTimers();
+
+    uint64_t now = nowMs();
+    while (!_timerQueue.empty() && _timers.find(_timerQueue.top().second) == _timers.end())
+        _timerQueue.pop();
+    if (!_timerQueue.empty())
+    {
+        uint64_t due = _timerQueue.top().first;
+        if (due <= now)
+            maxWaitMs = 0;
+        else if (due - now < maxWaitMs)
+            maxWaitMs = (uint32_t)(due - now);
+    }
+
+    struct epoll_event events[EVENT_LOOP_BATCH];
+    int count = epoll_wait(_epoll, events, EVENT_LOOP_BATCH, (int)maxWaitMs);
+    if (count < 0 && errno != EINTR)
+        perror("epoll_wait");
+
+    for (int i = 0; i < count; i++)
+    {
+        int fd = (int)(uint32_t)events[i].data.u64;
+        uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+        std::unordered_map<int, Registration>::iterator found = _registrations.find(fd);
+        if (found == _registrations.end() || found->second.generation != generation)
+            continue;
+
+        // The handler may remove itself
+        EventHandler handler = found->second.handler;
+        handler(events[i].events);
+    }
+}
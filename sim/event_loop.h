@@ -0,0 +1,58 @@
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+typedef std::function<void(uint32_t events)> EventHandler;
+typedef std::function<void()> TimerCallback;
+typedef uint64_t TimerId;
+
+// Single threaded epoll loop with one-shot timers. Times are in ms of the
+// real monotonic clock, not the host build's millis(), which delay()
+// moves forward.
+class EventLoop
+{
+  public:
+    EventLoop();
+    ~EventLoop();
+
+    static uint64_t nowMs();
+    static uint64_t nowUs();
+
+    // events are EPOLLIN, EPOLLOUT etc.
+    bool add(int fd, uint32_t events, EventHandler handler);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    TimerId after(uint32_t delayMs, TimerCallback callback);
+    void cancel(TimerId id);
+
+    // Runs the due timers, then waits up to maxWaitMs (less if a timer
+    // comes due first) and dispatches the events
+    void runOnce(uint32_t maxWaitMs);
+
+  private:
+    typedef struct tagRegistration
+    {
+        uint32_t generation;
+        EventHandler handler;
+    } Registration;
+
+    typedef std::pair<uint64_t, TimerId> TimerEntry; // due, id
+
+    void runTimers();
+
+    int _epoll;
+    uint32_t _generation;
+    std::unordered_map<int, Registration> _registrations;
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry> > _timerQueue;
+    std::unordered_map<TimerId, TimerCallback> _timers;
+    TimerId _nextTimer;
+};
+
+#endif // __EVENT_LOOP_H
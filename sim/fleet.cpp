@@ -0,0 +1,415 @@
+#include "fleet.h"
+
+#include <netdb.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+
+#include <ESP8266WiFi.h>
+
+#include "azure_dps.h"
+#include "host_heap.h"
+
+#define HOUSEKEEPING_INTERVAL 1000 // ms
+
+Fleet::Fleet(const FleetOptions &options)
+    : _options(options), _random(options.seed), _brokerLength(0), _dps(*this), _dpsNextSlotMs(0), _throttleTokens(0),
+      _throttleRefilledUs(0), _releaseScheduled(false), _startedMs(0), _endsMs(0), _libraryPollUs(0), _heapPerDevice(0),
+      _cpuS(0), _lastProgressAcked(0), _lastProgressPublished(0)
+{
+    memset(&_broker, 0, sizeof(_broker));
+}
+
+Fleet::~Fleet()
+{
+    FakeMqtt::setBackend(NULL);
+    for (size_t i = 0; i < _devices.size(); i++)
+        delete _devices[i];
+}
+
+bool resolveAddress(const std::string &host, uint16_t port, struct sockaddr_storage &address, socklen_t &length)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    char service[8];
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+    struct addrinfo *result;
+    int error = getaddrinfo(host.c_str(), service, &hints, &result);
+    if (error != 0)
+    {
+        fprintf(stderr, "Can't resolve %s: %s\n", host.c_str(), gai_strerror(error));
+        return false;
+    }
+
+    memcpy(&address, result->ai_addr, result->ai_addrlen);
+    length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+bool Fleet::start()
+{
+    if (!resolveAddress(_options.brokerHost, _options.brokerPort, _broker, _brokerLength))
+        return false;
+    if (!_options.dpsHost.empty() && !_dps.resolve(_options.dpsHost, _options.dpsPort))
+        return false;
+
+    // A socket per device
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < _options.devices + 64)
+        fprintf(stderr, "warning: only %lu file descriptors for %u devices\n", (unsigned long)limit.rlim_cur,
+                (unsigned)_options.devices);
+
+    // The library's clients connect through the fleet
+    FakeNet::setReachable(true);
+    FakeMqtt::setBackend(this);
+
+    size_t heapBefore = hostHeapStats().currentBytes;
+    _devices.reserve(_options.devices);
+    for (uint32_t i = 0; i < _options.devices; i++)
+    {
+        VirtualDevice *device = new VirtualDevice(*this, i);
+        _devices.push_back(device);
+        _byId[device->getId()] = device;
+    }
+    _heapPerDevice = _options.devices > 0 ? (hostHeapStats().currentBytes - heapBefore) / _options.devices : 0;
+
+    uint32_t periodMs = _options.sampleRate > 0 ? (uint32_t)(1000 / _options.sampleRate) : 0;
+    for (size_t i = 0; i < _devices.size(); i++)
+    {
+        VirtualDevice *device = _devices[i];
+        uint32_t startMs = _options.rampS > 0 ? std::uniform_int_distribution<uint32_t>(0, _options.rampS * 1000)(_random) : 0;
+        _loop.after(startMs, [this, device]() { provision(device); });
+        if (periodMs > 0)
+            scheduleSample(device, startMs + std::uniform_int_distribution<uint32_t>(0, periodMs)(_random));
+        if (_options.dropIntervalS > 0)
+            scheduleDrop(device);
+    }
+
+    if (_options.stormAtS > 0)
+    {
+        _loop.after(_options.stormAtS * 1000, [this]() {
+            printf("  reconnect storm: dropping every link\n");
+            for (size_t i = 0; i < _devices.size(); i++)
+                _devices[i]->drop(DROP_STORM);
+        });
+    }
+
+    _loop.after(HOUSEKEEPING_INTERVAL, [this]() { housekeeping(); });
+    if (_options.reportIntervalS > 0)
+        _loop.after(_options.reportIntervalS * 1000, [this]() { progress(); });
+    return true;
+}
+
+void Fleet::run()
+{
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    _startedMs = EventLoop::nowMs();
+    _endsMs = _startedMs + (uint64_t)_options.durationS * 1000;
+    _throttleRefilledUs = EventLoop::nowUs();
+
+    while (EventLoop::nowMs() < _endsMs)
+    {
+        // Any instance services all of them: connects, token refreshes
+        uint64_t startedUs = EventLoop::nowUs();
+        uint32_t idle = Centralduino.poll();
+        _libraryPollUs += EventLoop::nowUs() - startedUs;
+
+        _loop.runOnce(idle);
+    }
+
+    getrusage(RUSAGE_SELF, &after);
+    _cpuS = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+            ((after.ru_utime.tv_usec - before.ru_utime.tv_usec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / 1e6;
+
+    for (size_t i = 0; i < _devices.size(); i++)
+        _devices[i]->getClient().end();
+}
+
+void Fleet::provision(VirtualDevice *device)
+{
+    // The device's side of DPS is the library's: the registration's SAS
+    uint64_t startedUs = EventLoop::nowUs();
+    char authorization[256];
+    size_t length;
+    AzureDps.getDPSAuthString(device->getIdentity().scope_id, device->getId(), device->getIdentity().sas_key,
+                              authorization, sizeof(authorization), length);
+    device->getStats().libraryUs += EventLoop::nowUs() - startedUs;
+    device->getStats().provisions++;
+    if (!_options.dpsHost.empty())
+    {
+        _dps.provision(device, authorization, startedUs);
+        return;
+    }
+
+    // The service's side is a queue: one registration every 1/dpsRate s
+    uint64_t now = EventLoop::nowMs();
+    uint64_t slot = std::max(now, _dpsNextSlotMs);
+    if (_options.dpsRate > 0)
+        _dpsNextSlotMs = slot + (uint64_t)(1000 / _options.dpsRate);
+    uint64_t doneMs = slot + _options.dpsLatencyMs;
+
+    _loop.after((uint32_t)(doneMs - now), [this, device, startedUs]() {
+        device->getStats().provisionLatency.add(EventLoop::nowUs() - startedUs);
+        device->getClient().begin(device->getIdentity(), _options.hubName.c_str());
+    });
+}
+
+void Fleet::scheduleSample(VirtualDevice *device, uint32_t delayMs)
+{
+    _loop.after(delayMs, [this, device]() {
+        if (EventLoop::nowMs() >= _endsMs && _endsMs != 0)
+            return;
+        device->sample();
+        scheduleSample(device, (uint32_t)(1000 / _options.sampleRate));
+    });
+}
+
+void Fleet::scheduleDrop(VirtualDevice *device)
+{
+    std::exponential_distribution<double> interval(1 / _options.dropIntervalS);
+    _loop.after((uint32_t)(interval(_random) * 1000), [this, device]() {
+        device->drop(DROP_LINK);
+        scheduleDrop(device);
+    });
+}
+
+bool Fleet::admitPublish(VirtualDevice *device, uint32_t session)
+{
+    if (_options.throttleRate <= 0)
+        return true;
+
+    // A token bucket holding up to a second's worth
+    uint64_t now = EventLoop::nowUs();
+    _throttleTokens = std::min(_options.throttleRate, _throttleTokens + (now - _throttleRefilledUs) * _options.throttleRate / 1e6);
+    _throttleRefilledUs = now;
+    if (_held.empty() && _throttleTokens >= 1)
+    {
+        _throttleTokens--;
+        return true;
+    }
+
+    HeldEntry entry = {device, session};
+    _held.push_back(entry);
+    if (!_releaseScheduled)
+    {
+        _releaseScheduled = true;
+        _loop.after((uint32_t)(1000 / _options.throttleRate) + 1, [this]() { releaseHeld(); });
+    }
+    return false;
+}
+
+void Fleet::releaseHeld()
+{
+    _releaseScheduled = false;
+    uint64_t now = EventLoop::nowUs();
+    _throttleTokens = std::min(_options.throttleRate, _throttleTokens + (now - _throttleRefilledUs) * _options.throttleRate / 1e6);
+    _throttleRefilledUs = now;
+
+    while (!_held.empty() && _throttleTokens >= 1)
+    {
+        HeldEntry entry = _held.front();
+        _held.pop_front();
+        if (entry.device->releaseHeld(entry.session))
+            _throttleTokens--;
+    }
+
+    if (!_held.empty())
+    {
+        _releaseScheduled = true;
+        _loop.after((uint32_t)(1000 / _options.throttleRate) + 1, [this]() { releaseHeld(); });
+    }
+}
+
+void Fleet::housekeeping()
+{
+    uint64_t now = EventLoop::nowMs();
+    for (size_t i = 0; i < _devices.size(); i++)
+        _devices[i]->keepAlive(now);
+    _loop.after(HOUSEKEEPING_INTERVAL, [this]() { housekeeping(); });
+}
+
+void Fleet::progress()
+{
+    uint32_t online = 0, published = 0, acked = 0;
+    for (size_t i = 0; i < _devices.size(); i++)
+    {
+        online += _devices[i]->isOnline() ? 1 : 0;
+        published += _devices[i]->getStats().published;
+        acked += _devices[i]->getStats().acked;
+    }
+
+    printf("  %5us  online %u/%u  published %.0f/s  acked %.0f/s  held %u\n",
+           (unsigned)((EventLoop::nowMs() - _startedMs) / 1000), (unsigned)online, (unsigned)_devices.size(),
+           (double)(published - _lastProgressPublished) / _options.reportIntervalS,
+           (double)(acked - _lastProgressAcked) / _options.reportIntervalS, (unsigned)_held.size());
+    fflush(stdout);
+    _lastProgressPublished = published;
+    _lastProgressAcked = acked;
+    _loop.after(_options.reportIntervalS * 1000, [this]() { progress(); });
+}
+
+///////////////////////////////////////////////////////////////////
+// FakeMqttBackend, every device's client comes through here
+
+bool Fleet::connect(PubSubClient *client, const char *id, const char *user, const char *password, bool cleanSession)
+{
+    std::unordered_map<std::string, VirtualDevice *>::iterator found = _byId.find(id);
+    if (found == _byId.end())
+        return false;
+    _byClient[client] = found->second;
+    return found->second->open(client, user, password, cleanSession);
+}
+
+bool Fleet::publish(PubSubClient *client, const char *topic, const uint8_t *payload, unsigned int length)
+{
+    std::unordered_map<PubSubClient *, VirtualDevice *>::iterator found = _byClient.find(client);
+    return found != _byClient.end() && found->second->publish(topic, payload, length);
+}
+
+bool Fleet::subscribe(PubSubClient *client, const char *topic, uint8_t qos)
+{
+    std::unordered_map<PubSubClient *, VirtualDevice *>::iterator found = _byClient.find(client);
+    return found != _byClient.end() && found->second->subscribe(topic, qos);
+}
+
+void Fleet::disconnect(PubSubClient *client)
+{
+    std::unordered_map<PubSubClient *, VirtualDevice *>::iterator found = _byClient.find(client);
+    if (found != _byClient.end())
+        found->second->disconnect();
+}
+
+///////////////////////////////////////////////////////////////////
+// Reports
+
+static void printLatency(FILE *out, const char *name, const LatencyHistogram &histogram)
+{
+    if (histogram.getCount() == 0)
+    {
+        fprintf(out, "  %-22s none\n", name);
+        return;
+    }
+    fprintf(out, "  %-22s p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f  mean %8.2f ms (%u)\n", name,
+            histogram.percentileUs(50) / 1000.0, histogram.percentileUs(90) / 1000.0, histogram.percentileUs(99) / 1000.0,
+            histogram.percentileUs(99.9) / 1000.0, histogram.getMaxUs() / 1000.0, histogram.getMeanUs() / 1000.0,
+            (unsigned)histogram.getCount());
+}
+
+void Fleet::report(FILE *out)
+{
+    DeviceStats total = DeviceStats();
+    std::vector<double> rates;
+    VirtualDevice *slowest = NULL;
+    double seconds = _options.durationS;
+
+    for (size_t i = 0; i < _devices.size(); i++)
+    {
+        DeviceStats &stats = _devices[i]->getStats();
+        total.samples += stats.samples;
+        total.samplesOffline += stats.samplesOffline;
+        total.published += stats.published;
+        total.publishFailures += stats.publishFailures;
+        total.acked += stats.acked;
+        total.lost += stats.lost;
+        total.throttled += stats.throttled;
+        total.received += stats.received;
+        total.methodCalls += stats.methodCalls;
+        total.bytesOut += stats.bytesOut;
+        total.connects += stats.connects;
+        total.connacks += stats.connacks;
+        for (int reason = 0; reason < DROP_REASON_COUNT; reason++)
+            total.drops[reason] += stats.drops[reason];
+        total.provisions += stats.provisions;
+        total.provisionRetries += stats.provisionRetries;
+        total.libraryUs += stats.libraryUs;
+        total.publishLatency.merge(stats.publishLatency);
+        total.connectLatency.merge(stats.connectLatency);
+        total.provisionLatency.merge(stats.provisionLatency);
+
+        rates.push_back(stats.published / seconds);
+        if (slowest == NULL || stats.publishLatency.percentileUs(99) > slowest->getStats().publishLatency.percentileUs(99))
+            slowest = _devices[i];
+    }
+    std::sort(rates.begin(), rates.end());
+
+    uint32_t devices = _devices.size();
+    fprintf(out, "\n%u devices for %u s, %.2f samples/s each, QoS %u\n", (unsigned)devices, (unsigned)_options.durationS,
+            _options.sampleRate, (unsigned)_options.qos);
+
+    fprintf(out, "Provisioning: %u registrations, %u retried\n", (unsigned)total.provisions,
+            (unsigned)total.provisionRetries);
+    printLatency(out, "register to assigned", total.provisionLatency);
+
+    fprintf(out, "Connections: %u CONNECTs, %u accepted\n", (unsigned)total.connects, (unsigned)total.connacks);
+    printLatency(out, "CONNECT to CONNACK", total.connectLatency);
+    fprintf(out, "  drops: link %u, storm %u, token expired %u, refused %u, socket %u\n", (unsigned)total.drops[DROP_LINK],
+            (unsigned)total.drops[DROP_STORM], (unsigned)total.drops[DROP_TOKEN_EXPIRED], (unsigned)total.drops[DROP_REFUSED],
+            (unsigned)total.drops[DROP_SOCKET]);
+
+    fprintf(out, "Telemetry: %u samples (%u while offline), %u publishes (%.1f/s), %u acked (%.1f/s)\n",
+            (unsigned)total.samples, (unsigned)total.samplesOffline, (unsigned)total.published, total.published / seconds,
+            (unsigned)total.acked, total.acked / seconds);
+    fprintf(out, "  %u failed, %u lost with their connection, %u held by the throttle, %.1f KB/s out\n",
+            (unsigned)total.publishFailures, (unsigned)total.lost, (unsigned)total.throttled, total.bytesOut / seconds / 1024);
+    fprintf(out, "Received: %u messages, %u method calls answered\n", (unsigned)total.received,
+            (unsigned)total.methodCalls);
+    printLatency(out, "publish to PUBACK", total.publishLatency);
+    if (!rates.empty())
+        fprintf(out, "  per device: min %.2f  median %.2f  max %.2f publishes/s\n", rates.front(), rates[rates.size() / 2],
+                rates.back());
+    if (slowest != NULL && slowest->getStats().publishLatency.getCount() > 0)
+        fprintf(out, "  slowest device: %s, p99 %.2f ms\n", slowest->getId(),
+                slowest->getStats().publishLatency.percentileUs(99) / 1000.0);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, "Cost: %.2f CPU s (%.1f%% of a core), %.1f us CPU per device-second\n", _cpuS, 100 * _cpuS / seconds,
+            devices > 0 ? _cpuS * 1e6 / devices / seconds : 0);
+    fprintf(out, "  library: %.1f%% in poll(), %.1f us per sendMeasurement() and DPS auth string\n",
+            _cpuS > 0 ? 100 * _libraryPollUs / 1e6 / _cpuS : 0,
+            total.samples - total.samplesOffline + total.provisions > 0
+                ? (double)total.libraryUs / (total.samples - total.samplesOffline + total.provisions)
+                : 0);
+    fprintf(out, "  memory: %u B per client instance, %u B heap per virtual device, %lu KB max RSS (%.1f KB per device)\n",
+            (unsigned)sizeof(CentralduinoClass), (unsigned)_heapPerDevice, (unsigned long)usage.ru_maxrss,
+            devices > 0 ? (double)usage.ru_maxrss / devices : 0);
+}
+
+bool Fleet::writeCsv(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    fprintf(file, "device,samples,offline,published,acked,lost,throttled,received,bytes_out,connects,connacks,"
+                  "drops,provisions,p50_us,p99_us,max_us,connect_p50_us,library_us\n");
+    for (size_t i = 0; i < _devices.size(); i++)
+    {
+        DeviceStats &stats = _devices[i]->getStats();
+        uint32_t drops = 0;
+        for (int reason = 0; reason < DROP_REASON_COUNT; reason++)
+            drops += stats.drops[reason];
+        fprintf(file, "%s,%u,%u,%u,%u,%u,%u,%u,%llu,%u,%u,%u,%u,%llu,%llu,%llu,%llu,%llu\n", _devices[i]->getId(),
+                (unsigned)stats.samples, (unsigned)stats.samplesOffline, (unsigned)stats.published, (unsigned)stats.acked,
+                (unsigned)stats.lost, (unsigned)stats.throttled, (unsigned)stats.received, (unsigned long long)stats.bytesOut,
+                (unsigned)stats.connects, (unsigned)stats.connacks, (unsigned)drops, (unsigned)stats.provisions,
+                (unsigned long long)stats.publishLatency.percentileUs(50), (unsigned long long)stats.publishLatency.percentileUs(99),
+                (unsigned long long)stats.publishLatency.getMaxUs(), (unsigned long long)stats.connectLatency.percentileUs(50),
+                (unsigned long long)stats.libraryUs);
+    }
+    fclose(file);
+    return true;
+}
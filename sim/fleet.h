@@ -0,0 +1,116 @@
+#ifndef __FLEET_H
+#define __FLEET_H
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <PubSubClient.h>
+
+#include "dps_client.h"
+#include "event_loop.h"
+#include "virtual_device.h"
+
+typedef struct tagFleetOptions
+{
+    uint32_t devices;
+    std::string brokerHost;
+    uint16_t brokerPort;
+    std::string hubName;    // the devices' hub host name, for their SAS tokens; the broker host if empty
+    std::string dpsHost;    // a DPS endpoint to register with over HTTP, empty to model one
+    uint16_t dpsPort;
+    double sampleRate;      // per device, Hz
+    uint32_t durationS;
+    uint32_t rampS;         // device starts are spread over this
+    uint8_t qos;            // on the wire; 1 measures publish latency
+    double dpsRate;         // registrations the modeled provisioning service takes per second, 0 for no limit
+    uint32_t dpsLatencyMs;  // per registration, modeled
+    bool reprovision;       // dropped devices go through provisioning again
+    double dropIntervalS;   // mean time between link drops per device, 0 for none
+    uint32_t stormAtS;      // drop every link at this time, 0 for none
+    uint32_t tokenLifetimeS; // the broker drops connections this long after they're made, 0 for never
+    double throttleRate;    // publishes the hub takes per second across the fleet, 0 for no limit
+    uint32_t reportIntervalS;
+    uint32_t seed;
+} FleetOptions;
+
+bool resolveAddress(const std::string &host, uint16_t port, struct sockaddr_storage &address, socklen_t &length);
+
+// Runs the virtual devices on one epoll loop. It is the FakeMqttBackend of
+// every device's client, and plays the parts of the provisioning service
+// (a queue with a rate limit, unless given a real endpoint) and the hub's
+// throttling (publishes over the fleet-wide rate are held back).
+// Everything else is the library's code and a real broker.
+class Fleet : public FakeMqttBackend
+{
+  public:
+    Fleet(const FleetOptions &options);
+    ~Fleet();
+
+    bool start();
+    void run();
+    void report(FILE *out);
+    bool writeCsv(const char *path);
+
+    EventLoop &getLoop() { return _loop; }
+    const FleetOptions &getOptions() { return _options; }
+    const struct sockaddr *getBrokerAddress() { return (const struct sockaddr *)&_broker; }
+    socklen_t getBrokerAddressLength() { return _brokerLength; }
+    std::mt19937 &getRandom() { return _random; }
+
+    // Sends now, or holds the publish back until the hub's rate allows it
+    bool admitPublish(VirtualDevice *device, uint32_t session);
+
+    // Runs the device through the provisioning service, then starts it
+    void provision(VirtualDevice *device);
+
+    bool connect(PubSubClient *client, const char *id, const char *user, const char *password, bool cleanSession);
+    bool publish(PubSubClient *client, const char *topic, const uint8_t *payload, unsigned int length);
+    bool subscribe(PubSubClient *client, const char *topic, uint8_t qos);
+    void disconnect(PubSubClient *client);
+
+  private:
+    typedef struct tagHeldEntry
+    {
+        VirtualDevice *device;
+        uint32_t session;
+    } HeldEntry;
+
+    void scheduleSample(VirtualDevice *device, uint32_t delayMs);
+    void scheduleDrop(VirtualDevice *device);
+    void releaseHeld();
+    void housekeeping();
+    void progress();
+
+    FleetOptions _options;
+    EventLoop _loop;
+    std::mt19937 _random;
+    struct sockaddr_storage _broker;
+    socklen_t _brokerLength;
+
+    std::vector<VirtualDevice *> _devices;
+    std::unordered_map<std::string, VirtualDevice *> _byId;
+    std::unordered_map<PubSubClient *, VirtualDevice *> _byClient;
+
+    DpsClient _dps;
+
+    uint64_t _dpsNextSlotMs;
+    double _throttleTokens;
+    uint64_t _throttleRefilledUs;
+    std::deque<HeldEntry> _held;
+    bool _releaseScheduled;
+
+    uint64_t _startedMs;
+    uint64_t _endsMs;
+    uint64_t _libraryPollUs;
+    size_t _heapPerDevice;
+    double _cpuS;
+    uint32_t _lastProgressAcked;
+    uint32_t _lastProgressPublished;
+};
+
+#endif // __FLEET_H
@@ -0,0 +1,66 @@
+#include "latency_histogram.h"
+
+#include <string.h>
+
+LatencyHistogram::LatencyHistogram() : _count(0), _sumUs(0), _maxUs(0)
+{
+    memset(_buckets, 0, sizeof(_buckets));
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t us)
+{
+    if (us < LATENCY_SUB_BUCKETS)
+        return (size_t)us;
+
+    // Top 4 bits pick the bucket: the leading one and 3 below it
+    int shift = 63 - __builtin_clzll(us) - 3;
+    size_t bucket = (size_t)(shift + 1) * LATENCY_SUB_BUCKETS + ((us >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::upperEdge(size_t bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    int shift = (int)(bucket / LATENCY_SUB_BUCKETS) - 1;
+    uint64_t mantissa = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::add(uint64_t us)
+{
+    _buckets[bucketOf(us)]++;
+    _count++;
+    _sumUs += us;
+    if (us > _maxUs)
+        _maxUs = us;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        _buckets[i] += other._buckets[i];
+    _count += other._count;
+    _sumUs += other._sumUs;
+    if (other._maxUs > _maxUs)
+        _maxUs = other._maxUs;
+}
+
+uint64_t LatencyHistogram::percentileUs(double p) const
+{
+    if (_count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p / 100 * _count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += _buckets[i];
+        if (seen >= rank)
+            return upperEdge(i) < _maxUs ? upperEdge(i) : _maxUs;
+    }
+    return _maxUs;
+}
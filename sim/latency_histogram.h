@@ -0,0 +1,38 @@
+#ifndef __LATENCY_HISTOGRAM_H
+#define __LATENCY_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear buckets: 8 per power of two, so any percentile is within
+// 12.5% of the real value, from 1 us up to about four minutes
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS 200
+
+// Small enough to keep one per virtual device
+class LatencyHistogram
+{
+  public:
+    LatencyHistogram();
+
+    void add(uint64_t us);
+    void merge(const LatencyHistogram &other);
+
+    uint32_t getCount() const { return _count; }
+    uint64_t getMaxUs() const { return _maxUs; }
+    double getMeanUs() const { return _count > 0 ? (double)_sumUs / _count : 0; }
+
+    // p from 0 to 100, the upper edge of the bucket it falls in
+    uint64_t percentileUs(double p) const;
+
+  private:
+    static size_t bucketOf(uint64_t us);
+    static uint64_t upperEdge(size_t bucket);
+
+    uint32_t _buckets[LATENCY_BUCKETS];
+    uint32_t _count;
+    uint64_t _sumUs;
+    uint64_t _maxUs;
+};
+
+#endif // __LATENCY_HISTOGRAM_H
@@ -0,0 +1,187 @@
+// Fleet load simulator: runs many virtual devices, each a gateway-mode
+// client of the library, against a local MQTT broker.
+//
+//   pio run -e simulator && .pio/build/simulator/program --devices 1000 --rate 0.5
+//
+// Provisioning, token expiry and throttling are the parts of DPS and the
+// hub the simulator plays itself, see fleet.h. Any MQTT 3.1.1 broker will
+// do, e.g. mosquitto on port 1883, or the stand-in server, which also
+// serves DPS (--dps) and checks the SAS tokens; see standin/e2e.sh.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fleet.h"
+
+static void usage()
+{
+    printf("usage: program [options]\n"
+           "  --devices N          virtual devices (100)\n"
+           "  --broker HOST[:PORT] MQTT broker (127.0.0.1:1883)\n"
+           "  --hub NAME           hub host name the devices sign their tokens for (the broker host)\n"
+           "  --dps HOST[:PORT]    register with this DPS endpoint over HTTP instead of modeling one\n"
+           "  --rate HZ            samples per second per device (1)\n"
+           "  --duration S         length of the run (60)\n"
+           "  --ramp S             spread the device starts over S seconds (0, all at once)\n"
+           "  --qos 0|1            QoS of the publishes; 1 measures their latency (1)\n"
+           "  --dps-rate R         registrations per second the modeled provisioning service takes (0, no limit)\n"
+           "  --dps-latency MS     time for each modeled registration (0)\n"
+           "  --reprovision        dropped devices register again before reconnecting\n"
+           "  --drop-interval S    mean time between link drops per device (0, none)\n"
+           "  --storm-at S         drop every link at once at S seconds (0, never)\n"
+           "  --token-lifetime S   the broker ends connections S seconds after they're made (0, never)\n"
+           "  --throttle R         publishes per second the hub takes across the fleet (0, no limit)\n"
+           "  --report S           progress line every S seconds (5, 0 for none)\n"
+           "  --csv FILE           per device results\n"
+           "  --seed N             random seed (1)\n");
+}
+
+// HOST or HOST:PORT; the port is left as it is without one
+static void parseHostPort(const char *text, std::string &host, uint16_t &port)
+{
+    const char *colon = strrchr(text, ':');
+    if (colon != NULL)
+    {
+        host.assign(text, colon - text);
+        port = (uint16_t)strtoul(colon + 1, NULL, 10);
+    }
+    else
+    {
+        host = text;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FleetOptions options;
+    options.devices = 100;
+    options.brokerHost = "127.0.0.1";
+    options.brokerPort = 1883;
+    options.dpsPort = 80;
+    options.sampleRate = 1;
+    options.durationS = 60;
+    options.rampS = 0;
+    options.qos = 1;
+    options.dpsRate = 0;
+    options.dpsLatencyMs = 0;
+    options.reprovision = false;
+    options.dropIntervalS = 0;
+    options.stormAtS = 0;
+    options.tokenLifetimeS = 0;
+    options.throttleRate = 0;
+    options.reportIntervalS = 5;
+    options.seed = 1;
+    const char *csvPath = NULL;
+
+    static const struct option longOptions[] = {
+        {"devices", required_argument, NULL, 'n'},
+        {"broker", required_argument, NULL, 'b'},
+        {"hub", required_argument, NULL, 'H'},
+        {"dps", required_argument, NULL, 'E'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"ramp", required_argument, NULL, 'R'},
+        {"qos", required_argument, NULL, 'q'},
+        {"dps-rate", required_argument, NULL, 'p'},
+        {"dps-latency", required_argument, NULL, 'l'},
+        {"reprovision", no_argument, NULL, 'P'},
+        {"drop-interval", required_argument, NULL, 'D'},
+        {"storm-at", required_argument, NULL, 's'},
+        {"token-lifetime", required_argument, NULL, 't'},
+        {"throttle", required_argument, NULL, 'T'},
+        {"report", required_argument, NULL, 'i'},
+        {"csv", required_argument, NULL, 'c'},
+        {"seed", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:b:r:d:h", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            options.devices = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            parseHostPort(optarg, options.brokerHost, options.brokerPort);
+            break;
+        case 'H':
+            options.hubName = optarg;
+            break;
+        case 'E':
+            parseHostPort(optarg, options.dpsHost, options.dpsPort);
+            break;
+        case 'r':
+            options.sampleRate = strtod(optarg, NULL);
+            break;
+        case 'd':
+            options.durationS = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            options.rampS = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            options.qos = strtoul(optarg, NULL, 10) > 0 ? 1 : 0;
+            break;
+        case 'p':
+            options.dpsRate = strtod(optarg, NULL);
+            break;
+        case 'l':
+            options.dpsLatencyMs = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            options.reprovision = true;
+            break;
+        case 'D':
+            options.dropIntervalS = strtod(optarg, NULL);
+            break;
+        case 's':
+            options.stormAtS = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            options.tokenLifetimeS = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            options.throttleRate = strtod(optarg, NULL);
+            break;
+        case 'i':
+            options.reportIntervalS = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            csvPath = optarg;
+            break;
+        case 'S':
+            options.seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return option == 'h' ? 0 : 2;
+        }
+    }
+
+    if (options.devices == 0 || options.durationS == 0)
+    {
+        usage();
+        return 2;
+    }
+
+    if (options.hubName.empty())
+        options.hubName = options.brokerHost;
+
+    Fleet fleet(options);
+    printf("Starting %u devices against %s:%u\n", (unsigned)options.devices, options.brokerHost.c_str(),
+           (unsigned)options.brokerPort);
+    if (!options.dpsHost.empty())
+        printf("Registering with DPS at %s:%u\n", options.dpsHost.c_str(), (unsigned)options.dpsPort);
+    if (!fleet.start())
+        return 1;
+
+    fleet.run();
+    fleet.report(stdout);
+    if (csvPath != NULL && !fleet.writeCsv(csvPath))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,385 @@
+#include "virtual_device.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fleet.h"
+
+// Every device uses the same key; the signatures still differ by device id
+#define SIM_SCOPE_ID "0neSIMULATE"
+#define SIM_DEVICE_KEY "wZ1b4Zp0j6Q7mYx2bV8kq3Q2n1v0c5T6r7E8w9Y0a1s="
+
+#define READ_CHUNK 4096
+
+VirtualDevice::VirtualDevice(Fleet &fleet, uint32_t index)
+    : _fleet(fleet), _index(index), _mqtt(NULL), _stats(), _fd(-1), _session(0), _connecting(false), _connacked(false),
+      _wantWrite(false), _connectStartedUs(0), _lastSentMs(0), _nextPacketId(1)
+{
+    memset(&_identity, 0, sizeof(_identity));
+    strlcpy(_identity.scope_id, SIM_SCOPE_ID, sizeof(_identity.scope_id));
+    snprintf(_identity.device_id, sizeof(_identity.device_id), "sim-device-%06u", (unsigned)index);
+    strlcpy(_identity.sas_key, SIM_DEVICE_KEY, sizeof(_identity.sas_key));
+    _client.registerDeviceMethod(DEVICE_METHOD, [this]() {
+        _stats.methodCalls++;
+        return true;
+    });
+}
+
+VirtualDevice::~VirtualDevice()
+{
+    closeSocket();
+}
+
+void VirtualDevice::sample()
+{
+    _stats.samples++;
+    if (!isOnline())
+    {
+        _stats.samplesOffline++;
+        return;
+    }
+
+    // A slow wave, different for every device
+    double value = 20 + 5 * sin(EventLoop::nowMs() / 60000.0 + _index);
+    uint64_t startedUs = EventLoop::nowUs();
+    _client.sendMeasurement("temp", round(value * 10) / 10);
+    _stats.libraryUs += EventLoop::nowUs() - startedUs;
+}
+
+void VirtualDevice::keepAlive(uint64_t nowMs)
+{
+    if (!isOnline() || nowMs - _lastSentMs < DEVICE_KEEPALIVE * 1000 / 2)
+        return;
+
+    std::string packet;
+    mqttEncodeEmpty(packet, MQTT_PACKET_PINGREQ);
+    send(packet);
+}
+
+bool VirtualDevice::open(PubSubClient *client, const char *user, const char *password, bool cleanSession)
+{
+    closeSocket();
+    _mqtt = client;
+    _session++;
+
+    // Failures are reported later, like a connect that times out, so the
+    // library keeps its hub instead of going back to DPS (which the
+    // simulator doesn't serve)
+    _fd = socket(_fleet.getBrokerAddress()->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_fd >= 0)
+    {
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(_fd, _fleet.getBrokerAddress(), _fleet.getBrokerAddressLength()) != 0 && errno != EINPROGRESS)
+            closeSocket();
+    }
+    if (_fd < 0)
+    {
+        uint32_t session = _session;
+        _stats.connects++;
+        _stats.drops[DROP_SOCKET]++;
+        _fleet.getLoop().after(0, [this, session]() {
+            if (session == _session && _mqtt != NULL)
+                _mqtt->setConnected(false);
+        });
+        return true;
+    }
+
+    _connecting = true;
+    _wantWrite = true;
+    _fleet.getLoop().add(_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this](uint32_t events) { onEvent(events); });
+
+    // Sent once the TCP handshake is done, the library carries on (and
+    // subscribes) meanwhile, as it would with a broker that's slow to answer
+    std::string packet;
+    mqttEncodeConnect(packet, _identity.device_id, user, password, DEVICE_KEEPALIVE, cleanSession);
+    send(packet);
+    _connectStartedUs = EventLoop::nowUs();
+    _stats.connects++;
+    return true;
+}
+
+bool VirtualDevice::publish(const char *topic, const uint8_t *payload, unsigned int length)
+{
+    if (_fd < 0)
+    {
+        _stats.publishFailures++;
+        return false;
+    }
+
+    uint8_t qos = _fleet.getOptions().qos;
+    uint16_t packetId = 0;
+    if (qos > 0)
+    {
+        packetId = _nextPacketId++;
+        if (_nextPacketId == 0)
+            _nextPacketId = 1;
+    }
+
+    std::string packet;
+    mqttEncodePublish(packet, topic, payload, length, qos, packetId);
+    _stats.published++;
+    _stats.bytesOut += packet.size();
+
+    uint64_t now = EventLoop::nowUs();
+    if (!_fleet.admitPublish(this, _session))
+    {
+        HeldPublish held;
+        held.packet.swap(packet);
+        held.packetId = packetId;
+        held.queuedUs = now;
+        _held.push_back(held);
+        _stats.throttled++;
+        return true;
+    }
+
+    if (qos > 0)
+        _inflight[packetId] = now;
+    send(packet);
+    return true;
+}
+
+bool VirtualDevice::releaseHeld(uint32_t session)
+{
+    if (session != _session || _held.empty())
+        return false;
+
+    HeldPublish &held = _held.front();
+    if (_fleet.getOptions().qos > 0)
+        _inflight[held.packetId] = held.queuedUs;
+    send(held.packet);
+    _held.pop_front();
+    return true;
+}
+
+bool VirtualDevice::subscribe(const char *topic, uint8_t qos)
+{
+    if (_fd < 0)
+        return false;
+
+    std::string packet;
+    mqttEncodeSubscribe(packet, _nextPacketId++, topic, qos);
+    if (_nextPacketId == 0)
+        _nextPacketId = 1;
+    send(packet);
+    return true;
+}
+
+void VirtualDevice::disconnect()
+{
+    // The library ends the connection itself (token refresh, end())
+    if (_fd >= 0 && !_connecting)
+    {
+        std::string packet;
+        mqttEncodeEmpty(packet, MQTT_PACKET_DISCONNECT);
+        send(packet);
+    }
+    closeSocket();
+}
+
+void VirtualDevice::drop(DropReason reason)
+{
+    if (_fd < 0)
+        return;
+
+    _stats.drops[reason]++;
+    closeSocket();
+    if (_mqtt != NULL)
+        _mqtt->setConnected(false);
+
+    // Injected faults can send the device back through provisioning,
+    // the library reconnects by itself otherwise
+    if (_fleet.getOptions().reprovision && (reason == DROP_LINK || reason == DROP_STORM))
+    {
+        _client.end();
+        _fleet.provision(this);
+    }
+}
+
+void VirtualDevice::closeSocket()
+{
+    if (_fd < 0)
+        return;
+
+    _fleet.getLoop().remove(_fd);
+    close(_fd);
+    _fd = -1;
+    _connecting = false;
+    _connacked = false;
+    _out.clear();
+    _in.clear();
+
+    _stats.lost += _inflight.size() + _held.size();
+    _inflight.clear();
+    _held.clear();
+}
+
+void VirtualDevice::send(const std::string &packet)
+{
+    _out.append(packet);
+    _lastSentMs = EventLoop::nowMs();
+    if (!_connecting)
+        flush();
+}
+
+void VirtualDevice::flush()
+{
+    size_t sent = 0;
+    while (sent < _out.size())
+    {
+        ssize_t result = ::send(_fd, _out.data() + sent, _out.size() - sent, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            _out.erase(0, sent);
+            drop(DROP_SOCKET);
+            return;
+        }
+        sent += result;
+    }
+    _out.erase(0, sent);
+
+    bool wantWrite = !_out.empty();
+    if (wantWrite != _wantWrite)
+    {
+        _wantWrite = wantWrite;
+        _fleet.getLoop().modify(_fd, EPOLLIN | EPOLLRDHUP | (wantWrite ? EPOLLOUT : 0));
+    }
+}
+
+void VirtualDevice::onEvent(uint32_t events)
+{
+    if (_connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            drop(DROP_SOCKET);
+            return;
+        }
+        _connecting = false;
+    }
+
+    if (events & EPOLLOUT)
+    {
+        flush();
+        if (_fd < 0)
+            return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        char chunk[READ_CHUNK];
+        for (;;)
+        {
+            ssize_t result = recv(_fd, chunk, sizeof(chunk), 0);
+            if (result > 0)
+            {
+                _in.append(chunk, result);
+                continue;
+            }
+            if (result < 0 && (errno == EINTR))
+                continue;
+            if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            drop(DROP_SOCKET);
+            return;
+        }
+
+        size_t position = 0;
+        uint32_t session = _session;
+        while (position < _in.size())
+        {
+            MqttPacket packet;
+            long size = mqttParsePacket((const uint8_t *)_in.data() + position, _in.size() - position, packet);
+            if (size == 0)
+                break;
+            if (size < 0)
+            {
+                drop(DROP_SOCKET);
+                return;
+            }
+            onPacket(packet);
+            // The packet can end the connection, or the library reconnect
+            if (_session != session || _fd < 0)
+                return;
+            position += size;
+        }
+        _in.erase(0, position);
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        drop(DROP_SOCKET);
+}
+
+void VirtualDevice::onPacket(const MqttPacket &packet)
+{
+    switch (packet.type)
+    {
+    case MQTT_PACKET_CONNACK:
+        if (mqttParseAck(packet) != 0)
+        {
+            drop(DROP_REFUSED);
+            return;
+        }
+        _connacked = true;
+        _stats.connacks++;
+        _stats.connectLatency.add(EventLoop::nowUs() - _connectStartedUs);
+        if (_fleet.getOptions().tokenLifetimeS > 0)
+        {
+            uint32_t session = _session;
+            _fleet.getLoop().after(_fleet.getOptions().tokenLifetimeS * 1000, [this, session]() {
+                if (session == _session)
+                    drop(DROP_TOKEN_EXPIRED);
+            });
+        }
+        break;
+
+    case MQTT_PACKET_PUBACK:
+    {
+        std::unordered_map<uint16_t, uint64_t>::iterator found = _inflight.find(mqttParseAck(packet));
+        if (found != _inflight.end())
+        {
+            _stats.acked++;
+            _stats.publishLatency.add(EventLoop::nowUs() - found->second);
+            _inflight.erase(found);
+        }
+        break;
+    }
+
+    case MQTT_PACKET_PUBLISH:
+    {
+        std::string topic;
+        const uint8_t *payload;
+        size_t length;
+        uint16_t packetId;
+        if (!mqttParsePublish(packet, topic, payload, length, packetId))
+            break;
+        if (packetId != 0)
+        {
+            std::string ack;
+            mqttEncodeAck(ack, MQTT_PACKET_PUBACK, packetId);
+            send(ack);
+        }
+        _stats.received++;
+        if (_mqtt != NULL)
+            _mqtt->deliver(topic.c_str(), payload, (unsigned int)length);
+        break;
+    }
+
+    default:
+        // SUBACK, PINGRESP
+        break;
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef __VIRTUAL_DEVICE_H
+#define __VIRTUAL_DEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "centralduino.h"
+#include "event_loop.h"
+#include "latency_histogram.h"
+#include "mqtt_packet.h"
+
+class Fleet;
+
+// Seconds between keepalive pings on an idle connection is half of this
+#define DEVICE_KEEPALIVE 60
+
+// Direct method every device answers, for the stand-in's --method
+#define DEVICE_METHOD "ping"
+
+enum DropReason
+{
+    DROP_LINK,          // injected link drop
+    DROP_STORM,         // every link dropped at once
+    DROP_TOKEN_EXPIRED, // the broker ends a connection when its token runs out
+    DROP_REFUSED,       // CONNACK with an error
+    DROP_SOCKET,        // connect failed or the broker closed the connection
+    DROP_REASON_COUNT
+};
+
+typedef struct tagDeviceStats
+{
+    uint32_t samples;
+    uint32_t samplesOffline; // the client wasn't connected
+    uint32_t published;      // publishes handed to the transport
+    uint32_t publishFailures;
+    uint32_t acked;
+    uint32_t lost; // unacknowledged when the connection went down
+    uint32_t throttled;
+    uint32_t received;
+    uint32_t methodCalls;
+    uint64_t bytesOut;
+    uint32_t connects; // CONNECTs sent
+    uint32_t connacks;
+    uint32_t drops[DROP_REASON_COUNT];
+    uint32_t provisions;
+    uint32_t provisionRetries; // failed or throttled registrations, with a real DPS endpoint
+    uint64_t libraryUs; // in sendMeasurement() and the DPS auth string
+    LatencyHistogram publishLatency;
+    LatencyHistogram connectLatency;
+    LatencyHistogram provisionLatency;
+} DeviceStats;
+
+// One simulated device: a gateway-mode CentralduinoClass instance (the
+// library's own credentials, topics and serialization) whose MQTT traffic
+// goes over a non-blocking socket to the broker.
+class VirtualDevice
+{
+  public:
+    VirtualDevice(Fleet &fleet, uint32_t index);
+    ~VirtualDevice();
+
+    const char *getId() { return _identity.device_id; }
+    const _HubConfig &getIdentity() { return _identity; }
+    CentralduinoClass &getClient() { return _client; }
+    DeviceStats &getStats() { return _stats; }
+    bool isOnline() { return _fd >= 0 && _connacked; }
+
+    // Takes a sample and sends it with sendMeasurement()
+    void sample();
+    void keepAlive(uint64_t nowMs);
+    void drop(DropReason reason);
+
+    // Sends the oldest publish held back by the throttle, false if the
+    // connection it was held for is gone
+    bool releaseHeld(uint32_t session);
+
+    // FakeMqttBackend calls for this device's client
+    bool open(PubSubClient *client, const char *user, const char *password, bool cleanSession);
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length);
+    bool subscribe(const char *topic, uint8_t qos);
+    void disconnect();
+
+  private:
+    typedef struct tagHeldPublish
+    {
+        std::string packet;
+        uint16_t packetId;
+        uint64_t queuedUs;
+    } HeldPublish;
+
+    void onEvent(uint32_t events);
+    void onPacket(const MqttPacket &packet);
+    void send(const std::string &packet);
+    void flush();
+    void closeSocket();
+
+    Fleet &_fleet;
+    uint32_t _index;
+    _HubConfig _identity;
+    CentralduinoClass _client;
+    PubSubClient *_mqtt;
+    DeviceStats _stats;
+
+    int _fd;
+    uint32_t _session;
+    bool _connecting; // TCP handshake under way
+    bool _connacked;
+    bool _wantWrite;
+    uint64_t _connectStartedUs;
+    uint64_t _lastSentMs;
+    uint16_t _nextPacketId;
+    std::string _out;
+    std::string _in;
+    std::unordered_map<uint16_t, uint64_t> _inflight; // packet id, queued at
+    std::deque<HeldPublish> _held;
+};
+
+#endif // __VIRTUAL_DEVICE_H
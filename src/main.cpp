@@ -1,36 +1,75 @@
 #include <Arduino.h>
 #include "ArduinoLog.h"
-#include "Ticker.h"
 #include "Centralduino.h"
 
 // Used for random simluated telemetry values
 const double minTemp = -20.0;
 const double minLux = 0.0;
 
+// Telemetry sent every tick. The JSON layout is generated at compile time,
+// see telemetry_schema.h
+#define SAMPLE_TELEMETRY_FIELDS(FIELD) \
+    FIELD(FLOAT, temp, 1)              \
+    FIELD(INT, lux, 0)                 \
+    FIELD(INT, free_heap, 0)
+
+TELEMETRY_SCHEMA(SampleTelemetry, SAMPLE_TELEMETRY_FIELDS)
+
 // Location of config.json on SPIFFS (must start with /)
 const char *CONFIG_FILE = "/config.json";
 
+// Reported to the cloud, and compared with the version of the firmware
+// update requests
+const char *FIRMWARE_VERSION = "1.1";
+
+// CA of the server the firmware images are downloaded from, here Azure Blob
+// Storage (DigiCert Global Root G2)
+static const char OTA_CA_PEM[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh\n"
+    "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+    "d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH\n"
+    "MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT\n"
+    "MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
+    "b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG\n"
+    "9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI\n"
+    "2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx\n"
+    "1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ\n"
+    "q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz\n"
+    "tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ\n"
+    "vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP\n"
+    "BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV\n"
+    "5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY\n"
+    "1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4\n"
+    "NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG\n"
+    "Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91\n"
+    "8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe\n"
+    "pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n"
+    "MrY=\n"
+    "-----END CERTIFICATE-----\n";
+
 // Forward declarations
 bool reboot_callback();
 void connectWifi();
 void sendTelemetry();
 void doReboot();
 
-// Ticker setup - see https://github.com/sstaub/Ticker
-Ticker telemetryTimer(sendTelemetry, 10000); // 10 seconds
-Ticker rebootTimer(doReboot, 5000); // 5 sec
-
 void setup()
 {
     // Setup Serial and Logging first
     Serial.begin(115200);
     Serial.println();
     
-    // Centralduino uses ArduinoLog internally, so we need to set it up and specify the 
-    // verbosity. If you want to completely disable logging, see the following doc:
+    // This sketch logs its own messages with ArduinoLog. If you want to completely
+    // disable it, see the following doc:
     // https://github.com/thijse/Arduino-Log#disable-library
     Log.begin(LOG_LEVEL_VERBOSE, &Serial);
 
+    // Centralduino logs binary records to a RAM buffer instead, echoing only
+    // notices and errors. Print the buffer with BinaryLog.dump(Serial) and
+    // expand it with log_decoder.
+    BinaryLog.begin(&Serial, CLOG_NOTICE);
+
     // Required to be called in your setup() function
     // Will ensure the network is setup if it isn't already
     Centralduino.setup(CONFIG_FILE);
@@ -38,40 +77,53 @@ void setup()
     // Register a device method callback
     Centralduino.registerDeviceMethod("reboot", reboot_callback);
 
-    Log.trace("Done setting up... starting timers." CR);
+    // Firmware updates from the "ota" desired property or direct method,
+    // downloaded in the background and applied with a restart
+    static BearSSL::X509List otaTrustAnchors(OTA_CA_PEM);
+    Centralduino.enableOta(FIRMWARE_VERSION, &otaTrustAnchors);
 
-    Centralduino.sendProperty("firmware_ver", "1.1");
+    // A method that takes a while answers later; the hub waits up to the
+    // timeout (here the default, 25 seconds) for completeMethod()
+    Centralduino.registerDeferredMethod("calibrate", [](MethodToken token, const uint8_t *payload, size_t length) {
+        Scheduler.after(3000, [token]() { Centralduino.completeMethod(token, 200, "{\"offset\":0.4}"); }, "calibrate");
+        return METHOD_PENDING;
+    });
 
-    // Start our callback timers
-    telemetryTimer.start();
+    // The hub connection is made in the background once the clock is set,
+    // (re)send our reported properties every time it comes up
+    Centralduino.onHubConnected([]() {
+        Centralduino.sendProperty("firmware_ver", FIRMWARE_VERSION);
+    });
+
+    Log.trace("Done setting up... starting timers." CR);
+
+    // Tasks run from Centralduino.loop(), see scheduler.h
+    Scheduler.every(10000, sendTelemetry, "telemetry"); // 10 seconds
 }
 
 void loop()
 {
-    // Allow our timers to update
-    telemetryTimer.update();
-    rebootTimer.update();
-
     // Always call this at the end of loop()
     Centralduino.loop();
 }
 
 void sendTelemetry()
 {
-    // Send a measurement
-    double temp = minTemp + (rand() % 10);
-    double lux = minLux + (rand() % 10);
-
-    Centralduino.sendMeasurement("temp", temp);
-    Centralduino.sendMeasurement("lux", lux);
-    Centralduino.sendMeasurement("free_heap", ESP.getFreeHeap());
+    // Send the measurements as a single message. Each value is also checked
+    // against the alert rules set in the twin's "rules" desired property.
+    SampleTelemetry telemetry;
+    telemetry.temp = minTemp + (rand() % 10);
+    telemetry.lux = minLux + (rand() % 10);
+    telemetry.free_heap = ESP.getFreeHeap();
+
+    Centralduino.sendTelemetry(telemetry);
 }
 
 bool reboot_callback()
 {
     // handle it!
     Log.notice("Rebooting in 5 sec!! ***********************");
-    rebootTimer.start();
+    Scheduler.after(5000, doReboot, "reboot"); // 5 sec
     return true;
 }
 
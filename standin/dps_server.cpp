@@ -0,0 +1,307 @@
+#include "dps_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "sas_token.h"
+
+DpsServer::DpsServer(Standin &standin)
+    : _standin(standin), _nextConnection(1), _tokens(0), _refilledUs(EventLoop::nowUs())
+{
+    _tokens = std::max(1.0, standin.getOptions().dpsRate);
+}
+
+bool DpsServer::listen(uint16_t port, SSL_CTX *tls)
+{
+    return listenTcp(_standin.getLoop(), port, [this, tls](int fd) { accept(fd, tls); });
+}
+
+void DpsServer::accept(int fd, SSL_CTX *tls)
+{
+    uint64_t connectionId = _nextConnection++;
+    Connection &connection = _connections[connectionId];
+    connection.socket = new StreamSocket(_standin.getLoop(), fd, tls);
+    connection.lastDueMs = 0;
+    connection.closing = false;
+    connection.socket->start([this, connectionId](std::string &input) { onData(connectionId, input); },
+                             [this, connectionId]() {
+                                 _standin.getLoop().after(0, [this, connectionId]() {
+                                     std::unordered_map<uint64_t, Connection>::iterator found =
+                                         _connections.find(connectionId);
+                                     if (found == _connections.end())
+                                         return;
+                                     delete found->second.socket;
+                                     _connections.erase(found);
+                                 });
+                             });
+}
+
+static std::string toLower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+void DpsServer::onData(uint64_t connectionId, std::string &input)
+{
+    for (;;)
+    {
+        // The library follows its body with a stray line; nothing after the
+        // last request counts
+        std::unordered_map<uint64_t, Connection>::iterator found = _connections.find(connectionId);
+        if (found == _connections.end() || found->second.closing)
+        {
+            input.clear();
+            return;
+        }
+
+        size_t headEnd = input.find("\r\n\r\n");
+        if (headEnd == std::string::npos)
+        {
+            if (input.size() > DPS_MAX_HEAD)
+            {
+                _standin.getStats().httpBadRequests++;
+                found->second.closing = true;
+                respond(connectionId, 400, "{\"errorCode\":400000,\"message\":\"Request head too long.\"}", true);
+            }
+            return;
+        }
+
+        HttpRequest request;
+        request.close = false;
+        size_t contentLength = 0;
+        size_t lineEnd = input.find("\r\n");
+        std::string requestLine = input.substr(0, lineEnd);
+        size_t firstSpace = requestLine.find(' ');
+        size_t secondSpace = requestLine.find(' ', firstSpace + 1);
+        if (firstSpace == std::string::npos || secondSpace == std::string::npos)
+        {
+            _standin.getStats().httpBadRequests++;
+            found->second.closing = true;
+            respond(connectionId, 400, "{\"errorCode\":400000,\"message\":\"Bad request line.\"}", true);
+            return;
+        }
+        request.method = requestLine.substr(0, firstSpace);
+        request.path = requestLine.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+        request.path = request.path.substr(0, request.path.find('?'));
+
+        while (lineEnd < headEnd)
+        {
+            size_t start = lineEnd + 2;
+            lineEnd = input.find("\r\n", start);
+            size_t colon = input.find(':', start);
+            if (colon == std::string::npos || colon > lineEnd)
+                continue;
+            std::string name = toLower(input.substr(start, colon - start));
+            size_t valueStart = input.find_first_not_of(' ', colon + 1);
+            std::string value = valueStart < lineEnd ? input.substr(valueStart, lineEnd - valueStart) : std::string();
+            if (name == "content-length")
+                contentLength = strtoul(value.c_str(), NULL, 10);
+            else if (name == "authorization")
+                request.authorization = value;
+            else if (name == "connection")
+                request.close = toLower(value) == "close";
+        }
+
+        size_t bodyStart = headEnd + 4;
+        if (input.size() - bodyStart < contentLength)
+            return;
+        request.body = input.substr(bodyStart, contentLength);
+        input.erase(0, bodyStart + contentLength);
+
+        found->second.closing = request.close;
+        handle(connectionId, request);
+    }
+}
+
+void DpsServer::handle(uint64_t connectionId, const HttpRequest &request)
+{
+    StandinStats &stats = _standin.getStats();
+
+    // "", scope, "registrations", id, then "register" or "operations", operation
+    std::vector<std::string> parts;
+    size_t start = 0;
+    for (;;)
+    {
+        size_t slash = request.path.find('/', start);
+        parts.push_back(urlDecode(request.path.substr(start, slash == std::string::npos ? slash : slash - start)));
+        if (slash == std::string::npos)
+            break;
+        start = slash + 1;
+    }
+
+    bool isRegister = request.method == "PUT" && parts.size() == 5 && parts[2] == "registrations" &&
+                      parts[4] == "register";
+    bool isStatus = request.method == "GET" && parts.size() == 6 && parts[2] == "registrations" &&
+                    parts[4] == "operations";
+    if (!isRegister && !isStatus)
+    {
+        stats.httpBadRequests++;
+        respond(connectionId, 404, "{\"errorCode\":404000,\"message\":\"Not found.\"}", request.close);
+        return;
+    }
+
+    const std::string &scope = parts[1];
+    const std::string &registrationId = parts[3];
+    if (!authorize(request, scope, registrationId))
+    {
+        stats.dpsAuthFailures++;
+        respond(connectionId, 401, "{\"errorCode\":401002,\"message\":\"The device is unauthorized.\"}", request.close);
+        return;
+    }
+
+    if (isRegister)
+    {
+        if (request.body.find("\"registrationId\":\"" + registrationId + "\"") == std::string::npos)
+        {
+            stats.httpBadRequests++;
+            respond(connectionId, 400, "{\"errorCode\":400004,\"message\":\"Registration id doesn't match.\"}",
+                    request.close);
+            return;
+        }
+        if (!admitRegistration())
+        {
+            stats.dpsThrottled++;
+            respond(connectionId, 429, "{\"errorCode\":429001,\"message\":\"Operations are being throttled.\"}",
+                    request.close, 1);
+            return;
+        }
+        if (_standin.injectError())
+        {
+            stats.dpsErrors++;
+            respond(connectionId, 500, "{\"errorCode\":500000,\"message\":\"Internal error (injected).\"}",
+                    request.close);
+            return;
+        }
+
+        char operationId[24];
+        snprintf(operationId, sizeof(operationId), "4.%08x%08x", (unsigned)_standin.getRandom()(),
+                 (unsigned)_standin.getRandom()());
+        if (_operations.size() >= DPS_MAX_OPERATIONS)
+            expireOperations();
+        Operation &operation = _operations[operationId];
+        operation.registrationId = registrationId;
+        operation.createdUs = EventLoop::nowUs();
+        stats.registrations++;
+
+        respond(connectionId, 202, std::string("{\"operationId\":\"") + operationId + "\",\"status\":\"assigning\"}",
+                request.close);
+        return;
+    }
+
+    stats.statusPolls++;
+    std::unordered_map<std::string, Operation>::iterator found = _operations.find(parts[5]);
+    if (found == _operations.end() || found->second.registrationId != registrationId)
+    {
+        respond(connectionId, 404, "{\"errorCode\":404201,\"message\":\"Operation not found.\"}", request.close);
+        return;
+    }
+
+    uint64_t now = EventLoop::nowUs();
+    if (now - found->second.createdUs < (uint64_t)_standin.getOptions().assignMs * 1000)
+    {
+        respond(connectionId, 202, "{\"operationId\":\"" + parts[5] + "\",\"status\":\"assigning\"}", request.close);
+        return;
+    }
+
+    stats.assignments++;
+    stats.registerToAssigned.add(now - found->second.createdUs);
+    const std::string &hub = _standin.getOptions().hubName;
+    respond(connectionId, 200,
+            "{\"operationId\":\"" + parts[5] + "\",\"status\":\"assigned\",\"registrationState\":{\"registrationId\":\"" +
+                registrationId + "\",\"assignedHub\":\"" + hub + "\",\"deviceId\":\"" + registrationId +
+                "\",\"status\":\"assigned\",\"substatus\":\"initialAssignment\"}}",
+            request.close);
+    _operations.erase(found);
+}
+
+bool DpsServer::authorize(const HttpRequest &request, const std::string &scope, const std::string &registrationId)
+{
+    SasToken token;
+    return sasParse(request.authorization, token) && token.keyName == "registration" &&
+           sasResourceIs(token, scope + "/registrations/" + registrationId) &&
+           sasVerify(token, _standin.keyOf(registrationId));
+}
+
+bool DpsServer::admitRegistration()
+{
+    double rate = _standin.getOptions().dpsRate;
+    if (rate <= 0)
+        return true;
+
+    // Token bucket, a second's worth deep
+    uint64_t now = EventLoop::nowUs();
+    _tokens = std::min(std::max(1.0, rate), _tokens + (now - _refilledUs) * rate / 1e6);
+    _refilledUs = now;
+    if (_tokens < 1)
+        return false;
+    _tokens -= 1;
+    return true;
+}
+
+static const char *reasonOf(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 202:
+        return "Accepted";
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 404:
+        return "Not Found";
+    case 429:
+        return "Too Many Requests";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+void DpsServer::respond(uint64_t connectionId, int status, const std::string &body, bool close, uint32_t retryAfterS)
+{
+    std::unordered_map<uint64_t, Connection>::iterator found = _connections.find(connectionId);
+    if (found == _connections.end())
+        return;
+
+    char head[256];
+    int length = snprintf(head, sizeof(head),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: application/json; charset=utf-8\r\n"
+                          "Content-Length: %u\r\n",
+                          status, reasonOf(status), (unsigned)body.size());
+    if (retryAfterS > 0)
+        length += snprintf(head + length, sizeof(head) - length, "Retry-After: %u\r\n", (unsigned)retryAfterS);
+    snprintf(head + length, sizeof(head) - length, "%s\r\n", close ? "Connection: close\r\n" : "");
+    std::string response = head + body;
+
+    uint64_t now = EventLoop::nowMs();
+    uint64_t dueMs = std::max(now + _standin.responseDelayMs(), found->second.lastDueMs);
+    found->second.lastDueMs = dueMs;
+    _standin.getLoop().after((uint32_t)(dueMs - now), [this, connectionId, response, close]() {
+        std::unordered_map<uint64_t, Connection>::iterator found = _connections.find(connectionId);
+        if (found == _connections.end())
+            return;
+        // One write, the library reads the response as it finds it available
+        found->second.socket->send(response);
+        if (close)
+            found->second.socket->closeAfterSend();
+    });
+}
+
+void DpsServer::expireOperations()
+{
+    uint64_t cutoff = EventLoop::nowUs() - 60 * 1000000ULL;
+    for (std::unordered_map<std::string, Operation>::iterator it = _operations.begin(); it != _operations.end();)
+    {
+        if (it->second.createdUs < cutoff)
+            it = _operations.erase(it);
+        else
+            ++it;
+    }
+}
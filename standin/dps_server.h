@@ -0,0 +1,73 @@
+#ifndef __DPS_SERVER_H
+#define __DPS_SERVER_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+#include "standin.h"
+#include "stream_socket.h"
+
+// Longest request head the server reads
+#define DPS_MAX_HEAD 8192
+
+// Pending registrations kept; past this the ones older than a minute go
+#define DPS_MAX_OPERATIONS 100000
+
+// The device registration API of the provisioning service, as far as the
+// library uses it:
+//
+//   PUT /{scope}/registrations/{id}/register                202 assigning
+//   GET /{scope}/registrations/{id}/operations/{operation}  202 assigning, then 200 assigned
+//
+// Every request carries a SAS token for {scope}/registrations/{id}. Any
+// scope is accepted and every device is assigned to the one hub.
+class DpsServer
+{
+  public:
+    DpsServer(Standin &standin);
+
+    bool listen(uint16_t port, SSL_CTX *tls);
+
+  private:
+    typedef struct tagHttpRequest
+    {
+        std::string method;
+        std::string path;  // without the query
+        std::string authorization;
+        std::string body;
+        bool close;
+    } HttpRequest;
+
+    typedef struct tagConnection
+    {
+        StreamSocket *socket;
+        uint64_t lastDueMs; // responses keep the order of the requests
+        bool closing;       // a request asked for connection: close
+    } Connection;
+
+    typedef struct tagOperation
+    {
+        std::string registrationId;
+        uint64_t createdUs;
+    } Operation;
+
+    void accept(int fd, SSL_CTX *tls);
+    void onData(uint64_t connectionId, std::string &input);
+    void handle(uint64_t connectionId, const HttpRequest &request);
+    bool authorize(const HttpRequest &request, const std::string &scope, const std::string &registrationId);
+    bool admitRegistration();
+    void respond(uint64_t connectionId, int status, const std::string &body, bool close, uint32_t retryAfterS = 0);
+    void expireOperations();
+
+    Standin &_standin;
+    std::unordered_map<uint64_t, Connection> _connections;
+    uint64_t _nextConnection;
+    std::unordered_map<std::string, Operation> _operations;
+    double _tokens;
+    uint64_t _refilledUs;
+};
+
+#endif // __DPS_SERVER_H
@@ -0,0 +1,40 @@
+#!/bin/sh
+# End-to-end run on one box: the stand-in server, and the fleet simulator
+# registering with its DPS and connecting to its hub, each with its own
+# report at the end.
+#
+#   standin/e2e.sh [simulator options]       e.g. --devices 2000 --rate 0.5 --ramp 20
+#
+# Stand-in options (latency, throttling, faults) go in STANDIN_ARGS:
+#
+#   STANDIN_ARGS="--latency 20 --jitter 30 --dps-rate 100 --throttle 2000" standin/e2e.sh --devices 5000
+#
+# MQTT_PORT and DPS_PORT pick the ports (18830, 18080); NO_BUILD=1 skips
+# the pio build.
+set -e
+
+cd "$(dirname "$0")/.."
+[ -n "$NO_BUILD" ] || pio run -e standin -e simulator
+
+mqtt_port=${MQTT_PORT:-18830}
+dps_port=${DPS_PORT:-18080}
+hub=standin.azure-devices.net
+log=$(mktemp)
+
+.pio/build/standin/program --mqtt-plain-port "$mqtt_port" --dps-plain-port "$dps_port" --hub-name "$hub" \
+    --method ping --report 0 $STANDIN_ARGS > "$log" 2>&1 &
+standin=$!
+trap 'kill $standin 2>/dev/null; rm -f "$log"' EXIT
+sleep 1
+if ! kill -0 $standin 2>/dev/null; then
+    cat "$log"
+    exit 1
+fi
+
+.pio/build/simulator/program --broker "127.0.0.1:$mqtt_port" --dps "127.0.0.1:$dps_port" --hub "$hub" "$@"
+
+kill -INT $standin
+wait $standin || true
+echo
+echo "Stand-in:"
+cat "$log"
@@ -0,0 +1,519 @@
+#include "hub_server.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+
+#include "sas_token.h"
+
+#define HUB_HOUSEKEEPING_MS 1000
+
+// Largest timer the loop takes is 49 days; tokens that outlive this aren't
+// expired at all
+#define HUB_MAX_EXPIRY_S (7 * 24 * 3600)
+
+HubServer::HubServer(Standin &standin)
+    : _standin(standin), _nextSession(1), _nextRequestId(1), _throttleTatUs(0)
+{
+}
+
+bool HubServer::listen(uint16_t port, SSL_CTX *tls)
+{
+    return listenTcp(_standin.getLoop(), port, [this, tls](int fd) { accept(fd, tls); });
+}
+
+void HubServer::start()
+{
+    const StandinOptions &options = _standin.getOptions();
+    if (!options.methodName.empty() && options.methodIntervalS > 0)
+        _standin.getLoop().after((uint32_t)(options.methodIntervalS * 1000), [this]() { callMethod(); });
+    if (options.desiredIntervalS > 0)
+        _standin.getLoop().after((uint32_t)(options.desiredIntervalS * 1000), [this]() { patchDesired(); });
+    _standin.getLoop().after(HUB_HOUSEKEEPING_MS, [this]() { housekeeping(); });
+}
+
+void HubServer::accept(int fd, SSL_CTX *tls)
+{
+    uint64_t sessionId = _nextSession++;
+    Session &session = _sessions[sessionId];
+    session.socket = new StreamSocket(_standin.getLoop(), fd, tls);
+    session.connected = false;
+    session.keepAliveS = 0;
+    session.lastHeardMs = EventLoop::nowMs();
+    session.lastDueMs = 0;
+    session.methodsSubscribed = false;
+    session.desiredSubscribed = false;
+    session.expiryTimer = 0;
+    session.dropTimer = 0;
+    session.socket->start([this, sessionId](std::string &input) { onData(sessionId, input); },
+                          [this, sessionId]() { onClosed(sessionId); });
+}
+
+void HubServer::onData(uint64_t sessionId, std::string &input)
+{
+    size_t position = 0;
+    while (position < input.size())
+    {
+        std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+        if (found == _sessions.end() || !found->second.socket->isOpen())
+            return;
+
+        MqttPacket packet;
+        long size = mqttParsePacket((const uint8_t *)input.data() + position, input.size() - position, packet);
+        if (size == 0)
+            break;
+        if (size < 0)
+        {
+            _standin.getStats().protocolErrors++;
+            end(sessionId);
+            return;
+        }
+        found->second.lastHeardMs = EventLoop::nowMs();
+        onPacket(sessionId, found->second, packet);
+        position += size;
+    }
+    input.erase(0, position);
+}
+
+void HubServer::onClosed(uint64_t sessionId)
+{
+    std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+    if (found == _sessions.end())
+        return;
+
+    Session &session = found->second;
+    if (session.connected)
+    {
+        _standin.getStats().sessions--;
+        std::unordered_map<std::string, uint64_t>::iterator device = _byDevice.find(session.deviceId);
+        if (device != _byDevice.end() && device->second == sessionId)
+            _byDevice.erase(device);
+    }
+    _standin.getLoop().cancel(session.expiryTimer);
+    _standin.getLoop().cancel(session.dropTimer);
+
+    // The socket is still on the stack
+    _standin.getLoop().after(0, [this, sessionId]() {
+        std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+        if (found == _sessions.end())
+            return;
+        delete found->second.socket;
+        _sessions.erase(found);
+    });
+}
+
+void HubServer::end(uint64_t sessionId)
+{
+    std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+    if (found != _sessions.end())
+        found->second.socket->close();
+}
+
+void HubServer::onPacket(uint64_t sessionId, Session &session, const MqttPacket &packet)
+{
+    if (packet.type == MQTT_PACKET_CONNECT)
+    {
+        // Only once
+        if (!session.deviceId.empty())
+        {
+            _standin.getStats().protocolErrors++;
+            end(sessionId);
+            return;
+        }
+        onConnect(sessionId, session, packet);
+        return;
+    }
+
+    // Nothing before the CONNECT is accepted, and nothing while it's refused
+    if (!session.connected)
+    {
+        if (session.deviceId.empty())
+        {
+            _standin.getStats().protocolErrors++;
+            end(sessionId);
+        }
+        return;
+    }
+
+    switch (packet.type)
+    {
+    case MQTT_PACKET_PUBLISH:
+        onPublish(sessionId, session, packet);
+        break;
+
+    case MQTT_PACKET_SUBSCRIBE:
+        onSubscribe(sessionId, session, packet);
+        break;
+
+    case MQTT_PACKET_PINGREQ:
+    {
+        std::string response;
+        mqttEncodeEmpty(response, MQTT_PACKET_PINGRESP);
+        session.socket->send(response);
+        break;
+    }
+
+    case MQTT_PACKET_PUBACK:
+        // Of a QoS 1 delivery; everything is sent at QoS 0
+        break;
+
+    case MQTT_PACKET_DISCONNECT:
+        end(sessionId);
+        break;
+
+    default:
+        _standin.getStats().protocolErrors++;
+        end(sessionId);
+        break;
+    }
+}
+
+void HubServer::onConnect(uint64_t sessionId, Session &session, const MqttPacket &packet)
+{
+    StandinStats &stats = _standin.getStats();
+    const StandinOptions &options = _standin.getOptions();
+    stats.connects++;
+
+    MqttConnect connect;
+    if (!mqttParseConnect(packet, connect) || connect.clientId.empty())
+    {
+        stats.protocolErrors++;
+        end(sessionId);
+        return;
+    }
+    session.deviceId = connect.clientId;
+    session.keepAliveS = connect.keepAlive;
+
+    // {hub}/{id}/?api-version=..., and a token for {hub}/devices/{id}
+    std::string userPrefix = options.hubName + "/" + connect.clientId + "/";
+    SasToken token;
+    uint64_t nowS = (uint64_t)time(NULL);
+    uint8_t returnCode = MQTT_CONNACK_ACCEPTED;
+    if (connect.user.size() < userPrefix.size() ||
+        strncasecmp(connect.user.c_str(), userPrefix.c_str(), userPrefix.size()) != 0 ||
+        !sasParse(connect.password, token) || !sasResourceIs(token, options.hubName + "/devices/" + connect.clientId) ||
+        token.expirySeconds <= nowS || !sasVerify(token, _standin.keyOf(connect.clientId)))
+    {
+        stats.authFailures++;
+        returnCode = MQTT_CONNACK_NOT_AUTHORIZED;
+    }
+    else if (_standin.injectError())
+    {
+        stats.injectedRefusals++;
+        returnCode = MQTT_CONNACK_UNAVAILABLE;
+    }
+
+    std::string response;
+    mqttEncodeConnack(response, false, returnCode);
+    if (returnCode != MQTT_CONNACK_ACCEPTED)
+    {
+        // The hub closes the connection after a refusal
+        sendLater(sessionId, session, response);
+        _standin.getLoop().after((uint32_t)(session.lastDueMs - EventLoop::nowMs()) + 1,
+                                 [this, sessionId]() { end(sessionId); });
+        return;
+    }
+
+    // The newest connection of a device wins
+    std::unordered_map<std::string, uint64_t>::iterator previous = _byDevice.find(connect.clientId);
+    if (previous != _byDevice.end())
+    {
+        stats.sessionsKicked++;
+        end(previous->second);
+    }
+
+    session.connected = true;
+    _byDevice[connect.clientId] = sessionId;
+    stats.accepted++;
+    stats.sessions++;
+    stats.peakSessions = std::max(stats.peakSessions, stats.sessions);
+    sendLater(sessionId, session, response);
+
+    uint64_t lifetimeS = options.tokenLifetimeS > 0 ? options.tokenLifetimeS : token.expirySeconds - nowS;
+    if (lifetimeS <= HUB_MAX_EXPIRY_S)
+    {
+        session.expiryTimer = _standin.getLoop().after((uint32_t)(lifetimeS * 1000), [this, sessionId]() {
+            _standin.getStats().sessionsExpired++;
+            end(sessionId);
+        });
+    }
+
+    if (options.dropIntervalS > 0)
+    {
+        double delayS = std::exponential_distribution<double>(1 / options.dropIntervalS)(_standin.getRandom());
+        session.dropTimer = _standin.getLoop().after((uint32_t)std::min(delayS * 1000, 2e9), [this, sessionId]() {
+            _standin.getStats().sessionsDropped++;
+            end(sessionId);
+        });
+    }
+}
+
+// The value of a property, like $rid, in the part of a topic after "?"
+static std::string propertyOf(const std::string &topic, const char *name)
+{
+    size_t query = topic.find('?');
+    if (query == std::string::npos)
+        return std::string();
+
+    std::string key = std::string(name) + "=";
+    size_t position = query + 1;
+    while (position < topic.size())
+    {
+        size_t end = topic.find('&', position);
+        if (end == std::string::npos)
+            end = topic.size();
+        if (topic.compare(position, key.size(), key) == 0)
+            return topic.substr(position + key.size(), end - position - key.size());
+        position = end + 1;
+    }
+    return std::string();
+}
+
+static bool startsWith(const std::string &text, const std::string &prefix)
+{
+    return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+void HubServer::onPublish(uint64_t sessionId, Session &session, const MqttPacket &packet)
+{
+    StandinStats &stats = _standin.getStats();
+    std::string topic;
+    const uint8_t *payload;
+    size_t length;
+    uint16_t packetId;
+    if (!mqttParsePublish(packet, topic, payload, length, packetId))
+    {
+        stats.protocolErrors++;
+        end(sessionId);
+        return;
+    }
+
+    std::string ack;
+    if (packetId != 0)
+        mqttEncodeAck(ack, MQTT_PACKET_PUBACK, packetId);
+
+    if (startsWith(topic, "devices/" + session.deviceId + "/messages/events/"))
+    {
+        stats.telemetry++;
+        stats.telemetryBytes += length;
+        uint64_t throttledUs = throttleDelayUs();
+        if (!ack.empty())
+            sendLater(sessionId, session, ack, throttledUs);
+        return;
+    }
+
+    if (startsWith(topic, "$iothub/twin/GET/"))
+    {
+        stats.twinGets++;
+        Twin &twin = _twins[session.deviceId];
+        char document[64];
+        snprintf(document, sizeof(document), "\"$version\":%u}}", (unsigned)twin.reportedVersion);
+        std::string body = "{\"desired\":{" + twin.desired + (twin.desired.empty() ? "" : ",") +
+                           "\"$version\":" + std::to_string(twin.desiredVersion) + "},\"reported\":{" + document;
+
+        std::string response;
+        std::string responseTopic = "$iothub/twin/res/200/?$rid=" + propertyOf(topic, "$rid");
+        mqttEncodePublish(response, responseTopic.c_str(), (const uint8_t *)body.data(), body.size(), 0, 0);
+        sendLater(sessionId, session, ack + response);
+        return;
+    }
+
+    if (startsWith(topic, "$iothub/twin/PATCH/properties/reported/"))
+    {
+        stats.reportedPatches++;
+        Twin &twin = _twins[session.deviceId];
+        twin.reportedVersion++;
+
+        std::string response;
+        std::string responseTopic = "$iothub/twin/res/204/?$rid=" + propertyOf(topic, "$rid") +
+                                    "&$version=" + std::to_string(twin.reportedVersion);
+        mqttEncodePublish(response, responseTopic.c_str(), NULL, 0, 0, 0);
+        sendLater(sessionId, session, ack + response);
+        return;
+    }
+
+    if (startsWith(topic, "$iothub/methods/res/"))
+    {
+        std::unordered_map<std::string, PendingMethod>::iterator found = _pendingMethods.find(propertyOf(topic, "$rid"));
+        if (found != _pendingMethods.end())
+        {
+            stats.methodsAnswered++;
+            stats.methodRoundTrip.add(EventLoop::nowUs() - found->second.startedUs);
+            _standin.getLoop().cancel(found->second.timeoutTimer);
+            _pendingMethods.erase(found);
+        }
+        if (!ack.empty())
+            sendLater(sessionId, session, ack);
+        return;
+    }
+
+    stats.protocolErrors++;
+    end(sessionId);
+}
+
+void HubServer::onSubscribe(uint64_t sessionId, Session &session, const MqttPacket &packet)
+{
+    uint16_t packetId;
+    std::vector<MqttFilter> filters;
+    if (!mqttParseSubscribe(packet, packetId, filters))
+    {
+        _standin.getStats().protocolErrors++;
+        end(sessionId);
+        return;
+    }
+
+    std::vector<uint8_t> returnCodes;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        const std::string &topic = filters[i].topic;
+        uint8_t granted = std::min(filters[i].qos, (uint8_t)1);
+        if (topic == "$iothub/methods/POST/#")
+        {
+            if (!session.methodsSubscribed)
+                _methodTargets.push_back(sessionId);
+            session.methodsSubscribed = true;
+        }
+        else if (topic == "$iothub/twin/PATCH/properties/desired/#")
+        {
+            if (!session.desiredSubscribed)
+                _desiredTargets.push_back(sessionId);
+            session.desiredSubscribed = true;
+        }
+        else if (topic != "$iothub/twin/res/#" && topic != "devices/" + session.deviceId + "/messages/devicebound/#")
+        {
+            granted = MQTT_SUBACK_FAILURE;
+            _standin.getStats().subscriptionsRefused++;
+
+            // One entry for all devices
+            std::string pattern = topic;
+            size_t id = pattern.find(session.deviceId);
+            if (id != std::string::npos)
+                pattern.replace(id, session.deviceId.size(), "{id}");
+            _refusedFilters.insert(pattern);
+        }
+        returnCodes.push_back(granted);
+    }
+
+    std::string response;
+    mqttEncodeSuback(response, packetId, returnCodes.data(), returnCodes.size());
+    sendLater(sessionId, session, response);
+}
+
+void HubServer::sendLater(uint64_t sessionId, Session &session, const std::string &packet, uint64_t extraUs)
+{
+    uint64_t now = EventLoop::nowMs();
+    uint64_t dueMs = std::max(now + _standin.responseDelayMs() + (extraUs + 999) / 1000, session.lastDueMs);
+    session.lastDueMs = dueMs;
+    if (dueMs == now)
+    {
+        session.socket->send(packet);
+        return;
+    }
+
+    _standin.getLoop().after((uint32_t)(dueMs - now), [this, sessionId, packet]() {
+        std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+        if (found != _sessions.end())
+            found->second.socket->send(packet);
+    });
+}
+
+void HubServer::publishTo(Session &session, const std::string &topic, const std::string &payload)
+{
+    std::string packet;
+    mqttEncodePublish(packet, topic.c_str(), (const uint8_t *)payload.data(), payload.size(), 0, 0);
+    session.socket->send(packet);
+}
+
+uint64_t HubServer::throttleDelayUs()
+{
+    double rate = _standin.getOptions().throttleRate;
+    if (rate <= 0)
+        return 0;
+
+    // GCRA with a second of burst: past it, acks come out at the rate and
+    // the rest wait their turn
+    uint64_t now = EventLoop::nowUs();
+    _throttleTatUs = std::max(now, _throttleTatUs) + (uint64_t)(1e6 / rate);
+    if (_throttleTatUs <= now + 1000000)
+        return 0;
+    _standin.getStats().telemetryThrottled++;
+    return _throttleTatUs - now - 1000000;
+}
+
+uint64_t HubServer::pickTarget(std::vector<uint64_t> &targets, bool Session::*subscribed)
+{
+    while (!targets.empty())
+    {
+        size_t index = std::uniform_int_distribution<size_t>(0, targets.size() - 1)(_standin.getRandom());
+        uint64_t sessionId = targets[index];
+        std::unordered_map<uint64_t, Session>::iterator found = _sessions.find(sessionId);
+        if (found != _sessions.end() && found->second.connected && found->second.socket->isOpen() &&
+            found->second.*subscribed)
+            return sessionId;
+
+        // Gone since; the list is cleaned as it's drawn from
+        targets[index] = targets.back();
+        targets.pop_back();
+    }
+    return 0;
+}
+
+void HubServer::callMethod()
+{
+    const StandinOptions &options = _standin.getOptions();
+    _standin.getLoop().after((uint32_t)(options.methodIntervalS * 1000), [this]() { callMethod(); });
+
+    uint64_t sessionId = pickTarget(_methodTargets, &Session::methodsSubscribed);
+    if (sessionId == 0)
+        return;
+
+    std::string requestId = std::to_string(_nextRequestId++);
+    PendingMethod &pending = _pendingMethods[requestId];
+    pending.startedUs = EventLoop::nowUs();
+    pending.timeoutTimer = _standin.getLoop().after(options.methodTimeoutS * 1000, [this, requestId]() {
+        _standin.getStats().methodsTimedOut++;
+        _pendingMethods.erase(requestId);
+    });
+    _standin.getStats().methodsCalled++;
+    publishTo(_sessions[sessionId], "$iothub/methods/POST/" + options.methodName + "/?$rid=" + requestId, "{}");
+}
+
+void HubServer::patchDesired()
+{
+    _standin.getLoop().after((uint32_t)(_standin.getOptions().desiredIntervalS * 1000), [this]() { patchDesired(); });
+
+    uint64_t sessionId = pickTarget(_desiredTargets, &Session::desiredSubscribed);
+    if (sessionId == 0)
+        return;
+
+    Session &session = _sessions[sessionId];
+    Twin &twin = _twins[session.deviceId];
+    twin.desiredVersion++;
+    twin.desired = "\"sample_interval\":" + std::to_string(1 + _standin.getRandom()() % 60);
+    _standin.getStats().desiredPatches++;
+    publishTo(session, "$iothub/twin/PATCH/properties/desired/?$version=" + std::to_string(twin.desiredVersion),
+              "{" + twin.desired + ",\"$version\":" + std::to_string(twin.desiredVersion) + "}");
+}
+
+void HubServer::housekeeping()
+{
+    _standin.getLoop().after(HUB_HOUSEKEEPING_MS, [this]() { housekeeping(); });
+
+    // Keep-alive is 1.5 times what the client asked for, like any broker
+    uint64_t now = EventLoop::nowMs();
+    std::vector<uint64_t> idle;
+    for (std::unordered_map<uint64_t, Session>::iterator it = _sessions.begin(); it != _sessions.end(); ++it)
+    {
+        const Session &session = it->second;
+        uint64_t limitMs = session.deviceId.empty() ? HUB_CONNECT_TIMEOUT_MS : session.keepAliveS * 1500ULL;
+        if (session.socket->isOpen() && limitMs > 0 && now - session.lastHeardMs > limitMs)
+            idle.push_back(it->first);
+    }
+    for (size_t i = 0; i < idle.size(); i++)
+    {
+        _standin.getStats().keepAliveTimeouts++;
+        end(idle[i]);
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef __HUB_SERVER_H
+#define __HUB_SERVER_H
+
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "mqtt_packet.h"
+#include "standin.h"
+#include "stream_socket.h"
+
+// Connections that don't CONNECT within this are closed
+#define HUB_CONNECT_TIMEOUT_MS 10000
+
+// The MQTT side of IoT Hub, as far as the library uses it. Devices connect
+// as {hub}/{id}/... with a SAS token for {hub}/devices/{id}, and may then
+// publish to
+//
+//   devices/{id}/messages/events/...                telemetry, PUBACK for QoS 1
+//   $iothub/twin/GET/?$rid={rid}                     twin/res/200 with the twin
+//   $iothub/twin/PATCH/properties/reported/?$rid=... twin/res/204 with the new version
+//   $iothub/methods/res/{status}/?$rid={rid}         answers a method call
+//
+// and subscribe to devicebound, twin/res, twin desired patches and method
+// calls. Like the hub, a publish to any other topic ends the connection;
+// other subscriptions are refused in the SUBACK, and listed in the summary.
+class HubServer
+{
+  public:
+    HubServer(Standin &standin);
+
+    bool listen(uint16_t port, SSL_CTX *tls);
+
+    // Method calls, desired patches and keep-alive checks
+    void start();
+
+    const std::set<std::string> &getRefusedFilters() { return _refusedFilters; }
+
+  private:
+    typedef struct tagSession
+    {
+        StreamSocket *socket;
+        std::string deviceId;       // empty until the CONNECT is accepted
+        bool connected;
+        uint16_t keepAliveS;
+        uint64_t lastHeardMs;
+        uint64_t lastDueMs;         // responses keep the order of the requests
+        bool methodsSubscribed;
+        bool desiredSubscribed;
+        TimerId expiryTimer;
+        TimerId dropTimer;
+    } Session;
+
+    typedef struct tagTwin
+    {
+        uint32_t desiredVersion;
+        uint32_t reportedVersion;
+        std::string desired;        // the last patch's properties, without braces
+    } Twin;
+
+    typedef struct tagPendingMethod
+    {
+        uint64_t startedUs;
+        TimerId timeoutTimer;
+    } PendingMethod;
+
+    void accept(int fd, SSL_CTX *tls);
+    void onData(uint64_t sessionId, std::string &input);
+    void onClosed(uint64_t sessionId);
+    void onPacket(uint64_t sessionId, Session &session, const MqttPacket &packet);
+    void onConnect(uint64_t sessionId, Session &session, const MqttPacket &packet);
+    void onPublish(uint64_t sessionId, Session &session, const MqttPacket &packet);
+    void onSubscribe(uint64_t sessionId, Session &session, const MqttPacket &packet);
+
+    // Ends the session for a reason counted by the caller
+    void end(uint64_t sessionId);
+
+    // After the response latency, and never before an earlier response
+    void sendLater(uint64_t sessionId, Session &session, const std::string &packet, uint64_t extraUs = 0);
+    void publishTo(Session &session, const std::string &topic, const std::string &payload);
+
+    // Held back ack time, in us, for a telemetry message
+    uint64_t throttleDelayUs();
+
+    // A connected session subscribed through the flag, 0 if there's none
+    uint64_t pickTarget(std::vector<uint64_t> &targets, bool Session::*subscribed);
+    void callMethod();
+    void patchDesired();
+    void housekeeping();
+
+    Standin &_standin;
+    std::unordered_map<uint64_t, Session> _sessions;
+    std::unordered_map<std::string, uint64_t> _byDevice;
+    uint64_t _nextSession;
+    std::unordered_map<std::string, Twin> _twins;
+    std::unordered_map<std::string, PendingMethod> _pendingMethods; // by request id
+    uint32_t _nextRequestId;
+    std::vector<uint64_t> _methodTargets;
+    std::vector<uint64_t> _desiredTargets;
+    std::set<std::string> _refusedFilters;
+    uint64_t _throttleTatUs; // theoretical arrival time of the next message at the throttle rate
+};
+
+#endif // __HUB_SERVER_H
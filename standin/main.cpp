@@ -0,0 +1,334 @@
+// Local stand-in for DPS and IoT Hub: the registration API over HTTPS and
+// the hub's MQTT topics, with SAS tokens checked, so devices and the fleet
+// simulator run end to end on one box.
+//
+//   pio run -e standin && .pio/build/standin/program --method reboot --method-interval 1
+//
+// Without --cert and --key both services listen in the clear only, which
+// is what the simulator speaks; see e2e.sh. Latency, throttling and
+// failures are injected with the options below.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "dps_server.h"
+#include "hub_server.h"
+#include "standin.h"
+
+// The simulator's device key, so the two work together without options
+#define STANDIN_DEVICE_KEY "wZ1b4Zp0j6Q7mYx2bV8kq3Q2n1v0c5T6r7E8w9Y0a1s="
+
+static void usage()
+{
+    printf("usage: program [options]\n"
+           "  --hub-name NAME        host name DPS assigns and tokens are checked against\n"
+           "                         (standin.azure-devices.net)\n"
+           "  --device-key KEY       every device's key (the simulator's)\n"
+           "  --group-key KEY        or a group enrollment key, each device's derived from it\n"
+           "  --cert FILE --key FILE serve TLS on the ports below, see make_certs.sh\n"
+           "  --mqtt-port P          MQTT over TLS (8883)\n"
+           "  --dps-port P           DPS over TLS (8443)\n"
+           "  --mqtt-plain-port P    MQTT in the clear (1883, 0 for none)\n"
+           "  --dps-plain-port P     DPS in the clear (8080, 0 for none)\n"
+           "  --latency MS           added to every response (0)\n"
+           "  --jitter MS            plus up to this much more (0)\n"
+           "  --assign-ms MS         DPS register to assigned (500)\n"
+           "  --dps-rate R           registrations per second, 429 past it (0, no limit)\n"
+           "  --error-rate P         share of registrations and connects that fail, 0 to 1 (0)\n"
+           "  --throttle R           telemetry per second across the hub, later acks are held (0, no limit)\n"
+           "  --token-lifetime S     end connections S seconds in (0, when their token expires)\n"
+           "  --drop-interval S      mean time between dropped connections per device (0, none)\n"
+           "  --method NAME          direct method to call on random devices\n"
+           "  --method-interval S    between calls across the hub (1)\n"
+           "  --method-timeout S     calls not answered in this fail (30)\n"
+           "  --desired-interval S   between desired property patches across the hub (0, none)\n"
+           "  --duration S           stop after S seconds (0, on SIGINT or SIGTERM)\n"
+           "  --report S             progress line every S seconds (5, 0 for none)\n"
+           "  --seed N               random seed (1)\n");
+}
+
+static SSL_CTX *createTlsContext(const char *certPath, const char *keyPath)
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    // BearSSL on the device does TLS 1.2
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(context, certPath) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, keyPath, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        return NULL;
+    }
+    return context;
+}
+
+static void printLatency(FILE *out, const char *name, const LatencyHistogram &histogram)
+{
+    if (histogram.getCount() == 0)
+    {
+        fprintf(out, "  %-22s none\n", name);
+        return;
+    }
+    fprintf(out, "  %-22s p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f  mean %8.2f ms (%u)\n", name,
+            histogram.percentileUs(50) / 1000.0, histogram.percentileUs(90) / 1000.0, histogram.percentileUs(99) / 1000.0,
+            histogram.percentileUs(99.9) / 1000.0, histogram.getMaxUs() / 1000.0, histogram.getMeanUs() / 1000.0,
+            (unsigned)histogram.getCount());
+}
+
+static void report(FILE *out, const StandinStats &stats, HubServer &hub, double elapsedS)
+{
+    fprintf(out, "\nRan %.1f s\n", elapsedS);
+    fprintf(out, "DPS: %u registrations, %u status polls, %u assigned, %u throttled, %u errors, %u unauthorized, "
+                 "%u bad requests\n",
+            (unsigned)stats.registrations, (unsigned)stats.statusPolls, (unsigned)stats.assignments,
+            (unsigned)stats.dpsThrottled, (unsigned)stats.dpsErrors, (unsigned)stats.dpsAuthFailures,
+            (unsigned)stats.httpBadRequests);
+    printLatency(out, "register to assigned", stats.registerToAssigned);
+
+    fprintf(out, "Hub: %u connects, %u accepted, %u unauthorized, %u refused (injected); peak %u sessions\n",
+            (unsigned)stats.connects, (unsigned)stats.accepted, (unsigned)stats.authFailures,
+            (unsigned)stats.injectedRefusals, (unsigned)stats.peakSessions);
+    fprintf(out, "  ended: %u replaced by a new connection, %u token lifetime, %u dropped, %u keep-alive, "
+                 "%u protocol errors\n",
+            (unsigned)stats.sessionsKicked, (unsigned)stats.sessionsExpired, (unsigned)stats.sessionsDropped,
+            (unsigned)stats.keepAliveTimeouts, (unsigned)stats.protocolErrors);
+    fprintf(out, "Telemetry: %llu messages (%.1f/s), %llu bytes, %u acks held back by the throttle\n",
+            (unsigned long long)stats.telemetry, elapsedS > 0 ? stats.telemetry / elapsedS : 0,
+            (unsigned long long)stats.telemetryBytes, (unsigned)stats.telemetryThrottled);
+    fprintf(out, "Twin: %u gets, %u reported patches, %u desired patches sent\n", (unsigned)stats.twinGets,
+            (unsigned)stats.reportedPatches, (unsigned)stats.desiredPatches);
+    fprintf(out, "Methods: %u called, %u answered, %u timed out\n", (unsigned)stats.methodsCalled,
+            (unsigned)stats.methodsAnswered, (unsigned)stats.methodsTimedOut);
+    printLatency(out, "call to response", stats.methodRoundTrip);
+
+    if (stats.subscriptionsRefused > 0)
+    {
+        fprintf(out, "Refused %u subscriptions to:\n", (unsigned)stats.subscriptionsRefused);
+        const std::set<std::string> &filters = hub.getRefusedFilters();
+        for (std::set<std::string>::const_iterator it = filters.begin(); it != filters.end(); ++it)
+            fprintf(out, "  %s\n", it->c_str());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    StandinOptions options;
+    options.hubName = "standin.azure-devices.net";
+    options.deviceKey = STANDIN_DEVICE_KEY;
+    options.latencyMs = 0;
+    options.jitterMs = 0;
+    options.assignMs = 500;
+    options.dpsRate = 0;
+    options.errorRate = 0;
+    options.throttleRate = 0;
+    options.tokenLifetimeS = 0;
+    options.dropIntervalS = 0;
+    options.methodIntervalS = 1;
+    options.methodTimeoutS = 30;
+    options.desiredIntervalS = 0;
+    options.seed = 1;
+    const char *certPath = NULL;
+    const char *keyPath = NULL;
+    uint16_t mqttPort = 8883;
+    uint16_t dpsPort = 8443;
+    uint16_t mqttPlainPort = 1883;
+    uint16_t dpsPlainPort = 8080;
+    uint32_t durationS = 0;
+    uint32_t reportIntervalS = 5;
+
+    static const struct option longOptions[] = {
+        {"hub-name", required_argument, NULL, 'H'},
+        {"device-key", required_argument, NULL, 'k'},
+        {"group-key", required_argument, NULL, 'g'},
+        {"cert", required_argument, NULL, 'c'},
+        {"key", required_argument, NULL, 'K'},
+        {"mqtt-port", required_argument, NULL, 'm'},
+        {"dps-port", required_argument, NULL, 'p'},
+        {"mqtt-plain-port", required_argument, NULL, 'M'},
+        {"dps-plain-port", required_argument, NULL, 'P'},
+        {"latency", required_argument, NULL, 'l'},
+        {"jitter", required_argument, NULL, 'j'},
+        {"assign-ms", required_argument, NULL, 'a'},
+        {"dps-rate", required_argument, NULL, 'r'},
+        {"error-rate", required_argument, NULL, 'e'},
+        {"throttle", required_argument, NULL, 'T'},
+        {"token-lifetime", required_argument, NULL, 't'},
+        {"drop-interval", required_argument, NULL, 'D'},
+        {"method", required_argument, NULL, 'x'},
+        {"method-interval", required_argument, NULL, 'X'},
+        {"method-timeout", required_argument, NULL, 'o'},
+        {"desired-interval", required_argument, NULL, 'w'},
+        {"duration", required_argument, NULL, 'd'},
+        {"report", required_argument, NULL, 'i'},
+        {"seed", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int option;
+    while ((option = getopt_long(argc, argv, "d:h", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'H':
+            options.hubName = optarg;
+            break;
+        case 'k':
+            options.deviceKey = optarg;
+            break;
+        case 'g':
+            options.groupKey = optarg;
+            break;
+        case 'c':
+            certPath = optarg;
+            break;
+        case 'K':
+            keyPath = optarg;
+            break;
+        case 'm':
+            mqttPort = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            dpsPort = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            mqttPlainPort = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            dpsPlainPort = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            options.latencyMs = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            options.jitterMs = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            options.assignMs = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.dpsRate = strtod(optarg, NULL);
+            break;
+        case 'e':
+            options.errorRate = strtod(optarg, NULL);
+            break;
+        case 'T':
+            options.throttleRate = strtod(optarg, NULL);
+            break;
+        case 't':
+            options.tokenLifetimeS = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            options.dropIntervalS = strtod(optarg, NULL);
+            break;
+        case 'x':
+            options.methodName = optarg;
+            break;
+        case 'X':
+            options.methodIntervalS = strtod(optarg, NULL);
+            break;
+        case 'o':
+            options.methodTimeoutS = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            options.desiredIntervalS = strtod(optarg, NULL);
+            break;
+        case 'd':
+            durationS = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            reportIntervalS = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            options.seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return option == 'h' ? 0 : 2;
+        }
+    }
+
+    if ((certPath == NULL) != (keyPath == NULL))
+    {
+        fprintf(stderr, "--cert and --key go together\n");
+        return 2;
+    }
+
+    // SSL_write to a closed connection mustn't end the process; stopping
+    // is read from a signalfd so it happens between events
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stopSignals, NULL);
+    int signalFd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    // A socket per device
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Standin standin(options);
+    DpsServer dps(standin);
+    HubServer hub(standin);
+    EventLoop &loop = standin.getLoop();
+
+    if (certPath != NULL)
+    {
+        SSL_CTX *tls = createTlsContext(certPath, keyPath);
+        if (tls == NULL || !hub.listen(mqttPort, tls) || !dps.listen(dpsPort, tls))
+            return 1;
+        printf("TLS: MQTT on %u, DPS on %u\n", (unsigned)mqttPort, (unsigned)dpsPort);
+    }
+    if ((mqttPlainPort != 0 && !hub.listen(mqttPlainPort, NULL)) || (dpsPlainPort != 0 && !dps.listen(dpsPlainPort, NULL)))
+        return 1;
+    if (mqttPlainPort != 0 || dpsPlainPort != 0)
+        printf("Clear: MQTT on %u, DPS on %u (0 is off)\n", (unsigned)mqttPlainPort, (unsigned)dpsPlainPort);
+    printf("Assigning devices to %s\n", options.hubName.c_str());
+    fflush(stdout);
+
+    bool stopping = false;
+    loop.add(signalFd, EPOLLIN, [signalFd, &stopping](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+            stopping = true;
+    });
+    if (durationS > 0)
+        loop.after(durationS * 1000, [&stopping]() { stopping = true; });
+
+    const StandinStats &stats = standin.getStats();
+    uint64_t startedMs = EventLoop::nowMs();
+    uint64_t lastTelemetry = 0;
+    std::function<void()> progress = [&]() {
+        printf("  %5us  sessions %u  telemetry %.0f/s  registrations %u  methods %u/%u\n",
+               (unsigned)((EventLoop::nowMs() - startedMs) / 1000), (unsigned)stats.sessions,
+               (double)(stats.telemetry - lastTelemetry) / reportIntervalS, (unsigned)stats.registrations,
+               (unsigned)stats.methodsAnswered, (unsigned)stats.methodsCalled);
+        fflush(stdout);
+        lastTelemetry = stats.telemetry;
+        loop.after(reportIntervalS * 1000, progress);
+    };
+    if (reportIntervalS > 0)
+        loop.after(reportIntervalS * 1000, progress);
+
+    hub.start();
+    while (!stopping)
+        loop.runOnce(1000);
+
+    report(stdout, stats, hub, (EventLoop::nowMs() - startedMs) / 1000.0);
+    return 0;
+}
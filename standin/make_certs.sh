@@ -0,0 +1,53 @@
+#!/bin/sh
+# Makes a CA and a certificate for the stand-in server, in standin/certs/:
+#
+#   standin/make_certs.sh [NAME...]     names and addresses the devices use
+#                                       to reach it (localhost 127.0.0.1)
+#
+# then serve TLS with --cert standin/certs/server.pem --key standin/certs/server.key,
+# and build the device against the CA (and the stand-in's name and ports):
+#
+#   build_flags = -DCENTRALDUINO_CA_HEADER=\"standin_ca.h\" -Istandin/certs
+#       -DDEFAULT_ENDPOINT=\"192.168.1.10\" -DAZURE_HTTPS_SERVER_PORT=8443
+#
+# with --hub-name 192.168.1.10 on the stand-in, so the hub it assigns is
+# reachable too. The CA key stays in certs/; rerunning keeps the CA and
+# makes a new server certificate.
+set -e
+
+dir=$(dirname "$0")/certs
+mkdir -p "$dir"
+cd "$dir"
+
+[ $# -gt 0 ] || set -- localhost 127.0.0.1
+
+names=""
+for name in "$@"; do
+    case "$name" in
+    *[!0-9.]*) names="$names,DNS:$name" ;;
+    *) names="$names,IP:$name" ;;
+    esac
+done
+names=${names#,}
+
+if [ ! -f ca.key ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -days 3650 -subj "/CN=Centralduino stand-in CA" \
+        -keyout ca.key -out ca.pem 2>/dev/null
+fi
+
+# RSA 2048 keeps the handshake affordable for BearSSL on the ESP8266
+openssl req -newkey rsa:2048 -nodes -subj "/CN=$1" -keyout server.key -out server.csr 2>/dev/null
+printf 'subjectAltName=%s\nextendedKeyUsage=serverAuth\n' "$names" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial -days 825 \
+    -extfile server.ext -out server.pem 2>/dev/null
+rm -f server.csr server.ext
+
+# The CA as the library's SSL_CA_PEM_DEF
+{
+    echo "// Made by make_certs.sh, the stand-in server's CA"
+    echo "#define SSL_CA_PEM_DEF \\"
+    sed 's/.*/    "&\\r\\n" \\/' ca.pem
+    echo "    \"\""
+} > standin_ca.h
+
+echo "certs/server.pem for $names, device header certs/standin_ca.h"
@@ -0,0 +1,135 @@
+#include "sas_token.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+static const char SAS_PREFIX[] = "SharedAccessSignature ";
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+std::string urlDecode(const std::string &text)
+{
+    std::string decoded;
+    decoded.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '%' && i + 2 < text.size() && hexValue(text[i + 1]) >= 0 && hexValue(text[i + 2]) >= 0)
+        {
+            decoded.push_back((char)(hexValue(text[i + 1]) << 4 | hexValue(text[i + 2])));
+            i += 2;
+        }
+        else
+        {
+            decoded.push_back(text[i] == '+' ? ' ' : text[i]);
+        }
+    }
+    return decoded;
+}
+
+static bool base64Decode(const std::string &text, std::string &decoded)
+{
+    if (text.empty() || text.size() % 4 != 0)
+        return false;
+
+    decoded.resize(text.size() / 4 * 3);
+    int length = EVP_DecodeBlock((unsigned char *)&decoded[0], (const unsigned char *)text.data(), (int)text.size());
+    if (length < 0)
+        return false;
+
+    // EVP_DecodeBlock keeps the bytes of the padding
+    size_t padding = text[text.size() - 1] == '=' ? (text[text.size() - 2] == '=' ? 2 : 1) : 0;
+    decoded.resize(length - padding);
+    return true;
+}
+
+static std::string base64Encode(const unsigned char *data, size_t length)
+{
+    std::string encoded((length + 2) / 3 * 4 + 1, '\0');
+    int written = EVP_EncodeBlock((unsigned char *)&encoded[0], data, (int)length);
+    encoded.resize(written);
+    return encoded;
+}
+
+static bool hmacSha256(const std::string &base64Key, const std::string &message, unsigned char *digest)
+{
+    std::string key;
+    if (!base64Decode(base64Key, key))
+        return false;
+
+    unsigned int length = 0;
+    return HMAC(EVP_sha256(), key.data(), (int)key.size(), (const unsigned char *)message.data(), message.size(), digest,
+                &length) != NULL &&
+           length == 32;
+}
+
+bool sasParse(const std::string &text, SasToken &token)
+{
+    if (text.compare(0, sizeof(SAS_PREFIX) - 1, SAS_PREFIX) != 0)
+        return false;
+
+    token = SasToken();
+    size_t position = sizeof(SAS_PREFIX) - 1;
+    while (position < text.size())
+    {
+        size_t end = text.find('&', position);
+        if (end == std::string::npos)
+            end = text.size();
+        size_t equals = text.find('=', position);
+        if (equals != std::string::npos && equals < end)
+        {
+            std::string name = text.substr(position, equals - position);
+            std::string value = text.substr(equals + 1, end - equals - 1);
+            if (name == "sr")
+                token.resource = value;
+            else if (name == "sig")
+                token.signature = urlDecode(value);
+            else if (name == "se")
+                token.expiry = value;
+            else if (name == "skn")
+                token.keyName = value;
+        }
+        position = end + 1;
+    }
+
+    if (token.resource.empty() || token.signature.empty() || token.expiry.empty())
+        return false;
+    char *end;
+    token.expirySeconds = strtoull(token.expiry.c_str(), &end, 10);
+    return *end == '\0';
+}
+
+bool sasResourceIs(const SasToken &token, const std::string &expected)
+{
+    std::string resource = urlDecode(token.resource);
+    return resource.size() == expected.size() && strcasecmp(resource.c_str(), expected.c_str()) == 0;
+}
+
+bool sasVerify(const SasToken &token, const std::string &base64Key)
+{
+    unsigned char digest[32];
+    std::string signature;
+    if (!hmacSha256(base64Key, token.resource + "\n" + token.expiry, digest) || !base64Decode(token.signature, signature))
+        return false;
+    return signature.size() == sizeof(digest) && CRYPTO_memcmp(signature.data(), digest, sizeof(digest)) == 0;
+}
+
+std::string sasDeriveKey(const std::string &base64GroupKey, const std::string &registrationId)
+{
+    unsigned char digest[32];
+    if (!hmacSha256(base64GroupKey, registrationId, digest))
+        return std::string();
+    return base64Encode(digest, sizeof(digest));
+}
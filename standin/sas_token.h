@@ -0,0 +1,35 @@
+#ifndef __SAS_TOKEN_H
+#define __SAS_TOKEN_H
+
+#include <stdint.h>
+#include <string>
+
+// SharedAccessSignature sr={resource}&sig={signature}&se={expiry}[&skn={policy}]
+//
+// Checked the way IoT Hub and DPS do, with OpenSSL rather than the
+// library's own Sha256 and base64, so a bug there shows up as a rejected
+// token instead of passing on both sides.
+typedef struct tagSasToken
+{
+    std::string resource;    // sr as sent, URL encoded; it's what is signed
+    std::string signature;   // sig, URL decoded (still base64)
+    std::string expiry;      // se as sent
+    std::string keyName;     // skn, empty if missing
+    uint64_t expirySeconds;
+} SasToken;
+
+bool sasParse(const std::string &text, SasToken &token);
+
+// The resource, URL decoded, compared without case like the services do
+bool sasResourceIs(const SasToken &token, const std::string &expected);
+
+// HMAC-SHA256 of "{sr}\n{se}" with the base64 key
+bool sasVerify(const SasToken &token, const std::string &base64Key);
+
+// Key of one device in a group enrollment: HMAC-SHA256 of the registration
+// id with the group key, base64
+std::string sasDeriveKey(const std::string &base64GroupKey, const std::string &registrationId);
+
+std::string urlDecode(const std::string &text);
+
+#endif // __SAS_TOKEN_H
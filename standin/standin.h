@@ -0,0 +1,107 @@
+#ifndef __STANDIN_H
+#define __STANDIN_H
+
+#include <stdint.h>
+#include <random>
+#include <string>
+
+#include "event_loop.h"
+#include "latency_histogram.h"
+#include "sas_token.h"
+
+typedef struct tagStandinOptions
+{
+    std::string hubName;        // assigned by DPS, checked in the hub's SAS tokens
+    std::string deviceKey;      // every device's key, base64
+    std::string groupKey;       // or a group enrollment's, each key derived from it
+    uint32_t latencyMs;         // added to every response
+    uint32_t jitterMs;          // plus up to this much more
+    uint32_t assignMs;          // DPS registration time, register to assigned
+    double dpsRate;             // registrations per second, over it is 429; 0 for no limit
+    double errorRate;           // share of registrations and connects that fail, 0 to 1
+    double throttleRate;        // telemetry per second across the hub, acks of the rest are held back; 0 for no limit
+    uint32_t tokenLifetimeS;    // connections end this long after they're made, 0 for when their SAS expires
+    double dropIntervalS;       // mean time between dropped connections per device, 0 for none
+    std::string methodName;     // direct method the hub calls, empty for none
+    double methodIntervalS;     // between calls across the hub
+    uint32_t methodTimeoutS;
+    double desiredIntervalS;    // between desired property patches across the hub, 0 for none
+    uint32_t seed;
+} StandinOptions;
+
+typedef struct tagStandinStats
+{
+    // DPS
+    uint32_t registrations;
+    uint32_t statusPolls;
+    uint32_t assignments;
+    uint32_t dpsThrottled;
+    uint32_t dpsErrors;
+    uint32_t dpsAuthFailures;
+    uint32_t httpBadRequests;
+    LatencyHistogram registerToAssigned;
+
+    // Hub
+    uint32_t connects;
+    uint32_t accepted;
+    uint32_t authFailures;
+    uint32_t injectedRefusals;
+    uint32_t sessionsKicked;    // by a newer connection with the same id
+    uint32_t sessionsExpired;   // token lifetime
+    uint32_t sessionsDropped;   // injected
+    uint32_t keepAliveTimeouts;
+    uint32_t protocolErrors;
+    uint32_t sessions;
+    uint32_t peakSessions;
+    uint32_t subscriptionsRefused;
+    uint64_t telemetry;
+    uint64_t telemetryBytes;
+    uint32_t telemetryThrottled;
+    uint32_t twinGets;
+    uint32_t reportedPatches;
+    uint32_t desiredPatches;
+    uint32_t methodsCalled;
+    uint32_t methodsAnswered;
+    uint32_t methodsTimedOut;
+    LatencyHistogram methodRoundTrip;
+} StandinStats;
+
+// What both services share: the loop, the options, the counters, and the
+// random source for latency and fault injection
+class Standin
+{
+  public:
+    Standin(const StandinOptions &options) : _options(options), _random(options.seed), _stats() {}
+
+    EventLoop &getLoop() { return _loop; }
+    const StandinOptions &getOptions() { return _options; }
+    StandinStats &getStats() { return _stats; }
+    std::mt19937 &getRandom() { return _random; }
+
+    // latency plus up to jitter
+    uint32_t responseDelayMs()
+    {
+        if (_options.jitterMs == 0)
+            return _options.latencyMs;
+        return _options.latencyMs + std::uniform_int_distribution<uint32_t>(0, _options.jitterMs)(_random);
+    }
+
+    bool injectError()
+    {
+        return _options.errorRate > 0 && std::uniform_real_distribution<double>(0, 1)(_random) < _options.errorRate;
+    }
+
+    // The key the device's SAS tokens are signed with
+    std::string keyOf(const std::string &deviceId)
+    {
+        return _options.groupKey.empty() ? _options.deviceKey : sasDeriveKey(_options.groupKey, deviceId);
+    }
+
+  private:
+    StandinOptions _options;
+    EventLoop _loop;
+    std::mt19937 _random;
+    StandinStats _stats;
+};
+
+#endif // __STANDIN_H
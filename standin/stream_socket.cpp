@@ -0,0 +1,285 @@
+#include "stream_socket.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define READ_CHUNK 16384
+
+StreamSocket::StreamSocket(EventLoop &loop, int fd, SSL_CTX *tls)
+    : _loop(loop), _fd(fd), _ssl(NULL), _handshaking(false), _closeAfterSend(false), _writeBlocked(false), _events(0)
+{
+    if (tls != NULL)
+    {
+        _ssl = SSL_new(tls);
+        SSL_set_fd(_ssl, fd);
+        SSL_set_accept_state(_ssl);
+        // The output buffer grows and moves between retries
+        SSL_set_mode(_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        _handshaking = true;
+    }
+}
+
+StreamSocket::~StreamSocket()
+{
+    _onClose = nullptr;
+    close();
+}
+
+void StreamSocket::start(DataHandler onData, CloseHandler onClose)
+{
+    _onData = onData;
+    _onClose = onClose;
+    _events = EPOLLIN;
+    if (!_loop.add(_fd, _events, [this](uint32_t events) { onEvent(events); }))
+        close();
+}
+
+void StreamSocket::send(const std::string &data)
+{
+    if (_fd < 0)
+        return;
+
+    _out.append(data);
+    if (!_handshaking && !_writeBlocked && flush())
+        updateEvents();
+}
+
+void StreamSocket::closeAfterSend()
+{
+    _closeAfterSend = true;
+    if (_fd >= 0 && !_handshaking && _out.empty())
+        close();
+}
+
+void StreamSocket::close()
+{
+    if (_fd < 0)
+        return;
+
+    _loop.remove(_fd);
+    if (_ssl != NULL)
+    {
+        // Best effort close_notify; the socket is non-blocking
+        if (!_handshaking)
+            SSL_shutdown(_ssl);
+        SSL_free(_ssl);
+        _ssl = NULL;
+    }
+    ::close(_fd);
+    _fd = -1;
+    _in.clear();
+    _out.clear();
+
+    CloseHandler onClose = _onClose;
+    _onClose = nullptr;
+    if (onClose)
+        onClose();
+}
+
+void StreamSocket::onEvent(uint32_t events)
+{
+    (void)events;
+    if (_handshaking && !handshake())
+        return;
+
+    // Whatever the event, try both ways: TLS can need a read to finish a
+    // write and the other way around
+    if (!_out.empty() && !flush())
+        return;
+    if (!readAll())
+        return;
+    updateEvents();
+}
+
+bool StreamSocket::handshake()
+{
+    int result = SSL_do_handshake(_ssl);
+    if (result == 1)
+    {
+        _handshaking = false;
+        _writeBlocked = false;
+        return true;
+    }
+
+    switch (SSL_get_error(_ssl, result))
+    {
+    case SSL_ERROR_WANT_READ:
+        _writeBlocked = false;
+        updateEvents();
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        _writeBlocked = true;
+        updateEvents();
+        break;
+    default:
+        // Scanners, clients that don't trust the certificate
+        close();
+        break;
+    }
+    return false;
+}
+
+bool StreamSocket::readAll()
+{
+    char chunk[READ_CHUNK];
+    for (;;)
+    {
+        if (_ssl != NULL)
+        {
+            int result = SSL_read(_ssl, chunk, sizeof(chunk));
+            if (result > 0)
+            {
+                _in.append(chunk, result);
+                continue;
+            }
+            int error = SSL_get_error(_ssl, result);
+            if (error == SSL_ERROR_WANT_READ)
+                break;
+            if (error == SSL_ERROR_WANT_WRITE)
+            {
+                _writeBlocked = true;
+                break;
+            }
+            close();
+            return false;
+        }
+
+        ssize_t result = recv(_fd, chunk, sizeof(chunk), 0);
+        if (result > 0)
+        {
+            _in.append(chunk, result);
+            continue;
+        }
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        close();
+        return false;
+    }
+
+    // Anything after the last request of a closing connection is ignored
+    if (_closeAfterSend)
+        _in.clear();
+    if (!_in.empty())
+    {
+        _onData(_in);
+        if (_fd < 0)
+            return false;
+    }
+    return true;
+}
+
+bool StreamSocket::flush()
+{
+    size_t sent = 0;
+    _writeBlocked = false;
+    while (sent < _out.size())
+    {
+        size_t length = _out.size() - sent;
+        if (_ssl != NULL)
+        {
+            int result = SSL_write(_ssl, _out.data() + sent, length > INT_MAX ? INT_MAX : (int)length);
+            if (result > 0)
+            {
+                sent += result;
+                continue;
+            }
+            int error = SSL_get_error(_ssl, result);
+            if (error == SSL_ERROR_WANT_WRITE)
+                _writeBlocked = true;
+            else if (error != SSL_ERROR_WANT_READ)
+            {
+                close();
+                return false;
+            }
+            break;
+        }
+
+        ssize_t result = ::send(_fd, _out.data() + sent, length, MSG_NOSIGNAL);
+        if (result >= 0)
+        {
+            sent += result;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            _writeBlocked = true;
+            break;
+        }
+        close();
+        return false;
+    }
+    _out.erase(0, sent);
+
+    if (_out.empty() && _closeAfterSend)
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void StreamSocket::updateEvents()
+{
+    uint32_t events = EPOLLIN | (_writeBlocked ? EPOLLOUT : 0);
+    if (_fd >= 0 && events != _events)
+    {
+        _events = events;
+        _loop.modify(_fd, events);
+    }
+}
+
+bool listenTcp(EventLoop &loop, uint16_t port, AcceptHandler onAccept)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Can't listen on port %u: %s\n", (unsigned)port, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    // Lives as long as the process
+    return loop.add(fd, EPOLLIN, [fd, onAccept](uint32_t) {
+        for (;;)
+        {
+            int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                // EAGAIN, or out of descriptors: the rest wait in the backlog
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept4");
+                if (errno != EINTR)
+                    break;
+                continue;
+            }
+            int one = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            onAccept(client);
+        }
+    });
+}
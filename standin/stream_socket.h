@@ -0,0 +1,60 @@
+#ifndef __STREAM_SOCKET_H
+#define __STREAM_SOCKET_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+#include <openssl/ssl.h>
+
+#include "event_loop.h"
+
+// Read as much of the input as makes whole requests or packets, and erase it
+typedef std::function<void(std::string &input)> DataHandler;
+typedef std::function<void()> CloseHandler;
+typedef std::function<void(int fd)> AcceptHandler;
+
+// An accepted, non-blocking connection on the event loop, TLS when given a
+// context. The close handler runs once, from inside the socket's own
+// callbacks, so owners must delete the socket later (a 0 ms timer), never
+// from the handler itself.
+class StreamSocket
+{
+  public:
+    StreamSocket(EventLoop &loop, int fd, SSL_CTX *tls);
+    ~StreamSocket();
+
+    void start(DataHandler onData, CloseHandler onClose);
+    bool isOpen() { return _fd >= 0; }
+
+    void send(const std::string &data);
+
+    // Once the output has gone; for HTTP's connection: close
+    void closeAfterSend();
+    void close();
+
+  private:
+    void onEvent(uint32_t events);
+    bool handshake();
+    bool readAll();
+    bool flush();
+    void updateEvents();
+
+    EventLoop &_loop;
+    int _fd;
+    SSL *_ssl;
+    bool _handshaking;
+    bool _closeAfterSend;
+    bool _writeBlocked; // on the socket, or on TLS wanting to read first
+    uint32_t _events;
+    std::string _in;
+    std::string _out;
+    DataHandler _onData;
+    CloseHandler _onClose;
+};
+
+// Listens on port on all interfaces and hands over each accepted,
+// non-blocking connection
+bool listenTcp(EventLoop &loop, uint16_t port, AcceptHandler onAccept);
+
+#endif // __STREAM_SOCKET_H
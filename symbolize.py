@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+
+"""Centralduino crash report symbolizer
+
+Resolves the addresses in the "crash" telemetry messages sent by the
+library (see lib/Centralduino/crash_report.h) for a whole fleet at once.
+Each ELF's symbol table is loaded once and every address is looked up in
+memory; with --lines, file and line numbers come from a single addr2line
+process per ELF fed all the addresses, instead of one process per dump.
+
+Input is one message per line, as exported from the hub: any JSON object
+with a "crash" object somewhere inside. When several ELFs are given, each
+report goes to the one whose .bin next to it has the report's sketch MD5.
+
+  symbolize.py -e .pio/build/huzzah/firmware.elf crashes.jsonl
+  symbolize.py -e v1/firmware.elf -e v2/firmware.elf --summary crashes.jsonl
+"""
+
+import argparse
+import bisect
+import hashlib
+import json
+import os
+import subprocess
+import sys
+from collections import defaultdict
+
+from decode import EXCEPTIONS, PLATFORMS
+
+RESET_REASONS = [
+    "power on",
+    "hardware watchdog",
+    "exception",
+    "software watchdog",
+    "software restart",
+    "deep sleep wake",
+    "external reset"
+]
+
+REGISTERS = ["epc1", "epc2", "epc3", "excvaddr", "depc"]
+DEVICE_KEYS = ["deviceId", "device_id", "connectionDeviceId"]
+
+
+class SymbolTable(object):
+    def __init__(self, tool_prefix, elf_path):
+        self.elf = elf_path
+        self._tool_prefix = tool_prefix
+        self._starts = []
+        self._symbols = []
+        self._lines = {}
+
+        output = subprocess.check_output([tool_prefix + "nm", "-n", "-S", "-C", "--defined-only", elf_path],
+                                         encoding="utf-8")
+        for line in output.splitlines():
+            # address [size] type name
+            parts = line.split(None, 3)
+            if len(parts) == 4:
+                address, size, kind, name = int(parts[0], 16), int(parts[1], 16), parts[2], parts[3]
+            elif len(parts) == 3:
+                address, size, kind, name = int(parts[0], 16), 0, parts[1], parts[2]
+            else:
+                continue
+            if kind not in "tTwW":
+                continue
+            self._starts.append(address)
+            self._symbols.append((address, size, name))
+
+        self.sketch_md5 = None
+        bin_path = os.path.splitext(elf_path)[0] + ".bin"
+        if os.path.exists(bin_path):
+            with open(bin_path, "rb") as f:
+                self.sketch_md5 = hashlib.md5(f.read()).hexdigest()
+
+    def function(self, address):
+        index = bisect.bisect_right(self._starts, address) - 1
+        if index < 0:
+            return None
+        start, size, name = self._symbols[index]
+        if size and address >= start + size:
+            return None
+        return "{}+0x{:x}".format(name, address - start)
+
+    def load_lines(self, addresses):
+        addresses = sorted(set(addresses) - set(self._lines))
+        if not addresses:
+            return
+        process = subprocess.run([self._tool_prefix + "addr2line", "-a", "-f", "-p", "-C", "-e", self.elf],
+                                 input="\n".join("0x{:08x}".format(a) for a in addresses) + "\n",
+                                 stdout=subprocess.PIPE, encoding="utf-8", check=True)
+        for line in process.stdout.splitlines():
+            address, _, result = line.partition(": ")
+            if result and "??:" not in result:
+                self._lines[int(address, 16)] = result.split(" at ", 1)[-1]
+
+    def describe(self, address):
+        name = self.function(address)
+        if name is None:
+            return "0x{:08x}".format(address)
+        line = self._lines.get(address)
+        return "0x{:08x}: {}{}".format(address, name, " at " + line if line else "")
+
+
+def find_crash(value):
+    if isinstance(value, dict):
+        if isinstance(value.get("crash"), dict):
+            return value["crash"]
+        children = value.values()
+    elif isinstance(value, list):
+        children = value
+    else:
+        return None
+    for child in children:
+        found = find_crash(child)
+        if found is not None:
+            return found
+    return None
+
+
+def read_reports(files):
+    for file in files:
+        for number, line in enumerate(file, 1):
+            start = line.find("{")
+            if start < 0:
+                continue
+            try:
+                message = json.loads(line[start:])
+            except ValueError:
+                print("WARNING: {}:{} isn't JSON, skipped".format(file.name, number), file=sys.stderr)
+                continue
+            crash = find_crash(message)
+            if crash is None:
+                continue
+            device = next((message[key] for key in DEVICE_KEYS if isinstance(message, dict) and key in message), "?")
+            yield device, crash
+
+
+def to_address(value):
+    return int(value, 16) if isinstance(value, str) else int(value)
+
+
+def pick_table(tables, crash):
+    if len(tables) == 1:
+        return tables[0]
+    sketch = crash.get("sketch")
+    return next((table for table in tables if table.sketch_md5 == sketch), None)
+
+
+def describe_reason(crash):
+    reason = crash.get("reason", 0)
+    text = RESET_REASONS[reason] if reason < len(RESET_REASONS) else "reason {}".format(reason)
+    cause = crash.get("cause", 0)
+    if reason == 2 and cause < len(EXCEPTIONS):
+        text += ": " + EXCEPTIONS[cause].split(":")[0] + " ({})".format(cause)
+    return text
+
+
+def crash_site(table, crash):
+    # The faulting pc for exceptions, else the innermost known frame
+    frames = [to_address(crash["epc1"])] if crash.get("reason") == 2 else []
+    frames += [to_address(a) for a in crash.get("stack", [])]
+    names = [table.function(a) for a in frames]
+    names = [n.split("+")[0] for n in names if n is not None]
+    return " <- ".join(names[:3]) if names else "(unknown)"
+
+
+def print_report(device, crash, table):
+    print("Device {}: {}, after {} ms".format(device, describe_reason(crash), crash.get("uptime_ms", "?")))
+    if table is None:
+        print("  no ELF for sketch {}".format(crash.get("sketch")))
+        return
+    for register in REGISTERS:
+        value = to_address(crash.get(register, 0))
+        if value:
+            print("  {}:{} {}".format(register, " " * (8 - len(register)), table.describe(value)))
+    for address in crash.get("stack", []):
+        print("  " + table.describe(to_address(address)))
+    print("")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Symbolize Centralduino crash reports in bulk.")
+
+    parser.add_argument("-p", "--platform", help="The platform to decode from", choices=PLATFORMS.keys(),
+                        default="ESP8266")
+    parser.add_argument("-t", "--tool", help="Path to the xtensa toolchain",
+                        default="~/.platformio/packages/toolchain-xtensa/")
+    parser.add_argument("-e", "--elf", help="path to an elf file, repeat for several builds", action="append",
+                        required=True)
+    parser.add_argument("-l", "--lines", help="Resolve file and line numbers too", action="store_true")
+    parser.add_argument("-s", "--summary", help="Only print the crash sites and their counts", action="store_true")
+    parser.add_argument("files", help="Files with the crash messages (default STDIN)", nargs="*")
+
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    args = parse_args()
+
+    tool_prefix = os.path.join(os.path.abspath(os.path.expanduser(args.tool)),
+                               "bin", "xtensa-" + PLATFORMS[args.platform] + "-elf-")
+    if not os.path.exists(tool_prefix + "nm"):
+        print("ERROR: nm not found (" + tool_prefix + "nm)")
+        sys.exit(1)
+
+    tables = []
+    for elf in args.elf:
+        elf_file = os.path.abspath(os.path.expanduser(elf))
+        if not os.path.exists(elf_file):
+            print("ERROR: elf file not found (" + elf_file + ")")
+            sys.exit(1)
+        tables.append(SymbolTable(tool_prefix, elf_file))
+
+    files = [open(name, "r") for name in args.files] or [sys.stdin]
+    reports = [(device, crash, pick_table(tables, crash)) for device, crash in read_reports(files)]
+
+    if args.lines and not args.summary:
+        wanted = defaultdict(list)
+        for _, crash, table in reports:
+            if table is not None:
+                wanted[table].extend(to_address(crash.get(r, 0)) for r in REGISTERS)
+                wanted[table].extend(to_address(a) for a in crash.get("stack", []))
+        for table, addresses in wanted.items():
+            table.load_lines(a for a in addresses if table.function(a) is not None)
+
+    sites = defaultdict(lambda: [0, set()])
+    for device, crash, table in reports:
+        if not args.summary:
+            print_report(device, crash, table)
+        site = sites[(describe_reason(crash), crash_site(table, crash) if table else "(no elf)")]
+        site[0] += 1
+        site[1].add(device)
+
+    print("{} crash reports, {} sites".format(len(reports), len(sites)))
+    for (reason, site), (count, devices) in sorted(sites.items(), key=lambda item: -item[1][0]):
+        print("{:6} {:5} devices  {}: {}".format(count, len(devices), reason, site))
@@ -0,0 +1,151 @@
+// C2dMessage and C2dReceiver: the property bag is read out of the topic and
+// URL decoded, and the payload reaches the callbacks as far as they take it.
+
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+#include "c2d_message.h"
+#include "string_buffer.h"
+
+static C2dMessage message;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void test_properties()
+{
+    TEST_ASSERT_TRUE(message.parse("devices/dev1/messages/devicebound/%24.mid=42&%24.to=%2Fdevices%2Fdev1%2Fmessages"
+                                   "%2Fdevicebound&%24.ct=application%2Fjson&color=blue",
+                                   12));
+    TEST_ASSERT_EQUAL_UINT8(4, message.getPropertyCount());
+    TEST_ASSERT_EQUAL_UINT32(12, message.getLength());
+    TEST_ASSERT_EQUAL_STRING("42", message.getProperty("$.mid"));
+    TEST_ASSERT_EQUAL_STRING("/devices/dev1/messages/devicebound", message.getProperty("$.to"));
+    TEST_ASSERT_EQUAL_STRING("application/json", message.getProperty("$.ct"));
+    TEST_ASSERT_EQUAL_STRING("blue", message.getProperty("color"));
+    TEST_ASSERT_NULL(message.getProperty("size"));
+
+    // In topic order
+    TEST_ASSERT_EQUAL_STRING("$.mid", message.getProperty((uint8_t)0).name);
+    TEST_ASSERT_EQUAL_STRING("color", message.getProperty((uint8_t)3).name);
+}
+
+static void test_no_properties()
+{
+    TEST_ASSERT_TRUE(message.parse("devices/dev1/messages/devicebound/", 0));
+    TEST_ASSERT_EQUAL_UINT8(0, message.getPropertyCount());
+
+    // Empty pairs skipped, a name alone has an empty value
+    TEST_ASSERT_TRUE(message.parse("devices/dev1/messages/devicebound/&&flag&a=&=b&", 0));
+    TEST_ASSERT_EQUAL_UINT8(3, message.getPropertyCount());
+    TEST_ASSERT_EQUAL_STRING("", message.getProperty("flag"));
+    TEST_ASSERT_EQUAL_STRING("", message.getProperty("a"));
+    TEST_ASSERT_EQUAL_STRING("b", message.getProperty(""));
+}
+
+// Percent escapes decoded, a '+' kept, broken escapes left as they are
+static void test_url_decoding()
+{
+    TEST_ASSERT_TRUE(
+        message.parse("devices/dev1/messages/devicebound/a%20b=1+1%3D2&pct=100%25&bad=%zz%4&tail=%4", 0));
+    TEST_ASSERT_EQUAL_STRING("1+1=2", message.getProperty("a b"));
+    TEST_ASSERT_EQUAL_STRING("100%", message.getProperty("pct"));
+    TEST_ASSERT_EQUAL_STRING("%zz%4", message.getProperty("bad"));
+    TEST_ASSERT_EQUAL_STRING("%4", message.getProperty("tail"));
+
+    // Escaped separators stay in the value
+    TEST_ASSERT_TRUE(message.parse("devices/dev1/messages/devicebound/q=a%26b%3Dc", 0));
+    TEST_ASSERT_EQUAL_UINT8(1, message.getPropertyCount());
+    TEST_ASSERT_EQUAL_STRING("a&b=c", message.getProperty("q"));
+
+    char text[] = "x+y%41%4a%";
+    TEST_ASSERT_EQUAL_UINT(6, urlDecodeInPlace(text, strlen(text), true));
+    TEST_ASSERT_EQUAL_STRING("x yAJ%", text);
+}
+
+static void test_too_many_properties()
+{
+    std::string topic = "devices/dev1/messages/devicebound/";
+    for (int i = 0; i < C2D_MAX_PROPERTIES + 3; i++)
+        topic += "p" + std::to_string(i) + "=" + std::to_string(i) + "&";
+    TEST_ASSERT_TRUE(message.parse(topic.c_str(), 0));
+    TEST_ASSERT_EQUAL_UINT8(C2D_MAX_PROPERTIES, message.getPropertyCount());
+    TEST_ASSERT_EQUAL_STRING("0", message.getProperty("p0"));
+    TEST_ASSERT_NULL(message.getProperty(("p" + std::to_string(C2D_MAX_PROPERTIES)).c_str()));
+}
+
+static void test_refused_topics()
+{
+    TEST_ASSERT_FALSE(message.parse("devices/dev1/messages/events/a=1", 0));
+    TEST_ASSERT_FALSE(message.parse("$iothub/methods/POST/reboot/?$rid=1", 0));
+    TEST_ASSERT_FALSE(message.parse("other/dev1/messages/devicebound/a=1", 0));
+    TEST_ASSERT_EQUAL_UINT8(0, message.getPropertyCount());
+
+    std::string topic = "devices/dev1/messages/devicebound/big=" + std::string(C2D_PROPERTY_BAG_MAX_LEN, 'x');
+    TEST_ASSERT_FALSE(message.parse(topic.c_str(), 0));
+}
+
+static void test_receiver()
+{
+    C2dReceiver receiver;
+    std::string received;
+    int ends = 0;
+    bool wasComplete = false;
+    size_t takeAtMost = 1000;
+    receiver.setCallbacks(
+        [](const C2dMessage &message) { return message.getProperty("drop") == NULL; },
+        [&](const uint8_t *data, size_t length) {
+            size_t taken = length < takeAtMost ? length : takeAtMost;
+            received.append((const char *)data, taken);
+            takeAtMost -= taken;
+            return taken;
+        },
+        [&](const C2dMessage &message, bool complete) {
+            ends++;
+            wasComplete = complete;
+        },
+        16);
+
+    char topic[] = "devices/dev1/messages/devicebound/a=1";
+    receiver.deliver(topic, (const uint8_t *)"hello", 5);
+    TEST_ASSERT_EQUAL_STRING("hello", received.c_str());
+    TEST_ASSERT_EQUAL_INT(1, ends);
+    TEST_ASSERT_TRUE(wasComplete);
+
+    // Whatever the callback leaves is dropped
+    received.clear();
+    takeAtMost = 3;
+    receiver.deliver(topic, (const uint8_t *)"goodbye", 7);
+    TEST_ASSERT_EQUAL_STRING("goo", received.c_str());
+    TEST_ASSERT_EQUAL_INT(2, ends);
+    TEST_ASSERT_FALSE(wasComplete);
+
+    // Discarded before the payload: refused, over the limit, not a C2D topic
+    takeAtMost = 1000;
+    received.clear();
+    char dropped[] = "devices/dev1/messages/devicebound/drop";
+    receiver.deliver(dropped, (const uint8_t *)"x", 1);
+    receiver.deliver(topic, (const uint8_t *)"0123456789abcdefg", 17);
+    char malformed[] = "devices/dev1/messages/events/";
+    receiver.deliver(malformed, (const uint8_t *)"x", 1);
+    TEST_ASSERT_EQUAL_STRING("", received.c_str());
+    TEST_ASSERT_EQUAL_INT(2, ends);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_properties);
+    RUN_TEST(test_no_properties);
+    RUN_TEST(test_url_decoding);
+    RUN_TEST(test_too_many_properties);
+    RUN_TEST(test_refused_topics);
+    RUN_TEST(test_receiver);
+    return UNITY_END();
+}
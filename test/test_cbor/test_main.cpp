@@ -0,0 +1,122 @@
+// CborWriter against the examples in RFC 7049 appendix A.
+
+#include <string.h>
+#include <unity.h>
+
+#include "cbor_writer.h"
+
+static uint8_t buffer[64];
+
+void setUp()
+{
+    memset(buffer, 0, sizeof(buffer));
+}
+
+void tearDown()
+{
+}
+
+#define CHECK_ENCODING(call, ...)                                                                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        static const uint8_t expected[] = {__VA_ARGS__};                                                               \
+        CborWriter writer(buffer, sizeof(buffer));                                                                     \
+        writer.call;                                                                                                   \
+        TEST_ASSERT_FALSE(writer.hasOverflowed());                                                                     \
+        TEST_ASSERT_EQUAL_UINT(sizeof(expected), writer.getLength());                                                  \
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, sizeof(expected));                                              \
+    } while (0)
+
+static void test_integers()
+{
+    CHECK_ENCODING(writeInt(0), 0x00);
+    CHECK_ENCODING(writeInt(23), 0x17);
+    CHECK_ENCODING(writeInt(24), 0x18, 0x18);
+    CHECK_ENCODING(writeInt(100), 0x18, 0x64);
+    CHECK_ENCODING(writeInt(1000), 0x19, 0x03, 0xe8);
+    CHECK_ENCODING(writeInt(1000000), 0x1a, 0x00, 0x0f, 0x42, 0x40);
+    CHECK_ENCODING(writeInt(1000000000000LL), 0x1b, 0x00, 0x00, 0x00, 0xe8, 0xd4, 0xa5, 0x10, 0x00);
+    CHECK_ENCODING(writeInt(-1), 0x20);
+    CHECK_ENCODING(writeInt(-10), 0x29);
+    CHECK_ENCODING(writeInt(-100), 0x38, 0x63);
+    CHECK_ENCODING(writeInt(-1000), 0x39, 0x03, 0xe7);
+    CHECK_ENCODING(writeInt(INT64_MIN), 0x3b, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff);
+}
+
+// Half precision where it is lossless, single otherwise
+static void test_floats()
+{
+    CHECK_ENCODING(writeFloat(0.0f), 0xf9, 0x00, 0x00);
+    CHECK_ENCODING(writeFloat(-0.0f), 0xf9, 0x80, 0x00);
+    CHECK_ENCODING(writeFloat(1.0f), 0xf9, 0x3c, 0x00);
+    CHECK_ENCODING(writeFloat(1.5f), 0xf9, 0x3e, 0x00);
+    CHECK_ENCODING(writeFloat(65504.0f), 0xf9, 0x7b, 0xff);
+    CHECK_ENCODING(writeFloat(-4.0f), 0xf9, 0xc4, 0x00);
+    CHECK_ENCODING(writeFloat(100000.0f), 0xfa, 0x47, 0xc3, 0x50, 0x00);
+    CHECK_ENCODING(writeFloat(3.4028234663852886e+38f), 0xfa, 0x7f, 0x7f, 0xff, 0xff);
+    CHECK_ENCODING(writeFloat(0.1f), 0xfa, 0x3d, 0xcc, 0xcc, 0xcd);
+}
+
+static void test_simple_values()
+{
+    CHECK_ENCODING(writeBool(false), 0xf4);
+    CHECK_ENCODING(writeBool(true), 0xf5);
+    CHECK_ENCODING(writeNull(), 0xf6);
+}
+
+static void test_strings()
+{
+    CHECK_ENCODING(writeText("", 0), 0x60);
+    CHECK_ENCODING(writeText("IETF", 4), 0x64, 0x49, 0x45, 0x54, 0x46);
+
+    static const uint8_t bytes[] = {1, 2, 3, 4};
+    CHECK_ENCODING(writeBytes(bytes, sizeof(bytes)), 0x44, 0x01, 0x02, 0x03, 0x04);
+}
+
+static void test_containers()
+{
+    static const uint8_t expected[] = {0xa2, 0x61, 0x61, 0x01, 0x61, 0x62, 0x82, 0x02, 0x03};
+    CborWriter writer(buffer, sizeof(buffer));
+    writer.writeMap(2);
+    writer.writeText("a", 1);
+    writer.writeInt(1);
+    writer.writeText("b", 1);
+    writer.writeArray(2);
+    writer.writeInt(2);
+    writer.writeInt(3);
+    TEST_ASSERT_EQUAL_UINT(sizeof(expected), writer.getLength());
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, sizeof(expected));
+}
+
+// 273.15 as tag 4 [-2, 27315]
+static void test_decimal()
+{
+    CHECK_ENCODING(writeDecimal(27315, -2), 0xc4, 0x82, 0x21, 0x19, 0x6a, 0xb3);
+}
+
+// What doesn't fit is dropped and flagged, never written past the end
+static void test_overflow()
+{
+    CborWriter writer(buffer, 4);
+    writer.writeText("IETF", 4);
+    TEST_ASSERT_TRUE(writer.hasOverflowed());
+    TEST_ASSERT_EQUAL_UINT(4, writer.getLength());
+    TEST_ASSERT_EQUAL_HEX8(0, buffer[4]);
+
+    CborWriter fits(buffer, 5);
+    fits.writeText("IETF", 4);
+    TEST_ASSERT_FALSE(fits.hasOverflowed());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_integers);
+    RUN_TEST(test_floats);
+    RUN_TEST(test_simple_values);
+    RUN_TEST(test_strings);
+    RUN_TEST(test_containers);
+    RUN_TEST(test_decimal);
+    RUN_TEST(test_overflow);
+    return UNITY_END();
+}
@@ -0,0 +1,215 @@
+// GzipCompressor and crc32Update: the output inflates back to the input
+// and carries the right CRC-32 and length.
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+#include "crc32.h"
+#include "gzip_compressor.h"
+
+static GzipCompressor compressor;
+static uint8_t output[8192];
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Just enough of inflate (RFC 1951) for what the compressor writes: one
+// final block with the fixed Huffman codes
+class BitReader
+{
+  public:
+    BitReader(const uint8_t *data, size_t length) : _data(data), _length(length), _position(0) {}
+
+    bool isPastEnd() { return _position > _length * 8; }
+    size_t getBytePosition() { return (_position + 7) / 8; }
+
+    // Values go LSB first
+    uint32_t bits(uint8_t count)
+    {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < count; i++)
+            value |= (uint32_t)bit() << i;
+        return value;
+    }
+
+    // Huffman codes go MSB first
+    uint32_t code(uint8_t count)
+    {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < count; i++)
+            value = value << 1 | bit();
+        return value;
+    }
+
+  private:
+    uint8_t bit()
+    {
+        size_t position = _position++;
+        return position < _length * 8 ? (_data[position / 8] >> (position % 8)) & 1 : 0;
+    }
+
+    const uint8_t *_data;
+    size_t _length;
+    size_t _position;
+};
+
+static const uint16_t lengthBase[] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,  15,  17,  19,  23, 27,
+                                      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distanceBase[] = {1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+                                        33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+                                        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Checks the gzip container around the block too, false if anything is off
+static bool gunzip(const uint8_t *data, size_t length, std::string &out)
+{
+    static const uint8_t header[] = {0x1f, 0x8b, 8};
+    if (length < GZIP_OVERHEAD + 2 || memcmp(data, header, sizeof(header)) != 0)
+        return false;
+
+    BitReader in(data + 10, length - GZIP_OVERHEAD);
+    if (in.bits(1) != 1 || in.bits(2) != 1) // last block, fixed codes
+        return false;
+
+    out.clear();
+    for (;;)
+    {
+        uint32_t code = in.code(7);
+        uint16_t symbol;
+        if (code <= 0x17)
+        {
+            symbol = 256 + code;
+        }
+        else
+        {
+            code = code << 1 | in.code(1);
+            if (code >= 0x30 && code <= 0xbf)
+                symbol = code - 0x30;
+            else if (code >= 0xc0 && code <= 0xc7)
+                symbol = 280 + code - 0xc0;
+            else
+                symbol = 144 + (code << 1 | in.code(1)) - 0x190;
+        }
+        if (in.isPastEnd())
+            return false;
+
+        if (symbol < 256)
+        {
+            out += (char)symbol;
+            continue;
+        }
+        if (symbol == 256)
+            break;
+        if (symbol > 285)
+            return false;
+
+        size_t matchLength = lengthBase[symbol - 257] + in.bits(lengthExtra[symbol - 257]);
+        uint32_t distanceCode = in.code(5);
+        if (distanceCode >= 30)
+            return false;
+        size_t distance = distanceBase[distanceCode] + in.bits(distanceExtra[distanceCode]);
+        if (distance > out.size() || distance > GZIP_WINDOW_SIZE)
+            return false;
+        for (size_t i = 0; i < matchLength; i++)
+            out += out[out.size() - distance];
+    }
+
+    // The trailer follows the block, byte aligned
+    if (10 + in.getBytePosition() + 8 != length)
+        return false;
+    const uint8_t *trailer = data + length - 8;
+    uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+    uint32_t size = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (uint32_t)trailer[7] << 24;
+    return crc == crc32Update(0, out.data(), out.size()) && size == out.size();
+}
+
+static void test_crc32()
+{
+    TEST_ASSERT_EQUAL_HEX32(0, crc32Update(0, "", 0));
+    TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc32Update(0, "123456789", 9));
+
+    // In pieces, carrying the result over
+    uint32_t crc = crc32Update(0, "1234", 4);
+    TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc32Update(crc, "56789", 5));
+}
+
+static void checkRoundTrip(const std::string &input)
+{
+    size_t length = compressor.compress((const uint8_t *)input.data(), input.size(), output, sizeof(output));
+    TEST_ASSERT_GREATER_THAN(0, length);
+
+    std::string inflated;
+    TEST_ASSERT_TRUE(gunzip(output, length, inflated));
+    TEST_ASSERT_TRUE(inflated == input);
+}
+
+static void test_telemetry()
+{
+    std::string json;
+    for (int i = 0; i < 20; i++)
+        json += "{\"temp\":21." + std::to_string(i % 10) + ",\"humidity\":48.2,\"lux\":" + std::to_string(700 + i) +
+                "}";
+    checkRoundTrip(json);
+
+    size_t length = compressor.compress((const uint8_t *)json.data(), json.size(), output, sizeof(output));
+    TEST_ASSERT_LESS_THAN(json.size() / 3, length);
+}
+
+// Runs longer than a match, and repeats from within and beyond the window
+static void test_long_matches()
+{
+    checkRoundTrip(std::string(3000, 'a'));
+
+    std::string text;
+    for (int i = 0; i < 600; i++)
+        text += (char)('a' + (i * 7) % 26);
+    checkRoundTrip(text + text + text + text + text);
+
+    std::string gap;
+    srand(2);
+    for (int i = 0; i < GZIP_WINDOW_SIZE; i++)
+        gap += (char)(rand() & 0xff);
+    checkRoundTrip(text + gap + text);
+}
+
+static void test_incompressible()
+{
+    std::string noise;
+    srand(1);
+    for (int i = 0; i < 2000; i++)
+        noise += (char)(rand() & 0xff);
+    checkRoundTrip(noise);
+    checkRoundTrip(std::string());
+    checkRoundTrip("x");
+}
+
+static void test_output_too_small()
+{
+    std::string json(500, 'q');
+    for (size_t i = 0; i < json.size(); i += 3)
+        json[i] = (char)('0' + i % 10);
+    const uint8_t *input = (const uint8_t *)json.data();
+    TEST_ASSERT_EQUAL_UINT(0, compressor.compress(input, json.size(), output, GZIP_OVERHEAD + 4));
+    TEST_ASSERT_EQUAL_UINT(0, compressor.compress(input, json.size(), output, 4));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_crc32);
+    RUN_TEST(test_telemetry);
+    RUN_TEST(test_long_matches);
+    RUN_TEST(test_incompressible);
+    RUN_TEST(test_output_too_small);
+    return UNITY_END();
+}
@@ -0,0 +1,246 @@
+// BinaryLog and clogFormatRecord: what goes in through CLOG() comes back out
+// of dump() as records that expand to the catalog message, and malformed
+// records are refused.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+#include <Arduino.h>
+
+#include "binary_log.h"
+
+// Keeps what's printed, one entry per line
+class LinePrint : public Print
+{
+  public:
+    size_t write(uint8_t value) override
+    {
+        if (value == '\n')
+        {
+            lines.push_back(_line);
+            _line.clear();
+        }
+        else if (value != '\r')
+        {
+            _line += (char)value;
+        }
+        return 1;
+    }
+
+    std::vector<std::string> lines;
+
+  private:
+    std::string _line;
+};
+
+static LinePrint echo;
+
+void setUp()
+{
+    LinePrint discard;
+    BinaryLog.dump(discard);
+    BinaryLog.begin(NULL);
+    echo.lines.clear();
+}
+
+void tearDown()
+{
+    BinaryLog.begin(NULL);
+}
+
+// The records dump() prints, back from their "~<hex>" lines
+static std::vector<std::vector<uint8_t>> dumpRecords()
+{
+    LinePrint output;
+    BinaryLog.dump(output);
+
+    std::vector<std::vector<uint8_t>> records;
+    for (const std::string &line : output.lines)
+    {
+        TEST_ASSERT_EQUAL_CHAR('~', line[0]);
+        std::vector<uint8_t> record;
+        for (size_t i = 1; i + 1 < line.size(); i += 2)
+        {
+            unsigned int value;
+            sscanf(line.c_str() + i, "%2x", &value);
+            record.push_back((uint8_t)value);
+        }
+        records.push_back(record);
+    }
+    return records;
+}
+
+// The message, without the level and timestamp
+static std::string format(const std::vector<uint8_t> &record)
+{
+    char line[CLOG_ECHO_LENGTH];
+    if (clogFormatRecord(record.data(), record.size(), line, sizeof(line)) == 0)
+        return "(malformed)";
+    const char *message = strstr(line, ": ");
+    return message != NULL ? message + 2 : line;
+}
+
+static void test_round_trip()
+{
+    CLOG(SUBSCRIBE_FAILED, "devices/dev1/messages/devicebound/#", -3);
+    CLOG(MQTT_CLOSED, 7, 4000000000UL);
+    CLOG(DIRECT_METHOD, "reboot", "{\"delay\":5}");
+    CLOG(WIFI_CONNECTING);
+
+    std::vector<std::vector<uint8_t>> records = dumpRecords();
+    TEST_ASSERT_EQUAL_UINT(4, records.size());
+    TEST_ASSERT_EQUAL_STRING("mqttClient couldn't subscribe to devices/dev1/messages/devicebound/#. error code => -3",
+                             format(records[0]).c_str());
+    TEST_ASSERT_EQUAL_STRING("MQTT connection closed, rc=7, 4000000000 publishes unacked", format(records[1]).c_str());
+    TEST_ASSERT_EQUAL_STRING("Handling incoming direct method: reboot ({\"delay\":5})", format(records[2]).c_str());
+    TEST_ASSERT_EQUAL_STRING("Connecting to WiFi.", format(records[3]).c_str());
+
+    // Emptied by the dump
+    TEST_ASSERT_EQUAL_UINT(0, dumpRecords().size());
+}
+
+// The level letter and the time the record was written
+static void test_header()
+{
+    uint32_t before = millis();
+    CLOG(MQTT_CONNECT_FAILED, 5);
+    std::vector<std::vector<uint8_t>> records = dumpRecords();
+    TEST_ASSERT_EQUAL_UINT(1, records.size());
+
+    char line[CLOG_ECHO_LENGTH];
+    TEST_ASSERT_GREATER_THAN(0, clogFormatRecord(records[0].data(), records[0].size(), line, sizeof(line)));
+    char level;
+    unsigned long timestamp;
+    TEST_ASSERT_EQUAL_INT(2, sscanf(line, "%c %lu:", &level, &timestamp));
+    TEST_ASSERT_EQUAL_CHAR('E', level);
+    TEST_ASSERT_TRUE(timestamp >= before && timestamp <= millis());
+}
+
+// The conversion follows the argument, not the format
+static void test_argument_types()
+{
+    CLOG(BOOT_TOOK, 1.5);
+    CLOG(BOOT_TOOK, "many");
+    CLOG(NTP_RESYNC, -2147483647L - 1);
+
+    std::vector<std::vector<uint8_t>> records = dumpRecords();
+    TEST_ASSERT_EQUAL_STRING("Boot took 1.500000 ms", format(records[0]).c_str());
+    TEST_ASSERT_EQUAL_STRING("Boot took many ms", format(records[1]).c_str());
+    TEST_ASSERT_EQUAL_STRING("NTP resync, local clock was off by -2147483648 ms", format(records[2]).c_str());
+}
+
+static void test_long_string()
+{
+    std::string topic(100, 't');
+    CLOG(SUBSCRIBE_FAILED, topic.c_str(), 1);
+
+    std::vector<std::vector<uint8_t>> records = dumpRecords();
+    TEST_ASSERT_LESS_OR_EQUAL(CLOG_MAX_RECORD, records[0].size());
+    std::string expected = "mqttClient couldn't subscribe to " + topic.substr(0, CLOG_MAX_STRING) + ". error code => 1";
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), format(records[0]).c_str());
+}
+
+// Only records at or above the echo level are formatted as they're written
+static void test_echo()
+{
+    BinaryLog.begin(&echo, CLOG_WARNING);
+    CLOG(MQTT_CONNECT_FAILED, 5);
+    CLOG(MQTT_CONNECTED);
+    CLOG(UNKNOWN_METHOD, "nope");
+
+    TEST_ASSERT_EQUAL_UINT(2, echo.lines.size());
+    TEST_ASSERT_EQUAL_CHAR('E', echo.lines[0][0]);
+    TEST_ASSERT_TRUE(echo.lines[0].find(": MQTT connection failed, rc=5.") != std::string::npos);
+    TEST_ASSERT_EQUAL_CHAR('W', echo.lines[1][0]);
+    TEST_ASSERT_TRUE(echo.lines[1].find(": No handler registered for direct method nope") != std::string::npos);
+    TEST_ASSERT_EQUAL_UINT(3, dumpRecords().size());
+}
+
+// The oldest records make room, whole
+static void test_full_buffer()
+{
+    uint32_t dropped = BinaryLog.getDroppedCount();
+    for (int i = 0; i < CLOG_BUFFER_SIZE / 4; i++)
+        CLOG(NTP_TIME, i);
+    TEST_ASSERT_GREATER_THAN(dropped, BinaryLog.getDroppedCount());
+
+    std::vector<std::vector<uint8_t>> records = dumpRecords();
+    TEST_ASSERT_EQUAL_UINT(CLOG_BUFFER_SIZE / 4 - (BinaryLog.getDroppedCount() - dropped), records.size());
+    std::string last = "Fetched NTP epoch time is: " + std::to_string(CLOG_BUFFER_SIZE / 4 - 1);
+    TEST_ASSERT_EQUAL_STRING(last.c_str(), format(records.back()).c_str());
+    for (const std::vector<uint8_t> &record : records)
+        TEST_ASSERT_EQUAL_UINT8(record.size(), record[0]);
+}
+
+static void test_malformed()
+{
+    CLOG(SUBSCRIBE_FAILED, "topic", 1);
+    std::vector<uint8_t> good = dumpRecords()[0];
+    TEST_ASSERT_EQUAL_STRING("mqttClient couldn't subscribe to topic. error code => 1", format(good).c_str());
+
+    // Length byte disagrees
+    std::vector<uint8_t> record = good;
+    record[0]++;
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+
+    // Cut short, in the string and in the integer
+    record = good;
+    record.resize(CLOG_HEADER_LENGTH + 4);
+    record[0] = (uint8_t)record.size();
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+    record = good;
+    record.pop_back();
+    record[0] = (uint8_t)record.size();
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+
+    // Shorter than a header
+    record.assign(good.begin(), good.begin() + CLOG_HEADER_LENGTH - 1);
+    record[0] = (uint8_t)record.size();
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+
+    // Unknown message and unknown tag
+    record = good;
+    record[1] = (uint8_t)CLOG_MESSAGE_COUNT;
+    record[2] = (uint8_t)(CLOG_MESSAGE_COUNT >> 8);
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+    record = good;
+    record[CLOG_HEADER_LENGTH] = 'z';
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+
+    // String longer than what's left
+    record = good;
+    record[CLOG_HEADER_LENGTH + 1] = 200;
+    TEST_ASSERT_EQUAL_STRING("(malformed)", format(record).c_str());
+}
+
+// Cut to the buffer, still terminated
+static void test_small_buffer()
+{
+    CLOG(SUBSCRIBE_FAILED, "topic", 1);
+    std::vector<uint8_t> record = dumpRecords()[0];
+
+    char line[16];
+    memset(line, 'x', sizeof(line));
+    size_t length = clogFormatRecord(record.data(), record.size(), line, 12);
+    TEST_ASSERT_EQUAL_UINT(11, length);
+    TEST_ASSERT_EQUAL_UINT(11, strlen(line));
+    TEST_ASSERT_EQUAL_CHAR('x', line[12]);
+    TEST_ASSERT_EQUAL_UINT(0, clogFormatRecord(record.data(), record.size(), line, 0));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_header);
+    RUN_TEST(test_argument_types);
+    RUN_TEST(test_long_string);
+    RUN_TEST(test_echo);
+    RUN_TEST(test_full_buffer);
+    RUN_TEST(test_malformed);
+    RUN_TEST(test_small_buffer);
+    return UNITY_END();
+}
@@ -0,0 +1,297 @@
+// Deferred direct methods through the client and the fake broker: answered
+// once with the token they were given, a 429 when too many are in flight
+// and a 504 when they aren't answered in time.
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unity.h>
+
+#include <Arduino.h>
+#include <FS.h>
+#include <PubSubClient.h>
+
+#include "centralduino.h"
+#include "metrics.h"
+#include "network_worker.h"
+
+#define RESPONSE_PREFIX "$iothub/methods/res/"
+#define RESPONSE_WAIT_MS 500
+
+static const char configJson[] =
+    "{\"network\":{\"ssid\":\"test\",\"password\":\"test\"},"
+    "\"hub\":{\"scope_id\":\"0ne0000TEST\",\"device_id\":\"test-device-0001\","
+    "\"sas_key\":\"wZ1b4Zp0j6Q7mYx2bV8kq3Q2n1v0c5T6r7E8w9Y0a1s=\"}}";
+
+static char directory[] = "/tmp/centralduino-test-XXXXXX";
+
+// Keeps the method responses ("{status}/?$rid={rid}"), the rest is dropped
+class ResponseBroker : public FakeMqttBackend
+{
+  public:
+    bool connect(PubSubClient *, const char *, const char *, const char *, bool) { return true; }
+    bool publish(PubSubClient *, const char *topic, const uint8_t *, unsigned int)
+    {
+        if (strncmp(topic, RESPONSE_PREFIX, sizeof(RESPONSE_PREFIX) - 1) == 0)
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _responses.push_back(topic + sizeof(RESPONSE_PREFIX) - 1);
+        }
+        return true;
+    }
+    bool subscribe(PubSubClient *, const char *, uint8_t) { return true; }
+    void disconnect(PubSubClient *) {}
+
+    std::vector<std::string> responses()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _responses;
+    }
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _responses.clear();
+    }
+
+  private:
+    std::mutex _lock; // a network worker publishes
+    std::vector<std::string> _responses;
+};
+
+static ResponseBroker broker;
+static std::vector<MethodToken> tokens;
+static int calls;
+
+// The responses once there are count of them, or what came within
+// RESPONSE_WAIT_MS. Really waits: delay() only moves the clock on, and a
+// network worker sends them in its own time.
+static std::vector<std::string> waitForResponses(size_t count)
+{
+    uint32_t startedMs = millis();
+    while (broker.responses().size() < count && millis() - startedMs < RESPONSE_WAIT_MS)
+    {
+        Centralduino.poll();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return broker.responses();
+}
+
+void setUp()
+{
+    broker.clear();
+    tokens.clear();
+    calls = 0;
+}
+
+void tearDown()
+{
+    // Nothing left in flight, or still to be sent, for the next test
+    size_t count = broker.responses().size();
+    for (MethodToken token : tokens)
+        count += Centralduino.completeMethod(token, 200);
+    waitForResponses(count);
+}
+
+static int keepToken(MethodToken token, const uint8_t *, size_t)
+{
+    calls++;
+    tokens.push_back(token);
+    return METHOD_PENDING;
+}
+
+// As the hub sends it. With the network worker, it's handled in poll().
+static void callMethod(const char *name, const char *rid)
+{
+    char topic[128];
+    snprintf(topic, sizeof(topic), "$iothub/methods/POST/%s/?$rid=%s", name, rid);
+    FakeMqtt::deliver(topic, (const uint8_t *)"{}", 2);
+    Centralduino.poll();
+}
+
+static void test_answered_at_once()
+{
+    Centralduino.registerDeferredMethod("now", [](MethodToken, const uint8_t *, size_t) { return 400; });
+    callMethod("now", "1");
+    std::vector<std::string> responses = waitForResponses(1);
+    TEST_ASSERT_EQUAL_UINT(1, responses.size());
+    TEST_ASSERT_EQUAL_STRING("400/?$rid=1", responses[0].c_str());
+}
+
+static void test_completed_later()
+{
+    Centralduino.registerDeferredMethod("later", keepToken);
+    callMethod("later", "2");
+    callMethod("later", "3");
+    TEST_ASSERT_EQUAL_INT(2, calls);
+    TEST_ASSERT_TRUE(tokens[0] != tokens[1]);
+    TEST_ASSERT_EQUAL_UINT(0, broker.responses().size());
+
+    TEST_ASSERT_TRUE(Centralduino.completeMethod(tokens[1], 201));
+    TEST_ASSERT_TRUE(Centralduino.completeMethod(tokens[0], 202, "{\"done\":true}"));
+    std::vector<std::string> responses = waitForResponses(2);
+    TEST_ASSERT_EQUAL_UINT(2, responses.size());
+    TEST_ASSERT_EQUAL_STRING("201/?$rid=3", responses[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("202/?$rid=2", responses[1].c_str());
+
+    // Only once
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(tokens[0], 200));
+    tokens.clear();
+}
+
+// A token isn't valid for a later call that took its slot, or made up
+static void test_token_validation()
+{
+    Centralduino.registerDeferredMethod("stale", keepToken);
+    callMethod("stale", "4");
+    MethodToken first = tokens[0];
+    TEST_ASSERT_TRUE(Centralduino.completeMethod(first, 200));
+    callMethod("stale", "5");
+    TEST_ASSERT_EQUAL_UINT(first & 0x0F, tokens[1] & 0x0F);
+    TEST_ASSERT_TRUE(tokens[1] != first);
+
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(first, 500));
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(0, 500));
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(tokens[1] ^ 0x0F, 500));
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(tokens[1] + 0x10, 500));
+    std::vector<std::string> responses = waitForResponses(1);
+    TEST_ASSERT_EQUAL_UINT(1, responses.size());
+    TEST_ASSERT_EQUAL_STRING("200/?$rid=4", responses[0].c_str());
+
+    TEST_ASSERT_TRUE(Centralduino.completeMethod(tokens[1], 201));
+    tokens.clear();
+    responses = waitForResponses(2);
+    TEST_ASSERT_EQUAL_UINT(2, responses.size());
+    TEST_ASSERT_EQUAL_STRING("201/?$rid=5", responses[1].c_str());
+}
+
+// Completed from within its own callback
+static void test_completed_in_callback()
+{
+    Centralduino.registerDeferredMethod("inside", [](MethodToken token, const uint8_t *, size_t) {
+        Centralduino.completeMethod(token, 204);
+        return METHOD_PENDING;
+    });
+    callMethod("inside", "6");
+    std::vector<std::string> responses = waitForResponses(2);
+    TEST_ASSERT_EQUAL_UINT(1, responses.size());
+    TEST_ASSERT_EQUAL_STRING("204/?$rid=6", responses[0].c_str());
+}
+
+static void test_too_many()
+{
+    Centralduino.registerDeferredMethod("busy", keepToken);
+    char rid[8];
+    for (int i = 0; i < MAX_PENDING_METHODS; i++)
+    {
+        snprintf(rid, sizeof(rid), "%d", 10 + i);
+        callMethod("busy", rid);
+    }
+    TEST_ASSERT_EQUAL_INT(MAX_PENDING_METHODS, calls);
+
+    // Refused without calling it, as is a request id that doesn't fit
+    callMethod("busy", "20");
+    TEST_ASSERT_EQUAL_INT(MAX_PENDING_METHODS, calls);
+    std::vector<std::string> responses = waitForResponses(1);
+    TEST_ASSERT_EQUAL_UINT(1, responses.size());
+    TEST_ASSERT_EQUAL_STRING("429/?$rid=20", responses[0].c_str());
+
+    TEST_ASSERT_TRUE(Centralduino.completeMethod(tokens[0], 200));
+    tokens.erase(tokens.begin());
+    std::string longRid(METHOD_RID_MAX_LEN, '7');
+    callMethod("busy", longRid.c_str());
+    TEST_ASSERT_EQUAL_INT(MAX_PENDING_METHODS, calls);
+    responses = waitForResponses(3);
+    TEST_ASSERT_EQUAL_UINT(3, responses.size());
+    TEST_ASSERT_EQUAL_STRING(("429/?$rid=" + longRid).c_str(), responses[2].c_str());
+
+    // A free slot takes the next one
+    callMethod("busy", "21");
+    TEST_ASSERT_EQUAL_INT(MAX_PENDING_METHODS + 1, calls);
+}
+
+static void test_timed_out()
+{
+    uint32_t timeouts = Metrics.get(METRIC_METHOD_TIMEOUTS);
+    Centralduino.registerDeferredMethod("slow", keepToken, 100);
+    uint32_t startedMs = millis();
+    callMethod("slow", "30");
+    std::vector<std::string> responses = waitForResponses(1);
+    TEST_ASSERT_EQUAL_UINT(1, responses.size());
+    TEST_ASSERT_EQUAL_STRING("504/?$rid=30", responses[0].c_str());
+    TEST_ASSERT_TRUE(millis() - startedMs >= 100);
+    TEST_ASSERT_EQUAL_UINT32(timeouts + 1, Metrics.get(METRIC_METHOD_TIMEOUTS));
+
+    // Too late to answer
+    TEST_ASSERT_FALSE(Centralduino.completeMethod(tokens[0], 200));
+    tokens.clear();
+    TEST_ASSERT_EQUAL_UINT(1, waitForResponses(2).size());
+}
+
+static void setupClient()
+{
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+    setenv("SPIFFS_DIR", directory, 1);
+
+    File config = SPIFFS.open("/config.json", "w");
+    config.write((const uint8_t *)configJson, sizeof(configJson) - 1);
+    config.close();
+
+    FakeMqtt::setBackend(&broker);
+    Centralduino.setup("/config.json");
+    FakeMqtt::setConnected(true);
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    // Once the worker has seen the connection, publishes get through
+    while (FakeMqtt::publishCount() == 0)
+    {
+        Centralduino.sendMeasurement("temp", 21.5);
+        std::this_thread::sleep_for(std::chrono::milliseconds(NETWORK_WORKER_IDLE));
+    }
+#endif
+}
+
+static void removeDirectory()
+{
+    DIR *listing = opendir(directory);
+    if (listing == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            SPIFFS.remove(entry->d_name);
+    }
+    closedir(listing);
+    rmdir(directory);
+}
+
+int main(int argc, char **argv)
+{
+    setupClient();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_answered_at_once);
+    RUN_TEST(test_completed_later);
+    RUN_TEST(test_token_validation);
+    RUN_TEST(test_completed_in_callback);
+    RUN_TEST(test_too_many);
+    RUN_TEST(test_timed_out);
+    int failures = UNITY_END();
+
+#ifdef CENTRALDUINO_NETWORK_WORKER
+    CentralduinoClass::stopNetworkWorker();
+#endif
+    FakeMqtt::setBackend(NULL);
+    removeDirectory();
+    return failures;
+}
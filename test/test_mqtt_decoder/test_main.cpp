@@ -0,0 +1,300 @@
+// AsyncMqttTransport's decoder: packets read back whatever pieces they
+// arrive in, and the transport answers what needs answering.
+
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+#include <mqtt_packet.h>
+
+#include "async_mqtt_transport.h"
+
+// A connection whose incoming bytes are handed over by the test, at most
+// readable of them before the next loop()
+class ScriptedClient : public Client
+{
+  public:
+    ScriptedClient() : open(true), readable(0) {}
+
+    int connect(const char *host, uint16_t port) { return 1; }
+    size_t write(uint8_t value) { return write(&value, 1); }
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        written.append((const char *)buffer, size);
+        return size;
+    }
+    int availableForWrite() { return 4096; }
+    int available() { return (int)(readable < input.size() ? readable : input.size()); }
+    int read()
+    {
+        uint8_t value;
+        return read(&value, 1) == 1 ? value : -1;
+    }
+    int read(uint8_t *buffer, size_t size)
+    {
+        size_t count = size < (size_t)available() ? size : available();
+        if (count == 0)
+            return -1;
+        memcpy(buffer, input.data(), count);
+        input.erase(0, count);
+        readable -= count;
+        return count;
+    }
+    int peek() { return available() > 0 ? (uint8_t)input[0] : -1; }
+    void stop() { open = false; }
+    uint8_t connected() { return open; }
+    void flush() {}
+    using Print::write;
+
+    bool open;
+    std::string input;
+    size_t readable;
+    std::string written;
+};
+
+class RecordingHandler : public MqttStreamHandler
+{
+  public:
+    bool beginMessage(char *topic, uint32_t length)
+    {
+        this->topic = topic;
+        this->length = length;
+        payload.clear();
+        chunks = 0;
+        completed = false;
+        return true;
+    }
+    size_t writeMessage(const uint8_t *data, size_t length)
+    {
+        payload.append((const char *)data, length);
+        chunks++;
+        return length;
+    }
+    void endMessage(bool complete) { completed = complete; }
+
+    std::string topic;
+    uint32_t length;
+    std::string payload;
+    int chunks;
+    bool completed;
+};
+
+static ScriptedClient *client;
+static AsyncMqttTransport *transport;
+static std::string lastTopic;
+static std::string lastPayload;
+static int messages;
+
+void setUp()
+{
+    client = new ScriptedClient();
+    transport = new AsyncMqttTransport();
+    lastTopic.clear();
+    lastPayload.clear();
+    messages = 0;
+    transport->setCallback([](char *topic, uint8_t *payload, unsigned int length) {
+        lastTopic = topic;
+        lastPayload.assign((const char *)payload, length);
+        messages++;
+    });
+    TEST_ASSERT_TRUE(transport->connect(*client, "hub", 8883, "device", "user", "password"));
+}
+
+void tearDown()
+{
+    delete transport;
+    delete client;
+}
+
+// Lets the transport read the incoming bytes a few at a time
+static void deliver(const std::string &bytes, size_t piece)
+{
+    client->input += bytes;
+    while (client->input.size() > 0)
+    {
+        client->readable = piece;
+        TEST_ASSERT_TRUE(transport->loop());
+    }
+    client->readable = 0;
+}
+
+static void accept()
+{
+    std::string connack;
+    mqttEncodeConnack(connack, false, MQTT_CONNACK_ACCEPTED);
+    deliver(connack, 4);
+    TEST_ASSERT_TRUE(transport->isAccepted());
+}
+
+static void test_connect()
+{
+    MqttPacket packet;
+    const uint8_t *written = (const uint8_t *)client->written.data();
+    TEST_ASSERT_EQUAL(client->written.size(), mqttParsePacket(written, client->written.size(), packet));
+    MqttConnect connect;
+    TEST_ASSERT_TRUE(mqttParseConnect(packet, connect));
+    TEST_ASSERT_EQUAL_STRING("device", connect.clientId.c_str());
+    TEST_ASSERT_EQUAL_STRING("user", connect.user.c_str());
+    TEST_ASSERT_TRUE(connect.cleanSession);
+
+    // A byte per loop()
+    std::string connack;
+    mqttEncodeConnack(connack, true, MQTT_CONNACK_ACCEPTED);
+    TEST_ASSERT_FALSE(transport->isAccepted());
+    deliver(connack, 1);
+    TEST_ASSERT_TRUE(transport->isAccepted());
+    TEST_ASSERT_TRUE(transport->isSessionPresent());
+}
+
+static void test_refused()
+{
+    std::string connack;
+    mqttEncodeConnack(connack, false, MQTT_CONNACK_NOT_AUTHORIZED);
+    client->input = connack;
+    client->readable = connack.size();
+    TEST_ASSERT_FALSE(transport->loop());
+    TEST_ASSERT_FALSE(transport->connected());
+    TEST_ASSERT_EQUAL_INT(MQTT_CONNACK_NOT_AUTHORIZED, transport->state());
+    TEST_ASSERT_FALSE(client->open);
+}
+
+// With a remaining length of two bytes, in pieces of 1 to 7 bytes
+static void test_publish_in_pieces()
+{
+    accept();
+    std::string payload(300, 'p');
+    payload[0] = '{';
+    payload[299] = '}';
+    std::string publish;
+    const char *topic = "devices/d/messages/devicebound/x";
+    mqttEncodePublish(publish, topic, (const uint8_t *)payload.data(), payload.size(), 0, 0);
+
+    for (size_t piece = 1; piece <= 7; piece++)
+    {
+        deliver(publish, piece);
+        TEST_ASSERT_EQUAL_INT(piece, messages);
+        TEST_ASSERT_EQUAL_STRING(topic, lastTopic.c_str());
+        TEST_ASSERT_TRUE(lastPayload == payload);
+    }
+
+    // Several packets in one read
+    std::string two;
+    mqttEncodePublish(two, "a", (const uint8_t *)"1", 1, 0, 0);
+    mqttEncodePublish(two, "b", (const uint8_t *)"2", 1, 0, 0);
+    deliver(two, two.size());
+    TEST_ASSERT_EQUAL_INT(9, messages);
+    TEST_ASSERT_EQUAL_STRING("b", lastTopic.c_str());
+}
+
+static void test_qos1_acknowledged()
+{
+    accept();
+    client->written.clear();
+    std::string publish;
+    mqttEncodePublish(publish, "$iothub/methods/POST/reboot/?$rid=1", (const uint8_t *)"{}", 2, 1, 0x1234);
+    deliver(publish, 3);
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_STRING("{}", lastPayload.c_str());
+
+    MqttPacket packet;
+    TEST_ASSERT_EQUAL(4, mqttParsePacket((const uint8_t *)client->written.data(), client->written.size(), packet));
+    TEST_ASSERT_EQUAL_UINT8(MQTT_PACKET_PUBACK, packet.type);
+    TEST_ASSERT_EQUAL_UINT16(0x1234, mqttParseAck(packet));
+}
+
+// Acknowledged, or reported lost when the connection goes first
+static void test_qos1_lost()
+{
+    std::string acks;
+    transport->setAckCallback([&acks](uint16_t packetId, bool isAcknowledged, uint32_t latencyUs) {
+        acks += std::to_string(packetId) + (isAcknowledged ? "+" : "-");
+    });
+    accept();
+    TEST_ASSERT_TRUE(transport->publish("t", (const uint8_t *)"1", 1, 1));
+    TEST_ASSERT_TRUE(transport->publish("t", (const uint8_t *)"2", 1, 1));
+    TEST_ASSERT_TRUE(transport->publish("t", (const uint8_t *)"3", 1, 1));
+    TEST_ASSERT_EQUAL_UINT8(3, transport->getInflightCount());
+
+    std::string puback;
+    mqttEncodeAck(puback, MQTT_PACKET_PUBACK, 2);
+    deliver(puback, puback.size());
+    TEST_ASSERT_EQUAL_STRING("2+", acks.c_str());
+
+    client->open = false;
+    TEST_ASSERT_FALSE(transport->loop());
+    TEST_ASSERT_EQUAL_STRING("2+1-3-", acks.c_str());
+    TEST_ASSERT_EQUAL_UINT8(0, transport->getInflightCount());
+}
+
+static void test_subscribed()
+{
+    static const char *const topics[] = {"$iothub/methods/POST/#", "$iothub/twin/res/#"};
+    static const uint8_t qos[] = {0, 0};
+    TEST_ASSERT_TRUE(transport->subscribe(topics, qos, 2));
+    accept();
+    TEST_ASSERT_FALSE(transport->isSubscribed());
+
+    std::string suback;
+    mqttEncodeSuback(suback, 1, qos, 2);
+    deliver(suback, 1);
+    TEST_ASSERT_TRUE(transport->isSubscribed());
+}
+
+// Too large for the receive buffer: dropped, and the stream stays in step
+static void test_oversized_skipped()
+{
+    accept();
+    std::string big(MQTT_MAX_PACKET_SIZE + 100, 'x');
+    std::string packets;
+    mqttEncodePublish(packets, "big", (const uint8_t *)big.data(), big.size(), 0, 0);
+    mqttEncodePublish(packets, "small", (const uint8_t *)"ok", 2, 0, 0);
+    deliver(packets, 50);
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_STRING("small", lastTopic.c_str());
+    TEST_ASSERT_EQUAL_STRING("ok", lastPayload.c_str());
+    TEST_ASSERT_TRUE(transport->connected());
+}
+
+static void test_streamed()
+{
+    static const char prefix[] = "$iothub/streams/";
+    RecordingHandler handler;
+    transport->setStreamHandler(prefix, strlen(prefix), &handler);
+    accept();
+    client->written.clear();
+
+    std::string payload;
+    for (int i = 0; i < 3 * MQTT_MAX_PACKET_SIZE; i++)
+        payload += (char)('a' + i % 26);
+    std::string publish;
+    mqttEncodePublish(publish, "$iothub/streams/file", (const uint8_t *)payload.data(), payload.size(), 1, 7);
+    mqttEncodePublish(publish, "other", (const uint8_t *)"x", 1, 0, 0);
+    deliver(publish, 200);
+
+    TEST_ASSERT_EQUAL_STRING("$iothub/streams/file", handler.topic.c_str());
+    TEST_ASSERT_EQUAL_UINT32(payload.size(), handler.length);
+    TEST_ASSERT_TRUE(handler.payload == payload);
+    TEST_ASSERT_GREATER_THAN((int)(payload.size() / MQTT_STREAM_CHUNK) - 1, handler.chunks);
+    TEST_ASSERT_TRUE(handler.completed);
+
+    // Acknowledged once it has all been taken, and the next one isn't streamed
+    MqttPacket packet;
+    TEST_ASSERT_EQUAL(4, mqttParsePacket((const uint8_t *)client->written.data(), client->written.size(), packet));
+    TEST_ASSERT_EQUAL_UINT16(7, mqttParseAck(packet));
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_STRING("other", lastTopic.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connect);
+    RUN_TEST(test_refused);
+    RUN_TEST(test_publish_in_pieces);
+    RUN_TEST(test_qos1_acknowledged);
+    RUN_TEST(test_qos1_lost);
+    RUN_TEST(test_subscribed);
+    RUN_TEST(test_oversized_skipped);
+    RUN_TEST(test_streamed);
+    return UNITY_END();
+}
@@ -0,0 +1,154 @@
+// OtaUpdate against FakeHttpServer: an image is only committed when its
+// SHA-256 matches, however often the download has to be resumed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+#include <Arduino.h>
+#include <Updater.h>
+
+#include "fake_http.h"
+#include "ota_update.h"
+
+#define IMAGE_SIZE (64 * 1024)
+#define BYTES_PER_SECOND (256 * 1024)
+#define LATENCY_MS 20
+
+static const char URL[] = "http://firmware.test/image.bin";
+
+static std::string image;
+static char imageHash[2 * HASH_LENGTH + 1];
+
+static void hashImage(const std::string &data, char *hex)
+{
+    Sha256 sha256;
+    sha256.init();
+    sha256.write((const uint8_t *)data.data(), data.size());
+    uint8_t *digest = sha256.result();
+    for (int i = 0; i < HASH_LENGTH; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+void setUp()
+{
+    FakeUpdate::reset();
+    OtaUpdate.begin("1.0", NULL);
+    OtaUpdate.onReport(NULL);
+}
+
+void tearDown()
+{
+    OtaUpdate.setClient(NULL);
+}
+
+static void download(FakeHttpServer &server)
+{
+    OtaUpdate.setClient(&server);
+    TEST_ASSERT_EQUAL(OTA_STARTED, OtaUpdate.start(URL, image.size(), imageHash, "2.0"));
+    TEST_ASSERT_TRUE(OtaUpdate.isBusy());
+    TEST_ASSERT_EQUAL(OTA_BUSY, OtaUpdate.start(URL, image.size(), imageHash, "2.0"));
+    while (OtaUpdate.isBusy())
+    {
+        OtaUpdate.loop();
+        delay(OTA_STEP_INTERVAL);
+    }
+}
+
+static void test_whole()
+{
+    std::string states;
+    OtaUpdate.onReport([&states](const char *json, size_t length) { states.append(json, length); });
+
+    FakeHttpServer server(image, BYTES_PER_SECOND, LATENCY_MS);
+    download(server);
+    TEST_ASSERT_EQUAL(OTA_APPLIED, OtaUpdate.getState());
+    TEST_ASSERT_EQUAL_UINT32(1, FakeUpdate::commitCount());
+    TEST_ASSERT_TRUE(FakeUpdate::committedImage() == image);
+    TEST_ASSERT_EQUAL_UINT32(1, server.getConnectCount());
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE, OtaUpdate.getReceived());
+    TEST_ASSERT_EQUAL_STRING("2.0", OtaUpdate.getTargetVersion());
+    TEST_ASSERT_TRUE(states.find("\"state\":\"downloading\"") != std::string::npos);
+    TEST_ASSERT_TRUE(states.find("\"state\":\"applied\"") != std::string::npos);
+}
+
+// Picked up where it stopped, with a Range request each time
+static void test_resumed()
+{
+    FakeHttpServer server(image, BYTES_PER_SECOND, LATENCY_MS);
+    server.setDrops(3, 10000);
+    download(server);
+    TEST_ASSERT_EQUAL(OTA_APPLIED, OtaUpdate.getState());
+    TEST_ASSERT_TRUE(FakeUpdate::committedImage() == image);
+    TEST_ASSERT_EQUAL_UINT32(4, server.getConnectCount());
+    TEST_ASSERT_EQUAL_UINT32(3, server.getRangeRequestCount());
+    TEST_ASSERT_EQUAL_UINT8(3, OtaUpdate.getResumes());
+}
+
+// The whole file again, the part already written skipped
+static void test_range_ignored()
+{
+    FakeHttpServer server(image, BYTES_PER_SECOND, LATENCY_MS);
+    server.setDrops(1, 20000);
+    server.setIgnoresRange(true);
+    download(server);
+    TEST_ASSERT_EQUAL(OTA_APPLIED, OtaUpdate.getState());
+    TEST_ASSERT_TRUE(FakeUpdate::committedImage() == image);
+    TEST_ASSERT_EQUAL_UINT32(2, server.getConnectCount());
+}
+
+static void test_corrupted()
+{
+    std::string corrupted = image;
+    corrupted[corrupted.size() / 2] ^= 0x01;
+    FakeHttpServer server(corrupted, BYTES_PER_SECOND, LATENCY_MS);
+    download(server);
+    TEST_ASSERT_EQUAL(OTA_FAILED, OtaUpdate.getState());
+    TEST_ASSERT_EQUAL_UINT32(0, FakeUpdate::commitCount());
+
+    // Nothing is left half done, the next one starts afresh
+    FakeHttpServer good(image, BYTES_PER_SECOND, LATENCY_MS);
+    download(good);
+    TEST_ASSERT_EQUAL(OTA_APPLIED, OtaUpdate.getState());
+    TEST_ASSERT_TRUE(FakeUpdate::committedImage() == image);
+}
+
+static void test_refused()
+{
+    char badHash[sizeof(imageHash)];
+    strcpy(badHash, imageHash);
+    badHash[10] = 'g';
+
+    TEST_ASSERT_EQUAL(OTA_CURRENT, OtaUpdate.start(URL, image.size(), imageHash, "1.0"));
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start(URL, image.size(), badHash, "2.0"));
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start(URL, image.size(), "abc", "2.0"));
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start(URL, 0, imageHash, "2.0"));
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start("ftp://firmware.test/image.bin", image.size(), imageHash, "2.0"));
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start(URL, image.size(), imageHash, "2.\"0"));
+    // No trust anchors to check the server with
+    TEST_ASSERT_EQUAL(OTA_INVALID, OtaUpdate.start("https://firmware.test/image.bin", image.size(), imageHash, "2.0"));
+
+    FakeUpdate::setCapacity(IMAGE_SIZE - 1);
+    TEST_ASSERT_EQUAL(OTA_NO_ROOM, OtaUpdate.start(URL, image.size(), imageHash, "2.0"));
+    FakeUpdate::setCapacity(1024 * 1024);
+    TEST_ASSERT_FALSE(OtaUpdate.isBusy());
+}
+
+int main(int argc, char **argv)
+{
+    image.resize(IMAGE_SIZE);
+    srand(1);
+    for (size_t i = 0; i < image.size(); i++)
+        image[i] = (char)(rand() & 0xFF);
+    hashImage(image, imageHash);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_whole);
+    RUN_TEST(test_resumed);
+    RUN_TEST(test_range_ignored);
+    RUN_TEST(test_corrupted);
+    RUN_TEST(test_refused);
+    return UNITY_END();
+}
@@ -0,0 +1,205 @@
+// RuleEngine: what setRule() accepts, and when the alerts are raised and
+// cleared.
+
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+#include "rule_engine.h"
+
+typedef struct tagAlert
+{
+    std::string name;
+    bool raised;
+    float value;
+} Alert;
+
+static RuleEngine *engine;
+static std::vector<Alert> alerts;
+
+void setUp()
+{
+    engine = new RuleEngine();
+    alerts.clear();
+    engine->onAlert([](const Rule &rule, const char *stream, bool raised, float value) {
+        Alert alert = {rule.name, raised, value};
+        alerts.push_back(alert);
+    });
+}
+
+void tearDown()
+{
+    delete engine;
+}
+
+static void test_valid_rules()
+{
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 28 for 60s"));
+    TEST_ASSERT_TRUE(engine->setRule("rising", "rate temp > 0.5"));
+    TEST_ASSERT_TRUE(engine->setRule("low", "battery < 3.3 hyst 0.1"));
+    TEST_ASSERT_TRUE(engine->setRule("x.on", "x >= 1 for 5m"));
+    TEST_ASSERT_TRUE(engine->setRule("x.off", "x <= -1e3 hyst 2 for 10"));
+    TEST_ASSERT_EQUAL_UINT8(5, engine->getRuleCount());
+
+    // Same name, replaced
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 30"));
+    TEST_ASSERT_EQUAL_UINT8(5, engine->getRuleCount());
+    engine->removeRule("hot");
+    TEST_ASSERT_EQUAL_UINT8(4, engine->getRuleCount());
+}
+
+static void test_invalid_rules()
+{
+    static const char *const texts[] = {
+        "",
+        "temp",
+        "temp = 28",
+        "temp >",
+        "temp > hot",
+        "temp > 28x",
+        "temp > 28 junk",
+        "temp > 28 for",
+        "temp > 28 for 2d",
+        "temp > 28 for -5s",
+        "temp > 28 for 1441m", // over RULE_MAX_HOLD
+        "temp > 28 hyst -1",
+        "temp > 28 hyst",
+        "rate > 1",
+        "te\"mp > 1",
+        "temperature_outside > 1", // stream name too long
+        "temp > 1 for 1s for 2s for 3s for 4s for 5s for 6s for 7s for 8s", // too long
+    };
+
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 28"));
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+    {
+        if (engine->setRule("hot", texts[i]))
+            TEST_FAIL_MESSAGE(texts[i]);
+    }
+    TEST_ASSERT_FALSE(engine->setRule("a_rule_name_too_long", "temp > 28"));
+    TEST_ASSERT_FALSE(engine->setRule("", "temp > 28"));
+
+    // The rule that was there is untouched
+    TEST_ASSERT_EQUAL_UINT8(1, engine->getRuleCount());
+    engine->record("temp", 29, 0);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+}
+
+static void test_table_full()
+{
+    char name[8];
+    for (int i = 0; i < RULE_MAX_RULES; i++)
+    {
+        sprintf(name, "r%d", i);
+        TEST_ASSERT_TRUE(engine->setRule(name, "temp > 1"));
+    }
+    TEST_ASSERT_FALSE(engine->setRule("more", "temp > 1"));
+    TEST_ASSERT_EQUAL_UINT8(RULE_MAX_RULES, engine->getRuleCount());
+    TEST_ASSERT_TRUE(engine->setRule("r0", "temp > 2"));
+
+    engine->clearRules();
+    TEST_ASSERT_EQUAL_UINT8(0, engine->getRuleCount());
+}
+
+// Raised once the condition has held for the whole hold time
+static void test_hold()
+{
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 28 for 60s"));
+    engine->record("temp", 29, 1000);
+    engine->record("temp", 29.5f, 31000);
+    TEST_ASSERT_EQUAL_UINT(0, alerts.size());
+
+    // A dip starts the hold over
+    engine->record("temp", 27, 41000);
+    engine->record("temp", 29, 51000);
+    engine->record("temp", 29, 110000);
+    TEST_ASSERT_EQUAL_UINT(0, alerts.size());
+    engine->record("temp", 30, 111000);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+    TEST_ASSERT_TRUE(alerts[0].raised);
+    TEST_ASSERT_EQUAL_FLOAT(30, alerts[0].value);
+
+    // Not raised again while it holds, cleared as soon as it doesn't
+    engine->record("temp", 31, 112000);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+    engine->record("temp", 28, 113000);
+    TEST_ASSERT_EQUAL_UINT(2, alerts.size());
+    TEST_ASSERT_FALSE(alerts[1].raised);
+}
+
+// Cleared only once back past the threshold by the band
+static void test_hysteresis()
+{
+    TEST_ASSERT_TRUE(engine->setRule("low", "battery < 3.3 hyst 0.1"));
+    engine->record("battery", 3.29f, 0);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+    TEST_ASSERT_TRUE(alerts[0].raised);
+
+    engine->record("battery", 3.32f, 1000);
+    engine->record("battery", 3.38f, 2000);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+    engine->record("battery", 3.45f, 3000);
+    TEST_ASSERT_EQUAL_UINT(2, alerts.size());
+    TEST_ASSERT_FALSE(alerts[1].raised);
+}
+
+static void test_rate()
+{
+    TEST_ASSERT_TRUE(engine->setRule("rising", "rate temp > 0.5"));
+    engine->record("temp", 20, 0);
+    engine->record("temp", 20.2f, 1000);
+    TEST_ASSERT_EQUAL_UINT(0, alerts.size());
+    engine->record("temp", 22.2f, 3000);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+    TEST_ASSERT_EQUAL_STRING("rising", alerts[0].name.c_str());
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 1.0f, alerts[0].value);
+
+    // Other streams don't reach it
+    engine->record("humidity", 90, 4000);
+    TEST_ASSERT_EQUAL_UINT(1, alerts.size());
+}
+
+// A raised alert is cleared when its rule changes or goes, not when it's set
+// again as it was
+static void test_replaced_while_raised()
+{
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 28"));
+    TEST_ASSERT_TRUE(engine->setRule("cold", "temp < 35"));
+    engine->record("temp", 30, 0);
+    TEST_ASSERT_EQUAL_UINT(2, alerts.size());
+
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 28"));
+    TEST_ASSERT_EQUAL_UINT(2, alerts.size());
+
+    TEST_ASSERT_TRUE(engine->setRule("hot", "temp > 40"));
+    TEST_ASSERT_EQUAL_UINT(3, alerts.size());
+    TEST_ASSERT_EQUAL_STRING("hot", alerts[2].name.c_str());
+    TEST_ASSERT_FALSE(alerts[2].raised);
+    TEST_ASSERT_TRUE(isnan(alerts[2].value));
+    engine->record("temp", 30, 1000);
+    TEST_ASSERT_EQUAL_UINT(3, alerts.size());
+
+    engine->removeRule("cold");
+    TEST_ASSERT_EQUAL_UINT(4, alerts.size());
+    TEST_ASSERT_EQUAL_STRING("cold", alerts[3].name.c_str());
+    TEST_ASSERT_FALSE(alerts[3].raised);
+
+    // Not raised, nothing to clear
+    engine->clearRules();
+    TEST_ASSERT_EQUAL_UINT(4, alerts.size());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_rules);
+    RUN_TEST(test_invalid_rules);
+    RUN_TEST(test_table_full);
+    RUN_TEST(test_hold);
+    RUN_TEST(test_hysteresis);
+    RUN_TEST(test_rate);
+    RUN_TEST(test_replaced_while_raised);
+    return UNITY_END();
+}
@@ -0,0 +1,184 @@
+// SampleBlockEncoder and SampleBlockDecoder: what is encoded reads back bit
+// for bit, and a full or damaged block is handled.
+
+#include <string.h>
+#include <unity.h>
+
+#include "sample_block.h"
+
+#define START_MS 1600000000000ULL
+
+static uint8_t block[512];
+
+void setUp()
+{
+    memset(block, 0, sizeof(block));
+}
+
+void tearDown()
+{
+}
+
+static float sample(int i)
+{
+    return 20.0f + (i % 7) * 0.5f;
+}
+
+static void test_float_round_trip()
+{
+    SampleBlockEncoder encoder(block, sizeof(block), SAMPLE_BLOCK_FLOAT);
+    for (int i = 0; i < 100; i++)
+        TEST_ASSERT_TRUE(encoder.append(START_MS + i * 500, sample(i)));
+    TEST_ASSERT_EQUAL_UINT16(100, encoder.getCount());
+    // A steady rate and few distinct values take far less than 12 bytes a sample
+    TEST_ASSERT_LESS_THAN(100 * 3, encoder.getLength());
+
+    SampleBlockDecoder decoder(encoder.getData(), encoder.getLength());
+    TEST_ASSERT_TRUE(decoder.isValid());
+    TEST_ASSERT_EQUAL(SAMPLE_BLOCK_FLOAT, decoder.getType());
+    TEST_ASSERT_EQUAL_UINT16(100, decoder.getCount());
+    for (int i = 0; i < 100; i++)
+    {
+        uint64_t timestampMs;
+        float value;
+        float expected = sample(i);
+        TEST_ASSERT_TRUE(decoder.next(timestampMs, value));
+        TEST_ASSERT_EQUAL_UINT32(i * 500, (uint32_t)(timestampMs - START_MS));
+        TEST_ASSERT_EQUAL_MEMORY(&expected, &value, sizeof(value));
+    }
+
+    uint64_t timestampMs;
+    float value;
+    TEST_ASSERT_FALSE(decoder.next(timestampMs, value));
+}
+
+// Jitter, gaps, going back in time and values that flip sign and exponent
+static void test_float_irregular()
+{
+    static const uint32_t offsets[] = {0, 1, 2, 1000, 1001, 999, 70000, 70000, 4000000, 4000010};
+    static const float values[] = {0.0f, -0.0f, 1e-30f, -3.4e38f, 1.0f, 1.0f, 123456.789f, -2.25f, 0.1f, 65504.0f};
+
+    SampleBlockEncoder encoder(block, sizeof(block), SAMPLE_BLOCK_FLOAT);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        TEST_ASSERT_TRUE(encoder.append(START_MS + offsets[i], values[i]));
+
+    SampleBlockDecoder decoder(encoder.getData(), encoder.getLength());
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        uint64_t timestampMs;
+        float value;
+        TEST_ASSERT_TRUE(decoder.next(timestampMs, value));
+        TEST_ASSERT_EQUAL_UINT32(offsets[i], (uint32_t)(timestampMs - START_MS));
+        TEST_ASSERT_EQUAL_MEMORY(&values[i], &value, sizeof(value));
+    }
+}
+
+static void test_int_round_trip()
+{
+    static const int32_t values[] = {0, 1, -1, 1000, -1000, INT32_MAX, INT32_MIN, 0, 42, 42};
+
+    SampleBlockEncoder encoder(block, sizeof(block), SAMPLE_BLOCK_INT);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        TEST_ASSERT_TRUE(encoder.append(START_MS + i * 250, values[i]));
+    float wrongType = 1.0f;
+    TEST_ASSERT_FALSE(encoder.append(START_MS, wrongType));
+
+    SampleBlockDecoder decoder(encoder.getData(), encoder.getLength());
+    TEST_ASSERT_TRUE(decoder.isValid());
+    TEST_ASSERT_EQUAL(SAMPLE_BLOCK_INT, decoder.getType());
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        uint64_t timestampMs;
+        int32_t value;
+        TEST_ASSERT_TRUE(decoder.next(timestampMs, value));
+        TEST_ASSERT_EQUAL_UINT32(i * 250, (uint32_t)(timestampMs - START_MS));
+        TEST_ASSERT_EQUAL_INT(values[i], value);
+    }
+}
+
+// The sample that doesn't fit is refused and the block stays readable
+static void test_full_block()
+{
+    SampleBlockEncoder encoder(block, 24, SAMPLE_BLOCK_FLOAT);
+    int count = 0;
+    while (encoder.append(START_MS + count * 1000, count * 3.7f))
+        count++;
+    TEST_ASSERT_GREATER_THAN(0, count);
+    TEST_ASSERT_EQUAL_UINT16(count, encoder.getCount());
+    TEST_ASSERT_TRUE(encoder.getLength() <= 24);
+
+    SampleBlockDecoder decoder(encoder.getData(), encoder.getLength());
+    uint64_t timestampMs;
+    float value;
+    for (int i = 0; i < count; i++)
+    {
+        float expected = i * 3.7f;
+        TEST_ASSERT_TRUE(decoder.next(timestampMs, value));
+        TEST_ASSERT_EQUAL_MEMORY(&expected, &value, sizeof(value));
+    }
+    TEST_ASSERT_FALSE(decoder.next(timestampMs, value));
+
+    encoder.reset();
+    TEST_ASSERT_EQUAL_UINT16(0, encoder.getCount());
+    TEST_ASSERT_TRUE(encoder.append(START_MS, 1.0f));
+}
+
+static void test_damaged_block()
+{
+    SampleBlockEncoder encoder(block, sizeof(block), SAMPLE_BLOCK_FLOAT);
+    for (int i = 0; i < 50; i++)
+        encoder.append(START_MS + i * 10, i * 1.1f);
+
+    SampleBlockDecoder shortHeader(encoder.getData(), SAMPLE_BLOCK_HEADER_LENGTH - 1);
+    TEST_ASSERT_FALSE(shortHeader.isValid());
+
+    // Cut short, it reads what is there and stops
+    SampleBlockDecoder truncated(encoder.getData(), encoder.getLength() - 8);
+    TEST_ASSERT_TRUE(truncated.isValid());
+    uint64_t timestampMs;
+    float value;
+    int read = 0;
+    while (truncated.next(timestampMs, value))
+        read++;
+    TEST_ASSERT_GREATER_THAN(0, read);
+    TEST_ASSERT_LESS_THAN(50, read);
+
+    block[0] = (SAMPLE_BLOCK_VERSION + 1) << 4 | SAMPLE_BLOCK_FLOAT;
+    SampleBlockDecoder newer(block, encoder.getLength());
+    TEST_ASSERT_FALSE(newer.isValid());
+    TEST_ASSERT_FALSE(newer.next(timestampMs, value));
+}
+
+// A value window wider than 32 bits can't be read, the block is refused
+static void test_corrupt_window()
+{
+    static const uint8_t corrupt[] = {
+        SAMPLE_BLOCK_VERSION << 4 | SAMPLE_BLOCK_FLOAT, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x41, 0xa0, 0x00, 0x00, // first value, 20.0
+        0x14,                   // second timestamp, 10 ms later
+        0xe9, 0x40,             // new window: 11, leading 20, meaningful 20 + 1
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+
+    SampleBlockDecoder decoder(corrupt, sizeof(corrupt));
+    TEST_ASSERT_TRUE(decoder.isValid());
+    uint64_t timestampMs;
+    float value;
+    TEST_ASSERT_TRUE(decoder.next(timestampMs, value));
+    TEST_ASSERT_EQUAL_FLOAT(20.0f, value);
+    TEST_ASSERT_FALSE(decoder.next(timestampMs, value));
+    TEST_ASSERT_FALSE(decoder.isValid());
+    TEST_ASSERT_FALSE(decoder.next(timestampMs, value));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_float_round_trip);
+    RUN_TEST(test_float_irregular);
+    RUN_TEST(test_int_round_trip);
+    RUN_TEST(test_full_block);
+    RUN_TEST(test_damaged_block);
+    RUN_TEST(test_corrupt_window);
+    return UNITY_END();
+}